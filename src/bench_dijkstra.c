@@ -0,0 +1,254 @@
+/*
+ * Spanning tree Dijkstra microbenchmark on grid shaped wires.
+ *
+ * Power and clock meshes are the most cyclic wires a circuit can have, and
+ * every one of them goes through djikstra_spanning_tree when the distances
+ * are computed. This builds such meshes directly as graphs and times the
+ * radix heap version against the previous binary heap one, checking that
+ * both give spanning trees with the same path lengths. Meshes are full of
+ * equal distances, so the trees only match when both heaps break ties the
+ * same way (by node id): `ddelay` is the largest difference of the Elmore
+ * delays of the nodes, relative to the largest delay.
+ *
+ * Usage:
+ *   ca_bench_dijkstra [-reps N] [-pitch N] [size]...
+ *
+ * Each size N is a NxN mesh with lines every `pitch` pixels (default 4):
+ * a single layer mesh, and a two layer one with the horizontal lines on the
+ * upper layer joined by vias at every crossing. Default sizes are 16, 64 and
+ * 256.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elmore.h"
+#include "graph.h"
+#include "workers.h"
+
+static void usage() {
+  fprintf(stderr, "usage: ca_bench_dijkstra [-reps N] [-pitch N] [size]...\n");
+}
+
+/* Graph and node layers of a NxN mesh. Two layers: the h and v nodes of a
+ * crossing are joined by a via of length 1. */
+static void build_mesh(Graph* g, int** layer, int n, int pitch, bool two) {
+  int nodes_per = two ? 2 : 1;
+  graph_init(g, n * n * nodes_per);
+  arrsetlen(*layer, 0);
+  for (int i = 0; i < n * n * nodes_per; i++) {
+    graph_add_node(g, i);
+    arrput(*layer, two ? (i % 2 == 0) : 0);
+  }
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      int k = (y * n + x) * nodes_per;
+      int kv = two ? k + 1 : k;
+      if (x + 1 < n) graph_add_edge(g, k, k + nodes_per, pitch);
+      if (y + 1 < n) graph_add_edge(g, kv, kv + n * nodes_per, pitch);
+      if (two) graph_add_edge(g, k, kv, 1);
+    }
+  }
+  graph_build(g);
+}
+
+/* Previous version: max heap of negated distances, distances are reset
+ * with arrput, and the tree edge of a node is the source of its item. */
+static void dijkstra_binary_heap(PQ* p, float** pdist, bool** pdone, Graph* g,
+                                 int root, EdgeGroup* eg, int* layer,
+                                 float* c_per_w, float* sum_edges) {
+  eg->ne = 0;
+  eg->n = g->n;
+  memcpy(eg->eoff, g->eoff, (g->n + 1) * sizeof(int));
+  memset(eg->ecount, 0, g->n * sizeof(int));
+  arrsetlen(*pdist, 0);
+  arrsetlen(*pdone, 0);
+  for (int i = 0; i < g->n; i++) {
+    arrput(*pdist, -1.f);
+    arrput(*pdone, false);
+  }
+  float* dist = *pdist;
+  bool* done = *pdone;
+  /* The previous version left the root at -1, so with layer costs below 1
+   * nodes next to the root looked unvisited and trees differed. */
+  dist[root] = 0;
+  float sum = 0;
+  pq_push(p, -1, root, 0);
+  while (p->size > 0) {
+    int u = pq_top(p).dst;
+    int prev = pq_top(p).src;
+    pq_pop(p);
+    if (done[u]) continue;
+    done[u] = true;
+    float cw = c_per_w[layer[u]];
+    for (int ie = 0; ie < g->ecount[u]; ie++) {
+      GraphEdge e = g->edges[g->eoff[u] + ie];
+      float ew = cw * e.w;
+      sum += ew;
+      if (e.e == prev) {
+        int a = eg->ecount[prev]++;
+        eg->edges[eg->eoff[prev] + a] = (GraphEdge){u, e.w};
+        int b = eg->ecount[u]++;
+        eg->edges[eg->eoff[u] + b] = (GraphEdge){prev, e.w};
+        eg->ne += 2;
+      } else {
+        float alt = dist[u] + ew;
+        if ((alt < dist[e.e]) || (dist[e.e] < 0)) {
+          dist[e.e] = alt;
+          pq_push(p, u, e.e, -alt);
+        }
+      }
+    }
+  }
+  *sum_edges = sum / 2.f;
+}
+
+static bool nearly_equal(double a, double b) {
+  return (a - b) * (a - b) <= 1e-10 * (a * a + b * b);
+}
+
+/* Sum of the root to node path lengths along the tree. */
+static double tree_path_sum(EdgeGroup* eg, int root, int* layer,
+                            float* c_per_w) {
+  double* d = malloc(eg->n * sizeof(double));
+  int* stack = malloc(eg->n * sizeof(int));
+  for (int i = 0; i < eg->n; i++) d[i] = -1;
+  int ns = 0;
+  d[root] = 0;
+  stack[ns++] = root;
+  double total = 0;
+  while (ns > 0) {
+    int u = stack[--ns];
+    total += d[u];
+    for (int e = 0; e < eg->ecount[u]; e++) {
+      GraphEdge ge = eg->edges[eg->eoff[u] + e];
+      if (d[ge.e] >= 0) continue;
+      /* Same edge cost as the search: the layer of the node it leaves */
+      d[ge.e] = d[u] + c_per_w[layer[u]] * ge.w;
+      stack[ns++] = ge.e;
+    }
+  }
+  free(d);
+  free(stack);
+  return total;
+}
+
+/* Elmore delay of every node along the tree (every node can be a socket). */
+static float* tree_delays(EdgeGroup* eg, int root, int* layer,
+                          ElmoreCalculator* ec) {
+  float* delay = malloc(eg->n * sizeof(float));
+  elmore_calculator_run(ec, eg->n, eg->eoff, eg->ecount, layer, eg->edges,
+                        root, delay);
+  return delay;
+}
+
+/* Largest delay difference over the nodes, relative to the largest delay. */
+static double max_delay_diff(float* a, float* b, int n) {
+  double dmax = 0;
+  double amax = 0;
+  for (int i = 0; i < n; i++) {
+    double d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    if (d > dmax) dmax = d;
+    if (a[i] > amax) amax = a[i];
+  }
+  return amax > 0 ? dmax / amax : 0;
+}
+
+static bool bench_mesh(int n, int pitch, bool two, int reps) {
+  float c_per_w[2] = {1.0f, 0.35f};
+  ElmoreCalculator* ec = elmore_calculator_create();
+  ec->phys.c_per_w[0] = c_per_w[0];
+  ec->phys.c_per_w[1] = c_per_w[1];
+  ec->phys.r_per_w[0] = 1.0f / c_per_w[0];
+  ec->phys.r_per_w[1] = 0.5f / c_per_w[1];
+  Graph g;
+  int* layer = NULL;
+  build_mesh(&g, &layer, n, pitch, two);
+  EdgeGroup* eg = edge_group_create();
+  EdgeGroup* eg_ref = edge_group_create();
+  struct Djikstra* dj = djikstra_create();
+  int root = 0;
+
+  /* Sizes the reference tree from a first run of the new version */
+  float sum_new = 0;
+  djikstra_spanning_tree(dj, &g, root, eg_ref, layer, c_per_w, &sum_new);
+  PQ p;
+  pq_init(&p);
+  float* dist = NULL;
+  bool* done = NULL;
+  float sum_ref = 0;
+  double t_ref = 1e30;
+  double t_new = 1e30;
+  for (int r = 0; r < reps; r++) {
+    double t0 = workers_now();
+    dijkstra_binary_heap(&p, &dist, &done, &g, root, eg_ref, layer, c_per_w,
+                         &sum_ref);
+    double t1 = workers_now();
+    djikstra_spanning_tree(dj, &g, root, eg, layer, c_per_w, &sum_new);
+    double t2 = workers_now();
+    if (t1 - t0 < t_ref) t_ref = t1 - t0;
+    if (t2 - t1 < t_new) t_new = t2 - t1;
+  }
+  double path_ref = tree_path_sum(eg_ref, root, layer, c_per_w);
+  double path_new = tree_path_sum(eg, root, layer, c_per_w);
+  float* delay_ref = tree_delays(eg_ref, root, layer, ec);
+  float* delay_new = tree_delays(eg, root, layer, ec);
+  double ddelay = max_delay_diff(delay_ref, delay_new, g.n);
+  /* Both heaps pop in the same order, so the trees are the same */
+  bool ok = edge_group_is_tree(eg) && edge_group_is_tree(eg_ref) &&
+            nearly_equal(sum_ref, sum_new) &&
+            nearly_equal(path_ref, path_new) && ddelay <= 1e-6;
+  printf("%-6s %6d %9d %9d %12.1f %12.1f %6.2fx %9.2e %s\n",
+         two ? "2layer" : "1layer", n, g.n, g.ne / 2, 1e6 * t_ref, 1e6 * t_new,
+         t_new > 0 ? t_ref / t_new : 0.0, ddelay, ok ? "ok" : "MISMATCH");
+
+  free(delay_ref);
+  free(delay_new);
+  elmore_calculator_free(ec);
+
+  pq_destroy(&p);
+  arrfree(dist);
+  arrfree(done);
+  djikstra_free(dj);
+  edge_group_free(eg);
+  edge_group_free(eg_ref);
+  arrfree(layer);
+  graph_destroy(&g);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  int reps = 5;
+  int pitch = 4;
+  int* sizes = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-pitch") == 0 && i + 1 < argc) {
+      pitch = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && atoi(argv[i]) > 1) {
+      arrput(sizes, atoi(argv[i]));
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (reps < 1 || pitch < 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (arrlen(sizes) == 0) {
+    arrput(sizes, 16);
+    arrput(sizes, 64);
+    arrput(sizes, 256);
+  }
+  printf("%-6s %6s %9s %9s %12s %12s %7s %9s\n", "mesh", "size", "nodes",
+         "edges", "binary us", "radix us", "speedup", "ddelay");
+  int status = EXIT_SUCCESS;
+  for (int i = 0; i < arrlen(sizes); i++) {
+    if (!bench_mesh(sizes[i], pitch, false, reps)) status = EXIT_FAILURE;
+    if (!bench_mesh(sizes[i], pitch, true, reps)) status = EXIT_FAILURE;
+  }
+  arrfree(sizes);
+  return status;
+}
@@ -0,0 +1,158 @@
+/*
+ * History size benchmark.
+ *
+ * Runs each circuit headless and reports the average size of the rewind
+ * patches per tick: raw (as built by the simulation), with the field encoding
+ * and with the field encoding plus the LZ pass (see patch_codec.h).
+ *
+ * Usage:
+ *   ca_bench_history [-ticks N] [-poke N] <circuit.png>...
+ *
+ * Circuits without a level settle quickly, so every `-poke` ticks (default is
+ * 50, 0 disables it) a few random wires are toggled to keep them busy. The
+ * sequence is seeded, so runs are comparable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "img.h"
+#include "sim.h"
+#include "stb_ds.h"
+
+typedef struct {
+  int ticks;
+  u64 raw;
+  u64 stored;
+} HistStats;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ca_bench_history [-ticks N] [-poke N] <circuit.png>...\n");
+}
+
+static bool load_layers(const char* path, Image* layers, int* nl) {
+  Image img = LoadImage(path);
+  if (!img.data) return false;
+  ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  *nl = -1;
+  image_decode_layers(img, nl, layers);
+  UnloadImage(img);
+  if (*nl == 1) {
+    layers[0] = ensure_size_multiple_of(layers[0], 8);
+  }
+  return true;
+}
+
+static void poke_wires(Sim* sim, unsigned* rng) {
+  for (int k = 0; k < 4; k++) {
+    *rng = *rng * 1103515245 + 12345;
+    float x = (*rng >> 8) % sim->w;
+    *rng = *rng * 1103515245 + 12345;
+    float y = (*rng >> 8) % sim->h;
+    int pix;
+    sim_find_nearest_pixel(sim, 3, (v2){x, y}, &pix);
+    if (pix >= 0) sim_toggle_pixel(sim, pix);
+  }
+}
+
+static Status run(Image* layers, int nl, int ticks, int poke, bool lz,
+                  HistStats* st) {
+  LevelAPI api = {0};
+  Sim sim = {0};
+  SimParams p = {
+      .nl = nl,
+      .img = &layers[0],
+      .api = &api,
+      .headless = true,
+      .num_threads = 1,
+  };
+  Status s = sim_init(&sim, p);
+  if (!s.ok) return s;
+  if (sim_has_errors(&sim)) {
+    sim_destroy(&sim);
+    return status_error("circuit has errors");
+  }
+  sim.codec.lz = lz;
+  HSim hsim = wrap_sim(&sim);
+  unsigned rng = 12345;
+  for (int t = 0; t < ticks && s.ok; t++) {
+    if (poke > 0 && t % poke == 0) poke_wires(&sim, &rng);
+    s = hsim_nxt(&hsim);
+  }
+  *st = (HistStats){
+      .ticks = hsim.tick,
+      .raw = hsim.raw_bytes,
+      .stored = hsim.stored_bytes,
+  };
+  hsim_destroy(&hsim);
+  sim_destroy(&sim);
+  return s;
+}
+
+static double per_tick(u64 bytes, int ticks) {
+  return ticks > 0 ? (double)bytes / ticks : 0.0;
+}
+
+int main(int argc, char** argv) {
+  int ticks = 10000;
+  int poke = 50;
+  const char** circuits = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-ticks") == 0 && i + 1 < argc) {
+      ticks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-poke") == 0 && i + 1 < argc) {
+      poke = atoi(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      arrput(circuits, argv[i]);
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (arrlen(circuits) == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  SetTraceLogLevel(LOG_WARNING);
+  printf("%-28s %8s %10s %10s %10s %7s\n", "circuit", "ticks", "raw B/t",
+         "fields B/t", "lz B/t", "ratio");
+  HistStats total[2] = {0};
+  for (int ic = 0; ic < arrlen(circuits); ic++) {
+    const char* path = circuits[ic];
+    Image layers[MAX_LAYERS + 1] = {0};
+    int nl = -1;
+    if (!load_layers(path, layers, &nl)) {
+      fprintf(stderr, "Couldn't load %s\n", path);
+      continue;
+    }
+    HistStats st[2] = {0};
+    Status s = status_ok();
+    for (int lz = 0; lz < 2 && s.ok; lz++) {
+      s = run(layers, nl, ticks, poke, lz, &st[lz]);
+    }
+    for (int i = 0; i < nl; i++) UnloadImage(layers[i]);
+    if (!s.ok) {
+      fprintf(stderr, "Skipping %s: %s\n", path, s.err_msg);
+      continue;
+    }
+    for (int lz = 0; lz < 2; lz++) {
+      total[lz].ticks += st[lz].ticks;
+      total[lz].raw += st[lz].raw;
+      total[lz].stored += st[lz].stored;
+    }
+    printf("%-28s %8d %10.1f %10.1f %10.1f %6.1fx\n", GetFileName(path),
+           st[0].ticks, per_tick(st[0].raw, st[0].ticks),
+           per_tick(st[0].stored, st[0].ticks),
+           per_tick(st[1].stored, st[1].ticks),
+           st[1].stored > 0 ? (double)st[1].raw / st[1].stored : 0.0);
+  }
+  printf("%-28s %8d %10.1f %10.1f %10.1f %6.1fx\n", "total", total[0].ticks,
+         per_tick(total[0].raw, total[0].ticks),
+         per_tick(total[0].stored, total[0].ticks),
+         per_tick(total[1].stored, total[1].ticks),
+         total[1].stored > 0 ? (double)total[1].raw / total[1].stored : 0.0);
+  arrfree(circuits);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,350 @@
+/*
+ * NAND dedup microbenchmark.
+ *
+ * Runs each circuit headless and captures the active NAND list of every tick
+ * right before deduplication (carried over NANDs plus the ones awaken by
+ * socket events). Then times patch_builder_remove_duplicated_nand on those
+ * lists against the previous sort based version, checking that both give the
+ * same result.
+ *
+ * Usage:
+ *   ca_bench_dedup [-ticks N] [-poke N] [-reps N] [-adder BITS]...
+ *                  [circuit.png]...
+ *
+ * For instance a ripple-carry adder (05_aplusb/adder4bit.png) and a memory
+ * (04_memory1/registerfile.png) from campaign_solutions. `-adder BITS` adds
+ * a generated ripple-carry adder of that many bits (9 NANDs per bit), for
+ * carry chains longer than the campaign ones. Every `-poke` ticks (default
+ * is 20, 0 disables it) a few random wires are toggled to keep the circuit
+ * busy; the sequence is seeded, so runs are comparable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "img.h"
+#include "sim.h"
+#include "stb_ds.h"
+#include "workers.h"
+
+typedef struct {
+  NandState* states; /* All captured lists, back to back */
+  int* off;          /* Start of each tick list (one extra at the end) */
+} Capture;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ca_bench_dedup [-ticks N] [-poke N] [-reps N] "
+          "[-adder BITS]... [circuit.png]...\n");
+}
+
+static bool load_layers(const char* path, Image* layers, int* nl) {
+  Image img = LoadImage(path);
+  if (!img.data) return false;
+  ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  *nl = -1;
+  image_decode_layers(img, nl, layers);
+  UnloadImage(img);
+  if (*nl == 1) {
+    layers[0] = ensure_size_multiple_of(layers[0], 8);
+  }
+  return true;
+}
+
+static void px(Image* layers, int l, int x, int y) {
+  Color* data = layers[l].data;
+  data[y * layers[l].width + x] = WHITE;
+}
+
+static void hline(Image* layers, int l, int x0, int x1, int y) {
+  for (int x = x0; x <= x1; x++) px(layers, l, x, y);
+}
+
+static void vline(Image* layers, int l, int x, int y0, int y1) {
+  for (int y = y0; y <= y1; y++) px(layers, l, x, y);
+}
+
+/*
+ * Full adder of 9 NANDs. Net k < 9 is the output of NAND k (7 is the sum, 8
+ * the carry out), the inputs of each NAND are listed below.
+ */
+enum { FA_A = 9, FA_B, FA_CIN, FA_NETS };
+static const int fa_in[9][2] = {
+    {FA_A, FA_B},   /* 0 */
+    {FA_A, 0},      /* 1 */
+    {FA_B, 0},      /* 2 */
+    {1, 2},         /* 3: a xor b */
+    {3, FA_CIN},    /* 4 */
+    {3, 4},         /* 5 */
+    {FA_CIN, 4},    /* 6 */
+    {5, 6},         /* 7: sum */
+    {0, 4},         /* 8: carry out */
+};
+
+#define ADDER_PITCH 12 /* Between the NANDs of a bit */
+#define ADDER_BIT_W 112
+#define ADDER_NAND_Y (2 * FA_NETS + 2)
+
+/* Drop from the track of a net (upper layer, both ends are vias). */
+static void adder_drop(Image* layers, int* lo, int* hi, int net, int x,
+                       int y) {
+  vline(layers, 1, x, 1 + 2 * net, y);
+  if (x < lo[net]) lo[net] = x;
+  if (x > hi[net]) hi[net] = x;
+}
+
+/*
+ * Ripple-carry adder, bits side by side on 2 layers. The NANDs (facing
+ * right) are in a row on the lower layer, each net has a horizontal track
+ * above them (row 1 + 2 * net) and drops to its pins on the upper layer.
+ * Tracks and drops of different nets only cross on different layers, away
+ * from the drop ends, so they never connect. The carry track runs from the
+ * carry out of a bit to the NANDs of the next one. Inputs are not driven.
+ */
+static void gen_adder(int bits, Image* layers) {
+  int w = bits * ADDER_BIT_W + 8;
+  int h = ADDER_NAND_Y + 6;
+  for (int l = 0; l < 2; l++) {
+    layers[l] = GenImageColor(w, h, BLANK);
+  }
+  int cy = ADDER_NAND_Y;
+  int cout_x = -1;
+  for (int i = 0; i < bits; i++) {
+    int lo[FA_NETS];
+    int hi[FA_NETS];
+    for (int k = 0; k < FA_NETS; k++) {
+      lo[k] = w;
+      hi[k] = -1;
+    }
+    if (cout_x >= 0) {
+      lo[FA_CIN] = hi[FA_CIN] = cout_x;
+    }
+    for (int k = 0; k < 9; k++) {
+      int cx = i * ADDER_BIT_W + 8 + k * ADDER_PITCH;
+      px(layers, 0, cx + 1, cy + 1);
+      px(layers, 0, cx + 2, cy + 2);
+      px(layers, 0, cx + 1, cy + 3);
+      hline(layers, 0, cx - 3, cx - 1, cy + 1);
+      hline(layers, 0, cx - 5, cx - 1, cy + 3);
+      hline(layers, 0, cx + 4, cx + 5, cy + 2);
+      adder_drop(layers, lo, hi, fa_in[k][0], cx - 3, cy + 1);
+      adder_drop(layers, lo, hi, fa_in[k][1], cx - 5, cy + 3);
+      if (k < 7) {
+        adder_drop(layers, lo, hi, k, cx + 5, cy + 2);
+      } else if (k == 8 && i + 1 < bits) {
+        /* The track is drawn with the next bit */
+        vline(layers, 1, cx + 5, 1 + 2 * FA_CIN, cy + 2);
+        cout_x = cx + 5;
+      }
+    }
+    for (int k = 0; k < FA_NETS; k++) {
+      if (lo[k] <= hi[k]) hline(layers, 0, lo[k], hi[k], 1 + 2 * k);
+    }
+  }
+}
+
+static void poke_wires(Sim* sim, unsigned* rng) {
+  for (int k = 0; k < 4; k++) {
+    *rng = *rng * 1103515245 + 12345;
+    float x = (*rng >> 8) % sim->w;
+    *rng = *rng * 1103515245 + 12345;
+    float y = (*rng >> 8) % sim->h;
+    int pix;
+    sim_find_nearest_pixel(sim, 3, (v2){x, y}, &pix);
+    if (pix >= 0) sim_toggle_pixel(sim, pix);
+  }
+}
+
+/* Previous version: sort by id, then keep the first entry of each NAND. */
+static int compare_nandstate(const void* a, const void* b) {
+  int nandA = ((NandState*)a)->id_nand;
+  int nandB = ((NandState*)b)->id_nand;
+  return nandA - nandB;
+}
+
+static int dedup_qsort(NandState* a, int n) {
+  if (n == 0) return 0;
+  qsort(a, n, sizeof(NandState), compare_nandstate);
+  int m = 0;
+  for (int i = 1; i < n; i++) {
+    if (a[m].id_nand == a[i].id_nand) {
+      a[m].next_value = -2;
+    } else {
+      a[++m] = a[i];
+    }
+  }
+  return m + 1;
+}
+
+/* Runs the circuit, storing the lists to deduplicate of every tick. */
+static Status capture(Image* layers, int nl, int ticks, int poke, Capture* c,
+                      int* num_nands) {
+  LevelAPI api = {0};
+  Sim sim = {0};
+  SimParams p = {
+      .nl = nl,
+      .img = &layers[0],
+      .api = &api,
+      .headless = true,
+      .num_threads = 1,
+  };
+  Status s = sim_init(&sim, p);
+  if (!s.ok) return s;
+  if (sim_has_errors(&sim)) {
+    sim_destroy(&sim);
+    return status_error("circuit has errors");
+  }
+  *num_nands = arrlen(sim.pg.nands);
+  HSim hsim = wrap_sim(&sim);
+  PatchBuilder* pb = &sim.patch_builder;
+  unsigned rng = 12345;
+  for (int t = 0; t < ticks && s.ok; t++) {
+    /* Same steps as the tick, up to the dedup. The builder is reset after,
+     * so the tick itself is not changed. */
+    patch_builder_update_nandstate(&sim, pb, &sim.state);
+    patch_builder_handle_socket_events(pb, &sim.state);
+    int n = arrlen(pb->arr_nand_state);
+    arrput(c->off, arrlen(c->states));
+    memcpy(arraddnptr(c->states, n), pb->arr_nand_state,
+           n * sizeof(NandState));
+    patch_builder_reset(pb);
+    if (poke > 0 && t % poke == 0) poke_wires(&sim, &rng);
+    s = hsim_nxt(&hsim);
+  }
+  arrput(c->off, arrlen(c->states));
+  hsim_destroy(&hsim);
+  sim_destroy(&sim);
+  return s;
+}
+
+/* Seconds per pass over all the lists. Uses a dummy builder for the new
+ * version, with the tables sized as in the simulation. */
+static double time_dedup(Capture* c, int num_nands, int reps, bool table,
+                         NandState** out) {
+  PixelGraph pg = {0};
+  arrsetlen(pg.nands, num_nands);
+  PatchBuilder pb = {0};
+  pb.pg = &pg;
+  pb.nand_seen = calloc(num_nands, sizeof(u32));
+  pb.nand_pos = malloc(num_nands * sizeof(int));
+  int nticks = arrlen(c->off) - 1;
+  double best = 1e30;
+  for (int r = 0; r < reps; r++) {
+    arrsetlen(*out, 0);
+    double t0 = workers_now();
+    for (int t = 0; t < nticks; t++) {
+      int n = c->off[t + 1] - c->off[t];
+      arrsetlen(pb.arr_nand_state, n);
+      memcpy(pb.arr_nand_state, c->states + c->off[t], n * sizeof(NandState));
+      if (table) {
+        patch_builder_remove_duplicated_nand(&pb);
+      } else {
+        arrsetlen(pb.arr_nand_state, dedup_qsort(pb.arr_nand_state, n));
+      }
+      if (r == 0) {
+        int m = arrlen(pb.arr_nand_state);
+        memcpy(arraddnptr(*out, m), pb.arr_nand_state, m * sizeof(NandState));
+      }
+    }
+    double dt = workers_now() - t0;
+    if (dt < best) best = dt;
+  }
+  arrfree(pb.arr_nand_state);
+  arrfree(pb.arr_nand_sort);
+  free(pb.nand_seen);
+  free(pb.nand_pos);
+  arrfree(pg.nands);
+  return best;
+}
+
+/* Captures and times one circuit. False if the versions disagree. */
+static bool bench_circuit(const char* name, Image* layers, int nl, int ticks,
+                          int poke, int reps) {
+  Capture c = {0};
+  int num_nands = 0;
+  Status s = capture(layers, nl, ticks, poke, &c, &num_nands);
+  if (!s.ok) {
+    fprintf(stderr, "Skipping %s: %s\n", name, s.err_msg);
+    arrfree(c.states);
+    arrfree(c.off);
+    return true;
+  }
+  NandState* ref = NULL;
+  NandState* out = NULL;
+  double t_sort = time_dedup(&c, num_nands, reps, false, &ref);
+  double t_table = time_dedup(&c, num_nands, reps, true, &out);
+  bool ok = arrlen(ref) == arrlen(out) &&
+            memcmp(ref, out, arrlen(ref) * sizeof(NandState)) == 0;
+  if (!ok) {
+    fprintf(stderr, "%s: results differ\n", name);
+  }
+  int nticks = arrlen(c.off) - 1;
+  printf("%-28s %7d %8d %7.1f %12.1f %12.1f %6.2fx\n", name, num_nands,
+         nticks, (double)arrlen(c.states) / nticks, 1e9 * t_sort / nticks,
+         1e9 * t_table / nticks, t_table > 0 ? t_sort / t_table : 0.0);
+  arrfree(ref);
+  arrfree(out);
+  arrfree(c.states);
+  arrfree(c.off);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  int ticks = 20000;
+  int poke = 20;
+  int reps = 5;
+  const char** circuits = NULL;
+  int* adders = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-ticks") == 0 && i + 1 < argc) {
+      ticks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-poke") == 0 && i + 1 < argc) {
+      poke = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-adder") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      arrput(adders, atoi(argv[++i]));
+    } else if (argv[i][0] != '-') {
+      arrput(circuits, argv[i]);
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (arrlen(circuits) + arrlen(adders) == 0 || reps < 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  SetTraceLogLevel(LOG_WARNING);
+  printf("%-28s %7s %8s %7s %12s %12s %7s\n", "circuit", "nands", "ticks",
+         "avg n", "qsort ns/t", "table ns/t", "speedup");
+  int status = EXIT_SUCCESS;
+  for (int ic = 0; ic < arrlen(circuits); ic++) {
+    const char* path = circuits[ic];
+    Image layers[MAX_LAYERS + 1] = {0};
+    int nl = -1;
+    if (!load_layers(path, layers, &nl)) {
+      fprintf(stderr, "Couldn't load %s\n", path);
+      continue;
+    }
+    if (!bench_circuit(GetFileName(path), layers, nl, ticks, poke, reps)) {
+      status = EXIT_FAILURE;
+    }
+    for (int i = 0; i < nl; i++) UnloadImage(layers[i]);
+  }
+  for (int ia = 0; ia < arrlen(adders); ia++) {
+    Image layers[MAX_LAYERS + 1] = {0};
+    gen_adder(adders[ia], layers);
+    char name[64];
+    snprintf(name, sizeof(name), "adder%dbit (generated)", adders[ia]);
+    if (!bench_circuit(name, layers, 2, ticks, poke, reps)) {
+      status = EXIT_FAILURE;
+    }
+    for (int i = 0; i < 2; i++) UnloadImage(layers[i]);
+  }
+  arrfree(circuits);
+  arrfree(adders);
+  return status;
+}
@@ -0,0 +1,496 @@
+/*
+ * Parse benchmark on synthetic circuits.
+ *
+ * Generates circuits of a few kinds at several sizes, runs the headless
+ * parse (sim_init) on each one and records the time of every stage and the
+ * peak memory. Results are written as JSON, so runs of different versions
+ * can be compared:
+ *
+ *   nand_grid   Rows of chained NANDs (1 layer).
+ *   bus         Long buses, driven and read by a NAND at each end (1 layer).
+ *   via_farm    Blocks of lines joined by vias on the upper layer (2 layers).
+ *   memory      Array of NAND cells, word lines on the upper layer and bit
+ *               lines on the lower one (2 layers).
+ *   clock_mesh  Mesh covering the whole image, fed by an H tree on the upper
+ *               layer (2 layers).
+ *
+ * Usage:
+ *   ca_bench_parse [-reps N] [-threads N] [-circuit NAME]... [-o FILE]
+ *                  [-render] [size]...
+ *
+ * Sizes are the side of the square image, multiple of 64 (default 256, 1024,
+ * 4096 and 8192). With -reps, the times of the fastest run are kept. The
+ * renderer setup is only timed with -render, which needs a GL context (a
+ * hidden window is opened). The JSON goes to bench_parse.json by default,
+ * since the parse itself prints to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "i18n.h"
+#include "sim.h"
+#include "stb_ds.h"
+#include "workers.h"
+
+typedef struct {
+  int w, h, nl;
+  Image layers[MAX_LAYERS];
+  int nands; /* NANDs placed */
+} Canvas;
+
+typedef void (*GenFn)(Canvas* c);
+
+typedef struct {
+  const char* name;
+  int nl;
+  GenFn gen;
+} Circuit;
+
+/* Stage times (ms) of a parse. */
+typedef struct {
+  double total;
+  double pixel_code;
+  double find_nands;
+  double build_graph;
+  double components;
+  double wire_map;
+  double dist_graph;
+  double dist_setup; /* Dist graph phases, summed over the workers */
+  double dist_build;
+  double dist_elmore;
+  double render_setup;
+} StageTimes;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ca_bench_parse [-reps N] [-threads N] [-circuit NAME]... "
+          "[-o FILE] [-render] [size]...\n");
+}
+
+/* Peak memory is reset before each parse when the system allows it (Linux),
+ * otherwise it's the peak of the whole process. */
+static void reset_peak_rss() {
+#ifdef __linux__
+  FILE* f = fopen("/proc/self/clear_refs", "w");
+  if (f) {
+    fputs("5", f);
+    fclose(f);
+  }
+#endif
+}
+
+#ifdef __linux__
+static long proc_status_kb(const char* key) {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) return -1;
+  char line[256];
+  long kb = -1;
+  int n = strlen(key);
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, n) == 0 && line[n] == ':') {
+      kb = atol(line + n + 1);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+#endif
+
+/* Current and peak resident memory in kB, -1 if not known. */
+static long rss_kb() {
+#ifdef __linux__
+  return proc_status_kb("VmRSS");
+#else
+  return -1;
+#endif
+}
+
+static long peak_rss_kb() {
+#ifdef __linux__
+  long kb = proc_status_kb("VmHWM");
+  if (kb >= 0) return kb;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024; /* Bytes */
+#else
+  return ru.ru_maxrss;
+#endif
+#else
+  return -1;
+#endif
+}
+
+static void px(Canvas* c, int l, int x, int y) {
+  if (x < 0 || y < 0 || x >= c->w || y >= c->h) return;
+  Color* data = c->layers[l].data;
+  data[y * c->w + x] = WHITE;
+}
+
+static void hline(Canvas* c, int l, int x0, int x1, int y) {
+  for (int x = x0; x <= x1; x++) px(c, l, x, y);
+}
+
+static void vline(Canvas* c, int l, int x, int y0, int y1) {
+  for (int y = y0; y <= y1; y++) px(c, l, x, y);
+}
+
+/* NAND facing right, (cx, cy) is the top left of its 4x5 pattern. Inputs are
+ * read at (cx - 1, cy + 1) and (cx - 1, cy + 3), output at (cx + 4, cy + 2). */
+static void put_nand(Canvas* c, int cx, int cy) {
+  px(c, 0, cx + 1, cy + 1);
+  px(c, 0, cx + 2, cy + 2);
+  px(c, 0, cx + 1, cy + 3);
+  c->nands++;
+}
+
+/* Row of `n` NANDs, each one driving both inputs of the next. The inputs of
+ * the first one are left to the caller, the last one drives a stub. */
+static void nand_row(Canvas* c, int x0, int cy, int pitch, int n) {
+  for (int i = 0; i < n; i++) {
+    int cx = x0 + i * pitch;
+    put_nand(c, cx, cy);
+    if (i > 0) {
+      hline(c, 0, cx - pitch + 4, cx - 1, cy + 2);
+      vline(c, 0, cx - 1, cy + 1, cy + 3);
+    }
+  }
+  int last = x0 + (n - 1) * pitch;
+  hline(c, 0, last + 4, last + 6, cy + 2);
+}
+
+static void gen_nand_grid(Canvas* c) {
+  int pitch = 12;
+  int n = (c->w - 9) / pitch + 1;
+  /* The first NAND of every row reads the same input */
+  vline(c, 0, 1, 0, c->h - 1);
+  for (int cy = 1; cy + 4 < c->h; cy += 8) {
+    nand_row(c, 2, cy, pitch, n);
+  }
+}
+
+static void gen_bus(Canvas* c) {
+  vline(c, 0, 1, 0, c->h - 1);
+  for (int cy = 1; cy + 4 < c->h; cy += 6) {
+    nand_row(c, 2, cy, c->w - 9, 2);
+  }
+}
+
+/* Lines of a 64x64 block on the lower layer, and 3 pixel stubs on the upper
+ * one between each pair of lines: both ends of a stub are vias. */
+static void gen_via_farm(Canvas* c) {
+  for (int by = 0; by + 64 <= c->h; by += 64) {
+    for (int bx = 0; bx + 64 <= c->w; bx += 64) {
+      put_nand(c, bx + 2, by + 2);
+      vline(c, 0, bx + 1, by + 3, by + 5);
+      for (int k = 0; by + 4 + 2 * k <= by + 60; k++) {
+        int y = by + 4 + 2 * k;
+        hline(c, 0, k == 0 ? bx + 6 : bx + 8, bx + 60, y);
+        if (y + 2 > by + 60) continue;
+        for (int x = bx + 10 + 2 * (k % 2); x <= bx + 58; x += 4) {
+          vline(c, 1, x, y, y + 2);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * A NAND per cell, reading its word line (upper layer, through a via on its
+ * first input) and its bit line (lower layer, on the second one). Word lines
+ * are driven by a NAND at the left of each row, bit lines are inputs.
+ */
+static void gen_memory(Canvas* c) {
+  vline(c, 0, 1, 0, c->h - 1);
+  for (int cx = 16; cx + 6 < c->w; cx += 12) {
+    vline(c, 0, cx - 3, 0, c->h - 1);
+  }
+  for (int cy = 4; cy + 4 < c->h; cy += 8) {
+    put_nand(c, 2, cy);
+    hline(c, 0, 6, 7, cy + 2);
+    vline(c, 0, 7, cy - 1, cy + 2);
+    hline(c, 1, 7, c->w - 1, cy - 1);
+    for (int cx = 16; cx + 6 < c->w; cx += 12) {
+      put_nand(c, cx, cy);
+      vline(c, 0, cx - 1, cy, cy + 1);
+      px(c, 1, cx - 1, cy);
+      hline(c, 0, cx - 2, cx - 1, cy + 3);
+      hline(c, 0, cx + 4, cx + 6, cy + 2);
+    }
+  }
+}
+
+/* Bars of an H tree, recursing on its 4 ends. The ends of the last level are
+ * on the mesh lines (multiples of 8), where they make vias. */
+static void htree(Canvas* c, int x, int y, int a, int b) {
+  hline(c, 1, x - a, x + a, y);
+  vline(c, 1, x - a, y - b, y + b);
+  vline(c, 1, x + a, y - b, y + b);
+  if (a % 16 != 0 || b % 16 != 0) return;
+  for (int i = 0; i < 4; i++) {
+    htree(c, x + (i & 1 ? a : -a), y + (i & 2 ? b : -b), a / 2, b / 2);
+  }
+}
+
+static void gen_clock_mesh(Canvas* c) {
+  int n = c->w < c->h ? c->w : c->h;
+  /* Lines every 8 rows, joined by vertical bricks that never meet at the
+   * same pixel (which would be a crossing). */
+  for (int y = 0; y < c->h; y += 8) {
+    hline(c, 0, 0, c->w - 1, y);
+    if (y + 8 >= c->h) continue;
+    for (int x = (y / 8) % 2 ? 12 : 4; x < c->w; x += 16) {
+      vline(c, 0, x, y, y + 8);
+    }
+  }
+  /* Root driver between two lines, away from the bricks */
+  int cx = n / 2 - 4;
+  int cy = n / 2 + 2;
+  put_nand(c, cx, cy);
+  vline(c, 0, cx - 1, cy + 1, cy + 3);
+  px(c, 0, cx + 4, cy + 2);
+  vline(c, 1, n / 2, n / 2, n / 2 + 4);
+  htree(c, n / 2, n / 2, n / 4, n / 4);
+}
+
+static Circuit circuits[] = {
+    {"nand_grid", 1, gen_nand_grid},   {"bus", 1, gen_bus},
+    {"via_farm", 2, gen_via_farm},     {"memory", 2, gen_memory},
+    {"clock_mesh", 2, gen_clock_mesh},
+};
+
+#define NUM_CIRCUITS ((int)(sizeof(circuits) / sizeof(circuits[0])))
+
+static void canvas_init(Canvas* c, int size, int nl) {
+  *c = (Canvas){.w = size, .h = size, .nl = nl};
+  for (int l = 0; l < nl; l++) {
+    c->layers[l] = GenImageColor(size, size, BLANK);
+  }
+}
+
+static void canvas_destroy(Canvas* c) {
+  for (int l = 0; l < c->nl; l++) {
+    UnloadImage(c->layers[l]);
+  }
+}
+
+typedef struct {
+  const char* circuit;
+  int size;
+  int nl;
+  int nands;
+  int nodes;
+  int edges;
+  int wires;
+  int errors; /* Error flags of the parse */
+  long base_rss_kb;
+  long peak_rss_kb;
+  StageTimes ms;
+} Result;
+
+static Status run(Canvas* c, int threads, bool render, Result* res) {
+  LevelAPI api = {0};
+  Sim sim = {0};
+  RenderTexture2D layers[MAX_LAYERS] = {0};
+  if (render) {
+    for (int l = 0; l < c->nl; l++) {
+      layers[l] = LoadRenderTexture(c->w, c->h);
+    }
+  }
+  SimParams p = {
+      .nl = c->nl,
+      .img = c->layers,
+      .api = &api,
+      .layers = layers,
+      .headless = !render,
+      .num_threads = threads,
+  };
+  res->base_rss_kb = rss_kb();
+  reset_peak_rss();
+  double t0 = workers_now();
+  Status s = sim_init(&sim, p);
+  double t1 = workers_now();
+  res->peak_rss_kb = peak_rss_kb();
+  if (s.ok) {
+    res->nands = arrlen(sim.pg.nands);
+    res->nodes = sim.pg.g.n;
+    res->edges = sim.pg.g.ne / 2;
+    res->wires = sim.wg.nwire;
+    res->errors = sim.wg.global_error_flags;
+    res->ms = (StageTimes){
+        .total = 1000 * (t1 - t0),
+        .pixel_code = 1000 * sim.pg.t_code,
+        .find_nands = 1000 * sim.pg.t_nands,
+        .build_graph = 1000 * sim.pg.t_graph,
+        .components = 1000 * sim.wg.t_comp,
+        .wire_map = 1000 * sim.wg.t_wmap,
+        .dist_graph = 1000 * sim.dg.t_total,
+        .dist_setup = 1000 * sim.dg.t_setup,
+        .dist_build = 1000 * sim.dg.t_build,
+        .dist_elmore = 1000 * sim.dg.t_elmore,
+        .render_setup = render ? 1000 * sim.t_render : -1,
+    };
+  }
+  sim_destroy(&sim);
+  if (render) {
+    for (int l = 0; l < c->nl; l++) {
+      UnloadRenderTexture(layers[l]);
+    }
+  }
+  return s;
+}
+
+static void write_json(FILE* f, int threads, int reps, Result* res) {
+  fprintf(f, "{\n  \"threads\": %d,\n  \"reps\": %d,\n  \"results\": [",
+          threads, reps);
+  for (int i = 0; i < arrlen(res); i++) {
+    Result* r = &res[i];
+    StageTimes* t = &r->ms;
+    fprintf(f, "%s\n    {\"circuit\": \"%s\", \"size\": %d, \"layers\": %d,",
+            i > 0 ? "," : "", r->circuit, r->size, r->nl);
+    fprintf(f,
+            " \"nands\": %d, \"nodes\": %d, \"edges\": %d, \"wires\": %d,"
+            " \"errors\": %d,\n",
+            r->nands, r->nodes, r->edges, r->wires, r->errors);
+    fprintf(f, "     \"base_rss_kb\": %ld, \"peak_rss_kb\": %ld,\n",
+            r->base_rss_kb, r->peak_rss_kb);
+    fprintf(f,
+            "     \"ms\": {\"total\": %.3f, \"pixel_code\": %.3f,"
+            " \"find_nands\": %.3f, \"build_graph\": %.3f,\n"
+            "            \"components\": %.3f, \"wire_map\": %.3f,"
+            " \"dist_graph\": %.3f, \"dist_setup\": %.3f,\n"
+            "            \"dist_build\": %.3f, \"dist_elmore\": %.3f,",
+            t->total, t->pixel_code, t->find_nands, t->build_graph,
+            t->components, t->wire_map, t->dist_graph, t->dist_setup,
+            t->dist_build, t->dist_elmore);
+    if (t->render_setup >= 0) {
+      fprintf(f, " \"render_setup\": %.3f}}", t->render_setup);
+    } else {
+      fprintf(f, " \"render_setup\": null}}");
+    }
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+  int reps = 1;
+  int threads = 1;
+  bool render = false;
+  const char* out = "bench_parse.json";
+  int* sizes = NULL;
+  bool selected[NUM_CIRCUITS] = {0};
+  bool any_selected = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else if (strcmp(argv[i], "-render") == 0) {
+      render = true;
+    } else if (strcmp(argv[i], "-circuit") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      int k = 0;
+      while (k < NUM_CIRCUITS && strcmp(circuits[k].name, name) != 0) k++;
+      if (k == NUM_CIRCUITS) {
+        fprintf(stderr, "unknown circuit: %s\n", name);
+        return EXIT_FAILURE;
+      }
+      selected[k] = true;
+      any_selected = true;
+    } else if (argv[i][0] != '-' && atoi(argv[i]) >= 64 &&
+               atoi(argv[i]) % 64 == 0) {
+      arrput(sizes, atoi(argv[i]));
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (reps < 1 || threads < 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (arrlen(sizes) == 0) {
+    arrput(sizes, 256);
+    arrput(sizes, 1024);
+    arrput(sizes, 4096);
+    arrput(sizes, 8192);
+  }
+  /* Error messages of the parse */
+  init_i18n();
+  if (render) {
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "ca_bench_parse");
+  }
+
+  Result* res = NULL;
+  int status = EXIT_SUCCESS;
+  for (int k = 0; k < NUM_CIRCUITS; k++) {
+    if (any_selected && !selected[k]) continue;
+    for (int i = 0; i < arrlen(sizes); i++) {
+      Canvas c;
+      canvas_init(&c, sizes[i], circuits[k].nl);
+      circuits[k].gen(&c);
+      Result best = {0};
+      for (int r = 0; r < reps; r++) {
+        Result cur = {0};
+        Status s = run(&c, threads, render, &cur);
+        if (!s.ok) {
+          fprintf(stderr, "%s %d: %s\n", circuits[k].name, sizes[i],
+                  s.err_msg);
+          status = EXIT_FAILURE;
+          break;
+        }
+        if (r == 0 || cur.ms.total < best.ms.total) {
+          long peak = r == 0 ? cur.peak_rss_kb : best.peak_rss_kb;
+          best = cur;
+          if (peak > best.peak_rss_kb) best.peak_rss_kb = peak;
+        } else if (cur.peak_rss_kb > best.peak_rss_kb) {
+          best.peak_rss_kb = cur.peak_rss_kb;
+        }
+      }
+      best.circuit = circuits[k].name;
+      best.size = sizes[i];
+      best.nl = c.nl;
+      /* The generators are checked too: every NAND should be found and
+       * connected. Wires too long for the max delay are expected. */
+      if (best.nands != c.nands || (best.errors & ~STATUS_TOOSLOW)) {
+        fprintf(stderr, "%s %d: %d/%d nands, errors=%d\n", best.circuit,
+                best.size, best.nands, c.nands, best.errors);
+        status = EXIT_FAILURE;
+      }
+      arrput(res, best);
+      canvas_destroy(&c);
+    }
+  }
+
+  FILE* f = fopen(out, "w");
+  if (!f) {
+    fprintf(stderr, "can't write %s\n", out);
+    status = EXIT_FAILURE;
+  } else {
+    write_json(f, threads, reps, res);
+    fclose(f);
+  }
+  printf("%-10s %6s %9s %9s %10s %10s %10s\n", "circuit", "size", "nands",
+         "wires", "total ms", "dist ms", "peak MB");
+  for (int i = 0; i < arrlen(res); i++) {
+    Result* r = &res[i];
+    printf("%-10s %6d %9d %9d %10.1f %10.1f %10.1f\n", r->circuit, r->size,
+           r->nands, r->wires, r->ms.total, r->ms.dist_graph,
+           r->peak_rss_kb / 1024.0);
+  }
+  if (render) CloseWindow();
+  arrfree(res);
+  arrfree(sizes);
+  return status;
+}
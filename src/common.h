@@ -174,6 +174,7 @@
 
 typedef uint8_t u8;
 typedef int8_t i8;
+typedef uint16_t u16;
 typedef int32_t i32;
 typedef uint32_t u32;
 typedef int64_t i64;
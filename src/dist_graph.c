@@ -2,11 +2,14 @@
 
 #include "elmore.h"
 #include "img.h"
+#include "limits.h"
 #include "math.h"
 #include "pq.h"
 #include "profiler.h"
+#include "rectint.h"
 #include "renderv2.h"
 #include "stb_ds.h"
+#include "workers.h"
 
 static inline int mini(int a, int b) { return a < b ? a : b; }
 static inline int maxi(int a, int b) { return a > b ? a : b; }
@@ -25,7 +28,8 @@ static inline void fswap(float* a, float* b) {
 }
 
 /*
- * Extracts a subgraph from a bigger graph using specific nodes.
+ * Extracts a subgraph from a bigger graph using specific nodes. Its edges are
+ * left pending, so more nodes can be added before graph_build.
  */
 static void dist_build_subgraph(Graph* g,    /* Original graph (input) */
                                 Graph* subg, /* new subgraph (output)*/
@@ -42,7 +46,7 @@ static void dist_build_subgraph(Graph* g,    /* Original graph (input) */
   for (int k = 0; k < nk; k++) {
     int i0 = nodes[k];
     int ne = g->ecount[i0];
-    GraphEdge* p_edges = g->edges + i0 * g->max_edges;
+    GraphEdge* p_edges = g->edges + g->eoff[i0];
     for (int ek = 0; ek < ne; ek++) {
       int k1;
       int i2_e = p_edges[ek].e;
@@ -99,47 +103,87 @@ static inline float interp(int p0, int p1, int p, float rc, float d0,
   }
   return t0 + (t1 - t0) * a + rc * a * (1.f - a);
 }
+static inline void add_seg(DistSegment** segs, bool vertical, bool nomap,
+                           int l, int c, int p0, int p1, float rc_seg,
+                           float d0, float d1) {
+  DistSegment sg = {vertical, nomap, l, c, p0, p1, rc_seg, d0, d1};
+  arrput(*segs, sg);
+}
+
 /*
- * Creates a distance map from the distance of each node in a graph.
+ * Draws wire segments in the distance map. Only pixels with the segment
+ * orientation are written, the crossing pixels belong to the other wire.
+ * The map has the tiles of the wire map, which cover every wire pixel.
+ */
+static void draw_dist_map(TileMap* wmap, DistSegment* segs, int n, bool lone,
+                          u16** distmap, u8** ori) {
+  for (int i = 0; i < n; i++) {
+    DistSegment sg = segs[i];
+    if (sg.nomap) continue;
+    TileMap* tm = &wmap[sg.l];
+    int w = tm->w;
+    u16* map = distmap[sg.l];
+    u8* l_ori = ori[sg.l];
+    if (sg.vertical) {
+      for (int y = sg.p0; y <= sg.p1; y++) {
+        int idx = y * w + sg.c;
+        u8 v = l_ori[idx];
+        if (v == 1) {
+          /* Vertical distances are negative */
+          float d =
+              lone ? 0 : -interp(sg.p0, sg.p1, y, sg.rc_seg, sg.d0, sg.d1);
+          int it = tile_map_index(tm, sg.c, y);
+          assert(it >= 0);
+          map[it] = tile_dist_pack(d);
+        }
+      }
+    } else {
+      for (int x = sg.p0; x <= sg.p1; x++) {
+        int idx = sg.c * w + x;
+        u8 v = l_ori[idx];
+        float d = interp(sg.p0, sg.p1, x, sg.rc_seg, sg.d0, sg.d1);
+        if (v == 0) {
+          int it = tile_map_index(tm, x, sg.c);
+          assert(it >= 0);
+          map[it] = tile_dist_pack(lone ? 0 : d);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Creates the segments of a wire from the distance of each node in a graph.
  */
 static void setup_dist_map(
-    DistSpec spec, bool lone, int w0, /* Width of base image */
-    int h0,                           /* Height of base image */
-    Graph* g,                         /* Graph with distance nodes */
-    float* node_dist,                 /* Distance of each node */
-    float** distmap,                  /* Output distance map for each layer */
-    int ic,                           /* Component being treated */
-    u8** ori,                         /* orientation of each pixel */
-    RenderV2* rv2, float* out_maxdist /* Maximum distance */
+    DistSpec spec, int w0, /* Width of base image */
+    int h0,                /* Height of base image */
+    Graph* g,              /* Graph with distance nodes */
+    int* pix,              /* Pixel graph key of each node */
+    float* node_dist,      /* Distance of each node */
+    DistSegment** segs,    /* Segment output */
+    float* out_maxdist     /* Maximum distance */
 ) {
   int l0, xx0, yy0; /* Layer, x and y index of the node */
   int l1, x1, y1;   /* Layer, x and y index of the node */
   int s = w0 * h0;
-  // int w1 = w0;  // / 2;
-  // int h1 = h0;  // / 2;
   float max_dist = 0;
-  // TODO: Fix it
   for (int i = 0; i < g->n; i++) {
     int ne = g->ecount[i];
-    int off = g->max_edges * i;
+    int off = g->eoff[i];
     float dd0 = node_dist[i];
-    int idx0 = g->nodes[i];
+    int idx0 = pix[i];
     find_idx(s, w0, idx0, &l0, &yy0, &xx0);
-    // int w = l0 == 0 ? w0 : w1;
-    int w = w0;
-    float* map = distmap[l0];
-    u8* l_ori = ori[l0];
     // Case (i): single pixel with no edges
     if (ne == 0 || ne == 1) {
-      WireSegment ws = (WireSegment){ic, yy0 * w + xx0, yy0 * w + xx0};
-      renderv2_addhseg(rv2, ic, l0, xx0, xx0, yy0, 1, dd0, dd0);
+      add_seg(segs, false, true, l0, yy0, xx0, xx0, 1, dd0, dd0);
     }
     float rc = spec.r_per_w[l0] * spec.c_per_w[l0];
     for (int ie = 0; ie < ne; ie++) {
       int e = g->edges[off + ie].e;
       float ew = g->edges[off + ie].w;
       float rc_seg = 0.5 * ew * ew * rc;
-      int idx1 = g->nodes[e];
+      int idx1 = pix[e];
       float dd1 = node_dist[e];
       float d0 = dd0;
       float d1 = dd1;
@@ -152,7 +196,6 @@ static void setup_dist_map(
        * So, I don't want to add a seg if it's vias
        */
       if ((idx0 >= 0 && idx1 >= 0) || (idx0 < 0 && idx1 < 0)) {
-        WireSegment ws = (WireSegment){ic, y0 * w + x0, y1 * w + x1};
         assert((y0 == y1) || (x0 == x1));
       }
 
@@ -166,29 +209,11 @@ static void setup_dist_map(
         iswap(&x0, &x1);
         fswap(&d0, &d1);
       }
-      float t, t0, t1, a;
       if (x1 == x0) {
-        renderv2_addvseg(rv2, ic, l0, x0, y0, y1, rc_seg, d0, d1);
-        for (int y = y0; y <= y1; y++) {
-          int idx = y * w + x0;
-          u8 v = l_ori[idx];
-          if (v == 1) {
-            /* Vertical distances are negative */
-            map[idx] = lone ? 0 : -interp(y0, y1, y, rc_seg, d0, d1);
-          }
-        }
+        add_seg(segs, true, false, l0, x0, y0, y1, rc_seg, d0, d1);
       }
       if (y1 == y0) {
-        renderv2_addhseg(rv2, ic, l0, x0, x1, y0, rc_seg, d0, d1);
-        for (int x = x0; x <= x1; x++) {
-          int idx = y0 * w + x;
-          u8 v = l_ori[idx];
-          float d = interp(x0, x1, x, rc_seg, d0, d1);
-          // if (map[idx] == 0) {
-          if (v == 0) {
-            map[idx] = lone ? 0 : d;
-          }
-        }
+        add_seg(segs, false, false, l0, y0, x0, x1, rc_seg, d0, d1);
       }
     }
   }
@@ -206,21 +231,26 @@ static Image int2img(int w, int h, int* p) {
   return out;
 }
 
-static Image float2img(int w, int h, float f, float* p) {
-  Image out = GenImageColor(w, h, BLACK);
+static Image dist2img(TileMap* tm, float f, u16* p) {
+  Image out = GenImageColor(tm->w, tm->h, BLACK);
   Color* pix = out.data;
-  for (int i = 0; i < (w * h); i++) {
-    float v = p[i];
-    pix[i] = (Color){f * v, f * v, f * v, 255};
+  for (int y = 0; y < tm->h; y++) {
+    for (int x = 0; x < tm->w; x++) {
+      int it = tile_map_index(tm, x, y);
+      float v = it >= 0 ? tile_dist_unpack(p[it]) : 0;
+      pix[y * tm->w + x] = (Color){f * v, f * v, f * v, 255};
+    }
   }
   return out;
 }
 
-static void dist_graph_debug(DistGraph* dg, int nl, int w, int h) {
+static void dist_graph_debug(DistGraph* dg, int nl, TileMap* wmap) {
   for (int l = 0; l < nl; l++) {
     char fname[50];
     snprintf(fname, sizeof(fname), "d%d.png", l);
-    ExportImage(float2img(w, h, 100, dg->distmap[l]), fname);
+    Image img = dist2img(&wmap[l], 100, dg->distmap[l]);
+    ExportImage(img, fname);
+    UnloadImage(img);
     printf("Saved %s\n", fname);
   }
 }
@@ -260,6 +290,390 @@ static inline float find_pulse_energy(DistSpec* spec, float ctotal) {
   return 0.5 * ctotal * spec->vdd * spec->vdd;
 }
 
+/* Scratch of one dist_graph_init task. */
+typedef struct {
+  Graph gg; /* Subgraph of the wire */
+  EdgeGroup* eg;
+  ElmoreCalculator* ec;
+  struct Djikstra* dj;
+  int* layer;
+  int* pix; /* Pixel graph key of each subgraph node */
+  float* node_distance;
+  DistSegment* arr_seg; /* Segments of the wires done in this task */
+  int* sig;              /* Signature of the current wire */
+  int hits;
+  double t_setup;
+  double t_build;
+  double t_elmore;
+} DistScratch;
+
+typedef struct {
+  int isc; /* Scratch holding the segments (-1: the cache) */
+  int off;
+  int n;
+} DistSegRange;
+
+typedef struct {
+  DistGraph* dg;
+  DistSpec spec;
+  int w;
+  int h;
+  Graph* g;
+  int* wire_to_drv;
+  int* p_drv;
+  SocketDesc* wire_to_skt;
+  int* wire_to_skt_off;
+  int* p_skt;
+  int* noff; /* Offset of the nodes of each wire in n2 */
+  int* n2;   /* Nodes sorted by wire */
+  TileMap* wmap;
+  u8** ori;
+  RenderV2* rv2;
+  DistScratch* scratch; /* One per task */
+  DistCache* cache;
+  DistSegRange* wire_seg;
+  u64* sig_hash; /* Signature hash of each wire */
+  bool* lone;    /* Wires without driver */
+  int* order;     /* Wires by decreasing size */
+  int nc;
+  int next_wire;  /* Next entry of `order` to be taken */
+} DistCtx;
+
+/* Node keys of the wire, then its driver and socket pixels. */
+static void wire_signature(DistCtx* ctx, int c, int** sig) {
+  Graph* g = ctx->g;
+  int* subnodes = &ctx->n2[ctx->noff[c]];
+  int nk = ctx->noff[c + 1] - ctx->noff[c];
+  int skt_off = ctx->wire_to_skt_off[c];
+  int nskt = ctx->wire_to_skt_off[c + 1] - skt_off;
+  arrsetlen(*sig, nk + 1 + nskt);
+  int* p = *sig;
+  for (int k = 0; k < nk; k++) {
+    p[k] = g->nodes[subnodes[k]];
+  }
+  int drv = ctx->wire_to_drv[c];
+  p[nk] = drv != -1 ? ctx->p_drv[drv] : -1;
+  for (int iskt = 0; iskt < nskt; iskt++) {
+    p[nk + 1 + iskt] = ctx->p_skt[ctx->wire_to_skt[skt_off + iskt].socket];
+  }
+}
+
+/* FNV-1a, same result on every platform. */
+static u64 hash_ints(int* v, int n) {
+  u64 h = 14695981039346656037ull;
+  for (int i = 0; i < n; i++) {
+    h = (h ^ (u32)v[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+/* Copies the results of wire c from the cache, if it's there. */
+static bool dist_graph_wire_cached(DistCtx* ctx, int isc, int c) {
+  DistScratch* sc = &ctx->scratch[isc];
+  DistCache* dc = ctx->cache;
+  wire_signature(ctx, c, &sc->sig);
+  int n = arrlen(sc->sig);
+  u64 key = hash_ints(sc->sig, n);
+  ctx->sig_hash[c] = key;
+  if (!dc->map) return false;
+  ptrdiff_t i = hmgeti(dc->map, key);
+  if (i < 0) return false;
+  DistCacheWire* cw = &dc->map[i].value;
+  if (cw->stale || cw->sig_n != n ||
+      memcmp(dc->sig + cw->sig_off, sc->sig, n * sizeof(int)) != 0) {
+    return false;
+  }
+  int skt_off = ctx->wire_to_skt_off[c];
+  assert(cw->nskt == ctx->wire_to_skt_off[c + 1] - skt_off);
+  int* dt_ticks = dc->dt_ticks + cw->skt_off;
+  for (int iskt = 0; iskt < cw->nskt; iskt++) {
+    ctx->wire_to_skt[skt_off + iskt].dt_ticks = dt_ticks[iskt];
+  }
+  ctx->dg->gate_delay[c] = cw->gate_delay;
+  ctx->dg->wprop[c] = cw->wprop;
+  ctx->lone[c] = cw->lone;
+  draw_dist_map(ctx->wmap, dc->segs + cw->seg_off, cw->seg_n, cw->lone,
+                ctx->dg->distmap, ctx->ori);
+  ctx->wire_seg[c] = (DistSegRange){-1, cw->seg_off, cw->seg_n};
+  sc->hits++;
+  return true;
+}
+
+/*
+ * Distances, delays and energy of wire c. Only touches the wire own entries
+ * (and its pixels in the distance map), so wires can be done in any order.
+ */
+static void dist_graph_wire(DistCtx* ctx, int isc, int c) {
+  DistScratch* sc = &ctx->scratch[isc];
+  DistGraph* dg = ctx->dg;
+  DistSpec spec = ctx->spec;
+  Graph* g = ctx->g;
+  Graph* gg = &sc->gg;
+  EdgeGroup* eg = sc->eg;
+  ElmoreCalculator* ec = sc->ec;
+  struct Djikstra* dj = sc->dj;
+  int* wire_to_drv = ctx->wire_to_drv;
+  int* p_drv = ctx->p_drv;
+  SocketDesc* wire_to_skt = ctx->wire_to_skt;
+  int* wire_to_skt_off = ctx->wire_to_skt_off;
+  int* p_skt = ctx->p_skt;
+  int* noff = ctx->noff;
+  int* n2 = ctx->n2;
+  u8** ori = ctx->ori;
+  int w0 = ctx->w;
+  int h0 = ctx->h;
+  int img_size = w0 * h0;
+  int* layer = sc->layer;
+  int* pix = sc->pix;
+  float* node_distance = sc->node_distance;
+  double t0; /* used for profiling */
+  t0 = workers_now();
+  if (ctx->cache && dist_graph_wire_cached(ctx, isc, c)) {
+    sc->t_setup += workers_now() - t0;
+    return;
+  }
+  arrsetlen(layer, 0);
+  /* Creates a subgraph so we have better cache performance. */
+  int nk = noff[c + 1] - noff[c];
+  int* subnodes = &n2[noff[c]];
+  dist_build_subgraph(g, gg, nk, subnodes);
+  for (int ik = 0; ik < nk; ik++) {
+    arrput(layer, find_layer(img_size, g->nodes[subnodes[ik]]));
+  }
+
+  int root = -1;
+  int drv = wire_to_drv[c];
+  if (drv != -1) {
+    int idx = p_drv[drv];
+    root = find_node_from_idx(g, gg, idx);
+    assert(root >= 0);
+  }
+
+  /* Adds virtual nodes for the sockets associated with this wire */
+  int skt_off = wire_to_skt_off[c];
+  int nskt = wire_to_skt_off[c + 1] - skt_off;
+  int s_off = 1 << 30;
+  for (int iskt = 0; iskt < nskt; iskt++) {
+    int skt = wire_to_skt[skt_off + iskt].socket;
+    int skt_idx = p_skt[skt];
+    int node = find_node_from_idx(g, gg, skt_idx);
+    assert(node >= 0);
+    int r = graph_add_node(gg, s_off + skt);
+    assert(r == arrlen(layer));
+    arrput(layer, 0);        /* Nands are always at the layer 0 */
+    float w = spec.l_socket; /* Wire length associated to a nand input */
+    graph_add_edge(gg, node, r, w);
+  }
+  graph_build(gg);
+  arrsetlen(node_distance, gg->n);
+
+  sc->t_build += workers_now() - t0;
+  t0 = workers_now();
+
+  /* Distance calculation in graph */
+  bool lone = true;
+  if (root >= 0) {
+    lone = false;
+    int* _eoff = gg->eoff;
+    int* _ecount = gg->ecount;
+    GraphEdge* _edges = gg->edges;
+    float c_cyclic_total = -1;
+    if (!graph_is_tree(gg)) {
+      float sum_edges = 0;
+      djikstra_spanning_tree(dj, gg, root, eg, layer, spec.c_per_w,
+                             &sum_edges);
+      c_cyclic_total = sum_edges;
+      assert(edge_group_is_tree(eg));
+      _eoff = eg->eoff;
+      _ecount = eg->ecount;
+      _edges = eg->edges;
+#if 0
+      printf("after prune:\n");
+      {
+        int se = 0;
+        for (int i = 0; i < eg->n; i++) {
+          printf("Node %d: \n", i);
+          int ne = eg->ecount[i];
+          int off = eg->eoff[i];
+          for (int e = 0; e < ne; e++) {
+            int j = eg->edges[off + e].e;
+            float w = eg->edges[off + e].w;
+            printf("%d->%d : %f\n", i, j, w);
+          }
+        }
+        printf("num_nodes=%d num_edges=%d\n", eg->n, eg->ne);
+      }
+#endif
+    }
+    elmore_calculator_run(ec, gg->n, _eoff, _ecount, layer, _edges, root,
+                          node_distance);
+    /* The ctotal is used for the NAND activation time, ie, before the change
+     * actual starts. */
+    float ctotal = ec->ctotal;
+    float f = 1.f;
+    if (c_cyclic_total > 0) {
+      f = c_cyclic_total / ctotal;
+    }
+    ctotal = ctotal * f;
+    /*
+     * A      B
+     * |------|----- - - -
+     *   Gate    Wire
+     *
+     * c_down(B) = cGRAPH_down(B) + 0.5 * c_gate.
+     * T_D(B) = r_gate * c_down(B)
+     */
+    /* Gate delay depends only on total capacitance.
+     * Gate delay is the time for the NAND gate to activate (before
+     * propagation)
+     * */
+    dg->gate_delay[c] = find_gate_delay(&spec, ctotal);
+
+    assert(ctotal >= 0);
+    /* Pulse energy is separated from gate/driver energy */
+    // printf("nk %d ctotal %f\n", nk, ctotal);
+    dg->wprop[c].pulse_energy = find_pulse_energy(&spec, ctotal);
+
+    if (f > 1.f) {
+      for (int k = 0; k < gg->n; k++) {
+        node_distance[k] *= f;
+      }
+    }
+    for (int k = 0; k < gg->n; k++) {
+      assert(node_distance[k] >= 0);
+    }
+  } else {
+    /* No driver = gate delay of 0 */
+    dg->wprop[c].pulse_energy = spec.lone_pulse_energy;
+    dg->gate_delay[c] = 2;
+    for (int k = 0; k < gg->n; k++) {
+      node_distance[k] = 0;
+    }
+  }
+
+  /* removes added sockets and updates socket distance */
+  for (int iskt = nskt - 1; iskt >= 0; iskt--) {
+    int s = graph_pop_node(gg);
+    float dist_f = node_distance[s];
+    if (dist_f < 0) dist_f = -dist_f;
+    int dist_i = (int)(floorf(dist_f));
+    wire_to_skt[skt_off + iskt].dt_ticks = dist_i;
+  }
+
+  /* Image index of each subg node (subg keys are node indexes) */
+  arrsetlen(pix, nk);
+  for (int k = 0; k < nk; k++) {
+    // assert(node_distance[k] >= 0);
+    // printf("d[%d]=%f\n", k, node_distance[k]);
+    pix[k] = g->nodes[subnodes[k]];
+  }
+  sc->t_elmore += workers_now() - t0;
+  t0 = workers_now();
+#if 0
+  if (gg->n > 1) {
+    for (int i = 0; i < gg->n; i++) {
+      printf("dist[%d]=%f\n", i, node_distance[i]);
+    }
+  }
+#endif
+  /* From graph to wire segments and 2D distance map */
+  int seg0 = arrlen(sc->arr_seg);
+  setup_dist_map(spec, w0, h0, gg, pix, node_distance, &sc->arr_seg,
+                 &dg->wprop[c].max_delay);
+  int nseg = arrlen(sc->arr_seg) - seg0;
+  draw_dist_map(ctx->wmap, sc->arr_seg + seg0, nseg, lone, dg->distmap, ori);
+  if (ctx->rv2 || ctx->cache) {
+    ctx->wire_seg[c] = (DistSegRange){isc, seg0, nseg};
+  } else {
+    arrsetlen(sc->arr_seg, seg0);
+  }
+  if (ctx->lone) ctx->lone[c] = lone;
+  sc->t_setup += workers_now() - t0;
+  sc->layer = layer;
+  sc->pix = pix;
+  sc->node_distance = node_distance;
+}
+
+/* Takes wires, biggest first, until there's none left. */
+static void dist_graph_task(void* arg, int itask) {
+  DistCtx* ctx = arg;
+  while (true) {
+    int i = workers_fetch_add(&ctx->next_wire, 1);
+    if (i >= ctx->nc) break;
+    dist_graph_wire(ctx, itask, ctx->order[i]);
+  }
+}
+
+static DistSegment* wire_segments(DistCtx* ctx, DistSegRange sr) {
+  if (sr.isc < 0) return ctx->cache->segs + sr.off;
+  return ctx->scratch[sr.isc].arr_seg + sr.off;
+}
+
+/*
+ * Replaces the cache contents by the wires of this parse. Wires reused from
+ * the cache are copied over, so dropped wires don't pile up.
+ */
+static void dist_cache_update(DistCtx* ctx) {
+  DistCache* dc = ctx->cache;
+  DistGraph* dg = ctx->dg;
+  DistCache nxt = {.w = dc->w, .h = dc->h, .nl = dc->nl};
+  int* sig = NULL;
+  for (int c = 0; c < ctx->nc; c++) {
+    wire_signature(ctx, c, &sig);
+    DistSegRange sr = ctx->wire_seg[c];
+    DistSegment* seg = wire_segments(ctx, sr);
+    int skt_off = ctx->wire_to_skt_off[c];
+    int nskt = ctx->wire_to_skt_off[c + 1] - skt_off;
+    DistCacheWire cw = {
+        .sig_off = arrlen(nxt.sig),
+        .sig_n = arrlen(sig),
+        .seg_off = arrlen(nxt.segs),
+        .seg_n = sr.n,
+        .skt_off = arrlen(nxt.dt_ticks),
+        .nskt = nskt,
+        .lone = ctx->lone[c],
+        .gate_delay = dg->gate_delay[c],
+        .wprop = dg->wprop[c],
+    };
+    memcpy(arraddnptr(nxt.sig, cw.sig_n), sig, cw.sig_n * sizeof(int));
+    memcpy(arraddnptr(nxt.segs, sr.n), seg, sr.n * sizeof(DistSegment));
+    for (int iskt = 0; iskt < nskt; iskt++) {
+      arrput(nxt.dt_ticks, ctx->wire_to_skt[skt_off + iskt].dt_ticks);
+    }
+    assert(sr.n > 0);
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    for (int i = 0; i < sr.n; i++) {
+      DistSegment sg = seg[i];
+      int sx0 = sg.vertical ? sg.c : sg.p0;
+      int sx1 = sg.vertical ? sg.c : sg.p1;
+      int sy0 = sg.vertical ? sg.p0 : sg.c;
+      int sy1 = sg.vertical ? sg.p1 : sg.c;
+      x0 = mini(x0, sx0);
+      y0 = mini(y0, sy0);
+      x1 = maxi(x1, sx1);
+      y1 = maxi(y1, sy1);
+    }
+    cw.box = (RectangleInt){x0 - 1, y0 - 1, x1 - x0 + 3, y1 - y0 + 3};
+    hmput(nxt.map, ctx->sig_hash[c], cw);
+  }
+  arrfree(sig);
+  dist_cache_destroy(dc);
+  *dc = nxt;
+}
+
+typedef struct {
+  int n; /* Number of nodes */
+  int c;
+} WireSize;
+
+/* Decreasing size, then increasing wire id */
+static int compare_wire_size(const void* a, const void* b) {
+  const WireSize* wa = a;
+  const WireSize* wb = b;
+  if (wa->n != wb->n) return wb->n - wa->n;
+  return wa->c - wb->c;
+}
+
 /*
  * Computes the distance-to-driver for each wire.
  * This distance is then used to compute wire delay and for wire propagation
@@ -267,18 +681,31 @@ static inline float find_pulse_energy(DistSpec* spec, float ctotal) {
  *
  * The output will be a distance map image for each layer and a list of
  * segments that can be used in visualization update.
+ *
+ * Wires are independent, so they are spread over the workers (if any), with
+ * the biggest ones first: a few huge nets (clocks) take most of the time.
+ * Segments are handed to the renderer in wire order once all are done, so
+ * the output doesn't depend on the number of threads.
  */
 void dist_graph_init(DistGraph* dg, DistSpec spec, int w, int h, int nl,
                      Graph* g, /* Pixel graph */
                      int* wire_to_drv, int* p_drv, SocketDesc* wire_to_skt,
                      int* wire_to_skt_off, int* p_skt, int n_skt, int nc,
-                     int* comp, u8** ori, RenderV2* rv2, bool debug) {
+                     int* comp, TileMap* wmap, u8** ori, RenderV2* rv2,
+                     WorkerPool* workers, DistCache* cache, bool debug) {
   profiler_tic_single("dist_graph");
+  double t_start = workers_now();
+  if (cache && (cache->w != w || cache->h != h || cache->nl != nl)) {
+    dist_cache_destroy(cache);
+    cache->w = w;
+    cache->h = h;
+    cache->nl = nl;
+  }
   /* I need to be able to identify all nodes for each component, then I re-build
    * the graph.*/
-  PQ pq = {0};
   for (int l = 0; l < nl; l++) {
-    dg->distmap[l] = calloc(w * h, sizeof(float));
+    size_t n = (size_t)wmap[l].nslots * TILE_MAP_PIXELS;
+    dg->distmap[l] = calloc(n > 0 ? n : 1, sizeof(u16));
   }
   dg->wprop = calloc(nc, sizeof(WireProps));
   dg->gate_delay = calloc(nc, sizeof(int));
@@ -287,181 +714,114 @@ void dist_graph_init(DistGraph* dg, DistSpec spec, int w, int h, int nl,
   int* noff = calloc((nc + 1), sizeof(int));
   /* sorted nodes */
   int* n2 = calloc(g->n, sizeof(int));
-  /* temporary buffer used in dist calculation */
-  float* node_distance = calloc(g->n + n_skt, sizeof(float));
-  /* temporary buffer used in dist calculation */
-  int* stack = calloc(g->n, sizeof(int));
-  Graph gg = {0};
-  graph_init(&gg, 20);
-  pq_init(&pq);
   group_nodes_by_component(g, nc, comp, noff, n2);
-  int w0 = w;
-  int h0 = h;
-  EdgeGroup* eg = edge_group_create(g->max_edges);
-  ElmoreCalculator* ec = elmore_calculator_create();
-  ec->phys = spec;
-  struct Djikstra* dj = djikstra_create();
-
-  dg->t_setup = 0;
-  dg->t_build = 0;
-  dg->t_elmore = 0;
-
-  double vdd = spec.vdd;
-  int* layer = NULL;
 
-  /* Resistance of the gate, used for calculation of gate activation delay */
-  double t0; /* used for profiling */
-  int img_size = w * h;
+  WireSize* ws = malloc(nc * sizeof(WireSize));
   for (int c = 0; c < nc; c++) {
-    t0 = GetTime();
-    arrsetlen(layer, 0);
-    /* Creates a subgraph so we have better cache performance. */
-    int nk = noff[c + 1] - noff[c];
-    int* subnodes = &n2[noff[c]];
-    dist_build_subgraph(g, &gg, nk, subnodes);
-    for (int ik = 0; ik < nk; ik++) {
-      arrput(layer, find_layer(img_size, g->nodes[subnodes[ik]]));
-    }
-
-    int root = -1;
-    int drv = wire_to_drv[c];
-    if (drv != -1) {
-      int idx = p_drv[drv];
-      root = find_node_from_idx(g, &gg, idx);
-      assert(root >= 0);
-    }
-
-    /* Adds virtual nodes for the sockets associated with this wire */
-    int skt_off = wire_to_skt_off[c];
-    int nskt = wire_to_skt_off[c + 1] - skt_off;
-    int s_off = 1 << 30;
-    for (int iskt = 0; iskt < nskt; iskt++) {
-      int skt = wire_to_skt[skt_off + iskt].socket;
-      int skt_idx = p_skt[skt];
-      int node = find_node_from_idx(g, &gg, skt_idx);
-      assert(node >= 0);
-      int r = graph_add_node(&gg, s_off + skt);
-      assert(r == arrlen(layer));
-      arrput(layer, 0);        /* Nands are always at the layer 0 */
-      float w = spec.l_socket; /* Wire length associated to a nand input */
-      graph_add_edge(&gg, node, r, w);
-    }
-
-    dg->t_build += GetTime() - t0;
-    t0 = GetTime();
-
-    /* Distance calculation in graph */
-    bool lone = true;
-    if (root >= 0) {
-      lone = false;
-      int* _ecount = gg.ecount;
-      GraphEdge* _edges = gg.edges;
-      float c_cyclic_total = -1;
-      if (!graph_is_tree(&gg)) {
-        float sum_edges = 0;
-        djikstra_spanning_tree(dj, &gg, root, eg, layer, spec.c_per_w,
-                               &sum_edges);
-        c_cyclic_total = sum_edges;
-        assert(edge_group_is_tree(eg));
-        _ecount = eg->ecount;
-        _edges = eg->edges;
-#if 0
-        printf("after prune:\n");
-        {
-          int se = 0;
-          int me = eg->max_edges;
-          for (int i = 0; i < eg->n; i++) {
-            printf("Node %d: \n", i);
-            int ne = eg->ecount[i];
-            for (int e = 0; e < ne; e++) {
-              int j = eg->edges[me * i + e].e;
-              float w = g->edges[me * i + e].w;
-              printf("%d->%d : %f\n", i, j, w);
-            }
-          }
-          printf("num_nodes=%d num_edges=%d\n", eg->n, eg->ne);
-        }
-#endif
-      }
-      elmore_calculator_run(ec, gg.n, gg.max_edges, _ecount, layer, _edges,
-                            root, node_distance);
-      /* The ctotal is used for the NAND activation time, ie, before the change
-       * actual starts. */
-      float ctotal = ec->ctotal;
-      float f = 1.f;
-      if (c_cyclic_total > 0) {
-        f = c_cyclic_total / ctotal;
-      }
-      ctotal = ctotal * f;
-      /*
-       * A      B
-       * |------|----- - - -
-       *   Gate    Wire
-       *
-       * c_down(B) = cGRAPH_down(B) + 0.5 * c_gate.
-       * T_D(B) = r_gate * c_down(B)
-       */
-      /* Gate delay depends only on total capacitance.
-       * Gate delay is the time for the NAND gate to activate (before
-       * propagation)
-       * */
-      dg->gate_delay[c] = find_gate_delay(&spec, ctotal);
-
-      assert(ctotal >= 0);
-      /* Pulse energy is separated from gate/driver energy */
-      // printf("nk %d ctotal %f\n", nk, ctotal);
-      dg->wprop[c].pulse_energy = find_pulse_energy(&spec, ctotal);
-
-      if (f > 1.f) {
-        for (int k = 0; k < gg.n; k++) {
-          node_distance[k] *= f;
+    ws[c] = (WireSize){noff[c + 1] - noff[c], c};
+  }
+  qsort(ws, nc, sizeof(WireSize), compare_wire_size);
+  int* order = malloc(nc * sizeof(int));
+  for (int i = 0; i < nc; i++) {
+    order[i] = ws[i].c;
+  }
+  free(ws);
+
+  int ntasks = workers_count(workers);
+  if (ntasks > nc) ntasks = nc > 0 ? nc : 1;
+  DistScratch* scratch = calloc(ntasks, sizeof(DistScratch));
+  for (int i = 0; i < ntasks; i++) {
+    DistScratch* sc = &scratch[i];
+    graph_init(&sc->gg, g->n);
+    sc->eg = edge_group_create();
+    sc->ec = elmore_calculator_create();
+    sc->ec->phys = spec;
+    sc->dj = djikstra_create();
+  }
+  DistCtx ctx = {
+      .dg = dg,
+      .spec = spec,
+      .w = w,
+      .h = h,
+      .g = g,
+      .wire_to_drv = wire_to_drv,
+      .p_drv = p_drv,
+      .wire_to_skt = wire_to_skt,
+      .wire_to_skt_off = wire_to_skt_off,
+      .p_skt = p_skt,
+      .noff = noff,
+      .n2 = n2,
+      .wmap = wmap,
+      .ori = ori,
+      .rv2 = rv2,
+      .scratch = scratch,
+      .cache = cache,
+      .wire_seg = calloc(nc, sizeof(DistSegRange)),
+      .sig_hash = cache ? calloc(nc, sizeof(u64)) : NULL,
+      .lone = cache ? calloc(nc, sizeof(bool)) : NULL,
+      .order = order,
+      .nc = nc,
+      .next_wire = 0,
+  };
+  workers_run(workers, ntasks, dist_graph_task, &ctx);
+
+  /* Segments in wire order (the renderer groups them by wire) */
+  if (rv2) {
+    for (int c = 0; c < nc; c++) {
+      DistSegRange sr = ctx.wire_seg[c];
+      DistSegment* seg = wire_segments(&ctx, sr);
+      for (int i = 0; i < sr.n; i++) {
+        DistSegment sg = seg[i];
+        if (sg.vertical) {
+          renderv2_addvseg(rv2, c, sg.l, sg.c, sg.p0, sg.p1, sg.rc_seg, sg.d0,
+                           sg.d1);
+        } else {
+          renderv2_addhseg(rv2, c, sg.l, sg.p0, sg.p1, sg.c, sg.rc_seg, sg.d0,
+                           sg.d1);
         }
       }
-      for (int k = 0; k < gg.n; k++) {
-        assert(node_distance[k] >= 0);
-      }
-    } else {
-      /* No driver = gate delay of 0 */
-      dg->wprop[c].pulse_energy = spec.lone_pulse_energy;
-      dg->gate_delay[c] = 2;
-      for (int k = 0; k < gg.n; k++) {
-        node_distance[k] = 0;
-      }
     }
+  }
 
-    /* removes added sockets and updates socket distance */
-    for (int iskt = nskt - 1; iskt >= 0; iskt--) {
-      int s = graph_pop_node(&gg);
-      float dist_f = node_distance[s];
-      if (dist_f < 0) dist_f = -dist_f;
-      int dist_i = (int)(floorf(dist_f));
-      wire_to_skt[skt_off + iskt].dt_ticks = dist_i;
+  if (cache) {
+    int hits = 0;
+    for (int i = 0; i < ntasks; i++) {
+      hits += scratch[i].hits;
     }
+    dist_cache_update(&ctx);
+    cache->hits = hits;
+  }
 
-    /* Transforms subg node from node-index to image-index */
-    for (int k = 0; k < nk; k++) {
-      // assert(node_distance[k] >= 0);
-      // printf("d[%d]=%f\n", k, node_distance[k]);
-      gg.nodes[k] = g->nodes[subnodes[k]];
-    }
-    dg->t_elmore += GetTime() - t0;
-    t0 = GetTime();
-#if 0
-    if (gg.n > 1) {
-      for (int i = 0; i < gg.n; i++) {
-        printf("dist[%d]=%f\n", i, node_distance[i]);
-      }
-    }
-#endif
-    /* From graph to 2D distance map And wire segments */
-    setup_dist_map(spec, lone, w0, h0, &gg, node_distance, dg->distmap, c, ori,
-                   rv2, &dg->wprop[c].max_delay);
-    dg->t_setup += GetTime() - t0;
-    t0 = GetTime();
+  /* Times are summed over tasks */
+  dg->t_setup = 0;
+  dg->t_build = 0;
+  dg->t_elmore = 0;
+  for (int i = 0; i < ntasks; i++) {
+    DistScratch* sc = &scratch[i];
+    dg->t_setup += sc->t_setup;
+    dg->t_build += sc->t_build;
+    dg->t_elmore += sc->t_elmore;
+    graph_destroy(&sc->gg);
+    edge_group_free(sc->eg);
+    elmore_calculator_free(sc->ec);
+    djikstra_free(sc->dj);
+    arrfree(sc->layer);
+    arrfree(sc->pix);
+    arrfree(sc->node_distance);
+    arrfree(sc->arr_seg);
+    arrfree(sc->sig);
   }
+  free(scratch);
+  free(ctx.wire_seg);
+  free(ctx.sig_hash);
+  free(ctx.lone);
+  free(order);
   printf("time_build  = %.1f ms\n", (dg->t_build * 1000));
   printf("time_elmore = %.1f ms\n", (dg->t_elmore * 1000));
   printf("time_setup  = %.1f ms\n", (dg->t_setup * 1000));
+  if (cache) {
+    printf("cached_wires = %d/%d\n", cache->hits, nc);
+  }
   /*
    * Big img debug mode (no layer) :
   t_build  = 367.7 ms
@@ -483,18 +843,12 @@ void dist_graph_init(DistGraph* dg, DistSpec spec, int w, int h, int nl,
   */
 
   if (debug) {
-    dist_graph_debug(dg, nl, w, h);
+    dist_graph_debug(dg, nl, wmap);
   }
 
-  djikstra_free(dj);
-  elmore_calculator_free(ec);
-  edge_group_free(eg);
-  pq_destroy(&pq);
-  free(node_distance);
-  free(stack);
   free(n2);
   free(noff);
-  arrfree(layer);
+  dg->t_total = workers_now() - t_start;
   profiler_tac_single("dist_graph");
   // save_img_f32(w, h, dg->distmap[0], -40, 40, "../dmap.png");
 }
@@ -507,3 +861,31 @@ void dist_graph_destroy(DistGraph* dg) {
   }
 }
 
+void dist_cache_invalidate(DistCache* dc, bool all, int n,
+                           RectangleInt* rects) {
+  if (!all && n == 0) return;
+  /* Most wires are far from the edits, the box of all rects skips them */
+  RectangleInt bbox = n > 0 ? rects[0] : (RectangleInt){0};
+  for (int k = 1; k < n; k++) {
+    bbox = rect_int_union(bbox, rects[k]);
+  }
+  for (int i = 0; i < hmlen(dc->map); i++) {
+    DistCacheWire* cw = &dc->map[i].value;
+    if (all) {
+      cw->stale = true;
+      continue;
+    }
+    if (!rect_int_check_collision(cw->box, bbox)) continue;
+    for (int k = 0; k < n && !cw->stale; k++) {
+      cw->stale = rect_int_check_collision(cw->box, rects[k]);
+    }
+  }
+}
+
+void dist_cache_destroy(DistCache* dc) {
+  hmfree(dc->map);
+  arrfree(dc->sig);
+  arrfree(dc->segs);
+  arrfree(dc->dt_ticks);
+  *dc = (DistCache){0};
+}
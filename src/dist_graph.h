@@ -5,6 +5,7 @@
 #include "graph.h"
 #include "renderv2.h"
 #include "wire_graph.h"
+#include "workers.h"
 
 typedef struct {
   float max_delay;    /* Maximum time delay in the wire */
@@ -17,14 +18,70 @@ typedef struct {
   int idx_end;   /* Last index */
 } WireSegment;
 
+/* Wire segment, kept until it can be passed to the renderer in order. */
+typedef struct {
+  bool vertical;
+  bool nomap; /* Only for the renderer, not drawn in the distance map */
+  int l;
+  int c;  /* x of a vertical segment, y of a horizontal one */
+  int p0; /* Start and end along the segment */
+  int p1;
+  float rc_seg;
+  float d0;
+  float d1;
+} DistSegment;
+
+/* Results of one wire, in the arrays of the cache. */
+typedef struct {
+  int sig_off; /* Node keys, driver and socket pixels */
+  int sig_n;
+  int seg_off;
+  int seg_n;
+  int skt_off; /* dt_ticks of each socket */
+  int nskt;
+  RectangleInt box; /* Pixels covered by the wire, grown by one */
+  bool lone;
+  bool stale; /* Touched by an edit since the parse */
+  int gate_delay;
+  WireProps wprop;
+} DistCacheWire;
+
+typedef struct {
+  u64 key; /* Hash of the wire signature */
+  DistCacheWire value;
+} DistCacheEntry;
+
+/*
+ * Per wire results of the last distance graph, kept between simulations.
+ *
+ * A wire is identified by its signature: the keys of its graph nodes plus
+ * its driver and socket pixels. When a new parse finds a wire with the same
+ * signature, and no edit touched its region since, the distances, delays and
+ * segments are copied instead of computed again.
+ *
+ * Only the distance graph is incremental. The pixel graph, NAND detection and
+ * wire graph are rebuilt on every parse that misses the parse cache, i.e.
+ * after any edit.
+ */
+typedef struct {
+  int w, h, nl;
+  DistCacheEntry* map; /* stb hashmap */
+  int* sig;
+  DistSegment* segs;
+  int* dt_ticks;
+  int hits; /* Wires reused by the last parse */
+} DistCache;
+
 typedef struct {
   WireProps* wprop; /* max distance of each wire (in time steps) */
   int* gate_delay;  /* activation delay of each WIRE (when gate is present) */
-  float* distmap[MAX_LAYERS]; /* distance for each pixel */
+  u16* distmap[MAX_LAYERS]; /* distance for each pixel of the wire map tiles
+                             * (indexed with tile_map_index, tile_dist_pack) */
 
-  double t_setup;
+  double t_setup; /* Times summed over all workers */
   double t_build;
   double t_elmore;
+  double t_total; /* Wall time of the init */
 } DistGraph;
 
 void dist_graph_init(DistGraph* dg, DistSpec spec, int w, int h, int nl,
@@ -36,8 +93,16 @@ void dist_graph_init(DistGraph* dg, DistSpec spec, int w, int h, int nl,
                      int n_skt,               /* Number of sockets */
                      int nc,                  /* number of components/wires */
                      int* comp,               /* WireId of each (graph) node */
+                     TileMap* wmap,           /* Wire map of each layer */
                      u8** ori,                /* Orientation of each pixel */
-                     RenderV2* rv2, bool debug);
+                     RenderV2* rv2,
+                     WorkerPool* workers, /* Splits wires (NULL: serial) */
+                     DistCache* cache,    /* Reused and updated (or NULL) */
+                     bool debug);
 void dist_graph_destroy(DistGraph* dg);
 
+/* Marks the wires touching the rects (base image coords) as stale. */
+void dist_cache_invalidate(DistCache* dc, bool all, int n, RectangleInt* rects);
+void dist_cache_destroy(DistCache* dc);
+
 #endif
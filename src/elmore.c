@@ -30,7 +30,7 @@ static void elmore_alloc_buffers(ElmoreCalculator* ec, int n) {
   }
 }
 
-void elmore_calculator_run(ElmoreCalculator* e, int n, int me, int* ecount,
+void elmore_calculator_run(ElmoreCalculator* e, int n, int* eoff, int* ecount,
                            int* layer, GraphEdge* edges, int root,
                            float* node_distance) {
   elmore_alloc_buffers(e, n);
@@ -44,7 +44,7 @@ void elmore_calculator_run(ElmoreCalculator* e, int n, int me, int* ecount,
   for (int i = 0; i < n; i++) {
     int u = e->sorted[i];
     int ne = ecount[u];
-    int off = me * u;
+    int off = eoff[u];
     float myc = 0;
     // I need the real index !!
     int par = e->parent[u].v;
@@ -28,7 +28,7 @@ typedef struct {
 
 ElmoreCalculator* elmore_calculator_create();
 void elmore_calculator_free(ElmoreCalculator* e);
-void elmore_calculator_run(ElmoreCalculator* e, int n, int me, int* ecount,
+void elmore_calculator_run(ElmoreCalculator* e, int n, int* eoff, int* ecount,
                            int* layer, GraphEdge* edges, int root,
                            float* node_distance);
 
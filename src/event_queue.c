@@ -1,62 +1,176 @@
 #include "event_queue.h"
 
 #include "assert.h"
+#include "stb_ds.h"
 #include "stdlib.h"
 
+#define EVQ_CHUNK_BYTES (64 * 1024)
+
+static inline int block_cap(int cls) { return EVQ_MIN_BLOCK << cls; }
+
+static SocketEvent* pool_acquire(EventPool* p, int cls) {
+  assert(cls < EVQ_NUM_CLASSES);
+  SocketEvent* b = p->free[cls];
+  if (b) {
+    memcpy(&p->free[cls], b, sizeof(SocketEvent*));
+    return b;
+  }
+  size_t bytes = block_cap(cls) * sizeof(SocketEvent);
+  if (bytes > EVQ_CHUNK_BYTES / 4) {
+    /* Big blocks get their own chunk */
+    b = malloc(bytes);
+    arrput(p->chunks, b);
+    return b;
+  }
+  if (p->chunk_pos + bytes > p->chunk_end) {
+    /* The rest of the chunk is lost, at most a quarter of it */
+    u8* chunk = malloc(EVQ_CHUNK_BYTES);
+    arrput(p->chunks, chunk);
+    p->chunk_pos = chunk;
+    p->chunk_end = chunk + EVQ_CHUNK_BYTES;
+  }
+  b = (SocketEvent*)p->chunk_pos;
+  p->chunk_pos += bytes;
+  return b;
+}
+
+static void pool_release(EventPool* p, SocketEvent* b, int cls) {
+  memcpy(b, &p->free[cls], sizeof(SocketEvent*));
+  p->free[cls] = b;
+}
+
+static void pool_destroy(EventPool* p) {
+  for (int i = 0; i < arrlen(p->chunks); i++) {
+    free(p->chunks[i]);
+  }
+  arrfree(p->chunks);
+  *p = (EventPool){0};
+}
+
+static inline EventSlot* get_slot(EventQueue* e, int dt) {
+  assert(dt >= 0 && dt < e->ntime);
+  int i = e->cur_time + dt;
+  if (i >= e->ntime) i -= e->ntime;
+  return &e->slots[i];
+}
+
+/* Makes room for `n` more events in the slot. */
+static inline void slot_reserve(EventPool* p, EventSlot* s, int n) {
+  if (!s->ev) {
+    s->cls = 0;
+    while (block_cap(s->cls) < n) s->cls++;
+    s->ev = pool_acquire(p, s->cls);
+    return;
+  }
+  if (s->size + n <= block_cap(s->cls)) return;
+  int cls = s->cls + 1;
+  while (block_cap(cls) < s->size + n) cls++;
+  SocketEvent* b = pool_acquire(p, cls);
+  memcpy(b, s->ev, s->size * sizeof(SocketEvent));
+  pool_release(p, s->ev, s->cls);
+  s->ev = b;
+  s->cls = cls;
+}
+
+static inline void slot_clear(EventPool* p, EventSlot* s) {
+  if (s->ev) pool_release(p, s->ev, s->cls);
+  s->ev = NULL;
+  s->size = 0;
+}
+
 void event_queue_init(EventQueue* e, int ntime) {
+  *e = (EventQueue){0};
   e->ntime = ntime;
-  e->q_cap = malloc(ntime * sizeof(int));
-  e->qsize = malloc(ntime * sizeof(int));
-  e->q = malloc(ntime * sizeof(SocketEvent*));
-  e->pending_events = 0;
-  for (int iTime = 0; iTime < ntime; iTime++) {
-    e->q_cap[iTime] = 128;
-    e->qsize[iTime] = 0;
-    e->q[iTime] = malloc(e->q_cap[iTime] * sizeof(SocketEvent));
+  e->slots = calloc(ntime, sizeof(EventSlot));
+}
+
+/* Removes all the events (time is kept). */
+void event_queue_clear(EventQueue* e) {
+  for (int i = 0; i < e->ntime; i++) {
+    slot_clear(&e->pool, &e->slots[i]);
   }
+  e->pending_events = 0;
 }
 
 void event_queue_unschedule(EventQueue* e, int dt) {
-  int i = (e->cur_time + dt) % e->ntime;
-  e->qsize[i]--;
+  EventSlot* s = get_slot(e, dt);
+  assert(s->size > 0);
+  if (--s->size == 0) slot_clear(&e->pool, s);
   e->pending_events--;
 }
 
 void event_queue_schedule(EventQueue* e, int dt, int socket, int value) {
-  int i = (e->cur_time + dt) % e->ntime;
-  int qIdx = e->qsize[i]++;
-  e->q[i][qIdx] = (SocketEvent){socket, value};
+  EventSlot* s = get_slot(e, dt);
+  slot_reserve(&e->pool, s, 1);
+  s->ev[s->size++] = (SocketEvent){socket, value};
   e->pending_events++;
-  if (e->qsize[i] + 10 > e->q_cap[i]) {
-    e->q_cap[i] *= 2;
-    e->q[i] = realloc(e->q[i], e->q_cap[i] * sizeof(SocketEvent));
+}
+
+void event_queue_schedule_events(EventQueue* e, int dt, const SocketEvent* ev,
+                                 int n) {
+  if (n == 0) return;
+  EventSlot* s = get_slot(e, dt);
+  slot_reserve(&e->pool, s, n);
+  memcpy(s->ev + s->size, ev, n * sizeof(SocketEvent));
+  s->size += n;
+  e->pending_events += n;
+}
+
+void event_queue_schedule_sockets(EventQueue* e, int dt, const int* sockets,
+                                  int n, int value) {
+  if (n == 0) return;
+  EventSlot* s = get_slot(e, dt);
+  slot_reserve(&e->pool, s, n);
+  SocketEvent* ev = s->ev + s->size;
+  for (int k = 0; k < n; k++) {
+    ev[k] = (SocketEvent){sockets[k], value};
   }
+  s->size += n;
+  e->pending_events += n;
+}
+
+/* Removes the last `n` events of the slot. */
+void event_queue_unschedule_n(EventQueue* e, int dt, int n) {
+  if (n == 0) return;
+  EventSlot* s = get_slot(e, dt);
+  assert(s->size >= n);
+  s->size -= n;
+  if (s->size == 0) slot_clear(&e->pool, s);
+  e->pending_events -= n;
 }
 
 void event_queue_destroy(EventQueue* e) {
-  free(e->q_cap);
-  free(e->qsize);
-  for (int i = 0; i < e->ntime; i++) {
-    free(e->q[i]);
-  }
-  free(e->q);
+  free(e->slots);
+  pool_destroy(&e->pool);
+  *e = (EventQueue){0};
+}
+
+void event_queue_get_events(EventQueue* e, int dt, int* nEvent,
+                            SocketEvent** pEvents) {
+  EventSlot* s = get_slot(e, dt);
+  *nEvent = s->size;
+  *pEvents = s->ev;
 }
 
 void event_queue_get_current_events(EventQueue* e, int* nEvent,
                                     SocketEvent** pEvents) {
-  int i = e->cur_time;
-  *nEvent = e->qsize[i];
-  *pEvents = e->q[i];
+  event_queue_get_events(e, 0, nEvent, pEvents);
 }
 
 void event_queue_step_forward(EventQueue* e) {
-  e->pending_events -= e->qsize[e->cur_time];
-  e->qsize[e->cur_time] = 0;
+  EventSlot* s = &e->slots[e->cur_time];
+  e->pending_events -= s->size;
+  slot_clear(&e->pool, s);
   e->cur_time = (e->cur_time + 1) % e->ntime;
 }
 
 void event_queue_step_backward(EventQueue* e) {
   e->cur_time = (e->cur_time + e->ntime - 1) % e->ntime;
-  assert(e->qsize[e->cur_time] == 0);
+  assert(e->slots[e->cur_time].size == 0);
 }
 
+void event_queue_skip(EventQueue* e, int dt) {
+  assert(e->pending_events == 0);
+  int t = (e->cur_time + dt) % e->ntime;
+  e->cur_time = t < 0 ? t + e->ntime : t;
+}
@@ -7,10 +7,40 @@ typedef struct {
   int value;
 } SocketEvent;
 
+/*
+ * Events of one time slot. Storage is a block taken from the queue pool when
+ * the first event is scheduled and given back when the slot is emptied.
+ */
 typedef struct {
-  SocketEvent** q;     // one event queue per time.
-  int* q_cap;          // capacity of each queue
-  int* qsize;          // size of each queue
+  SocketEvent* ev; /* NULL when the slot has no block */
+  int size;
+  int cls; /* Size class of the block (capacity is EVQ_MIN_BLOCK << cls) */
+} EventSlot;
+
+#define EVQ_MIN_BLOCK 16
+#define EVQ_NUM_CLASSES 24
+
+/*
+ * Blocks of events shared by all the slots of a queue.
+ *
+ * Blocks are carved from big chunks and recycled through one free list per
+ * size class, so a running simulation doesn't allocate once the pool has
+ * grown to its peak usage.
+ */
+typedef struct {
+  SocketEvent* free[EVQ_NUM_CLASSES]; /* Free lists (next stored in block) */
+  void** chunks;                      /* Allocated chunks (owned) */
+  u8* chunk_pos;                      /* Free space of the last chunk */
+  u8* chunk_end;
+} EventPool;
+
+/*
+ * Timing wheel with one slot per tick. Delays are bounded by `ntime`, so a
+ * single level is enough: only the slot headers are allocated up front.
+ */
+typedef struct {
+  EventSlot* slots;    // one slot per time.
+  EventPool pool;      // storage of the slot events.
   int cur_time;        // current time
   int ntime;           // number of time steps
   int pending_events;  // number of events to be resolved
@@ -18,11 +48,23 @@ typedef struct {
 
 void event_queue_init(EventQueue* e, int ntime);
 void event_queue_destroy(EventQueue* e);
+void event_queue_clear(EventQueue* e);
 void event_queue_step_forward(EventQueue* e);
 void event_queue_step_backward(EventQueue* e);
+/* Moves an empty queue `dt` steps (backward when negative). */
+void event_queue_skip(EventQueue* e, int dt);
 void event_queue_get_current_events(EventQueue* e, int* nEvent,
                                     SocketEvent** pEvents);
+/* Events scheduled `dt` ticks from now. */
+void event_queue_get_events(EventQueue* e, int dt, int* nEvent,
+                            SocketEvent** pEvents);
 void event_queue_schedule(EventQueue* e, int dt, int socket, int value);
 void event_queue_unschedule(EventQueue* e, int dt);
+/* Bulk versions, all in the same slot */
+void event_queue_schedule_events(EventQueue* e, int dt, const SocketEvent* ev,
+                                 int n);
+void event_queue_schedule_sockets(EventQueue* e, int dt, const int* sockets,
+                                  int n, int value);
+void event_queue_unschedule_n(EventQueue* e, int dt, int n);
 
 #endif
@@ -1,13 +1,14 @@
 #include "graph.h"
 
 #include "stdio.h"
+#include "string.h"
 #include "union_find.h"
 
 static inline void edge_group_add_direct_edge(EdgeGroup* eg, int s, int t,
                                               float w) {
   eg->ne++;
   int e = eg->ecount[s]++;
-  int off = s * eg->max_edges;
+  int off = eg->eoff[s];
   eg->edges[off + e] = (GraphEdge){
       .e = t,
       .w = w,
@@ -19,25 +20,34 @@ static inline void edge_group_add_edge(EdgeGroup* eg, int s, int t, float w) {
   edge_group_add_direct_edge(eg, t, s, w);
 }
 
-EdgeGroup* edge_group_create(int max_edges) {
+EdgeGroup* edge_group_create() {
   EdgeGroup* eg = calloc(1, sizeof(EdgeGroup));
   eg->cap = 100;
+  eg->ecap = 200;
   eg->n = 0;
   eg->ne = 0;
-  eg->max_edges = max_edges;
-  eg->edges = calloc(eg->max_edges * eg->cap, sizeof(GraphEdge));
+  eg->edges = calloc(eg->ecap, sizeof(GraphEdge));
   eg->ecount = calloc(eg->cap, sizeof(int));
+  eg->eoff = calloc(eg->cap + 1, sizeof(int));
   return eg;
 }
 
-void edge_group_alloc(EdgeGroup* eg, int n) {
+/* Empty tree with the edge layout of `g`. */
+static void edge_group_alloc(EdgeGroup* eg, Graph* g) {
+  int n = g->n;
   eg->ne = 0;
   eg->n = n;
-  while (eg->n > eg->cap - 10) {
-    eg->cap *= 2;
-    eg->edges = realloc(eg->edges, eg->max_edges * eg->cap * sizeof(GraphEdge));
+  if (n > eg->cap) {
+    while (n > eg->cap) eg->cap *= 2;
     eg->ecount = realloc(eg->ecount, eg->cap * sizeof(int));
+    eg->eoff = realloc(eg->eoff, (eg->cap + 1) * sizeof(int));
+  }
+  int ne = g->eoff[n];
+  if (ne > eg->ecap) {
+    while (ne > eg->ecap) eg->ecap *= 2;
+    eg->edges = realloc(eg->edges, eg->ecap * sizeof(GraphEdge));
   }
+  memcpy(eg->eoff, g->eoff, (n + 1) * sizeof(int));
   for (int i = 0; i < n; i++) {
     eg->ecount[i] = 0;
   }
@@ -47,46 +57,120 @@ void edge_group_free(EdgeGroup* eg) {
   if (eg) {
     free(eg->edges);
     free(eg->ecount);
+    free(eg->eoff);
     free(eg);
   }
 }
 
+void graph_init(Graph* g, int nslots) {
+  *g = (Graph){0};
+  g->n = 0;
+  g->ne = 0;
+  g->cap = 1000;
+  g->ecap = 0;
+  g->ecount = calloc(g->cap, sizeof(int));
+  g->eoff = calloc(g->cap + 1, sizeof(int));
+  g->nodes = calloc(g->cap, sizeof(int));
+  g->nslots = nslots;
+  g->index = malloc(nslots * sizeof(int));
+  for (int i = 0; i < nslots; i++) {
+    g->index[i] = -1;
+  }
+}
+
+void graph_reset(Graph* g) {
+  for (int i = 0; i < g->n; i++) {
+    int slot = graph_slot(g->nodes[i]);
+    if (slot < g->nslots) g->index[slot] = -1;
+  }
+  g->ne = 0;
+  g->n = 0;
+  arrsetlen(g->arr_pending, 0);
+}
+
+void graph_destroy(Graph* g) {
+  free(g->edges);
+  free(g->eoff);
+  free(g->nodes);
+  free(g->ecount);
+  free(g->index);
+  arrfree(g->arr_pending);
+}
+
+/*
+ * Counting sort of the pending edges by source node. It's stable, so each
+ * node keeps its edges in the order they were added.
+ */
+void graph_build(Graph* g) {
+  int n = g->n;
+  int np = arrlen(g->arr_pending);
+  GraphPendingEdge* pe = g->arr_pending;
+  assert(np == g->ne);
+  if (np > g->ecap) {
+    g->ecap = np;
+    free(g->edges);
+    g->edges = malloc(g->ecap * sizeof(GraphEdge));
+  }
+  for (int i = 0; i < n; i++) {
+    g->ecount[i] = 0;
+  }
+  for (int i = 0; i < np; i++) {
+    g->ecount[pe[i].src]++;
+  }
+  g->eoff[0] = 0;
+  for (int i = 0; i < n; i++) {
+    g->eoff[i + 1] = g->eoff[i] + g->ecount[i];
+    g->ecount[i] = 0;
+  }
+  for (int i = 0; i < np; i++) {
+    int s = pe[i].src;
+    g->edges[g->eoff[s] + g->ecount[s]++] = (GraphEdge){pe[i].dst, pe[i].w};
+  }
+  arrsetlen(g->arr_pending, 0);
+}
+
 struct Djikstra {
-  PQ pq;
+  RHeap heap;
   bool* done;
   float* dist;
+  int* prev; /* Node that gave each node its distance */
 };
 
 struct Djikstra* djikstra_create() {
-  struct Djikstra* dji = calloc(1, sizeof(struct Djikstra));
-  pq_init(&dji->pq);
-  return dji;
+  return calloc(1, sizeof(struct Djikstra));
 }
 
 void djikstra_spanning_tree(struct Djikstra* dj, Graph* g, int root,
                             EdgeGroup* eg, int* layer, float* c_per_w,
                             float* sum_edges) {
   assert(root >= 0);
-  edge_group_alloc(eg, g->n);
-  arrsetlen(dj->dist, 0);
-  arrsetlen(dj->done, 0);
+  edge_group_alloc(eg, g);
   int n = g->n;
+  /* Scratch arrays keep their capacity between calls */
+  arrsetlen(dj->dist, n);
+  arrsetlen(dj->done, n);
+  arrsetlen(dj->prev, n);
   for (int i = 0; i < n; i++) {
-    arrput(dj->dist, -1.f);
-    arrput(dj->done, false);
+    dj->dist[i] = -1.f;
   }
-  dj->done[root] = 0;
-  PQ* p = &dj->pq;
+  memset(dj->done, 0, n * sizeof(bool));
+  RHeap* h = &dj->heap;
+  rheap_clear(h);
   float sum = 0;
-  pq_push(p, -1, root, 0);
-  while (p->size > 0) {
-    int u = pq_top(p).dst;
-    int prev = pq_top(p).src;
-    pq_pop(p);
+  dj->dist[root] = 0;
+  dj->prev[root] = -1;
+  rheap_push(h, 0, root);
+  /* Nodes pop by distance, then node id. A node hangs from the first node
+   * that reaches it at its final distance, so ties in meshes always give the
+   * same tree (and the same Elmore delays). */
+  while (h->size > 0) {
+    int u = rheap_pop(h, NULL);
+    /* Items left behind by a shorter distance */
     if (dj->done[u]) continue;
     dj->done[u] = true;
+    int prev = dj->prev[u];
     int ne = g->ecount[u];
-    int off = g->max_edges * u;
+    int off = g->eoff[u];
     float cw = c_per_w[layer[u]];
     for (int ie = 0; ie < ne; ie++) {
       int v = g->edges[off + ie].e;
@@ -98,8 +182,10 @@ void djikstra_spanning_tree(struct Djikstra* dj, Graph* g, int root,
       } else {
         float alt = dj->dist[u] + ew;
         if ((alt < dj->dist[v]) || (dj->dist[v] < 0)) {
+          /* Decrease key: the new item pops first, the old one is skipped */
           dj->dist[v] = alt;
-          pq_push(p, u, v, -alt);
+          dj->prev[v] = u;
+          rheap_push(h, alt, v);
         }
       }
     }
@@ -110,8 +196,10 @@ void djikstra_spanning_tree(struct Djikstra* dj, Graph* g, int root,
 
 void djikstra_free(struct Djikstra* dji) {
   if (!dji) return;
+  rheap_destroy(&dji->heap);
   arrfree(dji->done);
   arrfree(dji->dist);
+  arrfree(dji->prev);
   free(dji);
 }
 
@@ -120,10 +208,10 @@ void graph_print_weights(Graph* g) {
   for (int i = 0; i < g->n; i++) {
     printf("Node %d: \n", i);
     int ne = g->ecount[i];
-    int me = g->max_edges;
+    int off = g->eoff[i];
     for (int e = 0; e < ne; e++) {
-      int j = g->edges[me * i + e].e;
-      float w = g->edges[me * i + e].w;
+      int j = g->edges[off + e].e;
+      float w = g->edges[off + e].w;
       printf("%d->%d : %f\n", i, j, w);
     }
   }
@@ -138,42 +226,122 @@ void graph_print_stats(Graph* g) {
   printf("num_nodes=%d num_edges=%d\n", g->n, se);
 }
 
-int find_connected_components(Graph* g, int* c) {
-  /* uf rank */
-  int n = g->n;
-  int* r = calloc(n, sizeof(int));
-  int* cc = calloc(n, sizeof(int));
-  for (int i = 0; i < n; i++) {
-    cc[i] = i;
-  }
-  int me = g->max_edges;
-  for (int i = 0; i < n; i++) {
-    GraphEdge* ee = &g->edges[i * me];
+/*
+ * Nodes are split in ranges. Pixel graph nodes are created in image order,
+ * so a range is a band of rows of a layer. Each range is labeled on its own,
+ * then the edges that leave the ranges (band seams and layer vias) join them.
+ * Sets always keep their smallest node as root, which gives the numbering.
+ */
+typedef struct {
+  Graph* g;
+  int* cc;
+  int* root;
+  int* c;
+  int nchunks;
+  GraphPendingEdge** seams; /* Edges leaving each range */
+  int* first;               /* First component number of each range */
+} ComponentsCtx;
+
+static void node_range(ComponentsCtx* ctx, int itask, int* i0, int* i1) {
+  *i0 = (int)((long long)ctx->g->n * itask / ctx->nchunks);
+  *i1 = (int)((long long)ctx->g->n * (itask + 1) / ctx->nchunks);
+}
+
+static void components_local_task(void* arg, int itask) {
+  ComponentsCtx* ctx = arg;
+  Graph* g = ctx->g;
+  int i0, i1;
+  node_range(ctx, itask, &i0, &i1);
+  for (int i = i0; i < i1; i++) {
+    GraphEdge* ee = &g->edges[g->eoff[i]];
     int ne = g->ecount[i];
     for (int e = 0; e < ne; e++) {
-      uf_union(cc, r, i, ee[e].e);
+      int j = ee[e].e;
+      if (j >= i0 && j < i1) {
+        uf_union_min(ctx->cc, i, j);
+      } else if (j > i) {
+        GraphPendingEdge pe = {.src = i, .dst = j};
+        arrput(ctx->seams[itask], pe);
+      }
     }
   }
-  int k = 0;
-  for (int i = 0; i < n; i++) {
-    r[i] = -1;
+}
+
+/* Roots don't change anymore, so there's no path compression here. */
+static void components_root_task(void* arg, int itask) {
+  ComponentsCtx* ctx = arg;
+  int i0, i1;
+  node_range(ctx, itask, &i0, &i1);
+  int nroots = 0;
+  for (int i = i0; i < i1; i++) {
+    int r = i;
+    while (ctx->cc[r] != r) r = ctx->cc[r];
+    ctx->root[i] = r;
+    nroots += r == i;
+  }
+  ctx->first[itask] = nroots;
+}
+
+static void components_label_roots_task(void* arg, int itask) {
+  ComponentsCtx* ctx = arg;
+  int i0, i1;
+  node_range(ctx, itask, &i0, &i1);
+  int k = ctx->first[itask];
+  for (int i = i0; i < i1; i++) {
+    if (ctx->root[i] == i) ctx->c[i] = k++;
+  }
+}
+
+static void components_label_task(void* arg, int itask) {
+  ComponentsCtx* ctx = arg;
+  int i0, i1;
+  node_range(ctx, itask, &i0, &i1);
+  for (int i = i0; i < i1; i++) {
+    int r = ctx->root[i];
+    if (r != i) ctx->c[i] = ctx->c[r];
   }
-  // Flat-up the components
+}
+
+int find_connected_components(Graph* g, int* c, WorkerPool* workers) {
+  int n = g->n;
+  int nchunks = workers_count(workers);
+  if (n < 4096 * nchunks) nchunks = 1;
+  ComponentsCtx ctx = {
+      .g = g,
+      .cc = malloc(n * sizeof(int)),
+      .root = malloc(n * sizeof(int)),
+      .c = c,
+      .nchunks = nchunks,
+      .seams = calloc(nchunks, sizeof(GraphPendingEdge*)),
+      .first = malloc((nchunks + 1) * sizeof(int)),
+  };
   for (int i = 0; i < n; i++) {
-    cc[i] = uf_find(cc, i);
-    int ri = r[cc[i]];
-    if (ri == -1) {  // new component
-      r[cc[i]] = k;
-      c[i] = k;
-      k++;
-    } else {
-      c[i] = ri;
+    ctx.cc[i] = i;
+  }
+  workers_run(workers, nchunks, components_local_task, &ctx);
+  for (int t = 0; t < nchunks; t++) {
+    for (int e = 0; e < arrlen(ctx.seams[t]); e++) {
+      uf_union_min(ctx.cc, ctx.seams[t][e].src, ctx.seams[t][e].dst);
     }
+    arrfree(ctx.seams[t]);
   }
-  free(cc);
-  free(r);
+  workers_run(workers, nchunks, components_root_task, &ctx);
+  /* Root counts to first component numbers */
+  int k = 0;
+  for (int t = 0; t < nchunks; t++) {
+    int nroots = ctx.first[t];
+    ctx.first[t] = k;
+    k += nroots;
+  }
+  workers_run(workers, nchunks, components_label_roots_task, &ctx);
+  workers_run(workers, nchunks, components_label_task, &ctx);
+  free(ctx.cc);
+  free(ctx.root);
+  free(ctx.seams);
+  free(ctx.first);
   return k;
 }
+
 void gb_init(GraphBuilder* gb, int nv) {
   gb->ne_off = calloc(nv + 1, sizeof(int));
   gb->nv = nv;
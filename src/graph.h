@@ -6,6 +6,7 @@
 #include "stdbool.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "workers.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -21,33 +22,62 @@ typedef struct {
   int w;
 } GraphEdgeInt;
 
+/*
+ * Tree edges found by djikstra_spanning_tree. Same layout as the graph it was
+ * computed from: a node can't have more tree edges than graph edges.
+ */
 typedef struct {
   int n;
   int ne;
-  int max_edges;  // max edges
+  int* eoff; /* First edge of each node (size n+1) */
   GraphEdge* edges;
   int* ecount;
-  int cap;
+  int cap;  /* capacity in nodes */
+  int ecap; /* capacity in edges */
 } EdgeGroup;
 
-EdgeGroup* edge_group_create(int max_edges);
-void edge_group_alloc(EdgeGroup* eg, int n);
+EdgeGroup* edge_group_create();
 void edge_group_free(EdgeGroup* eg);
 
 typedef struct {
-  struct {
-    int key;
-    int value;
-  }* inv;
-  int* nodes;
+  int src;
+  int dst;
+  float w;
+} GraphPendingEdge;
+
+/*
+ * Undirected graph with an index from node keys to nodes.
+ *
+ * Edges are kept in CSR form: those of node i are edges[eoff[i]] up to
+ * ecount[i] of them. Edges added with graph_add_edge are pending until
+ * graph_build is called, which keeps the order in which they were added.
+ *
+ * The index is a dense array of `nslots` slots. Key k is in slot k (or -k-1
+ * for negative keys), so a pixel graph is indexed by pixel, and its horizontal
+ * (k) and vertical (-k-1) nodes share a slot. Nodes sharing a slot must be
+ * added one right after the other. Keys past the last slot aren't indexed.
+ */
+typedef struct {
+  int* index; /* First node of each slot (-1 if none) */
+  int nslots;
+  int* nodes;  /* Key of each node */
+  int* eoff;   /* First edge of each node (size n+1) */
+  int* ecount; /* Number of edges of each node */
   GraphEdge* edges;
-  int* ecount;
+  GraphPendingEdge* arr_pending; /* Edges not built yet */
   int ne;
   int n;
-  int max_edges;  // max edges
-  int cap;
+  int cap;  /* capacity in nodes */
+  int ecap; /* capacity in edges */
 } Graph;
 
+void graph_init(Graph* g, int nslots);
+/* Removes all nodes and edges (the index is cleared node by node). */
+void graph_reset(Graph* g);
+void graph_destroy(Graph* g);
+/* Moves the pending edges to the CSR arrays. */
+void graph_build(Graph* g);
+
 struct Djikstra;
 
 struct Djikstra* djikstra_create();
@@ -65,26 +95,27 @@ static inline bool edge_group_is_tree(EdgeGroup* eg) {
   return eg->ne == 2 * (eg->n - 1);
 }
 
+static inline int graph_slot(int nv) { return nv >= 0 ? nv : -nv - 1; }
+
+/* Removes the last node, which must be the last edge of its neighbours. */
 static inline int graph_pop_node(Graph* g) {
   int s = g->n - 1;
   int ne = g->ecount[s];
-  int me = g->max_edges;
+  int off = g->eoff[s];
   for (int i = 0; i < ne; i++) {
-    int v = g->edges[s * me + i].e;
+    int v = g->edges[off + i].e;
     g->ecount[v]--;
   }
+  int slot = graph_slot(g->nodes[s]);
+  if (slot < g->nslots && g->index[slot] == s) g->index[slot] = -1;
   g->n--;
   return s;
 }
 
 static inline void graph_add_direct_edge(Graph* g, int s, int t, float w) {
   g->ne++;
-  int e = g->ecount[s]++;
-  int off = s * g->max_edges;
-  g->edges[off + e] = (GraphEdge){
-      .e = t,
-      .w = w,
-  };
+  GraphPendingEdge pe = {s, t, w};
+  arrput(g->arr_pending, pe);
 }
 
 static inline void graph_add_edge(Graph* g, int s, int t, float w) {
@@ -95,56 +126,37 @@ static inline void graph_add_edge(Graph* g, int s, int t, float w) {
 
 static inline GraphEdge graph_get_neighboor(Graph* g, int s, int i) {
   assert(g->ecount[s] > i);
-  return g->edges[g->max_edges * s + i];
+  return g->edges[g->eoff[s] + i];
 }
 
 static inline bool graph_node_inv(Graph* g, int nv, int* v) {
-  int i = hmgeti(g->inv, nv);
-  if (i < 0) return false;
-  *v = g->inv[i].value;
+  int slot = graph_slot(nv);
+  if (slot >= g->nslots) return false;
+  int r = g->index[slot];
+  if (r < 0) return false;
+  if (g->nodes[r] != nv) {
+    /* The other node of the slot, if any */
+    r++;
+    if (r >= g->n || g->nodes[r] != nv) return false;
+  }
+  *v = r;
   return true;
 }
 
 static inline int graph_add_node(Graph* g, int nv) {
   int r = g->n++;
-  g->nodes[r] = nv;
-  g->ecount[r] = 0;
-  hmput(g->inv, nv, r);
-  while (g->n > g->cap - 10) {
+  if (g->n > g->cap) {
     g->cap *= 2;
-    g->edges = realloc(g->edges, g->max_edges * g->cap * sizeof(GraphEdge));
     g->nodes = realloc(g->nodes, g->cap * sizeof(int));
+    g->eoff = realloc(g->eoff, (g->cap + 1) * sizeof(int));
     g->ecount = realloc(g->ecount, g->cap * sizeof(int));
   }
+  g->nodes[r] = nv;
+  g->ecount[r] = 0;
+  int slot = graph_slot(nv);
+  if (slot < g->nslots && g->index[slot] < 0) g->index[slot] = r;
   return r;
 }
-
-static void graph_init(Graph* g, int max_edges) {
-  *g = (Graph){0};
-  g->max_edges = max_edges;
-  g->n = 0;
-  g->ne = 0;
-  g->cap = 1000;
-  g->edges = calloc(max_edges * g->cap, sizeof(GraphEdge));
-  g->ecount = calloc(g->cap, sizeof(int));
-  g->nodes = calloc(g->cap, sizeof(int));
-}
-
-static void graph_reset(Graph* g) {
-  g->ne = 0;
-  g->n = 0;
-  // TODO remove this hack!!
-  while (hmlen(g->inv) > 0) {
-    hmdel(g->inv, g->inv[0].key);
-  }
-}
-
-static void graph_destroy(Graph* g) {
-  free(g->edges);
-  free(g->nodes);
-  free(g->ecount);
-  hmfree(g->inv);
-}
 #endif
 
 void graph_print_stats(Graph* g);
@@ -221,11 +233,16 @@ int strongly_connected_components(GraphL* g, int* comp, int* compsz);
  *   c:  (Output)
  *      Array of size N. (allocated by the caller)
  *      Stores the component number of each node.
+ *   workers: (Input)
+ *      Splits the nodes in ranges (NULL: serial).
+ *
+ * Components are numbered in the order of their first node, whatever the
+ * number of workers.
  *
  * Returns the number of connected components found.
  *
  * */
-int find_connected_components(Graph* g, int* c);
+int find_connected_components(Graph* g, int* c, WorkerPool* workers);
 
 #if defined(__cplusplus)
 }
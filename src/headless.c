@@ -0,0 +1,186 @@
+/*
+ * Headless simulation runner.
+ *
+ * Loads a circuit image (and optionally a level kernel) and runs the
+ * simulation without a window or GL context, so it can be used in grading or
+ * benchmark farms.
+ *
+ * Usage:
+ *   ca_headless <circuit.png> [-kernel <level.lua>] [-ticks N] [-cycles N]
+ *               [-threads N] [-turbo]
+ *
+ * The run stops after N ticks or N level cycles (whichever is given, default
+ * is 10000 ticks), or when the level calls Pause(). `-threads` sets the number
+ * of threads used in the NAND update (default is 1, ie serial). `-turbo` steps
+ * the state in place without recording rewind patches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "img.h"
+#include "lua_level.h"
+#include "paths.h"
+#include "sim.h"
+#include "stb_ds.h"
+#include "workers.h"
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ca_headless <circuit.png> [-kernel <level.lua>] [-ticks N] "
+          "[-cycles N] [-threads N] [-turbo]\n");
+}
+
+static void print_ports(Sim* sim) {
+  LevelAPI* api = sim->api;
+  int np = arrlen(api->pg);
+  for (int ip = 0; ip < np; ip++) {
+    PinGroup* pg = &api->pg[ip];
+    PinComm pc = {0};
+    if (pg->type == PIN_IMG2LUA) {
+      pc = sim_port_read(sim, ip);
+    } else {
+      /* Drivers are read from the wire they drive */
+      int nw = arrlen(pg->pins);
+      int idrv = sim->pg.pgoff[ip];
+      for (int iw = 0; iw < nw; iw++) {
+        int c = sim->wg.drv_to_wire[idrv + iw];
+        if (c < 0) continue;
+        i64 v = pulse_unpack_vafter(sim->state.pulses[c]);
+        pc.b |= (v & 1LL) << iw;
+        pc.f |= ((v & 2LL) >> 1) << iw;
+      }
+    }
+    const char* dir = pg->type == PIN_IMG2LUA ? "in " : "out";
+    printf("port[%d] %s %-12s b=%" PRId64 " undef=%" PRId64 "\n", ip, dir,
+           pg->id, pc.b, pc.f);
+  }
+}
+
+int main(int argc, char** argv) {
+  const char* circuit = NULL;
+  const char* kernel = NULL;
+  i64 max_ticks = -1;
+  i64 max_cycles = -1;
+  int num_threads = 1;
+  bool turbo = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-kernel") == 0 && i + 1 < argc) {
+      kernel = argv[++i];
+    } else if (strcmp(argv[i], "-ticks") == 0 && i + 1 < argc) {
+      max_ticks = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "-cycles") == 0 && i + 1 < argc) {
+      max_cycles = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-turbo") == 0) {
+      turbo = true;
+    } else if (argv[i][0] != '-' && !circuit) {
+      circuit = argv[i];
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (!circuit) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (max_ticks < 0 && max_cycles < 0) max_ticks = 10000;
+
+  SetTraceLogLevel(LOG_WARNING);
+  Image img = LoadImage(circuit);
+  if (!img.data) {
+    fprintf(stderr, "Couldn't load %s\n", circuit);
+    return EXIT_FAILURE;
+  }
+  ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  Image layers[MAX_LAYERS + 1] = {0};
+  int nl = -1;
+  image_decode_layers(img, &nl, layers);
+  UnloadImage(img);
+  if (nl == 1) {
+    layers[0] = ensure_size_multiple_of(layers[0], 8);
+  }
+
+  LevelAPI api = {0};
+  LevelDef ldef = {0};
+  if (kernel) {
+    paths_init();
+    char* folder = clone_string(GetDirectoryPath(kernel));
+    ldef.id = "headless";
+    ldef.name = "headless";
+    ldef.kernel = (char*)kernel;
+    ldef.folder = folder;
+    ldef.is_custom_local = true;
+    Status s = lua_level_create(&api, &ldef);
+    if (!s.ok) {
+      fprintf(stderr, "Kernel error: %s\n", s.err_msg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Sim sim = {0};
+  SimParams p = {
+      .nl = nl,
+      .img = &layers[0],
+      .api = &api,
+      .layers = NULL,
+      .warmup_cycles = api.warmup_cycles,
+      .headless = true,
+      .num_threads = num_threads,
+  };
+  Status s = sim_init(&sim, p);
+  if (!s.ok) {
+    fprintf(stderr, "Simulation error: %s\n", s.err_msg);
+    return EXIT_FAILURE;
+  }
+  if (sim_has_errors(&sim)) {
+    fprintf(stderr, "Circuit has errors (flags=%d)\n",
+            sim.wg.global_error_flags);
+    return EXIT_FAILURE;
+  }
+
+  HSim hsim = wrap_sim(&sim);
+  double t0 = workers_now();
+  bool paused = false;
+  while (s.ok) {
+    if (max_ticks >= 0 && sim.state.cur_tick >= max_ticks) break;
+    if (max_cycles >= 0 && sim.state.cycle >= max_cycles) break;
+    /* Idle ticks are merged, without going past the limits (a tick moves the
+     * cycle by one at most) */
+    i64 warp = max_ticks >= 0 ? max_ticks - sim.state.cur_tick : INT32_MAX;
+    if (max_cycles >= 0 && max_cycles - sim.state.cycle < warp) {
+      warp = max_cycles - sim.state.cycle;
+    }
+    sim.max_warp = warp < INT32_MAX ? warp : INT32_MAX;
+    s = turbo ? hsim_nxt_turbo(&hsim) : hsim_nxt(&hsim);
+    if (sim.pause_requested) {
+      paused = true;
+      break;
+    }
+  }
+  double elapsed = workers_now() - t0;
+  if (!s.ok) {
+    fprintf(stderr, "Kernel error: %s\n", s.err_msg);
+  }
+
+  int ticks = sim.state.cur_tick;
+  printf("nands=%d wires=%d layers=%d size=%dx%d\n",
+         (int)arrlen(sim.pg.nands), sim.num_wire, nl, sim.w, sim.h);
+  printf("threads=%d turbo=%d\n", workers_count(sim.workers), turbo);
+  printf("ticks=%d cycles=%d%s\n", ticks, sim.state.cycle,
+         paused ? " (paused by level)" : "");
+  printf("elapsed=%.3fs ticks_per_sec=%.0f\n", elapsed,
+         elapsed > 0 ? ticks / elapsed : 0.0);
+  printf("max_tick=%d (cycle %d)\n", sim.state.max_tick,
+         sim.state.max_tick_cycle);
+  print_ports(&sim);
+
+  hsim_destroy(&hsim);
+  sim_destroy(&sim);
+  level_api_destroy(&api);
+  free(ldef.folder);
+  for (int i = 0; i < nl; i++) UnloadImage(layers[i]);
+  return s.ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,12 @@
 #include "hist.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "img.h"
+#include "stb_ds.h"
 
 /*
  * Creates and initialize a command.
@@ -70,12 +72,101 @@ static void hist_ensure_undo_size(Hist* h) {
   }
 }
 
+/* Past this, the two closest dirty rects are merged */
+#define HIST_MAX_DIRTY_RECTS 64
+
+static long long rect_area(RectangleInt r) {
+  return (long long)r.width * r.height;
+}
+
+/*
+ * Adds a changed region. It's merged with the regions it touches when their
+ * bounding box is not larger than both areas together, so strokes of many
+ * small edits end up as a few rects.
+ */
+static void hist_add_dirty_rect(Hist* h, RectangleInt r) {
+  if (h->dirty_all || rect_int_is_empty(r)) return;
+  int i = 0;
+  while (i < arrlen(h->arr_dirty_rects)) {
+    RectangleInt o = h->arr_dirty_rects[i];
+    RectangleInt u = rect_int_union(o, r);
+    if (rect_int_check_collision(o, r) &&
+        rect_area(u) <= rect_area(o) + rect_area(r)) {
+      /* The union can reach the rects already checked */
+      arrdelswap(h->arr_dirty_rects, i);
+      r = u;
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  arrput(h->arr_dirty_rects, r);
+  int n = arrlen(h->arr_dirty_rects);
+  if (n > HIST_MAX_DIRTY_RECTS) {
+    /* Merges the pair adding the least area, so far away edits stay apart */
+    RectangleInt* rs = h->arr_dirty_rects;
+    int bi = 0, bj = 1;
+    long long best = LLONG_MAX;
+    for (int i = 0; i < n; i++) {
+      for (int j = i + 1; j < n; j++) {
+        long long extra = rect_area(rect_int_union(rs[i], rs[j])) -
+                          rect_area(rs[i]) - rect_area(rs[j]);
+        if (extra < best) {
+          best = extra;
+          bi = i;
+          bj = j;
+        }
+      }
+    }
+    rs[bi] = rect_int_union(rs[bi], rs[bj]);
+    arrdelswap(h->arr_dirty_rects, bj);
+  }
+}
+
+/*
+ * Records the regions of the image buffers changed by a command, in base
+ * coords. Same regions both ways, undo writes the data before back. Selection
+ * moves, flips and rotations only touch the floating selection, which reaches
+ * the buffer when it's committed (a new ACTION_SEL_CREATE).
+ */
+static void hist_mark_cmd_dirty(Hist* h, HistCmd* c) {
+  switch (c->actType) {
+    case ACTION_BUFFER:
+    case ACTION_SEL_CREATE: {
+      for (int l = 0; l < MAX_LAYERS; l++) {
+        int ll = h->llsp[l];
+        Image img = c->data_after[l];
+        if (img.width == 0) img = c->data_before[l];
+        if (img.width == 0) continue;
+        RectangleInt r = {c->offset.x, c->offset.y, img.width << ll,
+                          img.height << ll};
+        hist_add_dirty_rect(h, r);
+      }
+      if (c->sel_rect.width > 0) {
+        hist_add_dirty_rect(h, c->sel_rect);
+      }
+      break;
+    }
+    case ACTION_SEL_MOVE:
+    case ACTION_SEL_FLIP_H:
+    case ACTION_SEL_FLIP_V:
+    case ACTION_SEL_ROTATE:
+      break;
+    case ACTION_RESIZE:
+    case ACTION_LAYER_PUSH:
+    case ACTION_LAYER_POP:
+      h->dirty_all = true;
+      break;
+  }
+}
+
 /*
  * Applies the command FORWARD action.
  * Will modify the state of history.
  */
 static void hist_cmd_do(HistCmd* c, Hist* h) {
   h->dirty = true;
+  hist_mark_cmd_dirty(h, c);
   h->tool = c->tool;
   switch (c->actType) {
     case ACTION_BUFFER: {
@@ -309,6 +400,7 @@ static void hist_cmd_do(HistCmd* c, Hist* h) {
  */
 static void hist_cmd_undo(HistCmd* c, Hist* h) {
   h->dirty = true;
+  hist_mark_cmd_dirty(h, c);
   if (c->next) {
     h->tool = c->next->tool;
   }
@@ -619,7 +711,10 @@ void hist_init(Hist* h) {
 #endif
 }
 
-void hist_destroy(Hist* h) { hist_clear_buffer(h); }
+void hist_destroy(Hist* h) {
+  hist_clear_buffer(h);
+  arrfree(h->arr_dirty_rects);
+}
 
 // Returns true if there's a region selected.
 bool hist_get_has_selection(Hist* h) {
@@ -939,6 +1034,7 @@ void hist_set_buffer(Hist* h, int nl, Image* buffer) {
   }
   h->layer = 0;
   h->dirty = false;
+  h->dirty_all = true;
   hist_reset_undo_history(h);
 }
 
@@ -948,6 +1044,19 @@ void hist_new_buffer(Hist* h, int bw, int bh) {
   hist_set_buffer(h, 1, &img);
 }
 
+// Regions of the image changed since the last hist_clear_dirty_rects (base
+// coords). If `all` is set, the whole image has to be considered changed.
+RectangleInt* hist_get_dirty_rects(Hist* h, int* n, bool* all) {
+  *n = arrlen(h->arr_dirty_rects);
+  *all = h->dirty_all;
+  return h->arr_dirty_rects;
+}
+
+void hist_clear_dirty_rects(Hist* h) {
+  arrsetlen(h->arr_dirty_rects, 0);
+  h->dirty_all = false;
+}
+
 // Getter to whether there was any change in the image.
 // Often used when we want to check whether we need to save before opening a
 // new image or before exiting the game.
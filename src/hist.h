@@ -106,6 +106,8 @@ typedef struct {
   bool dirty;           /* dirty flag for save */
   int maxUndoSize;      /* maximum size of undo history */
   int llsp[MAX_LAYERS]; /*log Spacing of each layer */
+  RectangleInt* arr_dirty_rects; /* Regions changed (base coords) */
+  bool dirty_all; /* Whole image changed (new image, resize or layers) */
 } Hist;
 
 void hist_init(Hist* h);
@@ -130,6 +132,8 @@ Image hist_get_active_buffer(Hist* h);
 RectangleInt hist_get_sel_rect(Hist* h);
 v2i hist_get_sel_offset(Hist* h);
 bool hist_get_is_dirty(Hist* h);
+RectangleInt* hist_get_dirty_rects(Hist* h, int* n, bool* all);
+void hist_clear_dirty_rects(Hist* h);
 void hist_set_not_dirty(Hist* h);
 bool hist_get_can_undo(Hist* h);
 bool hist_get_can_redo(Hist* h);
@@ -1,5 +1,7 @@
 #include "hsim.h"
 
+#include "stb_ds.h"
+
 void hsim_init(HSim* h) {
   *h = (HSim){0};
   u32 page_size = 32 * 1024 * 1024;
@@ -9,43 +11,255 @@ void hsim_init(HSim* h) {
   paged_cstack_init(&h->redo_stack, num_pages, page_size);
 }
 
+/*
+ * Enables checkpoints, with a total memory budget for history.
+ *
+ * Half of the budget goes to the undo/redo patch pages and half to snapshots
+ * and inputs. Oldest snapshots are dropped when going over it.
+ */
+void hsim_set_checkpoints(HSim* h, int interval, u64 budget) {
+  assert(interval > 0);
+  u64 stack_bytes = budget / 4;
+  u32 page_size = 32 * 1024 * 1024;
+  if (stack_bytes < 2 * (u64)page_size) {
+    page_size = stack_bytes / 2;
+  }
+  int num_pages = stack_bytes / page_size;
+  paged_cstack_destroy(&h->undo_stack);
+  paged_cstack_destroy(&h->redo_stack);
+  paged_cstack_init(&h->undo_stack, num_pages, page_size);
+  paged_cstack_init(&h->redo_stack, num_pages, page_size);
+  h->max_patch_size = page_size / 2;
+  h->checkpoint_interval = interval;
+  h->record_budget = budget / 2;
+}
+
+static bool hsim_has_checkpoints(HSim* h) { return h->checkpoint_interval > 0; }
+
+static void record_push(HSim* h, HSimRecord** arr, int tick, Buffer data) {
+  HSimRecord r = {.tick = tick, .data = buffer_clone(data)};
+  arrput(*arr, r);
+  h->record_bytes += data.size;
+}
+
+/* Removes records with tick >= `tick` */
+static void record_truncate(HSim* h, HSimRecord* arr, int tick) {
+  while (arrlen(arr) > 0 && arrlast(arr).tick >= tick) {
+    HSimRecord r = arrpop(arr);
+    h->record_bytes -= r.data.size;
+    buffer_free(&r.data);
+  }
+}
+
+/* Removes the first `n` records */
+static void record_drop_first(HSim* h, HSimRecord* arr, int n) {
+  for (int i = 0; i < n; i++) {
+    h->record_bytes -= arr[i].data.size;
+    buffer_free(&arr[i].data);
+  }
+  arrdeln(arr, 0, n);
+}
+
+static void hsim_clear_records(HSim* h) {
+  record_truncate(h, h->checkpoints, INT32_MIN);
+  record_truncate(h, h->tick_inputs, INT32_MIN);
+}
+
+/* Drops oldest snapshots (and inputs before them) while over budget. */
+static void hsim_enforce_budget(HSim* h) {
+  while (h->record_bytes > h->record_budget && arrlen(h->checkpoints) > 1) {
+    record_drop_first(h, h->checkpoints, 1);
+    int t0 = h->checkpoints[0].tick;
+    int n = 0;
+    while (n < arrlen(h->tick_inputs) && h->tick_inputs[n].tick < t0) n++;
+    record_drop_first(h, h->tick_inputs, n);
+  }
+}
+
+/* Latest snapshot taken strictly before `tick` (-1 if none). */
+static int hsim_find_checkpoint(HSim* h, int tick) {
+  for (int i = arrlen(h->checkpoints) - 1; i >= 0; i--) {
+    if (h->checkpoints[i].tick < tick) return i;
+  }
+  return -1;
+}
+
+/* First input record with tick >= `tick`. */
+static int hsim_find_input(HSim* h, int tick) {
+  int lo = 0;
+  int hi = arrlen(h->tick_inputs);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (h->tick_inputs[mid].tick < tick) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Called before computing a new tick.
+ *
+ * Patches older than the newest snapshot are not needed anymore: they can be
+ * rebuilt by replaying from the previous snapshot.
+ */
+static Status hsim_maybe_checkpoint(HSim* h) {
+  int nc = arrlen(h->checkpoints);
+  bool due = nc == 0 || h->tick % h->checkpoint_interval == 0;
+  if (!due || (nc > 0 && arrlast(h->checkpoints).tick == h->tick)) {
+    return status_ok();
+  }
+  Buffer snap = {0};
+  Status s = h->save(h->ctx, &snap);
+  if (!s.ok) return s;
+  record_push(h, &h->checkpoints, h->tick, snap);
+  paged_cstack_clear(&h->undo_stack);
+  hsim_enforce_budget(h);
+  return s;
+}
+
+static void hsim_record_inputs(HSim* h) {
+  record_truncate(h, h->tick_inputs, h->tick);
+  Buffer in = h->inputs(h->ctx);
+  if (in.size > 0) {
+    record_push(h, &h->tick_inputs, h->tick, in);
+  }
+}
+
+static Buffer hsim_encode(HSim* h, Buffer patch) {
+  return h->encode ? h->encode(h->ctx, patch) : patch;
+}
+
+static Buffer hsim_decode(HSim* h, Buffer data) {
+  return h->decode ? h->decode(h->ctx, data) : data;
+}
+
 static void hsim_panic_reset_history(HSim* h) {
   paged_cstack_clear(&h->undo_stack);
   paged_cstack_clear(&h->redo_stack);
+  /* Replaying would hit the same patch again, so older snapshots are lost
+   * too. The next tick starts a new checkpoint. */
+  hsim_clear_records(h);
 }
 
-void hsim_clear_forward_history(HSim* h) { paged_cstack_clear(&h->redo_stack); }
+void hsim_clear_forward_history(HSim* h) {
+  paged_cstack_clear(&h->redo_stack);
+  if (hsim_has_checkpoints(h)) {
+    record_truncate(h, h->checkpoints, h->tick + 1);
+    record_truncate(h, h->tick_inputs, h->tick);
+  }
+}
 
 Status hsim_nxt(HSim* h) {
   Buffer patch = {0};
+  Buffer data = {0}; /* Encoded patch */
   Status s = status_ok();
-  if (paged_cstack_empty(&h->redo_stack)) {
+  bool fresh = paged_cstack_empty(&h->redo_stack);
+  if (fresh) {
     /* Computes new patch */
-    s = h->diff(h->ctx, &patch);
+    if (hsim_has_checkpoints(h)) s = hsim_maybe_checkpoint(h);
+    if (s.ok) s = h->diff(h->ctx, &patch);
+    if (s.ok && hsim_has_checkpoints(h)) hsim_record_inputs(h);
+    if (s.ok) {
+      data = hsim_encode(h, patch);
+      h->raw_bytes += patch.size;
+      h->stored_bytes += data.size;
+    }
   } else {
     /* Uses stored patch */
-    patch = paged_cstack_pop(&h->redo_stack);
+    data = paged_cstack_pop(&h->redo_stack);
+    patch = hsim_decode(h, data);
   }
   if (s.ok) s = h->fwd(h->ctx, patch);
-  if (s.ok && (patch.size > h->max_patch_size)) {
+  if (!s.ok) return s;
+  if (data.size > h->max_patch_size) {
     hsim_panic_reset_history(h);
   } else {
-    paged_cstack_push(&h->undo_stack, patch);
+    paged_cstack_push(&h->undo_stack, data);
   }
+  h->tick++;
   return s;
 }
 
-bool hsim_has_prv(HSim* h) { return !paged_cstack_empty(&h->undo_stack); }
+/*
+ * Moves forward without recording history (turbo mode).
+ *
+ * Stored redo patches are still used first. Without checkpoints, past history
+ * can't be reached anymore after an unrecorded step, so it's dropped: when
+ * going back to hsim_nxt, recording restarts from the current state. With
+ * checkpoints, snapshots and inputs are still recorded, so it can be rewound
+ * later by replaying.
+ */
+Status hsim_nxt_turbo(HSim* h) {
+  if (!h->step || !paged_cstack_empty(&h->redo_stack)) {
+    return hsim_nxt(h);
+  }
+  Status s = status_ok();
+  if (hsim_has_checkpoints(h)) s = hsim_maybe_checkpoint(h);
+  if (!paged_cstack_empty(&h->undo_stack)) {
+    paged_cstack_clear(&h->undo_stack);
+  }
+  if (s.ok) s = h->step(h->ctx);
+  if (s.ok && hsim_has_checkpoints(h)) hsim_record_inputs(h);
+  if (s.ok) h->tick++;
+  return s;
+}
+
+/*
+ * Refills the undo stack by restoring the latest snapshot before the current
+ * tick and replaying the inputs up to the current tick.
+ */
+static Status hsim_rebuild(HSim* h) {
+  int ic = hsim_find_checkpoint(h, h->tick);
+  assert(ic >= 0);
+  HSimRecord c = h->checkpoints[ic];
+  Status s = status_ok();
+  int i0 = hsim_find_input(h, c.tick);
+  int i1 = hsim_find_input(h, h->tick);
+  for (int i = i1 - 1; i >= i0 && s.ok; i--) {
+    s = h->unwind(h->ctx, h->tick_inputs[i].data);
+  }
+  if (s.ok) s = h->load(h->ctx, c.data);
+  int ii = i0;
+  for (int t = c.tick; t < h->tick && s.ok; t++) {
+    Buffer in = {0};
+    if (ii < i1 && h->tick_inputs[ii].tick == t) {
+      in = h->tick_inputs[ii++].data;
+    }
+    Buffer patch = {0};
+    s = h->replay(h->ctx, in, &patch);
+    if (!s.ok) break;
+    Buffer data = hsim_encode(h, patch);
+    s = h->fwd(h->ctx, patch);
+    assert(data.size <= h->max_patch_size);
+    paged_cstack_push(&h->undo_stack, data);
+  }
+  return s;
+}
+
+bool hsim_has_prv(HSim* h) {
+  if (!paged_cstack_empty(&h->undo_stack)) return true;
+  return hsim_has_checkpoints(h) && hsim_find_checkpoint(h, h->tick) >= 0;
+}
 
 Status hsim_prv(HSim* h) {
   assert(hsim_has_prv(h));
-  Buffer patch = paged_cstack_pop(&h->undo_stack);
-  paged_cstack_push(&h->redo_stack, patch);
-  return h->bwd(h->ctx, patch);
+  if (paged_cstack_empty(&h->undo_stack)) {
+    Status s = hsim_rebuild(h);
+    if (!s.ok) return s;
+  }
+  Buffer data = paged_cstack_pop(&h->undo_stack);
+  paged_cstack_push(&h->redo_stack, data);
+  h->tick--;
+  return h->bwd(h->ctx, hsim_decode(h, data));
 }
 
 void hsim_destroy(HSim* h) {
   paged_cstack_destroy(&h->undo_stack);
   paged_cstack_destroy(&h->redo_stack);
+  hsim_clear_records(h);
+  arrfree(h->checkpoints);
+  arrfree(h->tick_inputs);
 }
-
@@ -4,22 +4,56 @@
 #include "paged_cstack.h"
 #include "status.h"
 
+/* Data attached to a tick (snapshot or external inputs). */
+typedef struct {
+  int tick;
+  Buffer data; /* Owned */
+} HSimRecord;
+
 typedef struct {
   void* ctx;                                /*not owned*/
   Status (*diff)(void* ctx, Buffer* patch); /* Buffer owned by ctx */
   Status (*fwd)(void* ctx, Buffer patch);
   Status (*bwd)(void* ctx, Buffer patch);
+  Status (*step)(void* ctx); /* Moves forward without a patch (optional) */
+  /* Compact patch encoding for the stacks (optional, Buffers owned by ctx) */
+  Buffer (*encode)(void* ctx, Buffer patch);
+  Buffer (*decode)(void* ctx, Buffer data);
+
+  /*
+   * Checkpoints (optional).
+   *
+   * Full snapshots are taken every `checkpoint_interval` ticks, together with
+   * the external inputs of every tick (the part of a tick that can't be
+   * recomputed from the state). Rewinding past the oldest stored patch
+   * restores a snapshot and replays the inputs forward to rebuild the patches.
+   */
+  Status (*save)(void* ctx, Buffer* snap);  /* Buffer owned by ctx */
+  Status (*load)(void* ctx, Buffer snap);   /* Restores a snapshot */
+  Buffer (*inputs)(void* ctx);              /* Inputs of last diff/step */
+  Status (*replay)(void* ctx, Buffer inputs, Buffer* patch); /* Like diff */
+  Status (*unwind)(void* ctx, Buffer inputs); /* Reverts what save misses */
 
   /* Compressed Stacks for undo/redos */
   PagedCStack undo_stack; /* Undo patches (data owned by hsim) */
   PagedCStack redo_stack; /* Redo patches (data owned by hsim) */
   u32 max_patch_size; /* Patches bigger than this will make history collapse. */
+  u64 raw_bytes;      /* Bytes of computed patches, before encoding */
+  u64 stored_bytes;   /* Bytes of computed patches, after encoding */
 
+  int tick;                  /* Ticks since start */
+  int checkpoint_interval;   /* Ticks between snapshots (0 = disabled) */
+  u64 record_budget;         /* Max bytes for snapshots and inputs */
+  u64 record_bytes;          /* Bytes used by snapshots and inputs */
+  HSimRecord* checkpoints;   /* Snapshots, oldest first */
+  HSimRecord* tick_inputs;   /* Non-empty inputs, oldest first */
 } HSim;
 
 void hsim_init(HSim* h);
+void hsim_set_checkpoints(HSim* h, int interval, u64 budget);
 void hsim_clear_forward_history(HSim* h);
 Status hsim_nxt(HSim* h);
+Status hsim_nxt_turbo(HSim* h);
 Status hsim_prv(HSim* h);
 bool hsim_has_prv(HSim* h);
 void hsim_destroy(HSim* h);
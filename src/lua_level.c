@@ -351,7 +351,7 @@ static int lua_Import(lua_State* L) {
 
 static int lua_texture_gc(lua_State* L) {
   Texture2D* tex = luaL_checkudata(L, 1, TEXTURE_MT);
-  UnloadTexture(*tex);
+  if (tex->id) UnloadTexture(*tex);
   return 0;
 }
 
@@ -368,7 +368,8 @@ static int lua_LoadTexture(lua_State* L) {
     full_path = checked_path;
   }
   Texture2D* tex = lua_newuserdata(L, sizeof(Texture2D));
-  *tex = LoadTexture(full_path);
+  /* Headless runs have no GL context: the level gets an empty texture. */
+  *tex = IsWindowReady() ? LoadTexture(full_path) : (Texture2D){0};
   free(checked_path);
   luaL_getmetatable(L, TEXTURE_MT);
   lua_setmetatable(L, -2);
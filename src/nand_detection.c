@@ -4,9 +4,8 @@
 #include "profiler.h"
 #include "stb_ds.h"
 #include "stdbool.h"
-
-static inline int mini(int a, int b) { return a < b ? a : b; }
-static inline int maxi(int a, int b) { return a > b ? a : b; }
+#include "stdlib.h"
+#include "string.h"
 
 typedef struct {
   int pw;
@@ -97,67 +96,108 @@ static pattern_def_t pd_list[] = {
          }},
 };
 
-void find_nands(int w, int h, u8* img, NandLoc** out_nands) {
-  profiler_tic_single("find_nand");
-  int nn = 0;
-  NandLoc* nands = 0;  // malloc(3 * cap * sizeof(int));
-  int* cand = 0;
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      int idx = y * w + x;
-      int b0 = img[idx];
-      int b1 = y > 0 ? img[idx - w] : 0;      // up
-      int b2 = x < w - 1 ? img[idx + 1] : 0;  // right
-      int b3 = y < h - 1 ? img[idx + w] : 0;  // bot
-      int b4 = x > 0 ? img[idx - 1] : 0;      // left
-      int b = b0 | (b1 << 1) | (b2 << 2) | (b3 << 3) | (b4 << 4);
-      if (b == 1) {
-        arrput(cand, idx);
+#define NUM_PATTERNS ((int)(sizeof(pd_list) / sizeof(pd_list[0])))
+
+/*
+ * Window around a candidate pixel that covers all the patterns, one bit per
+ * pixel: columns -2..3 and rows -1..3 of the candidate (30 bits).
+ */
+#define WIN_X0 -2
+#define WIN_Y0 -1
+#define WIN_W 6
+#define WIN_H 5
+
+static inline int win_bit(int dx, int dy) {
+  return (dy - WIN_Y0) * WIN_W + (dx - WIN_X0);
+}
+
+/* A pattern as a window mask: pixels it cares about, and their values. */
+typedef struct {
+  u32 care;
+  u32 val;
+} PatternMask;
+
+static void compile_patterns(PatternMask* pm) {
+  for (int ip = 0; ip < NUM_PATTERNS; ip++) {
+    pattern_def_t* pd = &pd_list[ip];
+    pm[ip] = (PatternMask){0};
+    for (int yy = 0; yy < pd->ph; yy++) {
+      for (int xx = 0; xx < pd->pw; xx++) {
+        int p = pd->data[yy * pd->pw + xx];
+        int dx = xx - pd->ox;
+        int dy = yy - pd->oy;
+        assert(dx >= WIN_X0 && dx < WIN_X0 + WIN_W);
+        assert(dy >= WIN_Y0 && dy < WIN_Y0 + WIN_H);
+        if (p == -1) continue;
+        pm[ip].care |= 1u << win_bit(dx, dy);
+        if (p == 1) pm[ip].val |= 1u << win_bit(dx, dy);
       }
     }
   }
+}
+
+/* Pixels outside of the image are background. */
+static u32 read_window(int w, int h, u8* img, int x, int y) {
+  u32 m = 0;
+  for (int dy = WIN_Y0; dy < WIN_Y0 + WIN_H; dy++) {
+    int yy = y + dy;
+    if (yy < 0 || yy >= h) continue;
+    u8* row = img + yy * w;
+    for (int dx = WIN_X0; dx < WIN_X0 + WIN_W; dx++) {
+      int xx = x + dx;
+      if (xx >= 0 && xx < w && row[xx]) m |= 1u << win_bit(dx, dy);
+    }
+  }
+  return m;
+}
+
+typedef struct {
+  int w;
+  int h;
+  u8* img;
+  int nbands;
+  PatternMask pm[NUM_PATTERNS];
+  NandLoc** out; /* Per band and pattern: out[band * NUM_PATTERNS + ip] */
+} FindNandsCtx;
 
-  for (int ip = 0; ip < 4; ip++) {
-    pattern_def_t pd = pd_list[ip];
-    int xmin = mini(0, mini(pd.w1x, mini(pd.w2x, pd.w3x)));
-    int ymin = mini(0, mini(pd.w1y, mini(pd.w2y, pd.w3y)));
-    int xmax = maxi(pd.pw, maxi(pd.w1x, maxi(pd.w2x, pd.w3x)));
-    int ymax = maxi(pd.ph, maxi(pd.w1y, maxi(pd.w2y, pd.w3y)));
-    for (int i = 0; i < arrlen(cand); i++) {
-      int idx = cand[i];
-      int x = idx % w;
-      int y = idx / w;
-      x = x - pd.ox;
-      y = y - pd.oy;
-      // if (x + xmin < 0 || y + ymin < 0 || x + xmax > w || y + ymax > h) {
-      //   continue;
-      // }
-      bool ok = true;
-      for (int xx = 0; xx < pd.pw; xx++) {
-        for (int yy = 0; yy < pd.ph; yy++) {
-          int p = pd.data[yy * pd.pw + xx];
-          int v = 0;
-          if (((y + yy) < 0) || (y + yy >= h) || (x + xx < 0) ||
-              (x + xx >= w)) {
-            v = 0;
-          } else {
-            v = img[(y + yy) * w + (x + xx)];
-          }
-          if (v != p && p != -1) {
-            ok = false;
-            break;
-          }
+static void find_nands_task(void* arg, int itask) {
+  FindNandsCtx* ctx = arg;
+  int w = ctx->w;
+  int h = ctx->h;
+  u8* img = ctx->img;
+  NandLoc** out = ctx->out + itask * NUM_PATTERNS;
+  int y0 = (int)((long long)h * itask / ctx->nbands);
+  int y1 = (int)((long long)h * (itask + 1) / ctx->nbands);
+  for (int y = y0; y < y1; y++) {
+    u8* row = img + y * w;
+    for (int x = 0; x < w; x++) {
+      /* Skips background, 8 pixels at a time */
+      if (x + 8 <= w) {
+        u64 word;
+        memcpy(&word, row + x, sizeof(word));
+        if (word == 0) {
+          x += 7;
+          continue;
         }
-        if (!ok) break;
       }
-
-      if (ok) {
-        int x0 = x + pd.w1x;
-        int y0 = y + pd.w1y;
-        int x1 = x + pd.w2x;
-        int y1 = y + pd.w2y;
-        int x2 = x + pd.w3x;
-        int y2 = y + pd.w3y;
+      /* Candidates are lone pixels, the first NAND body pixel in a scan */
+      if (!row[x]) continue;
+      if (x > 0 && row[x - 1]) continue;
+      if (x < w - 1 && row[x + 1]) continue;
+      if (y > 0 && row[x - w]) continue;
+      if (y < h - 1 && row[x + w]) continue;
+      u32 m = read_window(w, h, img, x, y);
+      for (int ip = 0; ip < NUM_PATTERNS; ip++) {
+        if ((m & ctx->pm[ip].care) != ctx->pm[ip].val) continue;
+        pattern_def_t* pd = &pd_list[ip];
+        int px = x - pd->ox;
+        int py = y - pd->oy;
+        int x0 = px + pd->w1x;
+        int y0 = py + pd->w1y;
+        int x1 = px + pd->w2x;
+        int y1 = py + pd->w2y;
+        int x2 = px + pd->w3x;
+        int y2 = py + pd->w3y;
         /* Checks if sockets and drivers fall inside the image */
         if ((x0 >= 0 && x0 < w && y0 >= 0 && y0 < h) &&
             (x1 >= 0 && x1 < w && y1 >= 0 && y1 < h) &&
@@ -167,13 +207,37 @@ void find_nands(int w, int h, u8* img, NandLoc** out_nands) {
               y1 * w + x1,  // second input
               y2 * w + x2,  // output
           };
-          arrput(nands, loc);
-          nn++;
+          arrput(out[ip], loc);
         }
       }
     }
   }
-  arrfree(cand);
+}
+
+void find_nands(int w, int h, u8* img, WorkerPool* workers,
+                NandLoc** out_nands) {
+  profiler_tic_single("find_nand");
+  FindNandsCtx ctx = {
+      .w = w,
+      .h = h,
+      .img = img,
+      .nbands = h < workers_count(workers) ? 1 : workers_count(workers),
+  };
+  compile_patterns(ctx.pm);
+  ctx.out = calloc(ctx.nbands * NUM_PATTERNS, sizeof(NandLoc*));
+  workers_run(workers, ctx.nbands, find_nands_task, &ctx);
+
+  /* Grouped by pattern, then in image order */
+  NandLoc* nands = 0;
+  for (int ip = 0; ip < NUM_PATTERNS; ip++) {
+    for (int b = 0; b < ctx.nbands; b++) {
+      NandLoc* l = ctx.out[b * NUM_PATTERNS + ip];
+      int n = arrlen(l);
+      if (n) memcpy(arraddnptr(nands, n), l, n * sizeof(NandLoc));
+      arrfree(l);
+    }
+  }
+  free(ctx.out);
   *out_nands = nands;
   profiler_tac_single("find_nand");
 }
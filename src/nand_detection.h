@@ -2,6 +2,7 @@
 #define CA_FIND_NANDS_H
 
 #include "common.h"
+#include "workers.h"
 
 /* Describes a NAND location in the image */
 typedef struct {
@@ -10,7 +11,9 @@ typedef struct {
   int d;  /* driver index */
 } NandLoc;
 
-void find_nands(int w, int h, u8* img, NandLoc** out_nands);
+/* Image rows are split in bands among the workers (NULL: serial). */
+void find_nands(int w, int h, u8* img, WorkerPool* workers,
+                NandLoc** out_nands);
 void remove_nand_pixels(int w, u8* img, NandLoc* nands);
 
 #endif
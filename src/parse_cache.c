@@ -0,0 +1,451 @@
+#include "parse_cache.h"
+
+#include "assert.h"
+#include "math.h"
+#include "stb_ds.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+typedef struct {
+  char magic[4];
+  u32 version;
+  u64 key;
+  int w, h, nl;
+  int nwire;
+  int nnand;
+  int nskt;
+  int ndrv;
+  int npgoff;
+  int has_errors;
+  int global_error_flags;
+  int nseg; /* Renderer segments (-1: parsed without renderer) */
+  u32 size; /* Whole file, so truncated files are skipped */
+  u64 sum;  /* Hash of everything after the header */
+} ParseCacheHeader;
+
+#define PARSE_CACHE_SUM_SEED 14695981039346656037ull
+
+typedef struct {
+  FILE* fp;
+  u32 size;
+  bool ok;
+  u64 sum; /* Hash of the padded sections written */
+} CacheWriter;
+
+typedef struct {
+  const u8* data;
+  u32 pos;
+  u32 size;
+  bool ok;
+} CacheReader;
+
+static inline u32 pad8(u32 bytes) { return (bytes + 7) & ~7u; }
+
+static u64 hash_bytes(u64 h, const void* data, size_t n) {
+  const u8* p = data;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    u64 v;
+    memcpy(&v, p + i, 8);
+    h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+  }
+  for (; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001B3ull;
+  }
+  return h;
+}
+
+u64 parse_cache_key(int nl, Image* imgs, PinGroup* pgs) {
+  int head[4] = {PARSE_CACHE_VERSION, nl, imgs[0].width, imgs[0].height};
+  u64 h = hash_bytes(14695981039346656037ull, head, sizeof(head));
+  for (int l = 0; l < nl; l++) {
+    assert(imgs[l].format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    h = hash_bytes(h, imgs[l].data, (size_t)imgs[l].width * imgs[l].height * 4);
+  }
+  for (int i = 0; i < arrlen(pgs); i++) {
+    int pin_head[2] = {pgs[i].type, arrlen(pgs[i].pins)};
+    h = hash_bytes(h, pin_head, sizeof(pin_head));
+    h = hash_bytes(h, pgs[i].pins, arrlen(pgs[i].pins) * sizeof(Coord2D));
+  }
+  return h;
+}
+
+static const char* cache_fname(const char* dir, u64 key) {
+  return TextFormat("%s/%016llx.bin", dir, (unsigned long long)key);
+}
+
+/* Sections are padded so all of them start 8 byte aligned */
+static void put(CacheWriter* w, const void* p, u32 bytes) {
+  static const u8 zero[8] = {0};
+  u32 pad = pad8(bytes) - bytes;
+  if (bytes > 0 && fwrite(p, 1, bytes, w->fp) != bytes) w->ok = false;
+  if (pad > 0 && fwrite(zero, 1, pad, w->fp) != pad) w->ok = false;
+  w->size += bytes + pad;
+  /* Same hash as the padded section read back in one go */
+  u32 full = bytes & ~7u;
+  w->sum = hash_bytes(w->sum, p, full);
+  if (full < bytes) {
+    u8 tail[8] = {0};
+    memcpy(tail, (const u8*)p + full, bytes - full);
+    w->sum = hash_bytes(w->sum, tail, sizeof(tail));
+  }
+}
+
+static void put_int(CacheWriter* w, int v) { put(w, &v, sizeof(int)); }
+
+static const void* get(CacheReader* r, u32 bytes) {
+  u32 padded = pad8(bytes);
+  if (!r->ok || padded > r->size - r->pos) {
+    r->ok = false;
+    return NULL;
+  }
+  const void* p = r->data + r->pos;
+  r->pos += padded;
+  return p;
+}
+
+static int get_int(CacheReader* r) {
+  const int* p = get(r, sizeof(int));
+  return p ? *p : 0;
+}
+
+/* Malloc'd copy of the next section. */
+static void* get_copy(CacheReader* r, u32 bytes) {
+  const void* p = get(r, bytes);
+  if (!p) return NULL;
+  void* out = malloc(bytes > 0 ? bytes : 1);
+  memcpy(out, p, bytes);
+  return out;
+}
+
+/* Copies the next section into a stb array (already sized). */
+static void get_arr(CacheReader* r, void* arr, u32 bytes) {
+  const void* p = get(r, bytes);
+  if (p && bytes > 0) memcpy(arr, p, bytes);
+}
+
+/* Wire map tiles, as stored in memory. */
+static void put_tile_map(CacheWriter* w, TileMap* m) {
+  put_int(w, m->nslots);
+  put_int(w, m->pal_off[m->nslots]);
+  put(w, m->slot, m->tw * m->th * sizeof(int));
+  put(w, m->pal_off, (m->nslots + 1) * sizeof(int));
+  put(w, m->pal, m->pal_off[m->nslots] * sizeof(int));
+  put(w, m->wire, m->nslots * TILE_MAP_PIXELS * sizeof(u16));
+}
+
+/* Checks every index, so a bad file can't point out of the arrays. */
+static void get_tile_map(CacheReader* r, TileMap* m, int w, int h, int nwire) {
+  m->w = w;
+  m->h = h;
+  m->tw = (w + TILE_MAP_SIZE - 1) >> TILE_MAP_SHIFT;
+  m->th = (h + TILE_MAP_SIZE - 1) >> TILE_MAP_SHIFT;
+  int ntiles = m->tw * m->th;
+  int nslots = get_int(r);
+  int npal = get_int(r);
+  if (nslots < 0 || nslots > ntiles || npal < 0 || npal > r->size) {
+    r->ok = false;
+    return;
+  }
+  m->nslots = nslots;
+  m->slot = get_copy(r, ntiles * sizeof(int));
+  m->pal_off = get_copy(r, (nslots + 1) * sizeof(int));
+  m->pal = get_copy(r, npal * sizeof(int));
+  m->wire = get_copy(r, nslots * TILE_MAP_PIXELS * sizeof(u16));
+  if (!r->ok) return;
+  for (int t = 0; t < ntiles; t++) {
+    if (m->slot[t] < -1 || m->slot[t] >= nslots) r->ok = false;
+  }
+  if (m->pal_off[0] != 0 || m->pal_off[nslots] != npal) r->ok = false;
+  for (int s = 0; s < nslots && r->ok; s++) {
+    int n = m->pal_off[s + 1] - m->pal_off[s];
+    if (n < 0) {
+      r->ok = false;
+      break;
+    }
+    u16* tile = m->wire + s * TILE_MAP_PIXELS;
+    for (int i = 0; i < TILE_MAP_PIXELS; i++) {
+      if (tile[i] > n) r->ok = false;
+    }
+  }
+  for (int i = 0; i < npal && r->ok; i++) {
+    if (m->pal[i] < 0 || m->pal[i] >= nwire) r->ok = false;
+  }
+}
+
+/* Fails the read if an index of `a` is out of [lo, hi). */
+static void check_range(CacheReader* r, const int* a, int n, int lo, int hi) {
+  for (int i = 0; i < n && r->ok; i++) {
+    if (a[i] < lo || a[i] >= hi) r->ok = false;
+  }
+}
+
+/*
+ * Checks the indexes between the loaded arrays (pixels, wires, sockets,
+ * drivers, pin groups), so a bad file falls back to a full parse instead of
+ * reading out of bounds later.
+ */
+static void check_indexes(CacheReader* r, Sim* sim, PixelGraph* pg,
+                          WireGraph* wg, int nseg, const int* wids) {
+  int nwire = wg->nwire;
+  int nskt = arrlen(pg->skt);
+  int ndrv = arrlen(pg->drv);
+  int npix = sim->w * sim->h;
+  check_range(r, pg->skt, nskt, -1, npix);
+  check_range(r, pg->drv, ndrv, -1, npix);
+  for (int i = 0; i < arrlen(pg->nands) && r->ok; i++) {
+    NandLoc n = pg->nands[i]; /* Pixel indexes */
+    if (n.s1 < 0 || n.s1 >= npix || n.s2 < 0 || n.s2 >= npix || n.d < 0 ||
+        n.d >= npix) {
+      r->ok = false;
+    }
+  }
+  PinGroup* pins = sim->api->pg;
+  if (arrlen(pg->pgoff) != arrlen(pins)) r->ok = false;
+  for (int i = 0; i < arrlen(pg->pgoff) && r->ok; i++) {
+    int n = pins[i].type == PIN_IMG2LUA ? nskt : ndrv;
+    int off = pg->pgoff[i];
+    if (off < 0 || off + arrlen(pins[i].pins) > n) r->ok = false;
+  }
+  check_range(r, wg->wire_to_drv, nwire, -1, ndrv);
+  check_range(r, wg->drv_to_wire, ndrv, -1, nwire);
+  check_range(r, wg->skt_to_wire, nskt, -1, nwire);
+  int* off = wg->wire_to_skt_off;
+  if (r->ok && (off[0] != 0 || off[nwire] > nskt)) r->ok = false;
+  for (int i = 0; i < nwire && r->ok; i++) {
+    if (off[i + 1] < off[i]) r->ok = false;
+  }
+  for (int i = 0; r->ok && i < off[nwire]; i++) {
+    int skt = wg->wire_to_skt[i].socket;
+    if (skt < 0 || skt >= nskt) r->ok = false;
+  }
+  for (int i = 0; i < nseg && r->ok; i++) {
+    int wire = wids[i] >> 4;
+    if (wire < 0 || wire >= nwire) r->ok = false;
+  }
+}
+
+/*
+ * Checks the values the sim uses without bounds: delays are at least one
+ * tick, socket events fit the event queue, energies are finite and
+ * non-negative, gate delays fit the NAND counters, and wires without driver
+ * have the delay of a zero distance (the sim can't report them, they have no
+ * driver status).
+ */
+static void check_values(CacheReader* r, WireGraph* wg, DistGraph* dg) {
+  int* off = wg->wire_to_skt_off;
+  for (int i = 0; i < wg->nwire && r->ok; i++) {
+    WireProps wp = dg->wprop[i];
+    int gd = dg->gate_delay[i];
+    if (!isfinite(wp.max_delay) || wp.max_delay < 1 ||
+        !isfinite(wp.pulse_energy) || wp.pulse_energy < 0 || gd < 0 ||
+        gd > UINT16_MAX || (wg->wire_to_drv[i] < 0 && wp.max_delay > 1)) {
+      r->ok = false;
+    }
+    for (int j = off[i]; j < off[i + 1] && r->ok; j++) {
+      int dt = wg->wire_to_skt[j].dt_ticks;
+      if (dt < 0 || dt + 1 >= SIM_MAX_QUEUE_DELAY) r->ok = false;
+    }
+  }
+}
+
+bool parse_cache_load(ParseCacheFile* f, const char* dir, u64 key, Sim* sim) {
+  *f = (ParseCacheFile){0};
+  const char* fname = cache_fname(dir, key);
+  if (!FileExists(fname)) {
+    return false;
+  }
+  int size = 0;
+  u8* data = LoadFileData(fname, &size);
+  if (!data) return false;
+  CacheReader r = {data, 0, size, true};
+  const ParseCacheHeader* hd = get(&r, sizeof(ParseCacheHeader));
+  if (!hd || memcmp(hd->magic, "CAPC", 4) != 0 ||
+      hd->version != PARSE_CACHE_VERSION || hd->key != key ||
+      hd->size != (u32)size || hd->w != sim->w || hd->h != sim->h ||
+      hd->nl != sim->nl || (!sim->headless && hd->nseg < 0) ||
+      hd->nwire < 0 || hd->nnand < 0 || hd->nskt < 0 || hd->ndrv < 0 ||
+      hd->npgoff < 0 || hd->nwire > size || hd->nnand > size ||
+      hd->nskt > size || hd->ndrv > size || hd->npgoff > size ||
+      hash_bytes(PARSE_CACHE_SUM_SEED, data + r.pos, size - r.pos) !=
+          hd->sum) {
+    UnloadFileData(data);
+    return false;
+  }
+  int w = hd->w;
+  int h = hd->h;
+  int nwire = hd->nwire;
+  int nskt = hd->nskt;
+  int ndrv = hd->ndrv;
+  PixelGraph pg = {0};
+  WireGraph wg = {0};
+  DistGraph dg = {0};
+  arrsetlen(pg.nands, hd->nnand);
+  arrsetlen(pg.skt, nskt);
+  arrsetlen(pg.drv, ndrv);
+  arrsetlen(pg.pgoff, hd->npgoff);
+  get_arr(&r, pg.nands, hd->nnand * sizeof(NandLoc));
+  get_arr(&r, pg.skt, nskt * sizeof(int));
+  get_arr(&r, pg.drv, ndrv * sizeof(int));
+  get_arr(&r, pg.pgoff, hd->npgoff * sizeof(int));
+  wg.nwire = nwire;
+  wg.has_errors = hd->has_errors;
+  wg.global_error_flags = hd->global_error_flags;
+  wg.wire_to_drv = get_copy(&r, nwire * sizeof(int));
+  wg.drv_to_wire = get_copy(&r, ndrv * sizeof(int));
+  wg.skt_to_wire = get_copy(&r, nskt * sizeof(int));
+  wg.drv_status = get_copy(&r, ndrv * sizeof(int));
+  wg.skt_status = get_copy(&r, nskt * sizeof(int));
+  wg.wire_to_skt = get_copy(&r, nskt * sizeof(SocketDesc));
+  wg.wire_to_skt_off = get_copy(&r, (nwire + 1) * sizeof(int));
+  dg.wprop = get_copy(&r, nwire * sizeof(WireProps));
+  dg.gate_delay = get_copy(&r, nwire * sizeof(int));
+  for (int l = 0; l < hd->nl && r.ok; l++) {
+    get_tile_map(&r, &wg.wmap[l], w, h, nwire);
+    if (r.ok) {
+      dg.distmap[l] =
+          get_copy(&r, wg.wmap[l].nslots * TILE_MAP_PIXELS * sizeof(u16));
+    }
+  }
+  f->nseg = hd->nseg;
+  f->seg_off = r.pos;
+  const int* wids = NULL;
+  if (hd->nseg > 0) {
+    wids = get(&r, hd->nseg * sizeof(int));
+    get(&r, hd->nseg * sizeof(Vector4));
+    get(&r, hd->nseg * sizeof(Vector2));
+  }
+  if (r.ok) check_indexes(&r, sim, &pg, &wg, hd->nseg, wids);
+  if (r.ok) check_values(&r, &wg, &dg);
+  if (!r.ok) {
+    printf("parse_cache: skipping bad file %s\n", fname);
+    pixel_graph_destroy(&pg);
+    wire_graph_destroy(&wg);
+    dist_graph_destroy(&dg);
+    UnloadFileData(data);
+    *f = (ParseCacheFile){0};
+    return false;
+  }
+  f->data = data;
+  f->size = size;
+  sim->pg = pg;
+  sim->wg = wg;
+  sim->dg = dg;
+  sim->num_wire = nwire;
+  return true;
+}
+
+void parse_cache_load_segments(ParseCacheFile* f, RenderV2* rv2) {
+  if (rv2 && f->nseg > 0) {
+    CacheReader r = {f->data, f->seg_off, f->size, true};
+    int n = f->nseg;
+    const int* wids = get(&r, n * sizeof(int));
+    const Vector4* pos = get(&r, n * sizeof(Vector4));
+    const Vector2* dist = get(&r, n * sizeof(Vector2));
+    assert(r.ok);
+    memcpy(arraddnptr(rv2->wids, n), wids, n * sizeof(int));
+    memcpy(arraddnptr(rv2->pos, n), pos, n * sizeof(Vector4));
+    memcpy(arraddnptr(rv2->dist, n), dist, n * sizeof(Vector2));
+    for (int i = 0; i < n; i++) {
+      renderv2_count_wire(rv2, wids[i] >> 4);
+    }
+  }
+  UnloadFileData(f->data);
+  *f = (ParseCacheFile){0};
+}
+
+static int compare_mod_time(const void* a, const void* b) {
+  long ta = GetFileModTime(*(const char**)a);
+  long tb = GetFileModTime(*(const char**)b);
+  return (ta > tb) - (ta < tb);
+}
+
+/* Removes the oldest files until there are PARSE_CACHE_MAX_FILES left. */
+static void parse_cache_trim(const char* dir) {
+  FilePathList files = LoadDirectoryFilesEx(dir, ".bin", false);
+  int n = files.count;
+  if (n > PARSE_CACHE_MAX_FILES) {
+    qsort(files.paths, n, sizeof(char*), compare_mod_time);
+    for (int i = 0; i < n - PARSE_CACHE_MAX_FILES; i++) {
+      remove(files.paths[i]);
+    }
+  }
+  UnloadDirectoryFiles(files);
+}
+
+void parse_cache_save(const char* dir, u64 key, Sim* sim) {
+  PixelGraph* pg = &sim->pg;
+  WireGraph* wg = &sim->wg;
+  DistGraph* dg = &sim->dg;
+  RenderV2* rv2 = sim->rv2;
+  if (!DirectoryExists(dir)) MakeDirectory(dir);
+  char fname[512];
+  char tmp[520];
+  snprintf(fname, sizeof(fname), "%s", cache_fname(dir, key));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+  CacheWriter w = {fopen(tmp, "wb"), 0, true, 0};
+  if (!w.fp) return;
+  int nwire = wg->nwire;
+  int nskt = arrlen(pg->skt);
+  int ndrv = arrlen(pg->drv);
+  ParseCacheHeader hd = {
+      .magic = {'C', 'A', 'P', 'C'},
+      .version = PARSE_CACHE_VERSION,
+      .key = key,
+      .w = sim->w,
+      .h = sim->h,
+      .nl = sim->nl,
+      .nwire = nwire,
+      .nnand = arrlen(pg->nands),
+      .nskt = nskt,
+      .ndrv = ndrv,
+      .npgoff = arrlen(pg->pgoff),
+      .has_errors = wg->has_errors,
+      .global_error_flags = wg->global_error_flags,
+      .nseg = rv2 ? arrlen(rv2->wids) : -1,
+  };
+  put(&w, &hd, sizeof(hd)); /* Rewritten at the end with size and sum */
+  w.sum = PARSE_CACHE_SUM_SEED;
+  put(&w, pg->nands, hd.nnand * sizeof(NandLoc));
+  put(&w, pg->skt, nskt * sizeof(int));
+  put(&w, pg->drv, ndrv * sizeof(int));
+  put(&w, pg->pgoff, hd.npgoff * sizeof(int));
+  put(&w, wg->wire_to_drv, nwire * sizeof(int));
+  put(&w, wg->drv_to_wire, ndrv * sizeof(int));
+  put(&w, wg->skt_to_wire, nskt * sizeof(int));
+  put(&w, wg->drv_status, ndrv * sizeof(int));
+  put(&w, wg->skt_status, nskt * sizeof(int));
+  put(&w, wg->wire_to_skt, nskt * sizeof(SocketDesc));
+  put(&w, wg->wire_to_skt_off, (nwire + 1) * sizeof(int));
+  put(&w, dg->wprop, nwire * sizeof(WireProps));
+  put(&w, dg->gate_delay, nwire * sizeof(int));
+  for (int l = 0; l < sim->nl; l++) {
+    put_tile_map(&w, &wg->wmap[l]);
+    put(&w, dg->distmap[l],
+        wg->wmap[l].nslots * TILE_MAP_PIXELS * sizeof(u16));
+  }
+  if (hd.nseg > 0) {
+    put(&w, rv2->wids, hd.nseg * sizeof(int));
+    put(&w, rv2->pos, hd.nseg * sizeof(Vector4));
+    put(&w, rv2->dist, hd.nseg * sizeof(Vector2));
+  }
+  hd.size = w.size;
+  hd.sum = w.sum;
+  if (fseek(w.fp, 0, SEEK_SET) != 0 ||
+      fwrite(&hd, 1, sizeof(hd), w.fp) != sizeof(hd)) {
+    w.ok = false;
+  }
+  if (fclose(w.fp) != 0) w.ok = false;
+  if (!w.ok) {
+    remove(tmp);
+    return;
+  }
+  remove(fname);
+  if (rename(tmp, fname) != 0) {
+    remove(tmp);
+    return;
+  }
+  parse_cache_trim(dir);
+}
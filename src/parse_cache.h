@@ -0,0 +1,45 @@
+#ifndef CA_PARSE_CACHE_H
+#define CA_PARSE_CACHE_H
+#include "sim.h"
+
+/*
+ * On-disk cache of the parse results, one file per circuit.
+ *
+ * Files are named after a hash of the layer images and level pins, so the
+ * same circuit opened again (or a blueprint/level solution run again) skips
+ * the pixel, wire and distance graphs. Stored:
+ *   PixelGraph: nands, sockets, drivers and pin group offsets.
+ *   WireGraph:  wire map tiles and the wire/socket/driver maps.
+ *   DistGraph:  wire props, gate delays, socket delays and distance map
+ *               tiles.
+ *   RenderV2:   wire segments (if the parse had a renderer).
+ * The pixel graph itself and the wire of each graph node aren't stored, they
+ * are only used to compute the distances.
+ *
+ * Sections are 8 byte aligned, in native byte order (the cache is local).
+ * PARSE_CACHE_VERSION must be bumped whenever parse results change.
+ */
+#define PARSE_CACHE_VERSION 3
+#define PARSE_CACHE_MAX_FILES 64
+
+typedef struct {
+  u8* data; /* File contents, until the segments are taken */
+  int size;
+  int seg_off; /* Offset of the renderer segments */
+  int nseg;
+} ParseCacheFile;
+
+u64 parse_cache_key(int nl, Image* imgs, PinGroup* pgs);
+/*
+ * Fills the parse results of the sim (pg, wg, dg and num_wire) from the
+ * cache file of `key`. Returns false if there's no usable file (missing,
+ * truncated, with a checksum mismatch, an index out of bounds or a bad
+ * delay).
+ */
+bool parse_cache_load(ParseCacheFile* f, const char* dir, u64 key, Sim* sim);
+/* Moves the segments to the renderer (if any) and releases the file. */
+void parse_cache_load_segments(ParseCacheFile* f, RenderV2* rv2);
+/* Stores the parse results of the sim, dropping the oldest files. */
+void parse_cache_save(const char* dir, u64 key, Sim* sim);
+
+#endif
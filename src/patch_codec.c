@@ -0,0 +1,363 @@
+#include "patch_codec.h"
+
+enum {
+  CODEC_MODE_FIELDS = 0,
+  CODEC_MODE_LZ = 1,
+};
+
+/* Smaller inputs skip the LZ pass: there's little to gain. */
+#define LZ_MIN_INPUT 64
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static void ensure_cap(Buffer* b, u32 cap) {
+  if (b->cap < cap) {
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+  }
+}
+
+static inline u32 zigzag(int v) { return ((u32)v << 1) ^ (u32)(v >> 31); }
+
+static inline int unzigzag(u32 u) { return (int)(u >> 1) ^ -(int)(u & 1); }
+
+#define CODEC_MAX_FIELDS 8
+
+static inline int varint_size(u64 v) {
+  int n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static inline u8* put_varint(u8* w, u64 v) {
+  while (v >= 0x80) {
+    *w++ = (u8)v | 0x80;
+    v >>= 7;
+  }
+  *w++ = (u8)v;
+  return w;
+}
+
+static inline u64 get_varint(const u8** pr, const u8* end) {
+  const u8* r = *pr;
+  u64 v = 0;
+  int shift = 0;
+  while (true) {
+    assert(r < end);
+    u8 b = *r++;
+    v |= (u64)(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+    shift += 7;
+  }
+  *pr = r;
+  return v;
+}
+
+static inline u32 read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+int codec_int(CodecStream* s) {
+  u8* p = buffer_pop_raw(&s->raw, sizeof(int));
+  int v;
+  if (s->decoding) {
+    v = unzigzag(get_varint(&s->r, s->r_end));
+    memcpy(p, &v, sizeof(v));
+  } else {
+    memcpy(&v, p, sizeof(v));
+    s->w = put_varint(s->w, zigzag(v));
+  }
+  return v;
+}
+
+void codec_bytes(CodecStream* s, u32 bytes) {
+  u8* p = buffer_pop_raw(&s->raw, bytes);
+  if (s->decoding) {
+    assert(s->r + bytes <= s->r_end);
+    memcpy(p, s->r, bytes);
+    s->r += bytes;
+  } else {
+    memcpy(s->w, p, bytes);
+    s->w += bytes;
+  }
+}
+
+void codec_double(CodecStream* s) {
+  u8* p = buffer_pop_raw(&s->raw, sizeof(double));
+  if (s->decoding) {
+    assert(s->r < s->r_end);
+    u8 mask = *s->r++;
+    for (int i = 0; i < sizeof(double); i++) {
+      p[i] = (mask >> i) & 1 ? *s->r++ : 0;
+    }
+    assert(s->r <= s->r_end);
+  } else {
+    u8* w = s->w++;
+    u8 mask = 0;
+    for (int i = 0; i < sizeof(double); i++) {
+      if (p[i] == 0) continue;
+      mask |= 1 << i;
+      *s->w++ = p[i];
+    }
+    *w = mask;
+  }
+}
+
+void codec_floats(CodecStream* s, int n) {
+  assert(n <= 64);
+  u8* p = buffer_pop_raw(&s->raw, n * sizeof(float));
+  if (s->decoding) {
+    u64 mask = get_varint(&s->r, s->r_end);
+    memset(p, 0, n * sizeof(float));
+    for (int i = 0; i < n; i++) {
+      if (!((mask >> i) & 1)) continue;
+      assert(s->r + sizeof(float) <= s->r_end);
+      memcpy(p + i * sizeof(float), s->r, sizeof(float));
+      s->r += sizeof(float);
+    }
+  } else {
+    u64 mask = 0;
+    for (int i = 0; i < n; i++) {
+      if (read32(p + i * sizeof(float)) != 0) mask |= 1ULL << i;
+    }
+    s->w = put_varint(s->w, mask);
+    for (int i = 0; i < n; i++) {
+      if (!((mask >> i) & 1)) continue;
+      memcpy(s->w, p + i * sizeof(float), sizeof(float));
+      s->w += sizeof(float);
+    }
+  }
+}
+
+/* Value stored for word i: zigzag of the word or of its delta. */
+static inline u32 word_code(const u8* p, int i, bool delta, int* prev) {
+  int v;
+  memcpy(&v, p + i * sizeof(int), sizeof(v));
+  if (delta) {
+    int d = (int)((u32)v - (u32)*prev);
+    *prev = v;
+    v = d;
+  }
+  return zigzag(v);
+}
+
+void codec_words(CodecStream* s, int n, int nfields, int delta_field) {
+  assert(nfields <= CODEC_MAX_FIELDS);
+  int nw = n * nfields;
+  u8* p = buffer_pop_raw(&s->raw, nw * sizeof(int));
+  u8 width[CODEC_MAX_FIELDS];
+  if (s->decoding) {
+    assert(s->r + nfields <= s->r_end);
+    memcpy(width, s->r, nfields);
+    s->r += nfields;
+    const u8* r = s->r;
+    u64 acc = 0;
+    int nb = 0;
+    int prev = 0;
+    int f = 0;
+    for (int i = 0; i < nw; i++) {
+      int wf = width[f];
+      while (nb < wf) {
+        assert(r < s->r_end);
+        acc |= (u64)(*r++) << nb;
+        nb += 8;
+      }
+      u32 code = acc & ((1ULL << wf) - 1);
+      acc >>= wf;
+      nb -= wf;
+      int v = unzigzag(code);
+      if (f == delta_field) {
+        v = (int)((u32)v + (u32)prev);
+        prev = v;
+      }
+      memcpy(p + i * sizeof(int), &v, sizeof(v));
+      if (++f == nfields) f = 0;
+    }
+    s->r = r;
+  } else {
+    /* First pass: bits needed by each field */
+    u32 used[CODEC_MAX_FIELDS] = {0};
+    int prev = 0;
+    int f = 0;
+    for (int i = 0; i < nw; i++) {
+      used[f] |= word_code(p, i, f == delta_field, &prev);
+      if (++f == nfields) f = 0;
+    }
+    for (f = 0; f < nfields; f++) {
+      width[f] = used[f] ? 32 - __builtin_clz(used[f]) : 0;
+    }
+    memcpy(s->w, width, nfields);
+    u8* w = s->w + nfields;
+    /* Second pass: packs the codes, LSB first */
+    u64 acc = 0;
+    int nb = 0;
+    prev = 0;
+    f = 0;
+    for (int i = 0; i < nw; i++) {
+      acc |= (u64)word_code(p, i, f == delta_field, &prev) << nb;
+      nb += width[f];
+      if (nb >= 32) {
+        u32 lo = (u32)acc;
+        memcpy(w, &lo, sizeof(lo));
+        w += sizeof(lo);
+        acc >>= 32;
+        nb -= 32;
+      }
+      if (++f == nfields) f = 0;
+    }
+    while (nb > 0) {
+      *w++ = (u8)acc;
+      acc >>= 8;
+      nb -= 8;
+    }
+    s->w = w;
+  }
+}
+
+int codec_array(CodecStream* s, int nfields, int delta_field) {
+  int n = codec_int(s);
+  if (n > 0) codec_words(s, n, nfields, delta_field);
+  return n;
+}
+
+static inline u32 lz_hash(u32 v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Greedy LZ77 with a single-entry hash table.
+ *
+ * Stream: (<varint nlit> <lits> <varint len-LZ_MIN_MATCH> <varint offset>)*
+ * ending with <varint nlit> <lits>. Matches are only taken when their encoding
+ * is shorter than the matched bytes, so output is at most n + 5 bytes per
+ * literal run.
+ */
+static u32 lz_compress(const u8* src, u32 n, u8* dst) {
+  u32 table[1 << LZ_HASH_BITS]; /* Last position + 1 with this hash */
+  memset(table, 0, sizeof(table));
+  u8* w = dst;
+  u32 lit = 0;
+  u32 i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    u32 v = read32(src + i);
+    u32 h = lz_hash(v);
+    u32 cand = table[h];
+    table[h] = i + 1;
+    if (cand > 0 && read32(src + cand - 1) == v) {
+      u32 m = cand - 1;
+      u32 len = LZ_MIN_MATCH;
+      while (i + len < n && src[m + len] == src[i + len]) len++;
+      u32 off = i - m;
+      int cost = varint_size(len - LZ_MIN_MATCH) + varint_size(off);
+      if (cost < len) {
+        w = put_varint(w, i - lit);
+        memcpy(w, src + lit, i - lit);
+        w += i - lit;
+        w = put_varint(w, len - LZ_MIN_MATCH);
+        w = put_varint(w, off);
+        i += len;
+        lit = i;
+        continue;
+      }
+    }
+    i++;
+  }
+  w = put_varint(w, n - lit);
+  memcpy(w, src + lit, n - lit);
+  w += n - lit;
+  return w - dst;
+}
+
+static void lz_decompress(const u8* r, const u8* end, u8* dst, u32 n) {
+  u32 o = 0;
+  while (true) {
+    u32 nlit = get_varint(&r, end);
+    assert(o + nlit <= n && r + nlit <= end);
+    memcpy(dst + o, r, nlit);
+    r += nlit;
+    o += nlit;
+    if (o == n) break;
+    u32 len = get_varint(&r, end) + LZ_MIN_MATCH;
+    u32 off = get_varint(&r, end);
+    assert(off > 0 && off <= o && o + len <= n);
+    /* Byte by byte: source and destination may overlap */
+    for (u32 k = 0; k < len; k++, o++) {
+      dst[o] = dst[o - off];
+    }
+  }
+  assert(r == end);
+}
+
+void patch_codec_init(PatchCodec* pc, PatchLayoutFn layout, bool lz) {
+  *pc = (PatchCodec){0};
+  pc->layout = layout;
+  pc->lz = lz;
+}
+
+void patch_codec_destroy(PatchCodec* pc) {
+  buffer_free(&pc->enc);
+  buffer_free(&pc->dec);
+  buffer_free(&pc->tmp);
+}
+
+Buffer patch_codec_encode(PatchCodec* pc, Buffer patch) {
+  if (patch.size == 0) {
+    return (Buffer){0};
+  }
+  /* Worst case: 5 bytes per int, 9 per double, plus masks and header. */
+  ensure_cap(&pc->enc, patch.size + patch.size / 2 + 64);
+  u8* w = pc->enc.data;
+  *w++ = CODEC_MODE_FIELDS;
+  w = put_varint(w, patch.size);
+  CodecStream s = {.decoding = false, .raw = patch, .w = w};
+  pc->layout(&s);
+  assert(s.raw.size == 0);
+  assert(s.w <= pc->enc.data + pc->enc.cap);
+  u8* fields = w;
+  u32 nfields = s.w - fields;
+  pc->enc.size = s.w - pc->enc.data;
+  if (pc->lz && nfields >= LZ_MIN_INPUT) {
+    ensure_cap(&pc->tmp, 2 * nfields + 16);
+    u32 nlz = lz_compress(fields, nfields, pc->tmp.data);
+    if (varint_size(nfields) + nlz < nfields) {
+      pc->enc.data[0] = CODEC_MODE_LZ;
+      w = put_varint(fields, nfields);
+      memcpy(w, pc->tmp.data, nlz);
+      pc->enc.size = w + nlz - pc->enc.data;
+    }
+  }
+  return (Buffer){.data = pc->enc.data, .size = pc->enc.size};
+}
+
+Buffer patch_codec_decode(PatchCodec* pc, Buffer data) {
+  if (data.size == 0) {
+    return (Buffer){0};
+  }
+  const u8* r = data.data;
+  const u8* end = data.data + data.size;
+  u8 mode = *r++;
+  u32 raw_size = get_varint(&r, end);
+  if (mode == CODEC_MODE_LZ) {
+    u32 nfields = get_varint(&r, end);
+    ensure_cap(&pc->tmp, nfields);
+    lz_decompress(r, end, pc->tmp.data, nfields);
+    r = pc->tmp.data;
+    end = r + nfields;
+  }
+  ensure_cap(&pc->dec, raw_size);
+  pc->dec.size = raw_size;
+  CodecStream s = {
+      .decoding = true,
+      .raw = {.data = pc->dec.data, .size = raw_size},
+      .r = r,
+      .r_end = end,
+  };
+  pc->layout(&s);
+  assert(s.raw.size == 0 && s.r == s.r_end);
+  return (Buffer){.data = pc->dec.data, .size = raw_size};
+}
@@ -0,0 +1,62 @@
+#ifndef CA_PATCH_CODEC_H
+#define CA_PATCH_CODEC_H
+#include "buffer.h"
+#include "common.h"
+
+/*
+ * Compact encoding of history patches.
+ *
+ * Patches are stacks of small ints, floats and int structs (see
+ * patch_builder_commit), most of them small or zero. The codec doesn't know
+ * their layout: a layout function walks the raw patch in pop order calling the
+ * codec_* functions below, which either encode the field being popped or
+ * decode it back into its place. Since the same function is used both ways,
+ * the two can't get out of sync.
+ *
+ * Encoded patch:
+ *   <u8 mode> <varint raw_size> <fields>
+ *   <u8 mode> <varint raw_size> <varint fields_size> <lz(fields)>  (mode=LZ)
+ *
+ * Field encodings:
+ *   int:    zigzag varint.
+ *   double: byte mask of the non-zero bytes, followed by them (patches are
+ *           xors, so equal high bytes cancel out).
+ *   floats: bit mask of non-zero values, followed by them.
+ *   words:  arrays of int structs. Fields are zigzag coded and bit packed,
+ *           with the bit width of each field stored first. One of the fields
+ *           (sorted ids) can be stored as the delta to the previous one.
+ */
+typedef struct {
+  bool decoding;
+  Buffer raw; /* Unvisited part of the raw patch (the visited one is popped) */
+  u8* w;      /* Encoding: write position */
+  const u8* r; /* Decoding: read position */
+  const u8* r_end;
+} CodecStream;
+
+typedef void (*PatchLayoutFn)(CodecStream* s);
+
+typedef struct {
+  PatchLayoutFn layout;
+  bool lz;    /* Runs a LZ pass on top of the field encoding */
+  Buffer enc; /* Last encoded patch */
+  Buffer dec; /* Last decoded patch */
+  Buffer tmp; /* Scratch for the LZ pass */
+} PatchCodec;
+
+void patch_codec_init(PatchCodec* pc, PatchLayoutFn layout, bool lz);
+void patch_codec_destroy(PatchCodec* pc);
+/* Returned buffers are owned by the codec, valid until the next call. */
+Buffer patch_codec_encode(PatchCodec* pc, Buffer patch);
+Buffer patch_codec_decode(PatchCodec* pc, Buffer data);
+
+/* Layout primitives. Each one visits the field at the top of the patch. */
+int codec_int(CodecStream* s);
+void codec_bytes(CodecStream* s, u32 bytes);
+void codec_double(CodecStream* s);
+void codec_floats(CodecStream* s, int n);
+void codec_words(CodecStream* s, int n, int nfields, int delta_field);
+/* Array pushed with buffer_push_array. Returns the number of elements. */
+int codec_array(CodecStream* s, int nfields, int delta_field);
+
+#endif
@@ -4,6 +4,18 @@
 #include "nand_detection.h"
 #include "profiler.h"
 #include "stb_ds.h"
+#include "workers.h"
+
+/* SSE2 is always there on x86-64, AVX2 only if the build enables it. */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PG_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define PG_AVX2 1
+#include <immintrin.h>
+#endif
 
 #define FLAG_LVIA (1 << 5)
 #define FLAG_DRV (1 << 6)
@@ -52,26 +64,98 @@
  * bit6: flag if pixel has a "via" to the upper layer.
  * bit7: flag id pixel is
  */
-static void sim_parse_code(int w, int h, u8* code, u8* code_up) {
-  int wc = w;
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      int idx = y * w + x;
-      int b0 = code[idx] & 1;
-      int b1 = y > 0 ? (code[idx - w] & 1) : 0;     /* up */
-      int b2 = x < w - 1 ? (code[idx + 1] & 1) : 0; /* right */
-      int b3 = y < h - 1 ? (code[idx + w] & 1) : 0; /* bot */
-      int b4 = x > 0 ? (code[idx - 1] & 1) : 0;     /* left */
-      u8 b = b0 | (b1 << 1) | (b2 << 2) | (b3 << 3) | (b4 << 4);
-      if (code_up) {
-        u8 c = code_up[(y)*wc + (x)] & 0x1F;
-        u8 via =
-            ((c == bC1) || (c == bC2) || (c == bC3) || (c == bC4) || (c == bM));
-        b |= (via << 5);
+static inline void sim_parse_code_px(int w, int x, u8* row, u8* up, u8* bot,
+                                     u8* cup) {
+  int b0 = row[x] & 1;
+  int b1 = up ? (up[x] & 1) : 0;             /* up */
+  int b2 = x < w - 1 ? (row[x + 1] & 1) : 0; /* right */
+  int b3 = bot ? (bot[x] & 1) : 0;           /* bot */
+  int b4 = x > 0 ? (row[x - 1] & 1) : 0;     /* left */
+  u8 b = b0 | (b1 << 1) | (b2 << 2) | (b3 << 3) | (b4 << 4);
+  if (cup) {
+    u8 c = cup[x] & 0x1F;
+    u8 via =
+        ((c == bC1) || (c == bC2) || (c == bC3) || (c == bC4) || (c == bM));
+    b |= (via << 5);
+  }
+  row[x] |= b;
+}
+
+/*
+ * Neighbourhood code of a row. Only the bit0 of the rows above and below
+ * (NULL outside the image) is read, they can be a copy of the real rows.
+ * The vector loops do the pixels with both horizontal neighbours inside the
+ * image.
+ */
+static void sim_parse_code_row(int w, u8* row, u8* up, u8* bot, u8* cup) {
+  int x = 0;
+  if (w > 0) sim_parse_code_px(w, x++, row, up, bot, cup);
+#if PG_AVX2
+  {
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i zero = _mm256_setzero_si256();
+    for (; x + 32 < w; x += 32) {
+#define LD(p) _mm256_and_si256(_mm256_loadu_si256((__m256i*)(p)), one)
+      __m256i m = LD(row + x);
+      __m256i u = up ? LD(up + x) : zero;
+      __m256i r = LD(row + x + 1);
+      __m256i b = bot ? LD(bot + x) : zero;
+      __m256i l = LD(row + x - 1);
+#undef LD
+      __m256i v = _mm256_or_si256(m, _mm256_slli_epi16(u, 1));
+      v = _mm256_or_si256(v, _mm256_slli_epi16(r, 2));
+      v = _mm256_or_si256(v, _mm256_slli_epi16(b, 3));
+      v = _mm256_or_si256(v, _mm256_slli_epi16(l, 4));
+      if (cup) {
+        __m256i c = _mm256_loadu_si256((__m256i*)(cup + x));
+        c = _mm256_and_si256(c, _mm256_set1_epi8(0x1F));
+        __m256i via = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(bC1));
+        via = _mm256_or_si256(via, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(bC2)));
+        via = _mm256_or_si256(via, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(bC3)));
+        via = _mm256_or_si256(via, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(bC4)));
+        via = _mm256_or_si256(via, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(bM)));
+        v = _mm256_or_si256(v, _mm256_and_si256(via, _mm256_set1_epi8(1 << 5)));
+      }
+      __m256i cur = _mm256_loadu_si256((__m256i*)(row + x));
+      _mm256_storeu_si256((__m256i*)(row + x), _mm256_or_si256(cur, v));
+    }
+  }
+#endif
+#if PG_SSE2
+  {
+    __m128i one = _mm_set1_epi8(1);
+    __m128i zero = _mm_setzero_si128();
+    for (; x + 16 < w; x += 16) {
+#define LD(p) _mm_and_si128(_mm_loadu_si128((__m128i*)(p)), one)
+      __m128i m = LD(row + x);
+      __m128i u = up ? LD(up + x) : zero;
+      __m128i r = LD(row + x + 1);
+      __m128i b = bot ? LD(bot + x) : zero;
+      __m128i l = LD(row + x - 1);
+#undef LD
+      /* Values are 0/1, so 16 bit shifts don't spill between bytes */
+      __m128i v = _mm_or_si128(m, _mm_slli_epi16(u, 1));
+      v = _mm_or_si128(v, _mm_slli_epi16(r, 2));
+      v = _mm_or_si128(v, _mm_slli_epi16(b, 3));
+      v = _mm_or_si128(v, _mm_slli_epi16(l, 4));
+      if (cup) {
+        __m128i c = _mm_loadu_si128((__m128i*)(cup + x));
+        c = _mm_and_si128(c, _mm_set1_epi8(0x1F));
+        __m128i via = _mm_cmpeq_epi8(c, _mm_set1_epi8(bC1));
+        via = _mm_or_si128(via, _mm_cmpeq_epi8(c, _mm_set1_epi8(bC2)));
+        via = _mm_or_si128(via, _mm_cmpeq_epi8(c, _mm_set1_epi8(bC3)));
+        via = _mm_or_si128(via, _mm_cmpeq_epi8(c, _mm_set1_epi8(bC4)));
+        via = _mm_or_si128(via, _mm_cmpeq_epi8(c, _mm_set1_epi8(bM)));
+        v = _mm_or_si128(v, _mm_and_si128(via, _mm_set1_epi8(1 << 5)));
       }
-      code[idx] |= b;
+      __m128i cur = _mm_loadu_si128((__m128i*)(row + x));
+      _mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(cur, v));
     }
   }
+#endif
+  for (; x < w; x++) {
+    sim_parse_code_px(w, x, row, up, bot, cup);
+  }
 }
 
 /*
@@ -101,7 +185,7 @@ static void sim_parse_code(int w, int h, u8* code, u8* code_up) {
 static Graph build_graph_from_code(int nl, int w, int h, u8** img_code) {
   Graph _g = {0};
   Graph* g = &_g;
-  graph_init(g, 20);
+  graph_init(g, nl * w * h);
   int w0 = w;
   int h0 = h;
   typedef struct {
@@ -285,22 +369,32 @@ static Graph build_graph_from_code(int nl, int w, int h, u8** img_code) {
     }
   }
   free(pv);
+  graph_build(g);
   return *g;
 }
 
-/* Separates background from foreground in a regular image. */
-static u8* gen_fg_code(Image img) {
-  int w = img.width;
-  int h = img.height;
-  u8* image = calloc(w * h, sizeof(u8));
-  assert(img.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
-  Color* colors = img.data;
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      image[y * w + x] = colors[y * w + x].a != 0;
-    }
+/* Separates background from foreground in a row of a regular image. */
+static void gen_fg_code_row(int w, Color* colors, u8* out) {
+  int x = 0;
+#if PG_SSE2
+  __m128i one = _mm_set1_epi8(1);
+  __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= w; x += 16) {
+    __m128i* p = (__m128i*)(colors + x);
+    /* Alpha is the high byte of each pixel */
+    __m128i a0 = _mm_srli_epi32(_mm_loadu_si128(p + 0), 24);
+    __m128i a1 = _mm_srli_epi32(_mm_loadu_si128(p + 1), 24);
+    __m128i a2 = _mm_srli_epi32(_mm_loadu_si128(p + 2), 24);
+    __m128i a3 = _mm_srli_epi32(_mm_loadu_si128(p + 3), 24);
+    __m128i a = _mm_packus_epi16(_mm_packs_epi32(a0, a1),
+                                 _mm_packs_epi32(a2, a3));
+    __m128i fg = _mm_andnot_si128(_mm_cmpeq_epi8(a, zero), one);
+    _mm_storeu_si128((__m128i*)(out + x), fg);
+  }
+#endif
+  for (; x < w; x++) {
+    out[x] = colors[x].a != 0;
   }
-  return image;
 }
 
 static void debug_imgcode(int nl, int w, int h, u8** img_code) {
@@ -354,7 +448,6 @@ static void draw_line2(int w, int x0, int y0, int x1, int y1, Color* pix) {
 }
 
 static void debug_edge_graph(int l, int w0, int h0, Graph* g) {
-  int se = g->max_edges;
   int s = w0 * h0;
   // int w1 = w0 / 2;
   // int h1 = h0 / 2;
@@ -368,7 +461,7 @@ static void debug_edge_graph(int l, int w0, int h0, Graph* g) {
     find_idx(s, w0, idx0, &l0, &y0, &x0);
     int ne = g->ecount[i];
     for (int j = 0; j < ne; j++) {
-      int i1 = g->edges[i * se + j].e;
+      int i1 = g->edges[g->eoff[i] + j].e;
       /* printf("E: %d %d\n", i, i1); */
       int idx1 = g->nodes[i1];
       find_idx(s, w0, idx1, &l1, &y1, &x1);
@@ -448,26 +541,125 @@ static inline int get_crossing_pixel_direction(int* pixels, int w, int h, int x,
   }
 }
 
-void find_pixel_orientation(int w, int h, int* pixels, u8* code, u8* ori) {
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      int idx = y * w + x;
-      u8 pc = code[idx] & (bA);
-      int v = 0;
-      if (pc == bA) {
-        v = get_crossing_pixel_direction(pixels, w, h, x, y);
-      } else if (pc == bV || (pc == (bM | bU)) || (pc == (bM | bB))) {
-        v = 1;
-      } else {
-        v = 0;
+static inline int pixel_orientation(int w, int h, int x, int y, int* pixels,
+                                    u8 code) {
+  u8 pc = code & (bA);
+  if (pc == bA) {
+    return get_crossing_pixel_direction(pixels, w, h, x, y);
+  } else if (pc == bV || (pc == (bM | bU)) || (pc == (bM | bB))) {
+    return 1;
+  }
+  return 0;
+}
+
+/* Orientation of the pixels of row y (needs the row neighbourhood code). */
+static void find_pixel_orientation_row(int w, int h, int y, int* pixels,
+                                       u8* code, u8* ori) {
+  u8* crow = code + y * w;
+  u8* orow = ori + y * w;
+  int x = 0;
+#if PG_AVX2
+  {
+    __m256i mask = _mm256_set1_epi8(bA);
+    __m256i one = _mm256_set1_epi8(1);
+    for (; x + 32 <= w; x += 32) {
+      __m256i pc = _mm256_loadu_si256((__m256i*)(crow + x));
+      pc = _mm256_and_si256(pc, mask);
+      __m256i v = _mm256_cmpeq_epi8(pc, _mm256_set1_epi8(bV));
+      v = _mm256_or_si256(v, _mm256_cmpeq_epi8(pc, _mm256_set1_epi8(bM | bU)));
+      v = _mm256_or_si256(v, _mm256_cmpeq_epi8(pc, _mm256_set1_epi8(bM | bB)));
+      _mm256_storeu_si256((__m256i*)(orow + x), _mm256_and_si256(v, one));
+      /* Crossings are rare, they are solved one by one */
+      u32 cross = _mm256_movemask_epi8(_mm256_cmpeq_epi8(pc, mask));
+      for (int i = 0; cross; i++, cross >>= 1) {
+        if (cross & 1) {
+          orow[x + i] = get_crossing_pixel_direction(pixels, w, h, x + i, y);
+        }
+      }
+    }
+  }
+#endif
+#if PG_SSE2
+  {
+    __m128i mask = _mm_set1_epi8(bA);
+    __m128i one = _mm_set1_epi8(1);
+    for (; x + 16 <= w; x += 16) {
+      __m128i pc = _mm_loadu_si128((__m128i*)(crow + x));
+      pc = _mm_and_si128(pc, mask);
+      __m128i v = _mm_cmpeq_epi8(pc, _mm_set1_epi8(bV));
+      v = _mm_or_si128(v, _mm_cmpeq_epi8(pc, _mm_set1_epi8(bM | bU)));
+      v = _mm_or_si128(v, _mm_cmpeq_epi8(pc, _mm_set1_epi8(bM | bB)));
+      _mm_storeu_si128((__m128i*)(orow + x), _mm_and_si128(v, one));
+      u32 cross = _mm_movemask_epi8(_mm_cmpeq_epi8(pc, mask));
+      for (int i = 0; cross; i++, cross >>= 1) {
+        if (cross & 1) {
+          orow[x + i] = get_crossing_pixel_direction(pixels, w, h, x + i, y);
+        }
       }
-      ori[idx] = v;
     }
   }
+#endif
+  for (; x < w; x++) {
+    orow[x] = pixel_orientation(w, h, x, y, pixels, crow[x]);
+  }
+}
+
+/* Rows of the image are split in bands, one per task. */
+typedef struct {
+  int nl;
+  int w;
+  int h;
+  int nbands;
+  Image* imgs;
+  u8** img_code;
+  int l; /* Layer of the code/orientation pass */
+  u8* ori;
+  /* Copy of the rows just above and below each band, the neighbour bands
+   * write them while the band reads them. */
+  u8* edges;
+} PixelCodeCtx;
+
+static void band_rows(PixelCodeCtx* ctx, int itask, int* y0, int* y1) {
+  *y0 = (int)((long long)ctx->h * itask / ctx->nbands);
+  *y1 = (int)((long long)ctx->h * (itask + 1) / ctx->nbands);
+}
+
+static void gen_fg_code_task(void* arg, int itask) {
+  PixelCodeCtx* ctx = arg;
+  int y0, y1;
+  band_rows(ctx, itask, &y0, &y1);
+  int w = ctx->w;
+  for (int l = 0; l < ctx->nl; l++) {
+    Color* colors = ctx->imgs[l].data;
+    for (int y = y0; y < y1; y++) {
+      gen_fg_code_row(w, colors + y * w, ctx->img_code[l] + y * w);
+    }
+  }
+}
+
+static void parse_code_task(void* arg, int itask) {
+  PixelCodeCtx* ctx = arg;
+  int y0, y1;
+  band_rows(ctx, itask, &y0, &y1);
+  int l = ctx->l;
+  int w = ctx->w;
+  u8* code = ctx->img_code[l];
+  u8* code_up = ctx->img_code[l + 1];
+  int* pixels = ctx->imgs[l].data;
+  u8* edge_up = y0 > 0 ? ctx->edges + (2 * itask) * w : NULL;
+  u8* edge_bot = y1 < ctx->h ? ctx->edges + (2 * itask + 1) * w : NULL;
+  for (int y = y0; y < y1; y++) {
+    u8* row = code + y * w;
+    u8* up = y > y0 ? row - w : edge_up;
+    u8* bot = y < y1 - 1 ? row + w : edge_bot;
+    u8* cup = code_up ? code_up + y * w : NULL;
+    sim_parse_code_row(w, row, up, bot, cup);
+    find_pixel_orientation_row(w, ctx->h, y, pixels, code, ctx->ori);
+  }
 }
 
 void pixel_graph_init(PixelGraph* pg, DistSpec spec, int nl, Image* imgs,
-                      PinGroup* p, bool debug) {
+                      PinGroup* p, WorkerPool* workers, bool debug) {
   profiler_tic_single("pixel_graph");
   miniprof_reset();
   miniprof_time();
@@ -475,11 +667,26 @@ void pixel_graph_init(PixelGraph* pg, DistSpec spec, int nl, Image* imgs,
   int h = imgs[0].height;
   u8* img_code[MAX_LAYERS + 1] = {0};
   for (int i = 0; i < nl; i++) {
-    img_code[i] = gen_fg_code(imgs[i]);
+    assert(imgs[i].format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    assert(imgs[i].width == w && imgs[i].height == h);
+    img_code[i] = malloc(w * h * sizeof(u8));
   }
-
-  find_nands(w, h, img_code[0], &pg->nands);
+  PixelCodeCtx ctx = {
+      .nl = nl,
+      .w = w,
+      .h = h,
+      .nbands = h < workers_count(workers) ? 1 : workers_count(workers),
+      .imgs = imgs,
+      .img_code = img_code,
+  };
+  double t0 = workers_now();
+  workers_run(workers, ctx.nbands, gen_fg_code_task, &ctx);
+  double t1 = workers_now();
+  pg->t_code = t1 - t0;
+
+  find_nands(w, h, img_code[0], workers, &pg->nands);
   remove_nand_pixels(w, img_code[0], pg->nands);
+  pg->t_nands = workers_now() - t1;
 
   /* Nand sockets/drivers */
   int nn = arrlen(pg->nands);
@@ -507,17 +714,33 @@ void pixel_graph_init(PixelGraph* pg, DistSpec spec, int nl, Image* imgs,
   }
 
   miniprof_time();  // T1 ends
-  /* This scales poorly with layers. Can be done on GPU ! */
+  /* Top layer first, the vias need the code of the layer above. Row bands
+   * of a layer go to the workers. */
+  t0 = workers_now();
+  ctx.edges = malloc(2 * ctx.nbands * w * sizeof(u8));
   for (int l = nl - 1; l >= 0; l--) {
-    sim_parse_code(w, h, img_code[l], img_code[l + 1]);
-    int wl = imgs[l].width;
-    int hl = imgs[l].height;
-    pg->ori[l] = calloc(wl * hl, sizeof(u8));
-    find_pixel_orientation(wl, hl, imgs[l].data, img_code[l], pg->ori[l]);
+    pg->ori[l] = malloc(w * h * sizeof(u8));
+    ctx.l = l;
+    ctx.ori = pg->ori[l];
+    for (int i = 0; i < ctx.nbands; i++) {
+      int y0, y1;
+      band_rows(&ctx, i, &y0, &y1);
+      if (y0 > 0) {
+        memcpy(ctx.edges + (2 * i) * w, img_code[l] + (y0 - 1) * w, w);
+      }
+      if (y1 < h) {
+        memcpy(ctx.edges + (2 * i + 1) * w, img_code[l] + y1 * w, w);
+      }
+    }
+    workers_run(workers, ctx.nbands, parse_code_task, &ctx);
   }
+  free(ctx.edges);
+  t1 = workers_now();
+  pg->t_code += t1 - t0;
   miniprof_time();  // T2 ends
   /* This is the slowest part */
   pg->g = build_graph_from_code(nl, w, h, img_code);
+  pg->t_graph = workers_now() - t1;
   miniprof_time();  // T3 ends
   if (debug) {
     debug_imgcode(nl, w, h, img_code);
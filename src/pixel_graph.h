@@ -5,6 +5,7 @@
 #include "graph.h"
 #include "nand_detection.h"
 #include "pin_spec.h"
+#include "workers.h"
 
 typedef struct {
   Graph g;             /* 3D pixel node graph */
@@ -14,10 +15,16 @@ typedef struct {
   u8* ori[MAX_LAYERS]; /* Orientation of a pixel. 0 is horizontal, 1 is
                           vertical. */
   int* pgoff;          /* socket/driver offset of each pingroup */
+
+  double t_code;  /* Pixel code passes (seconds) */
+  double t_nands; /* NAND detection */
+  double t_graph; /* Graph build from the code */
 } PixelGraph;
 
 void pixel_graph_init(PixelGraph* pg, DistSpec spec, int nl, Image* imgs,
-                      PinGroup* p, bool debug);
+                      PinGroup* p,
+                      WorkerPool* workers, /* Splits row bands (NULL: serial) */
+                      bool debug);
 void pixel_graph_destroy(PixelGraph* pg);
 
 #endif
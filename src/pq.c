@@ -1,7 +1,9 @@
 #include "pq.h"
 
 #include "assert.h"
+#include "stb_ds.h"
 #include "stdlib.h"
+#include "string.h"
 
 void pq_init(PQ* p) {
   p->cap = 100;
@@ -17,10 +19,16 @@ static inline void pq_swap(PQElem* a, PQElem* b) {
   *b = tmp;
 }
 
+// Whether a pops before b: higher priority, then lower dst
+static inline bool pq_before(PQElem a, PQElem b) {
+  return a.priority > b.priority ||
+         (a.priority == b.priority && a.dst < b.dst);
+}
+
 static void heapify_up(PQElem* heap, int index) {
   while (index > 0) {
     int parent = (index - 1) / 2;
-    if (heap[parent].priority >= heap[index].priority) {
+    if (!pq_before(heap[index], heap[parent])) {
       break;
     }
     pq_swap(&heap[parent], &heap[index]);
@@ -35,11 +43,11 @@ static void heapify_down(PQElem* heap, int size, int index) {
   int right = 2 * index + 2;
 
   // Find the element with highest priority among parent and children
-  if (left < size && heap[left].priority > heap[maxIndex].priority) {
+  if (left < size && pq_before(heap[left], heap[maxIndex])) {
     maxIndex = left;
   }
 
-  if (right < size && heap[right].priority > heap[maxIndex].priority) {
+  if (right < size && pq_before(heap[right], heap[maxIndex])) {
     maxIndex = right;
   }
 
@@ -100,3 +108,94 @@ PQElem pq_top(PQ* p) {
   }
   return p->heap[0];
 }
+
+static inline unsigned rheap_key(float f) {
+  assert(f >= 0);
+  unsigned k;
+  memcpy(&k, &f, sizeof(k));
+  return k;
+}
+
+static inline int rheap_bucket(unsigned last, unsigned key) {
+  unsigned x = key ^ last;
+  if (x == 0) return 0;
+#if defined(__GNUC__)
+  return 32 - __builtin_clz(x);
+#else
+  int b = 0;
+  while (x) {
+    b++;
+    x >>= 1;
+  }
+  return b;
+#endif
+}
+
+void rheap_clear(RHeap* h) {
+  for (int b = 0; b < RHEAP_NBUCKETS; b++) {
+    arrsetlen(h->bucket[b], 0);
+  }
+  h->head = 0;
+  h->last = 0;
+  h->size = 0;
+}
+
+void rheap_destroy(RHeap* h) {
+  for (int b = 0; b < RHEAP_NBUCKETS; b++) {
+    arrfree(h->bucket[b]);
+  }
+  *h = (RHeap){0};
+}
+
+static int rheap_item_cmp(const void* a, const void* b) {
+  int va = ((const RHeapItem*)a)->val;
+  int vb = ((const RHeapItem*)b)->val;
+  return (va > vb) - (va < vb);
+}
+
+void rheap_push(RHeap* h, float key, int val) {
+  unsigned k = rheap_key(key);
+  assert(k >= h->last);
+  RHeapItem it = {k, val};
+  int b = rheap_bucket(h->last, k);
+  arrput(h->bucket[b], it);
+  if (b == 0) {
+    /* Keeps the items left in bucket 0 sorted by value */
+    RHeapItem* items = h->bucket[0];
+    int i = arrlen(items) - 1;
+    while (i > h->head && items[i - 1].val > val) {
+      items[i] = items[i - 1];
+      i--;
+    }
+    items[i] = it;
+  }
+  h->size++;
+}
+
+int rheap_pop(RHeap* h, float* key) {
+  assert(h->size > 0);
+  if (h->head == arrlen(h->bucket[0])) {
+    /* Moves the first non empty bucket down, around its minimum */
+    arrsetlen(h->bucket[0], 0);
+    h->head = 0;
+    int b = 1;
+    while (arrlen(h->bucket[b]) == 0) b++;
+    RHeapItem* items = h->bucket[b];
+    int n = arrlen(items);
+    unsigned m = items[0].key;
+    for (int i = 1; i < n; i++) {
+      if (items[i].key < m) m = items[i].key;
+    }
+    h->last = m;
+    for (int i = 0; i < n; i++) {
+      arrput(h->bucket[rheap_bucket(m, items[i].key)], items[i]);
+    }
+    arrsetlen(h->bucket[b], 0);
+    qsort(h->bucket[0], arrlen(h->bucket[0]), sizeof(RHeapItem),
+          rheap_item_cmp);
+  }
+  RHeapItem it = h->bucket[0][h->head++];
+  h->size--;
+  if (key) memcpy(key, &it.key, sizeof(*key));
+  return it.val;
+}
@@ -2,7 +2,8 @@
 #define PQ_H
 #include "stdbool.h"
 
-// Priority queue implementation (max queue)
+// Priority queue implementation (max queue). Equal priorities pop by
+// increasing dst.
 typedef struct {
   int src;
   int dst;
@@ -21,4 +22,32 @@ bool pq_push(PQ* p, int src, int dst, float priority);
 PQElem pq_pop(PQ* p);
 PQElem pq_top(PQ* p);
 
+/*
+ * Monotone radix heap (min queue) for non-negative float keys, for
+ * Dijkstra-like searches where popped keys never decrease.
+ *
+ * Non-negative floats order like their bit patterns, which are used as
+ * radix keys: bucket b holds the items whose highest bit differing from the
+ * last popped key is b - 1. Items with the same key pop by increasing value,
+ * like a binary heap ordered by (key, value).
+ */
+#define RHEAP_NBUCKETS 33
+
+typedef struct {
+  unsigned key;
+  int val;
+} RHeapItem;
+
+typedef struct {
+  RHeapItem* bucket[RHEAP_NBUCKETS]; /* stb arrays, kept between uses */
+  int head;                          /* Next item of bucket 0 */
+  unsigned last;                     /* Last popped key */
+  int size;
+} RHeap;
+
+void rheap_clear(RHeap* h);
+void rheap_destroy(RHeap* h);
+void rheap_push(RHeap* h, float key, int val);
+int rheap_pop(RHeap* h, float* key);
+
 #endif
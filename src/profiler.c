@@ -20,6 +20,10 @@ static struct {
     const char* key;
     double value;
   } * tsingle;
+  struct {
+    const char* key;
+    double value;
+  } * counts;
   int first;
   int last;
 } C = {0};
@@ -59,6 +63,15 @@ void profiler_draw() {
     yy += 30;
   }
 
+  for (int i = 0; i < shlen(C.counts); i++) {
+    char txt[200];
+    snprintf(txt, sizeof(txt), "%20s: %.0lf", C.counts[i].key,
+             C.counts[i].value);
+    DrawText(txt, 50, yy + 1, 20, BLACK);
+    DrawText(txt, 50, yy, 20, LIME);
+    yy += 30;
+  }
+
   for (int i = 0; i < n; i++) {
     char txt[200];
     double t = 1000 * C.elapsed[i];
@@ -107,6 +120,10 @@ void profiler_tac_single(const char* name) {
   shput(C.tsingle, name, now - start);
 };
 
+void profiler_count(const char* name, double value) {
+  shput(C.counts, name, value);
+}
+
 void profiler_destroy() {
   free(C.stack_elapsed);
   free(C.stack_cname);
@@ -9,6 +9,8 @@ void profiler_tic(const char* name);
 void profiler_tic_single(const char* name);
 void profiler_tac();
 void profiler_tac_single(const char* name);
+/* Value shown with the timings, like the work done in the last frame. */
+void profiler_count(const char* name, double value);
 void profiler_draw();
 
 void miniprof_reset();
@@ -45,3 +45,16 @@ RectangleInt rect_int_get_collision(RectangleInt a, RectangleInt b) {
 
   return overlap;
 }
+
+// Smallest rectangle containing both rectangles.
+RectangleInt rect_int_union(RectangleInt a, RectangleInt b) {
+  int left = (a.x < b.x) ? a.x : b.x;
+  int top = (a.y < b.y) ? a.y : b.y;
+  int right1 = a.x + a.width;
+  int right2 = b.x + b.width;
+  int right = (right1 > right2) ? right1 : right2;
+  int bottom1 = a.y + a.height;
+  int bottom2 = b.y + b.height;
+  int bottom = (bottom1 > bottom2) ? bottom1 : bottom2;
+  return (RectangleInt){left, top, right - left, bottom - top};
+}
@@ -1,7 +1,6 @@
 #include "renderv2.h"
 
 #include "assert.h"
-#include "limits.h"
 #include "math.h"
 #include "raymath.h"
 #include "rlgl.h"
@@ -9,229 +8,82 @@
 #include "stb_ds.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "ui.h"
-#include "union_find.h"
-
-static void bucket_sort(int ng, int* g0, int* s0, int nb, int* bins, int* g2,
-                        int* s2) {
-  assert(nb <= 200);
-  int* bucket[200];
-  for (int i = 0; i < nb; i++) {
-    bucket[i] = NULL;
-  }
-  for (int i = 0; i < ng; i++) {
-    int g = g0[i];
-    int s = s0[i];
-    int k = nb - 1;
-    for (int b = 0; b < nb - 1; b++) {
-      if (s < bins[b]) {
-        k = b;
-        break;
-      }
-    }
-    arrput(bucket[k], i);
-  }
-  int k = 0;
-  for (int b = 0; b < nb; b++) {
-    int n = arrlen(bucket[b]);
-    for (int i = 0; i < n; i++) {
-      int ig = bucket[b][i];
-      g2[k] = g0[ig];
-      s2[k] = s0[ig];
-      k++;
-    }
-  }
-  for (int i = 0; i < nb; i++) {
-    arrfree(bucket[i]);
-  }
-}
 
-/* A more fine but more complex algorithm for scheduling..
- * If the naive solution is not enough I implement this one.
- * Step1: Find dirty offset blocks.
- * These contain just the TASK offset, not blocks. It starts with dirty
- * tasks, and then alternate between clean and dirty. Example:
- *   off[0] = 5
- *   off[1] = 35
- *   off[2] = 50
- *   off[3] = 70
- * Means:
- *    - 5-35 ==> Dirty tasks
- *    - 50-70 ==> Dirty tasks
- * The size is always 2k+1, where k is the number of dirty consecutive
- * blocks.
- * The gaps, or clean tasks are never empty.
- * An empty case would have
- *   off[0] = NUM_TASKS or
- *   off[0] =  wire_block[-1].off + wire_block[-1].size
- * After this step, we handle directly with tasks and not blocks anymore.
- * We also keep track of:
- *   (i) the total number of tasks to execute (ie dirty)
- *   (ii) The number of task segments.
- * We also sort the "gaps" by rough size by power of two in B bins. The gaps
- * that are too big are not accounted for.
- *
- * Gap block `k` is between dirty block `k` and dirty block `k+1`.
- * Step2: Merging
- * Now we merge consecutive blocks, until the stop condition is met.
- * Stop condition is that we want T tasks per call in average.
- * So, we want total_tasks >= num_segs * T.
- * We merge segments starting from small gaps and
- *
- * However, there's no reason to keep a gap higher than T
- * So gaps that are too big are rejected! (they won't count in the merging)
- * Step3: Defining final blocks.
- * Now need to iterate over each component to collect offset and size.
- * Blocks too big are broken down in the caller itself.
- *
- * Step4: Sorting:
- * Then, need to also sort by power of two. Bigger blocks need to go first and
- * the smaller ones last.
- *
+/*
+ * Draw calls of a pulse map update. Dirty wires are drawn in ranges of
+ * segments; past this many ranges, the ones with the smallest gaps between
+ * them are joined, and the clean segments in the gaps are drawn again (they
+ * don't change the pmap). The counters of the debug overlay show the calls
+ * and segments of each update.
  */
-static int* renderv2_schedule_tasks(RenderV2* r, uint32_t* dirty_mask) {
-  int nb = r->num_blocks;
-  int* off = calloc(nb + 1, sizeof(int));
-  int noff = 0;
-  int b0, b1;
-  for (int ib = 0; ib < nb; ib++) {
-    bool dirty = dirty_mask[ib] != 0;
-    b0 = r->wire_block[ib].off;
-    b1 = r->wire_block[ib].off + r->wire_block[ib].size;
-    bool last_clean = (noff % 2) == 0;
-    if ((dirty && last_clean) || (!dirty && !last_clean)) {
-      noff++;
-    }
-    off[noff] = b1;
-  }
-  // noff=0 --> 0 dirty
-  if (noff == 0) {
-    free(off);
-    return NULL;
-  }
-
-  // noff=1 --> 1 dirty  0 gap
-  // noff=2 --> 1 dirty  0 gap
-  // noff=3 --> 2 dirtys 1 gap
-
-  int ngap = (noff - 1) / 2;
-  int ng = ngap + 1;
-  int* g0 = NULL;
-  int* s0 = NULL;
-  int* g1 = NULL;
-  int* s1 = NULL;
-  int num_bin = 10;
-  int bins[] = {
-      500,   //
-      1000,  //
-      1500,  //
-      2000,  //
-      2500,  //
-      3000,  //
-      3500,  //
-      4000,  //
-      4500,  //
-      5000,  //
-  };
-
-  // Total num of tasks scheduled
-  int nt = 0;
-  for (int i = 0; i < ng; i++) {
-    nt += off[2 * i + 1] - off[2 * i];
-  }
-  for (int i = 0; i < ngap; i++) {
-    int i0 = off[2 * i + 1];
-    int i1 = off[2 * i + 2];
-    arrput(g0, i);
-    arrput(s0, i1 - i0);
-  }
-  arrsetlen(g1, arrlen(g0));
-  arrsetlen(s1, arrlen(s0));
-  bucket_sort(ngap, g0, s0, num_bin, bins, g1, s1);
-
-  int* rr = calloc(ng, sizeof(int));
-  int* cc = calloc(ng, sizeof(int));
-  for (int i = 0; i < ng; i++) {
-    cc[i] = i;
-  }
-
-  int T = 5000;
-  int nc = ng;
-  for (int ig = 0; ig < ngap; ig++) {
-    int s = s1[ig];
-    int g = g1[ig];
-    bool stop = false;
-    if (nt >= T * nc) stop = true;
-    if (s > T) stop = true;
-    if (stop) break;
-    uf_union(cc, rr, g, g + 1);
-    nt += s;
-    nc -= 1;
-  }
+#define RENDERV2_MAX_CALLS 64
+/* Segments drawn by one instanced call */
+#define RENDERV2_MAX_INSTANCES 25000
+/*
+ * Coarsest level of detail (3: 8x8 circuit pixels per pixel). Kept at 0
+ * until the LOD paths (panning, switches, NAND states, error mode) are
+ * checked on screen.
+ */
+#define RENDERV2_MAX_LOD 0
+/* Screen pixels drawn around the view, for the bloom */
+#define RENDERV2_VIEW_MARGIN 16
 
-  /* post-process components */
-  arrsetlen(g0, ng);
-  arrsetlen(s0, ng);
-  arrsetlen(g1, ng);
-  arrsetlen(s1, ng);
-  for (int i = 0; i < ng; i++) {
-    g0[i] = INT_MAX;
-    s0[i] = INT_MIN;
-  }
-  for (int i = 0; i < ng; i++) {
-    int k = uf_find(cc, i);
-    int i0 = off[2 * i + 0];
-    int i1 = off[2 * i + 1];
-    if (g0[k] > i0) g0[k] = i0;
-    if (s0[k] < i1) s0[k] = i1;
-  }
+static int cmp_int(const void* a, const void* b) {
+  return *(const int*)a - *(const int*)b;
+}
 
-  // Compress
-  int k = 0;
-  for (int i = 0; i < ng; i++) {
-    if (s0[i] != INT_MIN) {
-      s0[k] = s0[i] - g0[i];
-      g0[k] = g0[i];
-      k++;
+/* Joins the ranges over their smallest gaps, down to RENDERV2_MAX_CALLS. */
+static void renderv2_join_ranges(RenderV2* r) {
+  int* rg = r->ranges;
+  int nr = arrlen(rg) / 2;
+  int njoin = nr - RENDERV2_MAX_CALLS;
+  if (njoin <= 0) return;
+  arrsetlen(r->gaps, nr - 1);
+  for (int i = 0; i < nr - 1; i++) {
+    r->gaps[i] = rg[2 * i + 2] - rg[2 * i + 1];
+  }
+  qsort(r->gaps, nr - 1, sizeof(int), cmp_int);
+  /* Gaps below `limit` are joined, and `neq` of the ones equal to it */
+  int limit = r->gaps[njoin - 1];
+  int neq = njoin;
+  while (neq > 0 && r->gaps[neq - 1] == limit) neq--;
+  neq = njoin - neq;
+  int n = 1;
+  for (int i = 1; i < nr; i++) {
+    int gap = rg[2 * i] - rg[2 * n - 1];
+    if (gap < limit || (gap == limit && neq-- > 0)) {
+      rg[2 * n - 1] = rg[2 * i + 1];
+    } else {
+      rg[2 * n] = rg[2 * i];
+      rg[2 * n + 1] = rg[2 * i + 1];
+      n++;
     }
   }
-  assert(k == nc);
-
-  int bins2[] = {
-      1000,   //
-      2000,   //
-      5000,   //
-      8000,   //
-      10000,  //
-      20000,  //
-      40000,  //
-  };
-  bucket_sort(nc, g0, s0, 7, bins2, g1, s1);
-
-  int* ranges = NULL;
-  for (int i = 0; i < nc; i++) {
-    int j = nc - i - 1;
-    int start = g1[j];
-    int end = g1[j] + s1[j];
-    arrput(ranges, start);
-    arrput(ranges, end);
-  }
+  arrsetlen(r->ranges, 2 * n);
+}
 
-  arrfree(g0);
-  arrfree(s0);
-  arrfree(g1);
-  arrfree(s1);
-  free(cc);
-  free(rr);
-  free(off);
-
-  if (false) {
-    float fnt = nt;
-    float fn = arrlen(r->pos);
-    float perc = 100 * (fnt / fn);
-    printf("(A2) Drawing %f %% .\n", perc);
+/*
+ * Collects in r->ranges the [start, end) segment ranges of the dirty wire
+ * blocks, joined as above, and clears the dirty mask.
+ */
+static void renderv2_schedule_tasks(RenderV2* r, uint32_t* dirty_mask) {
+  arrsetlen(r->ranges, 0);
+  for (int ib = 0; ib < r->num_blocks; ib++) {
+    bool dirty = dirty_mask[ib] != 0;
+    dirty_mask[ib] = 0;
+    WireBlock b = r->wire_block[ib];
+    if (!dirty || b.size <= 0) continue;
+    int n = arrlen(r->ranges);
+    if (n > 0 && r->ranges[n - 1] == b.off) {
+      r->ranges[n - 1] = b.off + b.size;
+    } else {
+      arrput(r->ranges, b.off);
+      arrput(r->ranges, b.off + b.size);
+    }
   }
-  return ranges;
+  renderv2_join_ranges(r);
 }
 
 RenderV2* renderv2_create(int w, int h, int nwire, int nl,
@@ -258,6 +110,10 @@ RenderV2* renderv2_create(int w, int h, int nwire, int nl,
   texclear(r->acc_c, BLANK);
   texclear(r->acc_l, BLANK);
   r->hide_mask = ~0;
+  /* Levels must divide the circuit size */
+  while (r->max_lod < RENDERV2_MAX_LOD && (((w | h) >> r->max_lod) & 1) == 0) {
+    r->max_lod++;
+  }
   return r;
 }
 
@@ -322,7 +178,8 @@ static void renderv2_render_nand_states_error(RenderV2* r, NandDesc* nidx,
 
 static void renderv2_render_nand_states_normal(RenderV2* r, int ns,
                                                NandDesc* nidx,
-                                               NandState* states, float slack) {
+                                               NandStateArrays* states,
+                                               float slack) {
   int w = r->w;
 
   /* Clear arrays for this frame */
@@ -334,12 +191,12 @@ static void renderv2_render_nand_states_normal(RenderV2* r, int ns,
 
   /* Normal mode: render NANDs based on activation state */
   for (int i = 0; i < ns; i++) {
-    int id = states[i].id_nand;
-    float act = states[i].activation_counter;
-    float max_delay = states[i].max_delay;
+    int id = states->id_nand[i];
+    float act = states->activation_counter[i];
+    float max_delay = nidx[id].gate_delay;
     /* These are in "waking up" mode, they're not necessarily awake (ie maybe
      * won't change output value). */
-    if (max_delay < 1.0) continue;
+    if (act < 1.0 || max_delay < 1.0) continue;
 
     int idx = nidx[id].idx;
     int rot = nidx[id].rot;
@@ -352,7 +209,7 @@ static void renderv2_render_nand_states_normal(RenderV2* r, int ns,
     xc += 1;
     yc += 1;
 
-    float phase_x = (act - slack * 10.0) / max_delay;
+    float phase_x = (act - slack) / max_delay;
     float phase_y = rot;
 
     arrput(r->nandact_pos, ((Vector2){xc, yc}));
@@ -478,22 +335,80 @@ static void renderv2_render_nand(RenderV2* r, int mode) {
   EndTextureMode();
 }
 
+/* Pixels of the accumulated textures seen by `cam` on a tw x th target. */
+static Rectangle renderv2_visible_rect(RenderV2* r, Cam2D cam, int tw, int th) {
+  int w = r->acc_c->w;
+  int h = r->acc_c->h;
+  float m = RENDERV2_VIEW_MARGIN;
+  int x0 = floorf((-cam.off.x - m) / cam.sp);
+  int y0 = floorf((-cam.off.y - m) / cam.sp);
+  int x1 = ceilf((tw - cam.off.x + m) / cam.sp);
+  int y1 = ceilf((th - cam.off.y + m) / cam.sp);
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 > w ? w : x1;
+  y1 = y1 > h ? h : y1;
+  if (x1 < x0) x1 = x0;
+  if (y1 < y0) y1 = y0;
+  return (Rectangle){x0, y0, x1 - x0, y1 - y0};
+}
+
+/*
+ * Shades `roi` of the accumulated textures. Outside the last frame's region
+ * they hold stale pixels, so the newly exposed part is shaded without
+ * history (EMA factor 1) and only the overlap is blended with `f`.
+ */
+static void renderv2_map_circuit_light(RenderV2* r, Tex* layers, Times times,
+                                       float f, Rectangle roi) {
+  Texture lt = layers->rt.texture;
+  Rectangle o = r->roi;
+  r->roi = roi;
+  float x0 = fmaxf(roi.x, o.x);
+  float y0 = fmaxf(roi.y, o.y);
+  float x1 = fminf(roi.x + roi.width, o.x + o.width);
+  float y1 = fminf(roi.y + roi.height, o.y + o.height);
+  if (x1 <= x0 || y1 <= y0) {
+    texmapcircuitlight_v2(lt, r->pmap, r->error_mode, times, r->tickmod,
+                          r->tickgap, 1, roi, &r->acc_c, &r->acc_l);
+    return;
+  }
+  /* Bands above, below, left and right of the overlap */
+  Rectangle exposed[4] = {
+      {roi.x, roi.y, roi.width, y0 - roi.y},
+      {roi.x, y1, roi.width, roi.y + roi.height - y1},
+      {roi.x, y0, x0 - roi.x, y1 - y0},
+      {x1, y0, roi.x + roi.width - x1, y1 - y0},
+  };
+  for (int i = 0; i < 4; i++) {
+    if (exposed[i].width <= 0 || exposed[i].height <= 0) continue;
+    texmapcircuitlight_v2(lt, r->pmap, r->error_mode, times, r->tickmod,
+                          r->tickgap, 1, exposed[i], &r->acc_c, &r->acc_l);
+  }
+  Rectangle overlap = {x0, y0, x1 - x0, y1 - y0};
+  texmapcircuitlight_v2(lt, r->pmap, r->error_mode, times, r->tickmod,
+                        r->tickgap, f, overlap, &r->acc_c, &r->acc_l);
+}
+
 Tex* renderv2_render(RenderV2* r, Cam2D cam, int tw, int th, int ns,
-                     float frame_steps, NandDesc* nidx, NandState* states,
-                     bool use_neon, Times times) {
+                     float frame_steps, NandDesc* nidx,
+                     NandStateArrays* states, bool use_neon, Times times) {
   Tex* tc = texnew(tw, th);
   Tex* tl = texnew(tw, th);
   texclear(tc, r->bg_color);
   texclear(tl, BLACK);
   Tex* light = r->acc_l;
   Tex* circ = r->acc_c;
+  Tex* layers = r->lod > 0 ? r->lod_layers : r->combined_layers;
+  /* Screen pixels of a pixel of the accumulated textures */
+  Cam2D lcam = cam;
+  lcam.sp = cam.sp * (1 << r->lod);
 
   float f = 0.9;
   f = 0.8 * smoothstep(16, 128, frame_steps);
   f = 1 - f;
 
-  texmapcircuitlight_v2(r->combined_layers->rt.texture, r->pmap, r->error_mode,
-                        times, r->tickmod, r->tickgap, f, &circ, &light);
+  Rectangle roi = renderv2_visible_rect(r, lcam, tw, th);
+  renderv2_map_circuit_light(r, layers, times, f, roi);
   renderv2_render_err(r, times.utime);
 
   if (r->error_mode) {
@@ -505,8 +420,8 @@ Tex* renderv2_render(RenderV2* r, Cam2D cam, int tw, int th, int ns,
     }
   }
 
-  texproj(circ, cam, tc);
-  texproj(light, cam, tl);
+  texproj(circ, lcam, tc);
+  texproj(light, lcam, tl);
 
   Tex* combined;
   if (r->error_mode) {
@@ -533,6 +448,14 @@ static bool is_hidden(RenderV2* r, int l) {
   return (r->hide_mask & (1 << l)) != 0;
 }
 
+/* Reduces the circuit to the LOD, averaging each block of pixels. */
+static void renderv2_make_lod_layers(RenderV2* r) {
+  if (r->lod == 0) return;
+  Cam2D cam = {.sp = 1.f / (1 << r->lod)};
+  texclear(r->lod_layers, BLANK);
+  texproj(r->combined_layers, cam, r->lod_layers);
+}
+
 static void renderv2_combine_layers(RenderV2* r) {
   texclear(r->combined_layers, BLANK);
   if (!is_hidden(r, 0)) {
@@ -544,6 +467,34 @@ static void renderv2_combine_layers(RenderV2* r) {
       texdraw2(r->combined_layers->rt, r->layers[i]);
     }
   }
+  renderv2_make_lod_layers(r);
+}
+
+void renderv2_update_lod(RenderV2* r, Cam2D cam) {
+  /* Largest level where a pixel is still no bigger than a screen pixel */
+  int lod = 0;
+  while (lod < r->max_lod && cam.sp * (2 << lod) <= 1.f) lod++;
+  /* Error mode shows the background, which the reduction doesn't keep */
+  if (r->error_mode) lod = 0;
+  if (lod == r->lod) return;
+  r->lod = lod;
+  int w = r->w >> lod;
+  int h = r->h >> lod;
+  texdel(r->pmap);
+  texdel(r->acc_c);
+  texdel(r->acc_l);
+  texdel(r->lod_layers);
+  r->pmap = texnew(w, h);
+  r->acc_c = texnew(w, h);
+  r->acc_l = texnew(w, h);
+  r->lod_layers = lod > 0 ? texnew(w, h) : NULL;
+  texclear(r->pmap, BLANK);
+  texclear(r->acc_c, BLANK);
+  texclear(r->acc_l, BLANK);
+  renderv2_make_lod_layers(r);
+  r->roi = (Rectangle){0};
+  /* Wires are drawn again at the new resolution */
+  r->full_pmap_update = true;
 }
 
 void renderv2_update_hidden_mask(RenderV2* r, int hidden_mask) {
@@ -780,7 +731,7 @@ static void renderv2_dispatch(RenderV2* r, Shaders* s, int start, int end) {
   int loc_wids = s->wire2_aloc_wid;
   int loc_dist = s->wire2_aloc_dist;
   int loc_vert = s->wire2_aloc_vert;
-  int nmax = 25000;
+  int nmax = RENDERV2_MAX_INSTANCES;
   int off = start;
   while (off < end) {
     int ni = (end - off) > nmax ? nmax : (end - off);
@@ -806,8 +757,10 @@ static void renderv2_dispatch(RenderV2* r, Shaders* s, int start, int end) {
     rlEnableVertexAttribute(loc_pos);
 
     rlDrawLineArrayInstanced(0, 2, ni);
+    r->stats.calls++;
     off += ni;
   }
+  r->stats.segments += end - start;
 }
 
 void renderv2_update_pulse(RenderV2* r, Texture pulses, uint32_t* dirty_mask) {
@@ -840,74 +793,20 @@ void renderv2_update_pulse(RenderV2* r, Texture pulses, uint32_t* dirty_mask) {
   rlActiveTextureSlot(0);
   rlEnableTexture(pulses.id);
   set_shader_int(wire2, error_mode, &r->error_mode);
-  int nmax = 10000;
-  int n = arrlen(r->pos);
-  int algo = 2;
+  r->stats = (PulseStats){0};
   /* On first frame, forces drawing everything.
    * Only relevant for error mode, since the dirty flags are not
    * updated. */
   if (r->full_pmap_update) {
-    algo = 0;
     r->full_pmap_update = false;
-  }
-  // printf("update_pulse algo=%d\n", algo);
-  if (algo == 0) {
-    renderv2_dispatch(r, s, 0, n);
-  }
-  if (algo == 1) {
-    int T = 20000;
-    int skip = 4000;
-    // Taking into account dirty masks
-    int nb = r->num_blocks;
-    int start = -1;
-    int actual = 0;
-    int end = -1;
-    for (int i = 0; i < nb; i++) {
-      bool dirty = dirty_mask[i] != 0;
-      // dirty = true;
-      int b0 = r->wire_block[i].off;
-      int b1 = r->wire_block[i].off + r->wire_block[i].size;
-      if (dirty) {
-        if (start == -1) {
-          start = b0;
-          end = b1;
-        } else {
-          end = b1;
-        }
-      } else {
-        if (end != -1) {
-          if (b1 - end > skip) {
-            int nt = end - start;
-            actual += nt;
-            renderv2_dispatch(r, s, start, end);
-            start = -1;
-            end = -1;
-          }
-        }
-      }
-      // When do I dispatch?
-    }
-    if (start != -1) {
-      int nt = end - start;
-      actual += nt;
-      renderv2_dispatch(r, s, start, end);
-    }
-    if (false) {
-      float fnt = actual;
-      float fn = n;
-      float perc = 100 * (fnt / fn);
-      // printf("Drawing %f %% .\n", perc);
-    }
-  }
-  if (algo == 2) {
-    int* ranges = renderv2_schedule_tasks(r, dirty_mask);
-    int nr = arrlen(ranges) / 2;
+    memset(dirty_mask, 0, r->num_blocks * sizeof(uint32_t));
+    renderv2_dispatch(r, s, 0, arrlen(r->pos));
+  } else {
+    renderv2_schedule_tasks(r, dirty_mask);
+    int nr = arrlen(r->ranges) / 2;
     for (int i = 0; i < nr; i++) {
-      int start = ranges[2 * i];
-      int end = ranges[2 * i + 1];
-      renderv2_dispatch(r, s, start, end);
+      renderv2_dispatch(r, s, r->ranges[2 * i], r->ranges[2 * i + 1]);
     }
-    arrfree(ranges);
   }
   rlDisableVertexArray();
   EndShaderMode();
@@ -917,12 +816,17 @@ void renderv2_update_pulse(RenderV2* r, Texture pulses, uint32_t* dirty_mask) {
   EndTextureMode();
 }
 
+PulseStats renderv2_get_pulse_stats(RenderV2* r) { return r->stats; }
+
 void renderv2_free(RenderV2* r) {
   free(r->wire_block);
+  arrfree(r->ranges);
+  arrfree(r->gaps);
   texdel(r->pmap);
   texdel(r->acc_l);
   texdel(r->acc_c);
   texdel(r->combined_layers);
+  texdel(r->lod_layers);
   arrfree(r->pos);
   arrfree(r->wids);
   arrfree(r->dist);
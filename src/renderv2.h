@@ -9,21 +9,34 @@ typedef struct {
   Color c1; /* Socket 1 */
   Color c2; /* Socket 2 */
   Color c3; /* Driver */
+  int gate_delay; /* Ticks from input change to output change */
 } NandDesc;
 
+/* Active NAND gate (as built for the next tick) */
 typedef struct {
-  int activation_counter;
   int id_nand;
-  int next_value;
-  int max_delay;
-  float de;  // energy spent per tick
+  u16 activation_counter; /* Ticks left to change, 0 if not running yet */
+  i8 next_value;          /* Value after the change (-2: inputs changed) */
 } NandState;
 
+/* Active NAND gates of the simulation state, one array per field. */
+typedef struct {
+  int* id_nand;
+  u16* activation_counter;
+  i8* next_value;
+} NandStateArrays;
+
 typedef struct {
   int off;
   int size;
 } WireBlock;
 
+/* Work of a pulse map update. */
+typedef struct {
+  int segments; /* Segments drawn (dirty, or in a gap joined to them) */
+  int calls;    /* Draw calls */
+} PulseStats;
+
 typedef struct {
   int w;          /* Circuit width */
   int h;          /* Circuit height */
@@ -34,6 +47,9 @@ typedef struct {
   /* Dirty map optimization */
   int num_blocks;        /* Num wire blocks */
   WireBlock* wire_block; /* Block for dirty flags */
+  int* ranges;           /* Segments to redraw, [start, end) pairs (scratch) */
+  int* gaps;             /* Gaps between the ranges (scratch) */
+  PulseStats stats;      /* Last pulse map update */
   int* wids;             /* Wire IDs (gpu version) */
   Vector2* dist;         /* Distances of each segment end */
   Vector4* pos;          /* Position of segments */
@@ -85,18 +101,30 @@ typedef struct {
   Tex* acc_l;           /* Accumulated (EMA) light texture */
   bool full_pmap_update;
   Color bg_color; /* Color outside the circuit */
+  /*
+   * Level of detail: when zoomed out, the pmap and the accumulated textures
+   * have one pixel for 2^lod x 2^lod circuit pixels.
+   */
+  int lod;
+  int max_lod;
+  Tex* lod_layers; /* combined_layers reduced to the LOD (lod > 0) */
+  Rectangle roi;   /* Part of acc_c/acc_l drawn last frame, the rest is stale */
 } RenderV2;
 
 RenderV2* renderv2_create(int w, int h, int nwire, int nl,
                           RenderTexture* layers);
 void renderv2_update_hidden_mask(RenderV2* r, int hide_mask);
+/* Picks the level of detail for the zoom of `cam` (call before updates). */
+void renderv2_update_lod(RenderV2* r, Cam2D cam);
 void renderv2_prepare(RenderV2* r, int tickmod, int tickgap);
+/* Redraws the dirty wires in the pulse map, and clears the dirty mask. */
 void renderv2_update_pulse(RenderV2* r, Texture pulses, uint32_t* dirty_mask);
+PulseStats renderv2_get_pulse_stats(RenderV2* r);
 void renderv2_addnand(RenderV2* r, Vector2 p0, Vector2 p1, Vector2 p2, Color c0,
                       Color c1, Color c2);
 Tex* renderv2_render(RenderV2* r, Cam2D cam, int tw, int th, int ns,
-                     float frame_steps, NandDesc* nidx, NandState* states,
-                     bool use_neon, Times times);
+                     float frame_steps, NandDesc* nidx,
+                     NandStateArrays* states, bool use_neon, Times times);
 void renderv2_free(RenderV2* r);
 void renderv2_add_err_pixel(RenderV2* r, int x, int y);
 void renderv2_add_bad_nand(RenderV2* r, int nand_id);
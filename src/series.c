@@ -32,6 +32,26 @@ void unpack_series(Series* s, Buffer* patch, bool fw) {
   }
 }
 
+/*
+ * Patch of `pushes` consecutive pushes: xors of the min(pushes, h) slots
+ * written, starting at the first one.
+ */
+void unpack_series_n(Series* s, Buffer* patch, int pushes, bool fw) {
+  int n = buffer_pop_int(patch);
+  double* diff = buffer_pop_raw(patch, n * sizeof(double));
+  assert(n == (pushes < s->h ? pushes : s->h));
+  if (!fw) {
+    s->first = (s->first + s->h - pushes % s->h) % s->h;
+  }
+  for (int i = 0; i < n; i++) {
+    int j = (s->first + i) % s->h;
+    s->data[j] = double_xor(s->data[j], diff[i]);
+  }
+  if (fw) {
+    s->first = (s->first + pushes) % s->h;
+  }
+}
+
 void series_forward(Series* s, double diff) {
   s->data[s->first] = double_xor(s->data[s->first], diff);
   s->first = (s->first + 1) % s->h;
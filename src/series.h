@@ -18,5 +18,6 @@ void series_make_push_patch(Series* s, double value, double* patch);
 double series_top(Series* s);
 
 void unpack_series(Series* s, Buffer* patch, bool fw);
+void unpack_series_n(Series* s, Buffer* patch, int pushes, bool fw);
 
 #endif
@@ -8,6 +8,7 @@
 #include "img.h"
 #include "math.h"
 #include "msg.h"
+#include "parse_cache.h"
 #include "pixel_graph.h"
 #include "plot.h"
 #include "profiler.h"
@@ -21,7 +22,7 @@ enum {
   PATCH_QPOP = (1 << 1),
   PATCH_SKCT = (1 << 2),
   PATCH_PULS = (1 << 3), /* Wire Pulses */
-  PATCH_SCHD = (1 << 4), /* Schedules items */
+  PATCH_SCHD = (1 << 4), /* Wire changes (fanout schedules) */
   PATCH_NAND = (1 << 5),
   PATCH_MAXP = (1 << 6), /* Max pulse */
   PATCH_E_TICK = (1 << 7),
@@ -31,8 +32,15 @@ enum {
   PATCH_ERROR = (1 << 11),
   PATCH_DONE = (1 << 12),
   PATCH_WTOSH = (1 << 13),
+  PATCH_WARP = (1 << 14), /* Idle ticks merged in one patch (see sim_warp) */
 };
 
+/* Rewind history: ticks between full snapshots and total memory budget */
+#define HIST_CHECKPOINT_TICKS 2048
+#define HIST_BUDGET (256ULL * 1024 * 1024)
+/* Runs a LZ pass on stored patches (on top of the field encoding) */
+#define HIST_PATCH_LZ false
+
 #define getnwire(s) (s->wg.nwire)
 #define isskt(s) (s == PIN_IMG2LUA)
 #define isdrv(s) (s == PIN_LUA2IMG)
@@ -41,14 +49,15 @@ static inline int mini(int a, int b) { return a < b ? a : b; }
 static inline int maxi(int a, int b) { return a > b ? a : b; }
 
 static int sim_get_num_nands(Sim* sim) { return arrlen(sim->pg.nands); }
+static void patch_layout(CodecStream* s);
 
 static void print_graph(Graph* g) {
   for (int i = 0; i < g->n; i++) {
-    int me = g->max_edges;
+    int off = g->eoff[i];
     int ne = g->ecount[i];
     for (int e = 0; e < ne; e++) {
-      int kk = g->edges[i * me + e].e;
-      int ww = g->edges[i * me + e].w;
+      int kk = g->edges[off + e].e;
+      int ww = g->edges[off + e].w;
       printf("%d -- %d --> %d\n", i, ww, kk);
     }
   }
@@ -186,9 +195,11 @@ void sim_register_nands(Sim* sim, Image img) {
     Vector2 p1 = {x0, y0};
     Vector2 p2 = {x1, y1};
     Vector2 p3 = {x2, y2};
-    renderv2_addnand(sim->rv2, p1, p2, p3, c1, c2, c3);
+    if (sim->rv2) renderv2_addnand(sim->rv2, p1, p2, p3, c1, c2, c3);
     int idx = y2 * w + x2;
-    arrput(sim->nidx, ((NandDesc){idx, rot, c1, c2, c3}));
+    int wire = sim->wg.drv_to_wire[i];
+    int gate_delay = wire >= 0 ? sim->dg.gate_delay[wire] : 0;
+    arrput(sim->nidx, ((NandDesc){idx, rot, c1, c2, c3, gate_delay}));
   }
 
   /* Registering drivers that come from levels */
@@ -197,7 +208,7 @@ void sim_register_nands(Sim* sim, Image img) {
   for (int i = 0; i < ndrv; i++) {
     int idx = sim->pg.drv[i];
     /* Using rotation of 0 for drivers */
-    arrput(sim->nidx, ((NandDesc){idx, 0, 0, 0, 0}));
+    arrput(sim->nidx, ((NandDesc){idx, 0, 0, 0, 0, 0}));
   }
 }
 
@@ -259,9 +270,15 @@ static void collect_bugged_pixels(Sim* sim) {
   }
 }
 
+#define PULSE_TEX_WIDTH 4096
+
+static int get_pulse_tex_height(int num_wires) {
+  return (num_wires + PULSE_TEX_WIDTH - 1) / PULSE_TEX_WIDTH;
+}
+
 static Texture create_pulse_texture(int num_wires) {
-  int w = 4096;
-  int h = (num_wires + w - 1) / w;
+  int w = PULSE_TEX_WIDTH;
+  int h = get_pulse_tex_height(num_wires);
   Image tmp = GenImageColor(w, h, GREEN);
   Texture tex = LoadTextureFromImage(tmp);
   UnloadImage(tmp);
@@ -298,7 +315,7 @@ static void make_nand_lut(int* nand_lut) {
 }
 
 static void patch_builder_init(PatchBuilder* patch_builder, double vdd,
-                               double c_gate) {
+                               double c_gate, int num_nands) {
   patch_builder->level_patch.size = 0;
   patch_builder->level_patch.data = NULL;
   patch_builder->power_tick_series_patch = 0;
@@ -321,13 +338,16 @@ static void patch_builder_init(PatchBuilder* patch_builder, double vdd,
   patch_builder->arr_pulse_diff = NULL;
   patch_builder->arr_queue_popped = NULL;
   patch_builder->arr_wire_to_shift = NULL;
-  patch_builder->arr_schedule_item = NULL;
+  patch_builder->arr_fanout = NULL;
+  patch_builder->arr_ext_input = NULL;
+  patch_builder->workers = NULL;
+  patch_builder->lanes = NULL;
 
   patch_builder->arr_nand_state_len = 0;
   patch_builder->arr_skt_diff_len = 0;
   patch_builder->arr_pulse_diff_len = 0;
   patch_builder->arr_queue_popped_len = 0;
-  patch_builder->arr_schedule_item_len = 0;
+  patch_builder->arr_fanout_len = 0;
 
   patch_builder->flags = 0;
   patch_builder->max_pulse_time_diff = 0;
@@ -338,6 +358,11 @@ static void patch_builder_init(PatchBuilder* patch_builder, double vdd,
   patch_builder->k_gate_energy = 0.5 * c_gate * vdd * vdd;
 
   make_nand_lut(patch_builder->nand_lut);
+  patch_builder->nand_seen = calloc(num_nands, sizeof(u32));
+  patch_builder->nand_pos = malloc(num_nands * sizeof(int));
+  patch_builder->nand_gen = 0;
+  patch_builder->arr_nand_sort = NULL;
+  patch_builder->arr_nand_patch = NULL;
 }
 
 static void sim_state_init(SimState* state, int num_wire, int pulse_size,
@@ -378,7 +403,9 @@ static void sim_state_init(SimState* state, int num_wire, int pulse_size,
   for (int skt = 0; skt < num_sockets; skt++) {
     state->skt_values[skt] = S_BIT_UNDEFINED;
   }
-  state->nand_states = calloc(num_drivers, sizeof(NandState));
+  state->nand_states.id_nand = calloc(num_drivers, sizeof(int));
+  state->nand_states.activation_counter = calloc(num_drivers, sizeof(u16));
+  state->nand_states.next_value = calloc(num_drivers, sizeof(i8));
   state->pulses = malloc(state->pulse_size * sizeof(WirePulse));
   int tmod = state->tick_mod;
   int tgap = tmod / state->tick_slots;
@@ -537,19 +564,27 @@ static void compute_critical_path(Sim* sim) {
 
 static void sim_init_state(Sim* sim) {
   int nw = getnwire(sim);
-  sim->pulse_tex = create_pulse_texture(nw);
-  int pulse_size = sim->pulse_tex.width * sim->pulse_tex.height;
+  /* Headless mode keeps the same pulse layout, just without the texture. */
+  int pulse_size = PULSE_TEX_WIDTH * get_pulse_tex_height(nw);
+  if (!sim->headless) {
+    sim->pulse_tex = create_pulse_texture(nw);
+    sim->pulse_tex_stale = true;
+  }
   int ndrv = sim_get_num_drivers(sim);
   int nskt = sim_get_num_sockets(sim);
   sim_state_init(&sim->state, nw, pulse_size, ndrv, nskt);
   sim->state.sim = sim;
   if (!sim_has_errors(sim)) {
     patch_builder_init(&sim->patch_builder, sim->dist_spec.vdd,
-                       sim->dist_spec.c_gate);
+                       sim->dist_spec.c_gate, sim_get_num_nands(sim));
     // sim->patch_builder.fg = &sim->fg;
     sim->patch_builder.dg = &sim->dg;
     sim->patch_builder.wg = &sim->wg;
     sim->patch_builder.pg = &sim->pg;
+    sim->patch_builder.workers = sim->workers;
+    sim->tick_inputs = buffer_alloc(256);
+    sim->tick_inputs.size = 0;
+    patch_codec_init(&sim->codec, patch_layout, HIST_PATCH_LZ);
     dispatch_lone_wires(sim);
   } else {
     sim_add_errors_to_state(sim);
@@ -625,12 +660,12 @@ static void sim_add_driver_status(Sim* sim, int wire, int status) {
 }
 
 /* Enforces a limit on the wire delay so we don't have issues with the cyclic
- * event queue. */
+ * event queue. Gate delays must also fit the 16 bit NAND counters. */
 static void sim_check_max_delay(Sim* sim, int max_delay) {
   int nw = getnwire(sim);
   for (int i = 0; i < nw; i++) {
     int d = sim->dg.wprop[i].max_delay;
-    if (d > max_delay) {
+    if (d > max_delay || sim->dg.gate_delay[i] > UINT16_MAX) {
       sim_add_driver_status(sim, i, STATUS_TOOSLOW);
     }
   }
@@ -648,27 +683,60 @@ Status sim_init(Sim* sim, SimParams p) {
   sim->period_len = 1;
   Status status = status_ok();
   sim->api = p.api;
-  double start = GetTime();
+  sim->headless = p.headless;
+  if (p.num_threads > 1) {
+    sim->workers = workers_create(p.num_threads);
+  }
+  double start = workers_now();
   sim->poked = false;
   init_spec(&sim->dist_spec);
   sim->nl = p.nl;
   sim->pinbuf = malloc(arrlen(sim->api->pg) * sizeof(PinComm));
   sim->w = p.img[0].width;
   sim->h = p.img[0].height;
-  pixel_graph_init(&sim->pg, sim->dist_spec, p.nl, p.img, sim->api->pg, debug);
-  wire_graph_init(&sim->wg, sim->nl, sim->w, sim->h, &sim->pg, debug);
+  /* Same images and pins as a previous run: the parse is read back */
+  u64 cache_key = 0;
+  ParseCacheFile cache_file = {0};
+  bool cached = false;
+  if (p.parse_cache_dir) {
+    cache_key = parse_cache_key(p.nl, p.img, sim->api->pg);
+    cached = parse_cache_load(&cache_file, p.parse_cache_dir, cache_key, sim);
+  }
+  if (!cached) {
+    pixel_graph_init(&sim->pg, sim->dist_spec, p.nl, p.img, sim->api->pg,
+                     sim->workers, debug);
+    wire_graph_init(&sim->wg, sim->nl, sim->w, sim->h, &sim->pg,
+                    sim->workers, debug);
+  }
   sim->num_wire = getnwire(sim);
-  sim->rv2 = renderv2_create(sim->w, sim->h, sim->num_wire, sim->nl, p.layers);
-  // sim->rv2->bg_color = (Color){21, 11, 3, 255};
-  sim->rv2->bg_color = BLACK;
-
-  int nskt = arrlen(sim->pg.skt);
-  dist_graph_init(&sim->dg, sim->dist_spec, sim->w, sim->h, sim->nl, &sim->pg.g,
-                  sim->wg.wire_to_drv, sim->pg.drv, sim->wg.wire_to_skt,
-                  sim->wg.wire_to_skt_off, sim->pg.skt, nskt, getnwire(sim),
-                  sim->wg.comp, sim->pg.ori, sim->rv2, debug);
+  sim->t_render = 0;
+  if (!sim->headless) {
+    double t0 = workers_now();
+    sim->rv2 =
+        renderv2_create(sim->w, sim->h, sim->num_wire, sim->nl, p.layers);
+    // sim->rv2->bg_color = (Color){21, 11, 3, 255};
+    sim->rv2->bg_color = BLACK;
+    sim->t_render += workers_now() - t0;
+  }
+
+  if (cached) {
+    parse_cache_load_segments(&cache_file, sim->rv2);
+    /* Wire results of the dist cache may be older than the loaded ones */
+    if (p.dist_cache) dist_cache_invalidate(p.dist_cache, true, 0, NULL);
+  } else {
+    int nskt = arrlen(sim->pg.skt);
+    dist_graph_init(&sim->dg, sim->dist_spec, sim->w, sim->h, sim->nl,
+                    &sim->pg.g, sim->wg.wire_to_drv, sim->pg.drv,
+                    sim->wg.wire_to_skt, sim->wg.wire_to_skt_off, sim->pg.skt,
+                    nskt, getnwire(sim), sim->wg.comp, sim->wg.wmap,
+                    sim->pg.ori, sim->rv2, sim->workers, p.dist_cache, debug);
+    if (p.parse_cache_dir) {
+      parse_cache_save(p.parse_cache_dir, cache_key, sim);
+    }
+  }
   int max_delay = SIM_MAX_WIRE_DELAY;
   sim_check_max_delay(sim, max_delay);
+  wire_graph_build_fanout(&sim->wg);
 
   sim->dirty_mask_size = (sim->num_wire + 31) / 32;
   sim->pulse_dirty_mask = calloc(sim->dirty_mask_size, sizeof(uint32_t));
@@ -679,7 +747,7 @@ Status sim_init(Sim* sim, SimParams p) {
   sim_register_nands(sim, p.img[0]);
   profiler_tic_single("init2");
   bool has_errors = sim_has_errors(sim);
-  if (has_errors) {
+  if (has_errors && sim->rv2) {
     sim->rv2->error_mode = 1;
     collect_bugged_pixels(sim);
   }
@@ -694,8 +762,12 @@ Status sim_init(Sim* sim, SimParams p) {
     }
   }
 
-  int tickgap = sim->state.tick_mod / sim->state.tick_slots;
-  renderv2_prepare(sim->rv2, sim->state.tick_mod, tickgap);
+  if (sim->rv2) {
+    double t0 = workers_now();
+    int tickgap = sim->state.tick_mod / sim->state.tick_slots;
+    renderv2_prepare(sim->rv2, sim->state.tick_mod, tickgap);
+    sim->t_render += workers_now() - t0;
+  }
 
   if (sim_has_errors(sim)) {
     if (sim->wg.global_error_flags & STATUS_CONFLICT) {
@@ -710,13 +782,13 @@ Status sim_init(Sim* sim, SimParams p) {
   }
   profiler_tac_single("init2");
   printf("num_nands=%d\n", sim_get_num_nands(sim));
-  printf("parsing=%dms\n", (int)((GetTime() - start) * 1000));
+  printf("parsing=%dms\n", (int)((workers_now() - start) * 1000));
 
 #if 0
   if (!sim_has_errors(sim)) {
-    double start = GetTime();
+    double start = workers_now();
     compute_critical_path(sim);
-    double end = GetTime();
+    double end = workers_now();
     printf("scc_graph_time=%.2lf ms\n", (end - start) * 1000);
   }
 #endif
@@ -730,9 +802,9 @@ void sim_destroy(Sim* sim) {
   pixel_graph_destroy(&sim->pg);
   wire_graph_destroy(&sim->wg);
   dist_graph_destroy(&sim->dg);
-  UnloadTexture(sim->pulse_tex);
+  if (!sim->headless) UnloadTexture(sim->pulse_tex);
   free(sim->pulse_dirty_mask);
-  renderv2_free(sim->rv2);
+  if (sim->rv2) renderv2_free(sim->rv2);
   if (sim->light_ema) texdel(sim->light_ema);
   if (sim->circ_ema) texdel(sim->circ_ema);
   sim_state_destroy(&sim->state);
@@ -741,6 +813,10 @@ void sim_destroy(Sim* sim) {
   free(sim->switch_energy);
   arrfree(sim->nidx);
   arrfree(sim->ui_events);
+  workers_destroy(sim->workers);
+  buffer_free(&sim->tick_inputs);
+  buffer_free(&sim->snapshot);
+  patch_codec_destroy(&sim->codec);
   *sim = (Sim){0};
   msg_clear_permanent();
 }
@@ -770,7 +846,7 @@ void sim_find_nearest_pixel(Sim* sim, int tol, v2 fpix, int* pix) {
   int ymin = -1;
   int lmin = -1;
   for (int l = nl - 1; l >= 0; l--) {
-    int* wire_img = sim->wg.wmap[l];
+    TileMap* wire_img = &sim->wg.wmap[l];
     for (int yy = y0; yy <= y1; yy++) {
       for (int xx = x0; xx <= x1; xx++) {
         // center of pixel
@@ -779,9 +855,7 @@ void sim_find_nearest_pixel(Sim* sim, int tol, v2 fpix, int* pix) {
         float dx = cx - fpix.x;
         float dy = cy - fpix.y;
         float sdist = dx * dx + dy * dy;
-        int idx = yy * w + xx;
-        int c = wire_img[idx];
-        if (c != -1 && sdist < dmin) {
+        if (sdist < dmin && tile_map_get(wire_img, xx, yy) != -1) {
           dmin = sdist;
           xmin = xx;
           lmin = l;
@@ -803,8 +877,9 @@ float sim_get_pixel_dist(Sim* sim, int pix) {
   int s = w * h;
   int l = pix / s;
   int idx = pix - l * s;
-  float* dist_img = sim->dg.distmap[l];
-  float v = dist_img[idx];
+  int it = tile_map_index(&sim->wg.wmap[l], idx % w, idx / w);
+  if (it < 0) return 0;
+  float v = tile_dist_unpack(sim->dg.distmap[l][it]);
   return v < 0 ? -v : v;
 }
 
@@ -815,18 +890,16 @@ void sim_toggle_pixel(Sim* sim, int pix) {
   int l = pix / s;
   int idx = pix - l * s;
   assert(l < sim->nl);
-  int* wire_img = sim->wg.wmap[l];
-  int c = wire_img[idx];
+  int c = tile_map_get(&sim->wg.wmap[l], idx % w, idx / w);
+  // Don't want to simulate background component
+  if (c < 0) return;
   int v = pulse_unpack_vafter(sim->state.pulses[c]);
   int nextV = 2;
   if (v == 0) nextV = 1;
   if (v == 1) nextV = 0;
   if (v == 2) nextV = 0;
-  // Don't want to simulate background component
-  if (c >= 0) {
-    patch_builder_dispatch(&sim->patch_builder, &sim->state, c, nextV);
-    sim->poked = true;
-  }
+  patch_builder_dispatch(&sim->patch_builder, &sim->state, c, nextV);
+  sim->poked = true;
 }
 
 #define ALPHA_OFF 50
@@ -1000,12 +1073,69 @@ static void sim_pulse_adjust(Sim* sim) {
   }
 }
 
-static Status sim_diff(void* ctx, Buffer* patch) {
-  Sim* sim = ctx;
+/*
+ * External inputs of a tick: everything in a patch that can't be recomputed
+ * from the state alone. Dispatches done before the tick (user pokes) are kept
+ * apart from the ones done by the level update, since they are replayed at
+ * different points. Warped steps only record their length.
+ */
+typedef struct {
+  ExtInput* pre;
+  int npre;
+  ExtInput* lvl;
+  int nlvl;
+  bool level_updated;
+  Buffer level_patch;
+  int warp; /* Ticks merged in the step (0 for regular ticks) */
+} TickInputs;
+
+static void pack_tick_inputs(Sim* sim, int npre, int warp) {
+  PatchBuilder* builder = &sim->patch_builder;
+  Buffer* b = &sim->tick_inputs;
+  buffer_reset(b);
+  int n = arrlen(builder->arr_ext_input);
+  if (n == 0 && !builder->level_updated && warp == 0) {
+    return;
+  }
+  buffer_push_array(b, sizeof(ExtInput), npre, builder->arr_ext_input);
+  buffer_push_array(b, sizeof(ExtInput), n - npre,
+                    builder->arr_ext_input + npre);
+  if (builder->level_updated) {
+    buffer_push_mem(b, builder->level_patch);
+    buffer_push_int(b, builder->level_patch.size);
+  }
+  buffer_push_int(b, builder->level_updated);
+  buffer_push_int(b, warp);
+}
+
+static TickInputs unpack_tick_inputs(Buffer in) {
+  TickInputs ti = {0};
+  if (in.size == 0) {
+    return ti;
+  }
+  ti.warp = buffer_pop_int(&in);
+  ti.level_updated = buffer_pop_int(&in);
+  if (ti.level_updated) {
+    int size = buffer_pop_int(&in);
+    ti.level_patch = buffer_pop_mem(&in, size);
+  }
+  ti.lvl = buffer_pop_array(&in, sizeof(ExtInput), &ti.nlvl);
+  ti.pre = buffer_pop_array(&in, sizeof(ExtInput), &ti.npre);
+  return ti;
+}
+
+/*
+ * Fills the patch builder with the changes of the next tick.
+ *
+ * When `replay` is given, the level isn't called: its recorded dispatches and
+ * patch are used instead.
+ */
+static Status sim_build_tick(Sim* sim, const TickInputs* replay) {
   Status s = status_ok();
   sim_reset_ui_events(sim);
   SimState* state = &sim->state;
   PatchBuilder* builder = &sim->patch_builder;
+  int npre = arrlen(builder->arr_ext_input);
   sim_pulse_adjust(sim);
   patch_builder_update_nandstate(sim, builder, state);
   patch_builder_handle_socket_events(builder, state);
@@ -1014,18 +1144,198 @@ static Status sim_diff(void* ctx, Buffer* patch) {
   builder->cycle = with_level && !sim->state.done && !sim->state.error;
   /* Only updates/moves cycle forward when level is not complete/stopped. */
   int interval = sim->update_interval;
-  if (builder->cycle && interval == 0) {
-    s = sim_update_level(sim);
-  }
-  if (interval > 0) {
-    int t = state->cur_tick;
-    if (t % interval == 0 && t != 0) {
+  if (replay) {
+    for (int i = 0; i < replay->nlvl; i++) {
+      ExtInput in = replay->lvl[i];
+      patch_builder_dispatch(builder, state, in.wire, in.value);
+    }
+    if (replay->level_updated) {
+      builder->level_updated = true;
+      builder->level_patch = replay->level_patch;
+    }
+  } else {
+    if (builder->cycle && interval == 0) {
       s = sim_update_level(sim);
     }
+    if (interval > 0) {
+      int t = state->cur_tick;
+      if (t % interval == 0 && t != 0) {
+        s = sim_update_level(sim);
+      }
+    }
   }
   if (s.ok) {
     patch_builder_update_nrj(builder, state);
-    *patch = patch_builder_commit(&sim->patch_builder, state);
+    if (!replay) pack_tick_inputs(sim, npre, 0);
+  }
+  return s;
+}
+
+/* Ticks from `t` to the next multiple of `m` (0 if `t` is one). */
+static inline int ticks_to_multiple(int t, int m) { return (m - t % m) % m; }
+
+/*
+ * Number of ticks the next history step can cover (1 = regular tick).
+ *
+ * Once the circuit has settled with a timed level (update_interval > 0),
+ * nothing but the energy decay and the cycle/period counters moves until the
+ * level runs again, so those ticks can be merged in a single patch. Warps
+ * stop before the level update and before pulse shifts (see
+ * sim_pulse_adjust), which are still done as regular ticks.
+ */
+static int sim_warp_length(Sim* sim) {
+  SimState* state = &sim->state;
+  PatchBuilder* builder = &sim->patch_builder;
+  int interval = sim->update_interval;
+  if (sim->max_warp <= 1 || interval <= 0 || !sim_is_idle(sim) ||
+      arrlen(builder->arr_ext_input) > 0) {
+    return 1;
+  }
+  int t = state->cur_tick;
+  int k = sim->max_warp;
+  int m = state->tick_mod / state->tick_slots;
+  k = mini(k, ticks_to_multiple(t, m));
+  k = mini(k, ticks_to_multiple(t, interval));
+  return maxi(k, 1);
+}
+
+/* Slot of a series written by the `i`-th push of a warp, see sim_warp */
+static inline void warp_push(double* slots, int h, int i, double v) {
+  slots[i % h] = v;
+}
+
+/*
+ * Moves `k` idle ticks forward (see sim_warp_length) and builds their patch.
+ *
+ * Idle ticks only decay the energy, move the cycle/period counters and push
+ * to the series, so only those are stepped, on copies. The float operations
+ * are the ones of patch_builder_update_nrj in the same order, so the result
+ * is exactly the one of k regular ticks (which turbo mode still runs): there
+ * is no closed form for k ticks with the same rounding. Bins whose energy is
+ * gone add nothing and are dropped, so a long warp costs k times the bins
+ * still decaying. The patch holds xors of the energy, counters and series
+ * slots; like sim_diff, the state is left untouched.
+ */
+static Status sim_warp(Sim* sim, int k, Buffer* patch) {
+  SimState* state = &sim->state;
+  PatchBuilder* builder = &sim->patch_builder;
+  Series* series[3] = {
+      &state->power_tick_series,
+      &state->energy_per_period_series,
+      &state->ticks_per_period_series,
+  };
+  /* Last value pushed to each slot, from series->first on */
+  int off[3];
+  arrsetlen(builder->arr_warp_series, 0);
+  for (int i = 0; i < 3; i++) {
+    off[i] = arrlen(builder->arr_warp_series);
+    arrsetlen(builder->arr_warp_series, off[i] + mini(k, series[i]->h));
+  }
+  double* slots[3];
+  for (int i = 0; i < 3; i++) slots[i] = builder->arr_warp_series + off[i];
+  sim_reset_ui_events(sim);
+
+  float nrj[NRJ_BINS];
+  memcpy(nrj, state->energy_t, sizeof(nrj));
+  double power = state->power;
+  double acc_nrj = state->acc_nrj;
+  double total_energy = state->total_energy;
+  int cycle = state->cycle;
+  int period_tick = state->cur_period_tick;
+  int max_tick = state->max_tick;
+  int max_tick_cycle = state->max_tick_cycle;
+  int warmup = sim->warmup_cycles;
+  bool moves_cycle = !state->done && !state->error;
+  /* Bins with energy left, in order (adding 0 doesn't change the sums) */
+  int bins[NRJ_BINS];
+  int nbins = 0;
+  for (int j = 0; j < NRJ_BINS; j++) {
+    if (nrj[j] != 0) bins[nbins++] = j;
+  }
+  int eclk = 0;
+  for (int i = 0; i < k; i++) {
+    double tick_power = 0;
+    int n = 0;
+    for (int b = 0; b < nbins; b++) {
+      int j = bins[b];
+      float f = state->pow_decay[j];
+      float cur_power = f * nrj[j];
+      tick_power += cur_power;
+      nrj[j] = (1.0 - f) * nrj[j];
+      if (nrj[j] != 0) bins[n++] = j;
+    }
+    nbins = n;
+    power = double_xor(power, tick_power);
+    warp_push(slots[0], series[0]->h, i, tick_power);
+    double acc = tick_power + acc_nrj;
+    if (cycle >= warmup) total_energy += tick_power;
+    bool track_energy = true;
+    bool is_eclk = false;
+    if (moves_cycle) {
+      if (cycle < warmup) {
+        track_energy = false;
+      } else if (cycle % sim->period_len == 0) {
+        track_energy = false;
+        is_eclk = true;
+        warp_push(slots[1], series[1]->h, eclk, acc);
+        warp_push(slots[2], series[2]->h, eclk, state->cur_tick + i + 1);
+        eclk++;
+        if (period_tick + 1 > max_tick) {
+          max_tick = period_tick + 1;
+          max_tick_cycle = cycle;
+        }
+      }
+      cycle++;
+    }
+    acc_nrj = track_energy ? acc : 0;
+    if (is_eclk) {
+      period_tick = 0;
+    } else if (cycle > warmup) {
+      period_tick++;
+    }
+  }
+
+  Buffer* out = &builder->out_patch;
+  int pushes[3] = {k, eclk, eclk};
+  for (int i = 2; i >= 0; i--) {
+    Series* se = series[i];
+    int n = mini(pushes[i], se->h);
+    for (int j = 0; j < n; j++) {
+      slots[i][j] = double_xor(slots[i][j], se->data[(se->first + j) % se->h]);
+    }
+    buffer_push_raw(out, n * sizeof(double), slots[i]);
+    buffer_push_int(out, n);
+  }
+  for (int i = 0; i < NRJ_BINS; i++) {
+    nrj[i] = float_xor(state->energy_t[i], nrj[i]);
+  }
+  buffer_push_raw(out, NRJ_BINS * sizeof(float), nrj);
+  buffer_push_double(out, double_xor(state->acc_nrj, acc_nrj));
+  buffer_push_double(out, double_xor(state->power, power));
+  buffer_push_double(out, double_xor(state->total_energy, total_energy));
+  buffer_push_int(out, state->max_tick_cycle ^ max_tick_cycle);
+  buffer_push_int(out, state->max_tick ^ max_tick);
+  buffer_push_int(out, state->cur_period_tick ^ period_tick);
+  buffer_push_int(out, state->cycle ^ cycle);
+  buffer_push_int(out, eclk);
+  buffer_push_int(out, k);
+  buffer_push_int(out, PATCH_WARP);
+  *patch = *out;
+  out->size = 0;
+  return status_ok();
+}
+
+static Status sim_diff(void* ctx, Buffer* patch) {
+  Sim* sim = ctx;
+  int warp = sim_warp_length(sim);
+  if (warp > 1) {
+    Status s = sim_warp(sim, warp, patch);
+    if (s.ok) pack_tick_inputs(sim, 0, warp);
+    return s;
+  }
+  Status s = sim_build_tick(sim, NULL);
+  if (s.ok) {
+    *patch = patch_builder_commit(&sim->patch_builder, &sim->state);
   }
   return s;
 }
@@ -1058,9 +1368,8 @@ static inline int shift_pulse(int p, int delta, int mod) {
   return pulse_pack(up);
 }
 
-static void unpack_wire_to_shift(SimState* state, Buffer* patch, bool fw) {
-  int len;
-  int* wire_to_shift = buffer_pop_array(patch, sizeof(int), &len);
+static void apply_wire_to_shift(SimState* state, int* wire_to_shift, int len,
+                                bool fw) {
   int mod = state->tick_mod;
   int n = state->tick_slots;
   int m = mod / n;
@@ -1099,10 +1408,13 @@ static void unpack_wire_to_shift(SimState* state, Buffer* patch, bool fw) {
   }
 }
 
-static void unpack_skt(SimState* state, Buffer* patch) {
+static void unpack_wire_to_shift(SimState* state, Buffer* patch, bool fw) {
   int len;
-  SocketValueDiff* items =
-      buffer_pop_array(patch, sizeof(SocketValueDiff), &len);
+  int* wire_to_shift = buffer_pop_array(patch, sizeof(int), &len);
+  apply_wire_to_shift(state, wire_to_shift, len, fw);
+}
+
+static void apply_skt(SimState* state, SocketValueDiff* items, int len) {
   for (int i = 0; i < len; i++) {
     int iskt = items[i].skt;
     int xor_value = items[i].xor_value;
@@ -1110,12 +1422,17 @@ static void unpack_skt(SimState* state, Buffer* patch) {
   }
 }
 
+static void unpack_skt(SimState* state, Buffer* patch) {
+  int len;
+  SocketValueDiff* items =
+      buffer_pop_array(patch, sizeof(SocketValueDiff), &len);
+  apply_skt(state, items, len);
+}
+
 static void unpack_event(SimState* state, Buffer* patch, bool fw) {
   int len;
   SocketEvent* items = buffer_pop_array(patch, sizeof(SocketEvent), &len);
-  for (int i = 0; i < len; i++) {
-    event_queue_schedule(&state->ev_queue, 0, items[i].socket, items[i].value);
-  }
+  event_queue_schedule_events(&state->ev_queue, 0, items, len);
 }
 
 static void unpack_flags(int flags, SimState* state, bool fw) {
@@ -1140,34 +1457,57 @@ static inline void axori(int s, int n, void* pa, void* pb, void* pout) {
   }
 }
 
+/* Counter and next value of a NAND, as stored in patches. */
+static inline int nand_word(u16 counter, i8 next_value) {
+  return counter | (u8)next_value << 16;
+}
+
 static void unpack_nand_state(SimState* state, Buffer* patch) {
   int n1 = buffer_pop_int(patch);
-  Buffer b = buffer_pop_mem(patch, n1 * sizeof(NandState));
-  NandState* a0 = state->nand_states;
-  NandState* a1 = (NandState*)b.data;
-  axori(sizeof(NandState), n1, a0, a1, a0);
+  int* words = (int*)buffer_pop_raw(patch, n1 * sizeof(int));
+  int* ids = (int*)buffer_pop_raw(patch, n1 * sizeof(int));
+  NandStateArrays* a0 = &state->nand_states;
+  axori(sizeof(int), n1, a0->id_nand, ids, a0->id_nand);
+  for (int i = 0; i < n1; i++) {
+    a0->activation_counter[i] ^= (u16)words[i];
+    a0->next_value[i] ^= (i8)(words[i] >> 16);
+  }
   int xn = buffer_pop_int(patch);
   state->active_count ^= xn;
 }
 
-static void unpack_schedule(SimState* state, Buffer* patch, bool fw) {
-  int len;
-  ScheduleItem* items = buffer_pop_array(patch, sizeof(ScheduleItem), &len);
-  for (int i = 0; i < len; i++) {
-    int dt = items[i].dt_ticks;
-    if (fw) {
-      int skt = items[i].ev.socket;
-      int newValue = items[i].ev.value;
-      event_queue_schedule(&state->ev_queue, dt, skt, newValue);
-    } else {
-      event_queue_unschedule(&state->ev_queue, dt);
+/* Schedules (or removes) the socket events of each wire change. */
+static void apply_fanout(SimState* state, FanoutEvent* items, int len,
+                         bool fw) {
+  WireGraph* wg = &state->sim->wg;
+  EventQueue* q = &state->ev_queue;
+  if (fw) {
+    for (int i = 0; i < len; i++) {
+      int wire = items[i].wire;
+      for (int g = wg->fanout_off[wire]; g < wg->fanout_off[wire + 1]; g++) {
+        FanoutGroup fg = wg->fanout[g];
+        event_queue_schedule_sockets(q, fg.dt_ticks + 1,
+                                     wg->fanout_skt + fg.off, fg.n,
+                                     items[i].value);
+      }
+    }
+  } else {
+    for (int i = len - 1; i >= 0; i--) {
+      int wire = items[i].wire;
+      for (int g = wg->fanout_off[wire]; g < wg->fanout_off[wire + 1]; g++) {
+        FanoutGroup fg = wg->fanout[g];
+        event_queue_unschedule_n(q, fg.dt_ticks + 1, fg.n);
+      }
     }
   }
 }
 
-static void unpack_pulse(SimState* state, Buffer* patch, bool fw) {
+static void unpack_schedule(SimState* state, Buffer* patch, bool fw) {
   int len;
-  PulseDiff* items = buffer_pop_array(patch, sizeof(PulseDiff), &len);
+  FanoutEvent* items = buffer_pop_array(patch, sizeof(FanoutEvent), &len);
+  apply_fanout(state, items, len, fw);
+}
+static void apply_pulse(SimState* state, PulseDiff* items, int len, bool fw) {
   int mod = state->tick_mod;
   int t = state->cur_tick % mod;
   uint32_t* mask = state->sim->pulse_dirty_mask;
@@ -1203,9 +1543,42 @@ static void unpack_pulse(SimState* state, Buffer* patch, bool fw) {
   }
 }
 
+static void unpack_pulse(SimState* state, Buffer* patch, bool fw) {
+  int len;
+  PulseDiff* items = buffer_pop_array(patch, sizeof(PulseDiff), &len);
+  apply_pulse(state, items, len, fw);
+}
+
+static void unpack_warp(SimState* state, Buffer* patch, bool fw) {
+  int k = buffer_pop_int(patch);
+  int eclk = buffer_pop_int(patch);
+  state->cycle ^= buffer_pop_int(patch);
+  state->cur_period_tick ^= buffer_pop_int(patch);
+  state->max_tick ^= buffer_pop_int(patch);
+  state->max_tick_cycle ^= buffer_pop_int(patch);
+  state->total_energy =
+      double_xor(state->total_energy, buffer_pop_double(patch));
+  state->power = double_xor(state->power, buffer_pop_double(patch));
+  state->acc_nrj = double_xor(state->acc_nrj, buffer_pop_double(patch));
+  float* nrj = buffer_pop_raw(patch, NRJ_BINS * sizeof(float));
+  for (int i = 0; i < NRJ_BINS; i++) {
+    state->energy_t[i] = float_xor(nrj[i], state->energy_t[i]);
+  }
+  unpack_series_n(&state->power_tick_series, patch, k, fw);
+  unpack_series_n(&state->energy_per_period_series, patch, eclk, fw);
+  unpack_series_n(&state->ticks_per_period_series, patch, eclk, fw);
+  /* The queue is empty while idle: only its time moves */
+  event_queue_skip(&state->ev_queue, fw ? k : -k);
+  state->cur_tick += fw ? k : -k;
+}
+
 static Status patch_unpack(SimState* state, Buffer patch, bool fw) {
   Status s = status_ok();
   int flags = buffer_pop_int(&patch);
+  if (flags & PATCH_WARP) {
+    unpack_warp(state, &patch, fw);
+    return s;
+  }
   unpack_flags(flags, state, fw);
   if (flags & PATCH_LEVL) {
     s = unpack_level(state, &patch, fw);
@@ -1242,6 +1615,64 @@ static Status patch_unpack(SimState* state, Buffer patch, bool fw) {
   return s;
 }
 
+/* Walks a patch in the same order as patch_unpack, for the history codec. */
+static void patch_layout(CodecStream* s) {
+  int flags = codec_int(s);
+  if (flags & PATCH_WARP) {
+    for (int i = 0; i < 6; i++) codec_int(s);
+    for (int i = 0; i < 3; i++) codec_double(s);
+    codec_floats(s, NRJ_BINS);
+    for (int i = 0; i < 3; i++) {
+      int n = codec_int(s);
+      for (int j = 0; j < n; j++) codec_double(s);
+    }
+    return;
+  }
+  if (flags & PATCH_LEVL) {
+    int size = codec_int(s);
+    codec_bytes(s, size);
+  }
+  codec_double(s); /* total_energy */
+  codec_double(s); /* power_tick_series */
+  if (flags & PATCH_ECLK) {
+    codec_int(s);
+    codec_double(s);
+    codec_double(s);
+  }
+  if (flags & PATCH_MAXT) {
+    codec_int(s);
+    codec_int(s);
+  }
+  if (flags & PATCH_NAND) {
+    /* Xored with previous states: ids aren't sorted anymore */
+    int n1 = codec_int(s);
+    codec_words(s, n1, 1, -1); /* counters and next values */
+    codec_words(s, n1, 1, -1); /* ids */
+    codec_int(s);
+  }
+  /* Ids are (mostly) increasing: stored as deltas */
+  int nw = sizeof(int);
+  if (flags & PATCH_SCHD) codec_array(s, sizeof(FanoutEvent) / nw, 0);
+  if (flags & PATCH_WTOSH) codec_array(s, 1, 0);
+  if (flags & PATCH_PULS) codec_array(s, sizeof(PulseDiff) / nw, 0);
+  if (flags & PATCH_SKCT) codec_array(s, sizeof(SocketValueDiff) / nw, 0);
+  if (flags & PATCH_QPOP) codec_array(s, sizeof(SocketEvent) / nw, 0);
+  codec_double(s); /* power */
+  codec_double(s); /* acc_nrj */
+  codec_floats(s, NRJ_BINS);
+  if (flags & PATCH_MAXP) codec_int(s);
+}
+
+static Buffer sim_encode(void* ctx, Buffer patch) {
+  Sim* sim = ctx;
+  return patch_codec_encode(&sim->codec, patch);
+}
+
+static Buffer sim_decode(void* ctx, Buffer data) {
+  Sim* sim = ctx;
+  return patch_codec_decode(&sim->codec, data);
+}
+
 static Status sim_fwd(void* ctx, Buffer patch) {
   Sim* sim = ctx;
   return patch_unpack(&sim->state, patch, true);
@@ -1252,6 +1683,226 @@ static Status sim_bwd(void* ctx, Buffer patch) {
   return patch_unpack(&sim->state, patch, false);
 }
 
+/*
+ * Applies the builder content straight into the state, doing the same as
+ * patch_unpack(fw=true) on the committed patch but without encoding it.
+ *
+ * Popped queue events are not re-scheduled: the current queue slot still
+ * holds them and it's cleared when stepping forward.
+ */
+static Status patch_builder_apply(PatchBuilder* pb, SimState* state) {
+  Status s = status_ok();
+  if (pb->cycle) state->cycle++;
+  if (pb->level_updated) {
+    LevelAPI* api = state->sim->api;
+    if (api->fw) s = api->fw(api->u, pb->level_patch);
+    pb->level_patch.size = 0;
+    if (!s.ok) return s;
+  }
+  state->total_energy = double_xor(state->total_energy, pb->total_energy_patch);
+  series_forward(&state->power_tick_series, pb->power_tick_series_patch);
+  if (pb->flags & PATCH_ECLK) {
+    state->cur_period_tick ^= pb->period_tick_patch;
+    series_forward(&state->energy_per_period_series,
+                   pb->energy_per_period_series_patch);
+    series_forward(&state->ticks_per_period_series,
+                   pb->ticks_per_period_series_patch);
+  } else if (state->cycle > state->sim->warmup_cycles) {
+    state->cur_period_tick++;
+  }
+  if (pb->flags & PATCH_MAXT) {
+    state->max_tick_cycle ^= pb->max_tick_cycle_patch;
+    state->max_tick ^= pb->max_tick_patch;
+  }
+  int nn = arrlen(pb->arr_nand_state);
+  NandStateArrays* ns = &state->nand_states;
+  for (int i = 0; i < nn; i++) {
+    NandState* a = &pb->arr_nand_state[i];
+    ns->id_nand[i] = a->id_nand;
+    ns->activation_counter[i] = a->activation_counter;
+    ns->next_value[i] = a->next_value;
+  }
+  state->active_count = nn;
+  apply_fanout(state, pb->arr_fanout, arrlen(pb->arr_fanout), true);
+  apply_wire_to_shift(state, pb->arr_wire_to_shift,
+                      arrlen(pb->arr_wire_to_shift), true);
+  apply_pulse(state, pb->arr_pulse_diff, arrlen(pb->arr_pulse_diff), true);
+  apply_skt(state, pb->arr_skt_diff, arrlen(pb->arr_skt_diff));
+  for (int i = 0; i < NRJ_BINS; i++) {
+    state->energy_t[i] = float_xor(pb->nrj_patch[i], state->energy_t[i]);
+  }
+  state->power = double_xor(state->power, pb->power_patch);
+  state->acc_nrj = double_xor(state->acc_nrj, pb->acc_nrj_patch);
+  state->max_pulse_time += pb->max_pulse_time_diff;
+  event_queue_step_forward(&state->ev_queue);
+  state->cur_tick++;
+  patch_builder_reset(pb);
+  return s;
+}
+
+/* Moves one tick forward without recording a patch (turbo mode). */
+static Status sim_step(void* ctx) {
+  Sim* sim = ctx;
+  Status s = sim_build_tick(sim, NULL);
+  if (s.ok) {
+    s = patch_builder_apply(&sim->patch_builder, &sim->state);
+  }
+  return s;
+}
+
+static void save_series(Series* s, Buffer* b) {
+  buffer_push_raw(b, s->h * sizeof(double), s->data);
+  buffer_push_int(b, s->first);
+}
+
+static void load_series(Series* s, Buffer* b) {
+  s->first = buffer_pop_int(b);
+  memcpy(s->data, buffer_pop_raw(b, s->h * sizeof(double)),
+         s->h * sizeof(double));
+}
+
+/* Only non-empty slots of the queue are stored. */
+static void save_event_queue(EventQueue* q, Buffer* b) {
+  int nslots = 0;
+  for (int dt = 0; dt < q->ntime; dt++) {
+    int n;
+    SocketEvent* ev;
+    event_queue_get_events(q, dt, &n, &ev);
+    if (n == 0) continue;
+    buffer_push_array(b, sizeof(SocketEvent), n, ev);
+    buffer_push_int(b, dt);
+    nslots++;
+  }
+  buffer_push_int(b, nslots);
+  buffer_push_int(b, q->cur_time);
+}
+
+static void load_event_queue(EventQueue* q, Buffer* b) {
+  event_queue_clear(q);
+  q->cur_time = buffer_pop_int(b);
+  int nslots = buffer_pop_int(b);
+  for (int k = 0; k < nslots; k++) {
+    int dt = buffer_pop_int(b);
+    int n;
+    SocketEvent* ev = buffer_pop_array(b, sizeof(SocketEvent), &n);
+    event_queue_schedule_events(q, dt, ev, n);
+  }
+}
+
+/* Full state snapshot. Static data (pow_decay, tick_mod...) is not saved. */
+static Status sim_save(void* ctx, Buffer* snap) {
+  Sim* sim = ctx;
+  SimState* state = &sim->state;
+  Buffer* b = &sim->snapshot;
+  if (b->cap == 0) *b = buffer_alloc(1024);
+  buffer_reset(b);
+  buffer_push_raw(b, arrlen(sim->pg.skt) * sizeof(int), state->skt_values);
+  buffer_push_raw(b, sim->num_wire * sizeof(WirePulse), state->pulses);
+  /* Slots past active_count are saved too: nand patches are xored over them */
+  NandStateArrays* ns = &state->nand_states;
+  int nd = sim_get_num_drivers(sim);
+  buffer_push_raw(b, nd * sizeof(int), ns->id_nand);
+  for (int i = 0; i < nd; i++) {
+    int word = nand_word(ns->activation_counter[i], ns->next_value[i]);
+    buffer_push_int(b, word);
+  }
+  buffer_push_int(b, state->active_count);
+  save_series(&state->power_tick_series, b);
+  save_series(&state->energy_per_period_series, b);
+  save_series(&state->ticks_per_period_series, b);
+  save_event_queue(&state->ev_queue, b);
+  buffer_push_raw(b, NRJ_BINS * sizeof(float), state->energy_t);
+  buffer_push_double(b, state->power);
+  buffer_push_double(b, state->acc_nrj);
+  buffer_push_double(b, state->total_energy);
+  buffer_push_int(b, state->max_pulse_time);
+  buffer_push_int(b, state->cur_period_tick);
+  buffer_push_int(b, state->cur_tick);
+  buffer_push_int(b, state->max_tick);
+  buffer_push_int(b, state->max_tick_cycle);
+  buffer_push_int(b, state->cycle);
+  buffer_push_int(b, state->error);
+  buffer_push_int(b, state->done);
+  *snap = *b;
+  return status_ok();
+}
+
+static Status sim_load(void* ctx, Buffer snap) {
+  Sim* sim = ctx;
+  SimState* state = &sim->state;
+  Buffer* b = &snap;
+  state->done = buffer_pop_int(b);
+  state->error = buffer_pop_int(b);
+  state->cycle = buffer_pop_int(b);
+  state->max_tick_cycle = buffer_pop_int(b);
+  state->max_tick = buffer_pop_int(b);
+  state->cur_tick = buffer_pop_int(b);
+  state->cur_period_tick = buffer_pop_int(b);
+  state->max_pulse_time = buffer_pop_int(b);
+  state->total_energy = buffer_pop_double(b);
+  state->acc_nrj = buffer_pop_double(b);
+  state->power = buffer_pop_double(b);
+  memcpy(state->energy_t, buffer_pop_raw(b, NRJ_BINS * sizeof(float)),
+         NRJ_BINS * sizeof(float));
+  load_event_queue(&state->ev_queue, b);
+  load_series(&state->ticks_per_period_series, b);
+  load_series(&state->energy_per_period_series, b);
+  load_series(&state->power_tick_series, b);
+  state->active_count = buffer_pop_int(b);
+  int nn = sim_get_num_drivers(sim);
+  NandStateArrays* ns = &state->nand_states;
+  for (int i = nn - 1; i >= 0; i--) {
+    int word = buffer_pop_int(b);
+    ns->activation_counter[i] = (u16)word;
+    ns->next_value[i] = (i8)(word >> 16);
+  }
+  memcpy(ns->id_nand, buffer_pop_raw(b, nn * sizeof(int)), nn * sizeof(int));
+  int nw = sim->num_wire;
+  memcpy(state->pulses, buffer_pop_raw(b, nw * sizeof(WirePulse)),
+         nw * sizeof(WirePulse));
+  int nskt = arrlen(sim->pg.skt);
+  memcpy(state->skt_values, buffer_pop_raw(b, nskt * sizeof(int)),
+         nskt * sizeof(int));
+  assert(b->size == 0);
+  patch_builder_reset(&sim->patch_builder);
+  /* Every wire may have changed */
+  memset(sim->pulse_dirty_mask, 0xff, sim->dirty_mask_size * sizeof(uint32_t));
+  return status_ok();
+}
+
+static Buffer sim_tick_inputs(void* ctx) {
+  Sim* sim = ctx;
+  return sim->tick_inputs;
+}
+
+static Status sim_replay(void* ctx, Buffer inputs, Buffer* patch) {
+  Sim* sim = ctx;
+  TickInputs ti = unpack_tick_inputs(inputs);
+  if (ti.warp > 0) {
+    return sim_warp(sim, ti.warp, patch);
+  }
+  for (int i = 0; i < ti.npre; i++) {
+    patch_builder_dispatch(&sim->patch_builder, &sim->state, ti.pre[i].wire,
+                           ti.pre[i].value);
+  }
+  Status s = sim_build_tick(sim, &ti);
+  if (s.ok) {
+    *patch = patch_builder_commit(&sim->patch_builder, &sim->state);
+  }
+  return s;
+}
+
+/* The level state is not in snapshots: its patches are reverted instead. */
+static Status sim_unwind(void* ctx, Buffer inputs) {
+  Sim* sim = ctx;
+  TickInputs ti = unpack_tick_inputs(inputs);
+  LevelAPI* api = sim->api;
+  if (ti.level_updated && api && api->bw) {
+    return api->bw(api->u, ti.level_patch);
+  }
+  return status_ok();
+}
+
 HSim wrap_sim(Sim* sim) {
   HSim h = {0};
   hsim_init(&h);
@@ -1259,6 +1910,15 @@ HSim wrap_sim(Sim* sim) {
   h.diff = sim_diff;
   h.fwd = sim_fwd;
   h.bwd = sim_bwd;
+  h.step = sim_step;
+  h.encode = sim_encode;
+  h.decode = sim_decode;
+  h.save = sim_save;
+  h.load = sim_load;
+  h.inputs = sim_tick_inputs;
+  h.replay = sim_replay;
+  h.unwind = sim_unwind;
+  hsim_set_checkpoints(&h, HIST_CHECKPOINT_TICKS, HIST_BUDGET);
   return h;
 }
 
@@ -1267,7 +1927,9 @@ void sim_state_destroy(SimState* state) {
   series_destroy(&state->energy_per_period_series);
   series_destroy(&state->ticks_per_period_series);
   free(state->skt_values);
-  free(state->nand_states);
+  free(state->nand_states.id_nand);
+  free(state->nand_states.activation_counter);
+  free(state->nand_states.next_value);
   free(state->pulses);
   event_queue_destroy(&state->ev_queue);
 }
@@ -1303,7 +1965,8 @@ void patch_builder_reset(PatchBuilder* pb) {
   arrsetlen(pb->arr_skt_diff, 0);
   arrsetlen(pb->arr_queue_popped, 0);
   arrsetlen(pb->arr_wire_to_shift, 0);
-  arrsetlen(pb->arr_schedule_item, 0);
+  arrsetlen(pb->arr_fanout, 0);
+  arrsetlen(pb->arr_ext_input, 0);
 }
 
 void patch_builder_destroy(PatchBuilder* patch_builder) {
@@ -1313,7 +1976,22 @@ void patch_builder_destroy(PatchBuilder* patch_builder) {
   arrfree(patch_builder->arr_skt_diff);
   arrfree(patch_builder->arr_queue_popped);
   arrfree(patch_builder->arr_wire_to_shift);
-  arrfree(patch_builder->arr_schedule_item);
+  arrfree(patch_builder->arr_fanout);
+  arrfree(patch_builder->arr_ext_input);
+  arrfree(patch_builder->arr_warp_series);
+  arrfree(patch_builder->arr_nand_sort);
+  arrfree(patch_builder->arr_nand_patch);
+  free(patch_builder->nand_seen);
+  free(patch_builder->nand_pos);
+  for (int i = 0; i < arrlen(patch_builder->lanes); i++) {
+    NandLane* lane = &patch_builder->lanes[i];
+    arrfree(lane->arr_nand_state);
+    arrfree(lane->arr_pulse_diff);
+    arrfree(lane->arr_fanout);
+    arrfree(lane->arr_energy);
+    arrfree(lane->arr_ui_event);
+  }
+  arrfree(patch_builder->lanes);
 }
 
 bool patch_builder_empty(PatchBuilder* pb) {
@@ -1323,7 +2001,7 @@ bool patch_builder_empty(PatchBuilder* pb) {
   empty = empty && arrlen(pb->arr_skt_diff) == 0;
   empty = empty && arrlen(pb->arr_queue_popped) == 0;
   empty = empty && arrlen(pb->arr_wire_to_shift) == 0;
-  empty = empty && arrlen(pb->arr_schedule_item) == 0;
+  empty = empty && arrlen(pb->arr_fanout) == 0;
   empty = empty && (!pb->level_updated);
   empty = empty && (!pb->cycle);
   return empty;
@@ -1368,8 +2046,13 @@ bool patch_builder_empty(PatchBuilder* pb) {
     builder->aname = 0;                      \
   }
 
+/*
+ * Xor of the first n1 states with the new ones: ids first, then counter and
+ * next value packed in one word. States past n1 are left as they are, so
+ * going back restores them.
+ */
 void pack_nand_state(PatchBuilder* pb, SimState* state, Buffer* patch) {
-  NandState* a0 = state->nand_states;
+  NandStateArrays* a0 = &state->nand_states;
   NandState* a1 = pb->arr_nand_state;
   int n0 = state->active_count;
   int n1 = arrlen(a1);
@@ -1377,14 +2060,17 @@ void pack_nand_state(PatchBuilder* pb, SimState* state, Buffer* patch) {
     return;
   }
   pb->flags |= PATCH_NAND;
-  axori(sizeof(NandState), n1, a0, a1, a1);
-  Buffer buf = {
-      .data = (u8*)a1,
-      .size = n1 * sizeof(NandState),
-  };
+  int* x = pb->arr_nand_patch;
+  arrsetlen(x, 2 * n1);
+  for (int i = 0; i < n1; i++) {
+    x[i] = a0->id_nand[i] ^ a1[i].id_nand;
+    x[n1 + i] = nand_word(a0->activation_counter[i], a0->next_value[i]) ^
+                nand_word(a1[i].activation_counter, a1[i].next_value);
+  }
+  pb->arr_nand_patch = x;
   int xn = n1 ^ n0;
   buffer_push_int(patch, xn);
-  buffer_push_mem(patch, buf);
+  buffer_push_raw(patch, 2 * n1 * sizeof(int), x);
   buffer_push_int(patch, n1);
 }
 
@@ -1405,7 +2091,7 @@ Buffer patch_builder_commit(PatchBuilder* pb, SimState* state) {
   PACK_ARRAY(pb, arr_skt_diff, PATCH_SKCT);
   PACK_ARRAY(pb, arr_pulse_diff, PATCH_PULS);
   PACK_ARRAY(pb, arr_wire_to_shift, PATCH_WTOSH);
-  PACK_ARRAY(pb, arr_schedule_item, PATCH_SCHD);
+  PACK_ARRAY(pb, arr_fanout, PATCH_SCHD);
   pack_nand_state(pb, state, patch);
   if (pb->flags & PATCH_MAXT) {
     buffer_push_int(patch, pb->max_tick_patch);
@@ -1425,10 +2111,53 @@ Buffer patch_builder_commit(PatchBuilder* pb, SimState* state) {
   return out;
 }
 
-static int compare_nandstate(const void* a, const void* b) {
-  int nandA = ((NandState*)a)->id_nand;
-  int nandB = ((NandState*)b)->id_nand;
-  return nandA - nandB;
+/* Smaller lists are sorted by insertion */
+#define NAND_SORT_SMALL 32
+#define NAND_RADIX_BITS 8
+
+/* Sorts by id (ids are unique). Stable LSD radix, O(n) for a given circuit. */
+static void sort_nand_states(PatchBuilder* builder, int num_nands) {
+  NandState* a = builder->arr_nand_state;
+  int n = arrlen(a);
+  bool sorted = true;
+  for (int i = 1; i < n && sorted; i++) {
+    sorted = a[i - 1].id_nand < a[i].id_nand;
+  }
+  if (sorted) return;
+  if (n <= NAND_SORT_SMALL) {
+    for (int i = 1; i < n; i++) {
+      NandState x = a[i];
+      int j = i - 1;
+      while (j >= 0 && a[j].id_nand > x.id_nand) {
+        a[j + 1] = a[j];
+        j--;
+      }
+      a[j + 1] = x;
+    }
+    return;
+  }
+  arrsetlen(builder->arr_nand_sort, n);
+  NandState* src = a;
+  NandState* dst = builder->arr_nand_sort;
+  int nb = 1 << NAND_RADIX_BITS;
+  int cnt[1 << NAND_RADIX_BITS];
+  for (int shift = 0; (num_nands - 1) >> shift; shift += NAND_RADIX_BITS) {
+    memset(cnt, 0, sizeof(cnt));
+    for (int i = 0; i < n; i++) cnt[(src[i].id_nand >> shift) & (nb - 1)]++;
+    int off = 0;
+    for (int d = 0; d < nb; d++) {
+      int c = cnt[d];
+      cnt[d] = off;
+      off += c;
+    }
+    for (int i = 0; i < n; i++) {
+      dst[cnt[(src[i].id_nand >> shift) & (nb - 1)]++] = src[i];
+    }
+    NandState* tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != a) memcpy(a, src, n * sizeof(NandState));
 }
 
 /*
@@ -1443,55 +2172,53 @@ static int compare_nandstate(const void* a, const void* b) {
  * 3. The nand has been awaken twice (two socket events), in which case there
  * will also be more than one nand entry.
  *
- * For that, as of today we perform a post-processing step where we look for
- * repeatead nands and remove old versions. Since the number of NAND active
- * state is expected to be very small per tick, and the array is contiguous (ie
- * cache friendly), we perform a simple sorting followed by duplcation removal.
+ * Repeated NANDs are merged into their first entry, which is marked as awake.
+ * A per-NAND table stamped with the current generation tells whether (and
+ * where) a NAND was already seen, so no clearing is needed between ticks. The
+ * list is then sorted by id, which is cheap since the carried over entries are
+ * already in order.
  */
 void patch_builder_remove_duplicated_nand(PatchBuilder* builder) {
-  int nActNew = arrlen(builder->arr_nand_state);
-  if (nActNew > 0) {
-    qsort(builder->arr_nand_state, nActNew, sizeof(NandState),
-          compare_nandstate);
-    int nAct = nActNew;
-    nActNew = 0;
-    NandState* pNxt = builder->arr_nand_state;
-    for (int iAct = 1; iAct < nAct; iAct++) {
-      int nand1 = pNxt[nActNew].id_nand;
-      int nand2 = pNxt[iAct].id_nand;
-      if (nand1 == nand2) {
-        int cnt0 = pNxt[nActNew].activation_counter;
-        int cnt1 = pNxt[iAct].activation_counter;
-        pNxt[nActNew].next_value = -2;
-      } else {
-        pNxt[++nActNew] = pNxt[iAct];
-      }
+  int nAct = arrlen(builder->arr_nand_state);
+  if (nAct == 0) {
+    return;
+  }
+  int num_nands = arrlen(builder->pg->nands);
+  if (++builder->nand_gen == 0) {
+    memset(builder->nand_seen, 0, num_nands * sizeof(u32));
+    builder->nand_gen = 1;
+  }
+  u32 gen = builder->nand_gen;
+  u32* seen = builder->nand_seen;
+  int* pos = builder->nand_pos;
+  NandState* pNxt = builder->arr_nand_state;
+  int nActNew = 0;
+  for (int iAct = 0; iAct < nAct; iAct++) {
+    int id = pNxt[iAct].id_nand;
+    if (seen[id] == gen) {
+      pNxt[pos[id]].next_value = -2;
+    } else {
+      seen[id] = gen;
+      pos[id] = nActNew;
+      pNxt[nActNew++] = pNxt[iAct];
     }
-    nActNew++;
-    arrsetlen(builder->arr_nand_state, nActNew);
   }
+  arrsetlen(builder->arr_nand_state, nActNew);
+  sort_nand_states(builder, num_nands);
 }
 
 /*
- * Schedule modification for each socket in the fanout of the wire.
+ * Records the wire change: its fanout is scheduled when the patch is applied,
+ * with one bulk insertion per delay (see wire_graph_build_fanout).
  */
-static void fanout_schedule(
-    int* arr_offset,         /* Offset for wire_to_skt */
-    SocketDesc* wire_to_skt, /* Sockets for each wire */
-    int wire,                /* Wire that is changing */
-    int new_value,           /* New value of that wire */
-    ScheduleItem** items     /* Schedule array that is updated*/
-) {
+static void fanout_schedule(WireGraph* wg, int wire, int new_value,
+                            FanoutEvent** items) {
   assert(wire >= 0);
-  int off = arr_offset[wire];
-  int ns = arr_offset[wire + 1] - off;
-  ScheduleItem item = {0};
-  for (int i = 0; i < ns; i++) {
-    item.dt_ticks = wire_to_skt[off + i].dt_ticks + 1;
-    item.ev.socket = wire_to_skt[off + i].socket;
-    item.ev.value = new_value;
-    arrput(*items, item);
+  if (wg->fanout_off[wire] == wg->fanout_off[wire + 1]) {
+    return;
   }
+  FanoutEvent item = {.wire = wire, .value = new_value};
+  arrput(*items, item);
 }
 
 static inline int upper_idx(int x) {
@@ -1517,8 +2244,36 @@ static void add_energy(PatchBuilder* builder, double e, int T) {
   builder->nrj_patch[i0 - 1] += a * e;
 }
 
-void patch_builder_dispatch(PatchBuilder* builder, SimState* state, int wire,
-                            int new_value) {
+/* Lane that writes straight into the builder arrays. */
+static NandLane lane_borrow(PatchBuilder* builder) {
+  return (NandLane){
+      .arr_nand_state = builder->arr_nand_state,
+      .arr_pulse_diff = builder->arr_pulse_diff,
+      .arr_fanout = builder->arr_fanout,
+      .max_pulse_time_diff = builder->max_pulse_time_diff,
+      .deferred = false,
+  };
+}
+
+static void lane_give_back(PatchBuilder* builder, NandLane* lane) {
+  builder->arr_nand_state = lane->arr_nand_state;
+  builder->arr_pulse_diff = lane->arr_pulse_diff;
+  builder->arr_fanout = lane->arr_fanout;
+  builder->max_pulse_time_diff = lane->max_pulse_time_diff;
+}
+
+static void lane_add_energy(PatchBuilder* builder, NandLane* lane, double e,
+                            int T) {
+  if (lane->deferred) {
+    EnergyItem item = {.e = e, .T = T};
+    arrput(lane->arr_energy, item);
+  } else {
+    add_energy(builder, e, T);
+  }
+}
+
+static void lane_dispatch(PatchBuilder* builder, NandLane* lane,
+                          SimState* state, int wire, int new_value) {
   assert(wire >= 0 && wire < state->pulse_size);
   WirePulse* pulse = &state->pulses[wire];
   bool changes = pulse_unpack_vafter(*pulse) != new_value;
@@ -1539,18 +2294,26 @@ void patch_builder_dispatch(PatchBuilder* builder, SimState* state, int wire,
       .xor_value = new_pulse ^ (*pulse),
   };
   // printf("pulse: w=%d t=%d v=%d\n", wire, nxt_tick, new_value);
-  arrput(builder->arr_pulse_diff, pulseDiff);
+  arrput(lane->arr_pulse_diff, pulseDiff);
   /* Checks for update on max pulse time. */
-  int cur_max_time = state->max_pulse_time + builder->max_pulse_time_diff;
+  int cur_max_time = state->max_pulse_time + lane->max_pulse_time_diff;
   int t_D = builder->dg->wprop[wire].max_delay;
   double pulse_energy = builder->dg->wprop[wire].pulse_energy;
   int my_time = state->cur_tick + t_D;
   if (my_time > cur_max_time) {
-    builder->max_pulse_time_diff = my_time - state->max_pulse_time;
+    lane->max_pulse_time_diff = my_time - state->max_pulse_time;
   }
-  fanout_schedule(builder->wg->wire_to_skt_off, builder->wg->wire_to_skt, wire,
-                  new_value, &builder->arr_schedule_item);
-  add_energy(builder, pulse_energy, t_D);
+  fanout_schedule(builder->wg, wire, new_value, &lane->arr_fanout);
+  lane_add_energy(builder, lane, pulse_energy, t_D);
+}
+
+void patch_builder_dispatch(PatchBuilder* builder, SimState* state, int wire,
+                            int new_value) {
+  ExtInput in = {.wire = wire, .value = new_value};
+  arrput(builder->arr_ext_input, in);
+  NandLane lane = lane_borrow(builder);
+  lane_dispatch(builder, &lane, state, wire, new_value);
+  lane_give_back(builder, &lane);
 }
 
 // Smallest power of 2 >= x
@@ -1618,39 +2381,32 @@ void sim_add_ui_event(Sim* s, float act) {
  *  builder is updated by hand (ie there's a copy of everything).
  *
  */
-void patch_builder_update_nandstate(Sim* sim, PatchBuilder* builder,
-                                    SimState* state) {
-  int nAct = state->active_count;
+static void update_nand_range(Sim* sim, PatchBuilder* builder, NandLane* lane,
+                              SimState* state, int i0, int i1) {
   int total_sockets = arrlen(builder->pg->skt);
   int num_nands = arrlen(builder->pg->nands);
-  const NandState* prev_nands = state->nand_states;
-  for (int iAct = 0; iAct < nAct; iAct++) {
-    int i_nand = prev_nands[iAct].id_nand;
-    int next_value = prev_nands[iAct].next_value;
-    int de = prev_nands[iAct].de;
-    int max_delay = prev_nands[iAct].max_delay;
-    int prev_counter = prev_nands[iAct].activation_counter;
+  const NandStateArrays* prev_nands = &state->nand_states;
+  for (int iAct = i0; iAct < i1; iAct++) {
+    int i_nand = prev_nands->id_nand[iAct];
+    int next_value = prev_nands->next_value[iAct];
+    int prev_counter = prev_nands->activation_counter[iAct];
 
     // Bounds check for NAND index
     assert(i_nand >= 0 && i_nand < num_nands);
 
     if (next_value >= 0) {
-      int nxtCounter = prev_counter - 10;
+      int nxtCounter = prev_counter - 1;
       if (nxtCounter <= 0) {
         int wire = builder->wg->drv_to_wire[i_nand];
         assert(wire >= 0);
-        patch_builder_dispatch(
-            builder, state, wire,
-            next_value);  // dispatch can be done asynchronously
+        lane_dispatch(builder, lane, state, wire, next_value);
       } else {
         NandState nxt = (NandState){
             .id_nand = i_nand,
             .next_value = next_value,
-            .max_delay = max_delay,
-            .de = de,
             .activation_counter = nxtCounter,
         };
-        arrput(builder->arr_nand_state, nxt);
+        arrput(lane->arr_nand_state, nxt);
       }
     } else {
       // Here we evaluate next value and wether it actually needs update!
@@ -1661,25 +2417,117 @@ void patch_builder_update_nandstate(Sim* sim, PatchBuilder* builder,
       int value = builder->nand_lut[(sktA << 2) + sktB];
       int wire = builder->wg->drv_to_wire[i_nand];
       assert(wire >= 0);
-      WirePulse* pulse = &state->pulses[wire];
       bool changes = pulse_unpack_vafter(state->pulses[wire]) != value;
       if (changes) {
         int gate_delay = builder->dg->gate_delay[wire];
-        sim_add_ui_event(sim, gate_delay);
+        if (lane->deferred) {
+          arrput(lane->arr_ui_event, gate_delay);
+        } else {
+          sim_add_ui_event(sim, gate_delay);
+        }
         NandState nxt = (NandState){
             .id_nand = i_nand,
             .next_value = value,
-            .max_delay = 10 * gate_delay,
-            .de = 1,
-            .activation_counter = 10 * gate_delay,
+            .activation_counter = gate_delay,
         };
-        arrput(builder->arr_nand_state, nxt);
-        add_energy(builder, builder->k_gate_energy, gate_delay);
+        arrput(lane->arr_nand_state, nxt);
+        lane_add_energy(builder, lane, builder->k_gate_energy, gate_delay);
       }
     }
   }
 }
 
+/* Below this many active NANDs, waking threads costs more than it saves. */
+#define PAR_MIN_ACTIVE 4096
+/* Tasks per thread, so uneven chunks still balance. */
+#define PAR_TASKS_PER_THREAD 4
+
+typedef struct {
+  Sim* sim;
+  PatchBuilder* builder;
+  SimState* state;
+  int ntasks;
+} NandTaskCtx;
+
+static void update_nand_task(void* arg, int itask) {
+  NandTaskCtx* ctx = arg;
+  int n = ctx->state->active_count;
+  int i0 = (int)((i64)n * itask / ctx->ntasks);
+  int i1 = (int)((i64)n * (itask + 1) / ctx->ntasks);
+  NandLane* lane = &ctx->builder->lanes[itask];
+  update_nand_range(ctx->sim, ctx->builder, lane, ctx->state, i0, i1);
+}
+
+/*
+ * Appends each lane output to the builder in task order. Energy is replayed
+ * item by item (instead of adding per-lane sums) so floating point results
+ * don't depend on the number of tasks.
+ */
+static void merge_lanes(Sim* sim, PatchBuilder* builder, int ntasks) {
+  for (int k = 0; k < ntasks; k++) {
+    NandLane* lane = &builder->lanes[k];
+    int n;
+    n = arrlen(lane->arr_nand_state);
+    memcpy(arraddnptr(builder->arr_nand_state, n), lane->arr_nand_state,
+           n * sizeof(NandState));
+    n = arrlen(lane->arr_pulse_diff);
+    memcpy(arraddnptr(builder->arr_pulse_diff, n), lane->arr_pulse_diff,
+           n * sizeof(PulseDiff));
+    n = arrlen(lane->arr_fanout);
+    memcpy(arraddnptr(builder->arr_fanout, n), lane->arr_fanout,
+           n * sizeof(FanoutEvent));
+    n = arrlen(lane->arr_energy);
+    for (int i = 0; i < n; i++) {
+      add_energy(builder, lane->arr_energy[i].e, lane->arr_energy[i].T);
+    }
+    n = arrlen(lane->arr_ui_event);
+    for (int i = 0; i < n; i++) {
+      sim_add_ui_event(sim, lane->arr_ui_event[i]);
+    }
+    builder->max_pulse_time_diff =
+        maxi(builder->max_pulse_time_diff, lane->max_pulse_time_diff);
+    arrsetlen(lane->arr_nand_state, 0);
+    arrsetlen(lane->arr_pulse_diff, 0);
+    arrsetlen(lane->arr_fanout, 0);
+    arrsetlen(lane->arr_energy, 0);
+    arrsetlen(lane->arr_ui_event, 0);
+  }
+}
+
+static void patch_builder_update_nandstate_par(Sim* sim, PatchBuilder* builder,
+                                               SimState* state) {
+  int ntasks = PAR_TASKS_PER_THREAD * workers_count(builder->workers);
+  int nlanes = arrlen(builder->lanes);
+  if (nlanes < ntasks) {
+    arrsetlen(builder->lanes, ntasks);
+    memset(&builder->lanes[nlanes], 0, (ntasks - nlanes) * sizeof(NandLane));
+  }
+  for (int k = 0; k < ntasks; k++) {
+    builder->lanes[k].max_pulse_time_diff = builder->max_pulse_time_diff;
+    builder->lanes[k].deferred = true;
+  }
+  NandTaskCtx ctx = {
+      .sim = sim,
+      .builder = builder,
+      .state = state,
+      .ntasks = ntasks,
+  };
+  workers_run(builder->workers, ntasks, update_nand_task, &ctx);
+  merge_lanes(sim, builder, ntasks);
+}
+
+void patch_builder_update_nandstate(Sim* sim, PatchBuilder* builder,
+                                    SimState* state) {
+  int nAct = state->active_count;
+  if (builder->workers && nAct >= PAR_MIN_ACTIVE) {
+    patch_builder_update_nandstate_par(sim, builder, state);
+    return;
+  }
+  NandLane lane = lane_borrow(builder);
+  update_nand_range(sim, builder, &lane, state, 0, nAct);
+  lane_give_back(builder, &lane);
+}
+
 /*
  * Advances the event queue in time.
  *
@@ -1729,9 +2577,7 @@ void patch_builder_handle_socket_events(PatchBuilder* builder,
         NandState newState = {
             .id_nand = id_nand,
             .next_value = -2,
-            .activation_counter = -1,
-            .max_delay = 0,
-            .de = 0.0f,
+            .activation_counter = 0,
         };
         arrput(builder->arr_nand_state, newState);
       } else {
@@ -1741,16 +2587,16 @@ void patch_builder_handle_socket_events(PatchBuilder* builder,
   }
 }
 
-int sim_get_pixel_error_status(Sim* sim, int pix) {
+int sim_get_pixel_error_status(Sim* sim, SimSnapshot* snap, int pix) {
   int w = sim->w;
   int h = sim->h;
   int s = w * h;
   int l = pix / s;
   int idx = pix - l * s;
   assert(l < sim->nl);
-  int* wire_img = sim->wg.wmap[l];
-  int c = wire_img[idx];
-  int v = pulse_unpack_vafter(sim->state.pulses[c]);
+  int c = tile_map_get(&sim->wg.wmap[l], idx % w, idx / w);
+  if (c < 0) return 0;
+  int v = pulse_unpack_vafter(snap->pulses[c]);
   if (v == 2) return STATUS_CONFLICT;
   if (v == 3) return STATUS_TOOSLOW;
   return 0;
@@ -1763,27 +2609,157 @@ void sim_reset_dirty_mask(Sim* sim) {
   }
 }
 
-Tex* sim_render_v2(Sim* sim, int tw, int th, Cam2D cam, float frame_steps,
-                   float slack_steps, int hide_mask, bool use_neon) {
+void sim_snapshot_init(SimSnapshot* s, Sim* sim) {
+  int ndrv = sim_get_num_drivers(sim);
+  *s = (SimSnapshot){0};
+  s->pulses = calloc(sim->state.pulse_size, sizeof(WirePulse));
+  s->nand_states.id_nand = calloc(ndrv, sizeof(int));
+  s->nand_states.activation_counter = calloc(ndrv, sizeof(u16));
+  s->nand_states.next_value = calloc(ndrv, sizeof(i8));
+  s->dirty_mask_size = sim->dirty_mask_size;
+  s->dirty_mask = calloc(s->dirty_mask_size, sizeof(uint32_t));
+}
+
+void sim_snapshot_destroy(SimSnapshot* s) {
+  free(s->pulses);
+  free(s->nand_states.id_nand);
+  free(s->nand_states.activation_counter);
+  free(s->nand_states.next_value);
+  free(s->dirty_mask);
+  arrfree(s->ui_events);
+  *s = (SimSnapshot){0};
+}
+
+void sim_snapshot_take(SimSnapshot* s, Sim* sim) {
+  SimState* state = &sim->state;
+  int n = state->active_count;
+  s->tick = state->cur_tick;
+  s->active_count = n;
+  memcpy(s->pulses, state->pulses, state->pulse_size * sizeof(WirePulse));
+  memcpy(s->nand_states.id_nand, state->nand_states.id_nand, n * sizeof(int));
+  memcpy(s->nand_states.activation_counter,
+         state->nand_states.activation_counter, n * sizeof(u16));
+  memcpy(s->nand_states.next_value, state->nand_states.next_value,
+         n * sizeof(i8));
+  for (int i = 0; i < s->dirty_mask_size; i++) {
+    s->dirty_mask[i] |= sim->pulse_dirty_mask[i];
+  }
+  sim_reset_dirty_mask(sim);
+  s->total_energy = state->total_energy;
+  s->cycle = sim_get_effective_cycle(sim);
+  s->period_tick = state->cur_period_tick;
+  s->max_tick = state->max_tick;
+  s->max_tick_cycle = state->max_tick_cycle;
+  s->base_tps = sim->base_tps;
+  s->warmup = sim_is_on_warmup(sim);
+  s->complete = sim->complete;
+}
+
+void sim_snapshot_add_events(SimSnapshot* s, Sim* sim) {
+  for (int i = 0; i < arrlen(sim->ui_events); i++) {
+    arrput(s->ui_events, sim->ui_events[i]);
+  }
+}
+
+void sim_snapshot_merge(SimSnapshot* s, SimSnapshot* older) {
+  for (int i = 0; i < s->dirty_mask_size; i++) {
+    s->dirty_mask[i] |= older->dirty_mask[i];
+  }
+  for (int i = 0; i < arrlen(older->ui_events); i++) {
+    arrput(s->ui_events, older->ui_events[i]);
+  }
+  s->pause_requested |= older->pause_requested;
+}
+
+void sim_snapshot_reset(SimSnapshot* s) {
+  memset(s->dirty_mask, 0, s->dirty_mask_size * sizeof(uint32_t));
+  arrsetlen(s->ui_events, 0);
+  s->pause_requested = false;
+}
+
+/* Clean blocks of wires below this are sent with the dirty ones around */
+#define PULSE_UPLOAD_GAP 8
+
+static void upload_pulse_rect(Texture tex, WirePulse* pulses, int x, int y,
+                              int w, int h) {
+  Rectangle rec = {x, y, w, h};
+  UpdateTextureRec(tex, rec, pulses + y * tex.width + x);
+}
+
+/*
+ * Sends the dirty wires of a snapshot to the pulse texture. Dirty blocks
+ * (32 wires) of a texture row are joined into runs, and runs covering whole
+ * rows into one rectangle, to keep the number of uploads low.
+ */
+static void upload_dirty_pulses(Sim* sim, SimSnapshot* snap) {
+  Texture tex = sim->pulse_tex;
+  if (sim->pulse_tex_stale) {
+    UpdateTexture(tex, snap->pulses);
+    sim->pulse_tex_stale = false;
+    return;
+  }
+  uint32_t* mask = snap->dirty_mask;
+  int nb = snap->dirty_mask_size;
+  int bpr = tex.width / 32; /* Blocks per row */
+  int full_y = 0;           /* Full rows not sent yet: [full_y, y) */
+  int full_h = 0;
+  for (int y = 0; y * bpr < nb; y++) {
+    int row = y * bpr;
+    int end = row + bpr < nb ? row + bpr : nb;
+    int b0 = -1;
+    int b1 = -1;
+    bool full = false;
+    for (int b = row; b <= end; b++) {
+      if (b < end && !mask[b]) continue;
+      if (b0 >= 0 && (b == end || b - b1 > PULSE_UPLOAD_GAP)) {
+        if (b0 == row && b1 == row + bpr) {
+          full = true;
+        } else {
+          upload_pulse_rect(tex, snap->pulses, (b0 - row) * 32, y,
+                            (b1 - b0) * 32, 1);
+        }
+        b0 = -1;
+      }
+      if (b == end) break;
+      if (b0 < 0) b0 = b;
+      b1 = b + 1;
+    }
+    if (full) {
+      if (full_h == 0) full_y = y;
+      full_h++;
+    } else if (full_h > 0) {
+      upload_pulse_rect(tex, snap->pulses, 0, full_y, tex.width, full_h);
+      full_h = 0;
+    }
+  }
+  if (full_h > 0) {
+    upload_pulse_rect(tex, snap->pulses, 0, full_y, tex.width, full_h);
+  }
+}
+
+Tex* sim_render_v2(Sim* sim, SimSnapshot* snap, int tw, int th, Cam2D cam,
+                   float frame_steps, float slack_steps, int hide_mask,
+                   bool use_neon) {
   renderv2_update_hidden_mask(sim->rv2, hide_mask);
-  UpdateTexture(sim->pulse_tex, sim->state.pulses);
-  renderv2_update_pulse(sim->rv2, sim->pulse_tex, sim->pulse_dirty_mask);
+  renderv2_update_lod(sim->rv2, cam);
+  upload_dirty_pulses(sim, snap);
+  /* Also clears the dirty mask */
+  renderv2_update_pulse(sim->rv2, sim->pulse_tex, snap->dirty_mask);
+  PulseStats ps = renderv2_get_pulse_stats(sim->rv2);
+  profiler_count("pmap_segments", ps.segments);
+  profiler_count("pmap_calls", ps.calls);
   double rtime = GetTime();
   float utime = sin(2 * rtime * M_PI);
   float gtime = frame_steps * 5;
   Times times = {
-      .tick = sim->state.cur_tick,
+      .tick = snap->tick,
       .slack = slack_steps,
       .utime = utime,
       .glow_dt = gtime,
   };
-  int ns = sim->state.active_count;
+  int ns = snap->active_count;
   Tex* out = renderv2_render(sim->rv2, cam, tw, th, ns, frame_steps, sim->nidx,
-                             sim->state.nand_states, use_neon, times);
-
-  /* TODO: the reset should be done inside the rendering directly to avoid extra
-   * cache*/
-  sim_reset_dirty_mask(sim);
+                             &snap->nand_states, use_neon, times);
   return out;
 }
 
@@ -1820,6 +2796,8 @@ void sim_dry_run() {
   assert(stat.ok);
   assert(!sim_has_errors(&s));
   HSim hsim = wrap_sim(&s);
+  SimSnapshot snap;
+  sim_snapshot_init(&snap, &s);
   for (int i = 0; i < 3; i++) {
     stat = hsim_nxt(&hsim);
     assert(stat.ok);
@@ -1829,9 +2807,11 @@ void sim_dry_run() {
     int hide_mask = 0;
     bool use_neon = true;
     float frame_steps = 20;
-    Tex* rendered =
-        sim_render_v2(&s, 50, 50, cam, frame_steps, slack, hide_mask, use_neon);
+    sim_snapshot_take(&snap, &s);
+    Tex* rendered = sim_render_v2(&s, &snap, 50, 50, cam, frame_steps, slack,
+                                  hide_mask, use_neon);
   }
+  sim_snapshot_destroy(&snap);
   hsim_destroy(&hsim);
   sim_destroy(&s);
   UnloadRenderTexture(rt);
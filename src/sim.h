@@ -7,12 +7,14 @@
 #include "hsim.h"
 #include "level_api.h"
 #include "paged_stack.h"
+#include "patch_codec.h"
 #include "pixel_graph.h"
 #include "renderv2.h"
 #include "series.h"
 #include "status.h"
 #include "tex.h"
 #include "wire_graph.h"
+#include "workers.h"
 
 #define NRJ_BINS 32
 
@@ -30,11 +32,6 @@ enum {
   S_BIT_BUGGED,
 };
 
-typedef struct {
-  int dt_ticks;
-  SocketEvent ev;
-} ScheduleItem;
-
 typedef struct {
   int before_value;
   int after_value;
@@ -51,7 +48,7 @@ typedef struct {
   int* skt_values;          /* Current value of sockets (size=numSkts); */
   EventQueue ev_queue;      /* Event Queue for Socket updates */
   WirePulse* pulses;        /* Visu state of wires (size=numWires) */
-  NandState* nand_states;   /* State of NAND gates. (max_size=numNands) */
+  NandStateArrays nand_states;     /* State of NAND gates. (max_size=numNands) */
   Series power_tick_series; /* List of spent energy per tick (power) */
   Series energy_per_period_series; /* List of spent energy per cycle */
   Series ticks_per_period_series;  /* List of ticks per cycle */
@@ -102,13 +99,47 @@ typedef struct {
   int xor_value;
 } SocketValueDiff;
 
+/* Wire change whose fanout is scheduled (see WireGraph fanout groups) */
+typedef struct {
+  int wire;
+  int value;
+} FanoutEvent;
+
+/* Wire dispatch coming from outside the circuit (level ports, user pokes) */
+typedef struct {
+  int wire;
+  int value;
+} ExtInput;
+
+typedef struct {
+  double e;
+  int T;
+} EnergyItem;
+
+/*
+ * Scratch output of the NAND update for a contiguous range of the active
+ * list. Lanes are concatenated in order into the builder, so the patch is
+ * the same as the one built serially.
+ */
+typedef struct {
+  NandState* arr_nand_state;
+  PulseDiff* arr_pulse_diff;
+  FanoutEvent* arr_fanout;
+  EnergyItem* arr_energy; /* Energy added, replayed in order when merging */
+  float* arr_ui_event;    /* Gate delays of ui events, replayed on merge */
+  int max_pulse_time_diff;
+  bool deferred; /* Energy and ui events go to the arrays above */
+} NandLane;
+
 typedef struct {
   NandState* arr_nand_state;
   SocketValueDiff* arr_skt_diff;
   PulseDiff* arr_pulse_diff;
   SocketEvent* arr_queue_popped;
-  ScheduleItem* arr_schedule_item;
+  FanoutEvent* arr_fanout;
   int* arr_wire_to_shift;
+  ExtInput* arr_ext_input; /* External dispatches, recorded for replay */
+  double* arr_warp_series; /* Series slots overwritten by a warp */
   Buffer level_patch;
   double power_patch;
   double total_energy_patch;
@@ -126,13 +157,20 @@ typedef struct {
   int arr_skt_diff_len;
   int arr_pulse_diff_len;
   int arr_queue_popped_len;
-  int arr_schedule_item_len;
+  int arr_fanout_len;
   int flags;
 
   // FanoutGraph* fg; /* Does not own */
   WireGraph* wg;  /* Does not own */
   DistGraph* dg;  /* Does not own */
   PixelGraph* pg; /* Does not own */
+  WorkerPool* workers; /* Does not own (NULL for serial update) */
+  NandLane* lanes;     /* Per-task scratch of the parallel NAND update */
+  u32* nand_seen;      /* Dedup generation that last saw each NAND */
+  int* nand_pos;       /* Entry of each NAND in arr_nand_state (if seen) */
+  u32 nand_gen;        /* Current dedup generation */
+  NandState* arr_nand_sort; /* Scratch of the active list sort */
+  int* arr_nand_patch;      /* Scratch of pack_nand_state */
 
   int max_pulse_time_diff;
   int nand_lut[16];     /* Fixed array used in nand evaluation */
@@ -177,7 +215,8 @@ typedef struct Sim {
 
   /* Rendering */
   NandDesc* nidx;    /* index of each nand (used in visu) */
-  Texture pulse_tex; /* Pulse GPU data (used in visu)*/
+  Texture pulse_tex;    /* Pulse GPU data (used in visu)*/
+  bool pulse_tex_stale; /* Next upload sends all the wires */
 
   int period_len; /* How often to capture max tick */
   Cam2D prv_cam;
@@ -188,8 +227,15 @@ typedef struct Sim {
   int dirty_mask_size;
   bool pause_requested; /* pausing from within simulation */
   int64_t update_interval;
+  int max_warp; /* Max idle ticks merged in one history step (<= 1: none) */
   int base_tps;
   bool complete; /* Activats on complete */
+  bool headless; /* No renderer/GPU resources (rv2 is NULL) */
+  double t_render; /* Renderer setup time of the last init (seconds) */
+  WorkerPool* workers; /* Threads for the NAND update (NULL if serial) */
+  Buffer tick_inputs;  /* External inputs of the last tick (for replay) */
+  Buffer snapshot;     /* Last state snapshot (for checkpoints) */
+  PatchCodec codec;    /* Encoding of history patches */
 } Sim;
 
 typedef struct {
@@ -198,12 +244,53 @@ typedef struct {
   Image* img;
   LevelAPI* api;
   RenderTexture2D* layers;
+  bool headless; /* Skips renderer setup, doesn't need a GL context */
+  int num_threads; /* Threads used in NAND update (<= 1 is serial) */
+  DistCache* dist_cache; /* Distance graph of the last parse (or NULL) */
+  const char* parse_cache_dir; /* On-disk parse cache (NULL: not used) */
 } SimParams;
 
+/*
+ * What sim_render_v2 draws, copied out of the Sim so that ticks can go on
+ * while a frame is drawn (see sim_thread.h). Dirty wires, UI events and
+ * pause requests add up over the ticks until the snapshot is drawn.
+ */
+typedef struct {
+  int tick;
+  int active_count;
+  WirePulse* pulses;           /* size=pulse_size */
+  NandStateArrays nand_states; /* First active_count are used */
+  uint32_t* dirty_mask;        /* Wires changed since the last frame */
+  int dirty_mask_size;
+  SimUiEvent* ui_events; /* stb array */
+  bool pause_requested;  /* The level called Pause() */
+  /* Shown by the HUD */
+  double total_energy;
+  int cycle; /* Effective cycle (see sim_get_effective_cycle) */
+  int period_tick;
+  int max_tick;
+  int max_tick_cycle;
+  int base_tps;
+  bool warmup;
+  bool complete;
+} SimSnapshot;
+
 Status sim_init(Sim* sim, SimParams params);
 void sim_destroy(Sim* sim);
-Tex* sim_render_v2(Sim* sim, int tw, int th, Cam2D cam, float frame_steps,
-                   float slackSteps, int hide_mask, bool use_neon);
+void sim_snapshot_init(SimSnapshot* s, Sim* sim);
+void sim_snapshot_destroy(SimSnapshot* s);
+/* Copies the state, and moves the dirty wires of the Sim to the snapshot. */
+void sim_snapshot_take(SimSnapshot* s, Sim* sim);
+/* Adds the UI events of the last tick. */
+void sim_snapshot_add_events(SimSnapshot* s, Sim* sim);
+/* Adds what added up in an older snapshot that won't be drawn. */
+void sim_snapshot_merge(SimSnapshot* s, SimSnapshot* older);
+/* Drops what added up, once it has been drawn. */
+void sim_snapshot_reset(SimSnapshot* s);
+/* Draws a snapshot of `sim` (clears its dirty wires). */
+Tex* sim_render_v2(Sim* sim, SimSnapshot* snap, int tw, int th, Cam2D cam,
+                   float frame_steps, float slackSteps, int hide_mask,
+                   bool use_neon);
 Tex* sim_render_energy(Sim* sim, int tw, int th);
 
 bool sim_is_on_warmup(Sim* sim);
@@ -212,7 +299,7 @@ void sim_find_nearest_pixel(Sim* sim, int tol, v2 fPix, int* pix);
 bool sim_has_errors(Sim* sim);
 void sim_set_complete(Sim* sim);
 void sim_toggle_pixel(Sim* sim, int pix); /* Used for manual interaction */
-int sim_get_pixel_error_status(Sim* sim, int pix);
+int sim_get_pixel_error_status(Sim* sim, SimSnapshot* snap, int pix);
 HSim wrap_sim(Sim* sim);
 void sim_port_write(Sim* sim, int iport, PinComm pc);
 PinComm sim_port_read(Sim* sim, int iport);
@@ -0,0 +1,185 @@
+#include "sim_thread.h"
+
+#include "stb_ds.h"
+#include "stdlib.h"
+#include "workers.h"
+
+struct SimThread {
+  WorkerThread* wt;
+  Sim* sim;
+  HSim* hsim;
+  SimCommand* cmds; /* stb array */
+  SimFrame frames[3];
+  int back;       /* Filled by the thread */
+  int mid;        /* Last complete frame */
+  int front;      /* Drawn by the UI */
+  bool mid_fresh; /* `mid` wasn't returned yet */
+  int waiting;    /* The UI waits for the lock */
+  bool quit;
+
+  /* Thread side */
+  double target;
+  int target_seq;
+  bool turbo;
+  bool changed; /* Ticked since the last frame */
+  Status status;
+};
+
+static void set_target(SimThread* t, double target) {
+  t->target = target;
+  t->target_seq++;
+  t->changed = true;
+}
+
+/* Moves the back frame to the middle. A middle frame that was never drawn
+ * is replaced, so what added up in it goes to the new one. */
+static void publish(SimThread* t) {
+  SimFrame* f = &t->frames[t->back];
+  sim_snapshot_take(&f->snap, t->sim);
+  if (t->mid_fresh) sim_snapshot_merge(&f->snap, &t->frames[t->mid].snap);
+  f->target = t->target;
+  f->target_seq = t->target_seq;
+  f->status = t->status;
+  int b = t->back;
+  t->back = t->mid;
+  t->mid = b;
+  t->mid_fresh = true;
+  sim_snapshot_reset(&t->frames[t->back].snap);
+  t->changed = false;
+}
+
+static void run_commands(SimThread* t) {
+  Sim* sim = t->sim;
+  for (int i = 0; i < arrlen(t->cmds); i++) {
+    SimCommand c = t->cmds[i];
+    int cur = sim->state.cur_tick;
+    switch (c.type) {
+      case SIM_CMD_TARGET:
+        if (c.target_seq == t->target_seq) t->target = c.target;
+        t->turbo = c.turbo;
+        break;
+      case SIM_CMD_POKE:
+        /* interaction doesn't work when going backward */
+        if (t->target >= cur) {
+          sim_toggle_pixel(sim, c.pix);
+          hsim_clear_forward_history(t->hsim);
+          set_target(t, cur + 1);
+        }
+        break;
+      case SIM_CMD_PAUSE:
+        if (t->target >= cur + 1) set_target(t, cur);
+        break;
+    }
+  }
+  arrsetlen(t->cmds, 0);
+}
+
+/* Runs one tick towards the target. False when there's nothing to run. */
+static bool step(SimThread* t) {
+  Sim* sim = t->sim;
+  double slack = t->target - sim->state.cur_tick;
+  if (slack < 0) {
+    /* Can't go backward */
+    if (!hsim_has_prv(t->hsim)) {
+      set_target(t, sim->state.cur_tick);
+      return false;
+    }
+    t->status = hsim_prv(t->hsim);
+    t->changed = true;
+    /* Went back over a warp (several idle ticks in one step) */
+    if (t->target - sim->state.cur_tick >= 1) {
+      set_target(t, sim->state.cur_tick);
+    }
+    return t->status.ok;
+  }
+  if (slack < 1) return false;
+  /* Idle ticks can be merged, as long as it doesn't go past the target */
+  sim->max_warp = (int)slack;
+  t->status = t->turbo ? hsim_nxt_turbo(t->hsim) : hsim_nxt(t->hsim);
+  t->changed = true;
+  if (!t->status.ok) return false;
+  sim_snapshot_add_events(&t->frames[t->back].snap, sim);
+  /* Simulation has called Pause() */
+  if (sim->pause_requested) {
+    sim->pause_requested = false;
+    t->frames[t->back].snap.pause_requested = true;
+    set_target(t, sim->state.cur_tick);
+  }
+  /* A stored warp was redone past the target */
+  if (t->target < sim->state.cur_tick) {
+    set_target(t, sim->state.cur_tick);
+  }
+  return true;
+}
+
+static void sim_thread_main(void* ctx, int itask) {
+  (void)itask;
+  SimThread* t = ctx;
+  workers_thread_lock(t->wt);
+  while (!t->quit) {
+    if (workers_fetch_add(&t->waiting, 0) > 0) {
+      workers_thread_wait(t->wt);
+      continue;
+    }
+    run_commands(t);
+    bool ticked = t->status.ok && step(t);
+    /* While ticking, frames are only made when the last one was taken */
+    if (t->changed && (!ticked || !t->mid_fresh)) publish(t);
+    if (!ticked) workers_thread_wait(t->wt);
+  }
+  workers_thread_unlock(t->wt);
+}
+
+SimThread* sim_thread_start(Sim* sim, HSim* hsim) {
+  SimThread* t = calloc(1, sizeof(SimThread));
+  t->sim = sim;
+  t->hsim = hsim;
+  for (int i = 0; i < 3; i++) {
+    sim_snapshot_init(&t->frames[i].snap, sim);
+  }
+  t->back = 0;
+  t->mid = 1;
+  t->front = 2;
+  t->target = sim->state.cur_tick;
+  t->status = status_ok();
+  publish(t);
+  t->wt = workers_thread_create();
+  workers_thread_start(t->wt, sim_thread_main, t);
+  return t;
+}
+
+void sim_thread_stop(SimThread* t) {
+  t->quit = true;
+  workers_thread_broadcast(t->wt);
+  workers_thread_unlock(t->wt);
+  workers_thread_destroy(t->wt);
+  for (int i = 0; i < 3; i++) {
+    sim_snapshot_destroy(&t->frames[i].snap);
+  }
+  arrfree(t->cmds);
+  free(t);
+}
+
+void sim_thread_lock(SimThread* t) {
+  workers_fetch_add(&t->waiting, 1);
+  workers_thread_lock(t->wt);
+  workers_fetch_add(&t->waiting, -1);
+}
+
+void sim_thread_unlock(SimThread* t) {
+  workers_thread_broadcast(t->wt);
+  workers_thread_unlock(t->wt);
+}
+
+void sim_thread_push(SimThread* t, SimCommand cmd) { arrput(t->cmds, cmd); }
+
+SimFrame* sim_thread_frame(SimThread* t, bool* fresh) {
+  *fresh = t->mid_fresh;
+  if (t->mid_fresh) {
+    int f = t->front;
+    t->front = t->mid;
+    t->mid = f;
+    t->mid_fresh = false;
+  }
+  return &t->frames[t->front];
+}
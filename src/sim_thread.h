@@ -0,0 +1,61 @@
+#ifndef CA_SIM_THREAD_H
+#define CA_SIM_THREAD_H
+#include "hsim.h"
+#include "sim.h"
+
+/*
+ * Simulation running on its own thread, towards a target tick.
+ *
+ * While started, the thread owns the Sim and its HSim, and moves them one
+ * tick at a time to the target (backward too, through the history). The UI
+ * thread sends it commands through a queue, and gets back what to draw
+ * through a triple buffer of frames: the thread fills one, the last complete
+ * one waits in the middle, and the UI draws the third one, so neither side
+ * waits for the other to draw or to tick.
+ *
+ * Anything else that reads or calls into the Sim (level scripts, the queue)
+ * needs the lock; what the HUD shows comes with the frame. The thread only
+ * holds it while running a tick, and gives it away between ticks as soon as
+ * it's asked for.
+ */
+typedef enum {
+  SIM_CMD_TARGET, /* Runs to `target` (going back when it's behind) */
+  SIM_CMD_POKE,   /* Toggles the wire at `pix` */
+  SIM_CMD_PAUSE,  /* Stops before the next tick */
+} SimCommandType;
+
+typedef struct {
+  SimCommandType type;
+  double target;
+  bool turbo;     /* Ticks to the target aren't recorded */
+  int target_seq; /* Last target change of the thread seen by the UI */
+  int pix;
+} SimCommand;
+
+typedef struct {
+  SimSnapshot snap;
+  /* The thread moves the target when it can't be reached (start of the
+   * history, Pause() from the level, pokes). Targets sent before the UI saw
+   * the last change are ignored. */
+  double target;
+  int target_seq;
+  Status status; /* First error, nothing runs after it */
+} SimFrame;
+
+typedef struct SimThread SimThread;
+
+/* From now on, `sim` and `hsim` can only be used with the lock held. */
+SimThread* sim_thread_start(Sim* sim, HSim* hsim);
+/* Stops the thread (lock held). The Sim belongs to the caller again. */
+void sim_thread_stop(SimThread* t);
+void sim_thread_lock(SimThread* t);
+void sim_thread_unlock(SimThread* t);
+/* Commands run in order, before the next tick (lock held). */
+void sim_thread_push(SimThread* t, SimCommand cmd);
+/*
+ * Latest complete frame (lock held). `fresh` is false when it was already
+ * returned. The frame can be drawn without the lock, until the next call.
+ */
+SimFrame* sim_thread_frame(SimThread* t, bool* fresh);
+
+#endif
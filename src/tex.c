@@ -4,50 +4,122 @@
 #include "colors.h"
 #include "rlgl.h"
 #include "shaders.h"
+#include "stb_ds.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "ui.h"
 #include "utils.h"
 
+/*
+ * GPU memory kept in free textures, beyond it the oldest ones are freed. The
+ * budget is the memory of the textures in use (one frame's worth of targets
+ * can be pooled), and at least this much.
+ */
+#define TEX_POOL_MIN_BUDGET (128 << 20)
+/* Frames a free texture is kept without being used again */
+#define TEX_MAX_IDLE_FRAMES 120
+
+typedef struct {
+  u64 key;    /* w << 32 | h */
+  Tex* value; /* Free textures of the size, last freed first */
+} TexBucket;
+
 static struct {
-  int cnt;
-  Tex* items;
+  TexBucket* pool; /* stb hash map */
+  Tex* oldest;     /* Free textures, by time they were freed */
+  Tex* newest;
+  int frame;
+  TexStats stats;
 } C = {0};
 
 static bool texsamesize(Tex* a, Tex* b) {
   return (a->w == b->w) && (a->h == b->h);
 }
 
-static bool texhassize(Tex* a, int w, int h) {
-  return (a->w == w) && (a->h == h);
+static u64 texkey(int w, int h) { return ((u64)w << 32) | (u32)h; }
+
+/* Color and depth buffers */
+static size_t texbytes(Tex* t) { return (size_t)t->w * t->h * 8; }
+
+static void pool_put(Tex* t) {
+  u64 key = texkey(t->w, t->h);
+  Tex* head = hmget(C.pool, key);
+  t->prev = NULL;
+  t->next = head;
+  if (head) head->prev = t;
+  hmput(C.pool, key, t);
+  t->older = C.newest;
+  t->newer = NULL;
+  if (C.newest) {
+    C.newest->newer = t;
+  } else {
+    C.oldest = t;
+  }
+  C.newest = t;
+  t->last_use = C.frame;
+  C.stats.pool_bytes += texbytes(t);
+}
+
+static void pool_remove(Tex* t) {
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else if (t->next) {
+    hmput(C.pool, texkey(t->w, t->h), t->next);
+  } else {
+    hmdel(C.pool, texkey(t->w, t->h));
+  }
+  if (t->next) t->next->prev = t->prev;
+  if (t->older) {
+    t->older->newer = t->newer;
+  } else {
+    C.oldest = t->newer;
+  }
+  if (t->newer) {
+    t->newer->older = t->older;
+  } else {
+    C.newest = t->older;
+  }
+  C.stats.pool_bytes -= texbytes(t);
+}
+
+static void texfree(Tex* t) {
+  if (!t->borrowed) {
+    UnloadRenderTexture(t->rt);
+    C.stats.count--;
+    C.stats.bytes -= texbytes(t);
+  }
+  free(t);
 }
 
 Tex* texnew(int w, int h) {
-  Tex* item = C.items;
-  while (item) {
-    if ((item->refc == 0) && (!item->borrowed) && texhassize(item, w, h)) {
-      item->refc++;
-      item->uses++;
-      return item;
-    }
-    item = item->next;
+  Tex* item = hmget(C.pool, texkey(w, h));
+  if (item) {
+    pool_remove(item);
+    item->refc = 1;
+    C.stats.hits++;
+    return item;
   }
-  assert(!item);
-  C.cnt++;
-  if (C.cnt == 50) abort();
+  C.stats.misses++;
   item = calloc(1, sizeof(Tex));
   item->rt = gen_render_texture(w, h, BLANK);
   item->refc = 1;
   item->w = w;
   item->h = h;
-  item->uses++;
-  item->next = C.items;
-  C.items = item;
+  C.stats.count++;
+  C.stats.bytes += texbytes(item);
   return item;
 }
 
 void texdel(Tex* t) {
-  if (t) t->refc--;
+  if (!t) return;
+  assert(t->refc > 0);
+  t->refc--;
+  if (t->refc > 0) return;
+  if (t->borrowed) {
+    texfree(t);
+  } else {
+    pool_put(t);
+  }
 }
 Tex* texnewlike(Tex* t) { return texnew(t->w, t->h); }
 
@@ -138,72 +210,31 @@ void texproj(Tex* t, Cam2D cam, Tex* out) {
 
 /* Returns a Tex object that doesnt own its memory */
 Tex* texborrow(RenderTexture2D rt) {
-  Tex* item = C.items;
-  while (item) {
-    if ((item->borrowed) && (item->refc == 0) &&
-        rt.texture.id == item->rt.texture.id) {
-      item->refc++;
-      item->uses++;
-      return item;
-    }
-    item = item->next;
-  }
-  C.cnt++;
-  if (C.cnt == 50) abort();
-  item = calloc(1, sizeof(Tex));
+  Tex* item = calloc(1, sizeof(Tex));
   item->rt = rt;
   item->refc = 1;
-  item->uses = 1;
+  item->borrowed = true;
   item->w = rt.texture.width;
   item->h = rt.texture.height;
-  item->next = C.items;
-  C.items = item;
   return item;
 }
 
-#if 0
-void texprerender() {
-  Tex* item = C.items;
-  while (item) {
-    item->uses = 0;
-    item = item->next;
-  }
-}
-#endif
-
-void texfree(Tex* t) {
-  if (!t->borrowed) UnloadRenderTexture(t->rt);
-  C.cnt--;
-  free(t);
-}
-
 void texcleanup() {
-  Tex* prev = NULL;
-  Tex* item = C.items;
-  int tot = 0;
-  int totafter = 0;
-  while (item) {
-    Tex* next = item->next;
-    tot++;
-    if (item->uses == 0 && item->refc == 0) {
-      if (prev) {
-        prev->next = next;
-      } else {
-        C.items = next;
-      }
-      texfree(item);
-      // printf("cleaned tex\n");
-    } else {
-      totafter++;
-      item->uses = 0;
-      prev = item;
-    }
-    item = next;
+  C.frame++;
+  size_t budget = C.stats.bytes - C.stats.pool_bytes;
+  if (budget < TEX_POOL_MIN_BUDGET) budget = TEX_POOL_MIN_BUDGET;
+  while (C.oldest) {
+    Tex* t = C.oldest;
+    bool idle = C.frame - t->last_use > TEX_MAX_IDLE_FRAMES;
+    if (!idle && C.stats.pool_bytes <= budget) break;
+    pool_remove(t);
+    texfree(t);
+    C.stats.evictions++;
   }
-  assert(tot < 50);
-  // printf("tex_total=%d -> %d\n", tot, totafter);
 }
 
+TexStats texstats() { return C.stats; }
+
 void texclear(Tex* t, Color c) {
   BeginTextureMode(t->rt);
   ClearBackground(c);
@@ -212,7 +243,7 @@ void texclear(Tex* t, Color c) {
 
 void texmapcircuitlight_v2(Texture2D circuit, Tex* pmap, int error_mode,
                            Times times, int tickmod, int tickgap, float f_ema,
-                           Tex** circ, Tex** light) {
+                           Rectangle roi, Tex** circ, Tex** light) {
   Texture main_tex = circuit;
   int w = circuit.width;
   int h = circuit.height;
@@ -226,6 +257,7 @@ void texmapcircuitlight_v2(Texture2D circuit, Tex* pmap, int error_mode,
 
   rlSetupMRT((*circ)->rt.id, (*light)->rt.texture.id, 2);
   BeginTextureMode((*circ)->rt);
+  BeginScissorMode(roi.x, roi.y, roi.width, roi.height);
   rlSetBlendMode(BLEND_CUSTOM);
   rlSetBlendFactors(RL_ONE, RL_ZERO, RL_FUNC_ADD);
 
@@ -262,6 +294,7 @@ void texmapcircuitlight_v2(Texture2D circuit, Tex* pmap, int error_mode,
   // Reset blend mode to default
   rlSetBlendMode(RL_BLEND_ALPHA);
 
+  EndScissorMode();
   EndTextureMode();
   rlResetMRT((*circ)->rt.id);
 }
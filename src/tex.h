@@ -13,17 +13,33 @@ typedef struct {
  * The idea is to be able to re-use memory easily without worrying about memory
  * management during the pipeline.
  * I'll try to move all my gpu-based rendering stuff here.
+ *
+ * Free buffers stay in a pool, by size, until texcleanup frees the ones that
+ * weren't used for a while or that go over the pool budget (oldest first).
+ * The budget follows the memory of the buffers in use.
  * */
 typedef struct Tex {
   RenderTexture rt;
-  int refc; /* uses = 0 --> Free, uses>0 --> being used */
-  int uses;
+  int refc; /* refc = 0 --> Free (in the pool), refc>0 --> being used */
   bool borrowed;
-  int w; /* buffer Width */
-  int h; /* buffer height */
+  int w;            /* buffer Width */
+  int h;            /* buffer height */
+  int last_use;     /* Frame it was freed */
+  struct Tex* prev; /* Free buffers of the same size */
   struct Tex* next;
+  struct Tex* older; /* Free buffers, by time they were freed */
+  struct Tex* newer;
 } Tex;
 
+typedef struct {
+  int hits;          /* texnew calls served by the pool */
+  int misses;        /* texnew calls that created a buffer */
+  int evictions;     /* Free buffers destroyed by texcleanup */
+  int count;         /* Buffers alive (not borrowed) */
+  size_t bytes;      /* GPU memory of the buffers alive */
+  size_t pool_bytes; /* Part of it in free buffers */
+} TexStats;
+
 /* Returns an available buffer with the given size */
 Tex* texnew(int w, int h);
 
@@ -47,8 +63,10 @@ Tex* texgauss2(Tex* t);
 /* Projects source buffer into dst buffer using camera */
 void texproj(Tex* src, Cam2D cam, Tex* dst);
 
-/* Clean unused textures with reference 0 */
+/* Frees pooled textures unused for a while or over budget (once a frame) */
 void texcleanup();
+/* Counters of the pool, shown in the debug overlay */
+TexStats texstats();
 
 /* Fills buffer with color (ClearBackground)*/
 void texclear(Tex* t, Color c);
@@ -72,7 +90,8 @@ void texdrawboard(Tex* t, Cam2D cam, int cw, int ch, Color c);
  * The mouse coordinates are relative to the center of the texture */
 void texclock(Tex* t, float mx, float my);
 
+/* Only `roi` (in pixels of circ) is drawn, the rest is kept. */
 void texmapcircuitlight_v2(Texture2D circuit, Tex* pmap, int error_mode,
                            Times times, int tickmod, int tickgap, float f_ema,
-                           Tex** circ, Tex** light);
+                           Rectangle roi, Tex** circ, Tex** light);
 #endif
@@ -0,0 +1,144 @@
+#include "tile_map.h"
+
+#include "stdlib.h"
+
+/* Part of a run inside a tile. */
+typedef struct {
+  int wire;
+  int off; /* First pixel in the tile */
+  int len;
+  int step; /* 1 or TILE_MAP_SIZE */
+} TilePiece;
+
+typedef struct {
+  TileMap* m;
+  int* piece_off; /* Pieces of each slot (nslots + 1) */
+  TilePiece* piece;
+  int* pal_n; /* Palette size of each slot */
+  int nchunks;
+} TileBuild;
+
+/* Splits a run at tile borders. Counts the pieces of each tile, or stores
+ * them when `piece` is set. */
+static void split_stroke(TileMap* m, TileStroke st, int* count, int* cursor,
+                         TilePiece* piece) {
+  int x = st.x;
+  int y = st.y;
+  int left = st.len;
+  while (left > 0) {
+    int ix = x & (TILE_MAP_SIZE - 1);
+    int iy = y & (TILE_MAP_SIZE - 1);
+    int room = TILE_MAP_SIZE - (st.vertical ? iy : ix);
+    int n = left < room ? left : room;
+    int tile = (y >> TILE_MAP_SHIFT) * m->tw + (x >> TILE_MAP_SHIFT);
+    if (piece) {
+      piece[cursor[m->slot[tile]]++] = (TilePiece){
+          .wire = st.wire,
+          .off = (iy << TILE_MAP_SHIFT) + ix,
+          .len = n,
+          .step = st.vertical ? TILE_MAP_SIZE : 1,
+      };
+    } else {
+      count[tile]++;
+    }
+    if (st.vertical) {
+      y += n;
+    } else {
+      x += n;
+    }
+    left -= n;
+  }
+}
+
+/* Builds the palette of each slot (in order of appearance) and paints it. */
+static void paint_task(void* arg, int itask) {
+  TileBuild* b = arg;
+  TileMap* m = b->m;
+  int s0 = (int)((long long)m->nslots * itask / b->nchunks);
+  int s1 = (int)((long long)m->nslots * (itask + 1) / b->nchunks);
+  for (int s = s0; s < s1; s++) {
+    /* Until compacted, the palette of a slot is stored at its pieces */
+    int* pal = m->pal + b->piece_off[s];
+    int npal = 0;
+    int last = 0;
+    u16* tile = m->wire + s * TILE_MAP_PIXELS;
+    for (int k = b->piece_off[s]; k < b->piece_off[s + 1]; k++) {
+      TilePiece p = b->piece[k];
+      if (npal == 0 || pal[last] != p.wire) {
+        last = 0;
+        while (last < npal && pal[last] != p.wire) last++;
+        if (last == npal) pal[npal++] = p.wire;
+      }
+      u16 v = last + 1;
+      for (int i = 0; i < p.len; i++) {
+        tile[p.off + i * p.step] = v;
+      }
+    }
+    b->pal_n[s] = npal;
+  }
+}
+
+void tile_map_build(TileMap* m, int w, int h, TileStroke* strokes, int n,
+                    WorkerPool* workers) {
+  *m = (TileMap){0};
+  m->w = w;
+  m->h = h;
+  m->tw = (w + TILE_MAP_SIZE - 1) >> TILE_MAP_SHIFT;
+  m->th = (h + TILE_MAP_SIZE - 1) >> TILE_MAP_SHIFT;
+  int ntiles = m->tw * m->th;
+  int* count = calloc(ntiles, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    split_stroke(m, strokes[i], count, NULL, NULL);
+  }
+  /* Slots in tile order, and their pieces */
+  TileBuild b = {.m = m};
+  m->slot = malloc(ntiles * sizeof(int));
+  for (int t = 0; t < ntiles; t++) {
+    m->slot[t] = count[t] > 0 ? m->nslots++ : -1;
+  }
+  int nslots = m->nslots;
+  b.piece_off = malloc((nslots + 1) * sizeof(int));
+  b.piece_off[0] = 0;
+  for (int t = 0; t < ntiles; t++) {
+    int s = m->slot[t];
+    if (s >= 0) b.piece_off[s + 1] = b.piece_off[s] + count[t];
+  }
+  int npieces = b.piece_off[nslots];
+  int* cursor = count; /* Reused */
+  for (int s = 0; s < nslots; s++) {
+    cursor[s] = b.piece_off[s];
+  }
+  b.piece = malloc((npieces > 0 ? npieces : 1) * sizeof(TilePiece));
+  for (int i = 0; i < n; i++) {
+    split_stroke(m, strokes[i], NULL, cursor, b.piece);
+  }
+  free(count);
+
+  m->wire = calloc((size_t)nslots * TILE_MAP_PIXELS, sizeof(u16));
+  m->pal = malloc((npieces > 0 ? npieces : 1) * sizeof(int));
+  b.pal_n = malloc((nslots > 0 ? nslots : 1) * sizeof(int));
+  b.nchunks = nslots < workers_count(workers) ? 1 : workers_count(workers);
+  workers_run(workers, b.nchunks, paint_task, &b);
+
+  /* Palettes moved together */
+  m->pal_off = malloc((nslots + 1) * sizeof(int));
+  int npal = 0;
+  for (int s = 0; s < nslots; s++) {
+    memmove(m->pal + npal, m->pal + b.piece_off[s], b.pal_n[s] * sizeof(int));
+    m->pal_off[s] = npal;
+    npal += b.pal_n[s];
+  }
+  m->pal_off[nslots] = npal;
+  m->pal = realloc(m->pal, (npal > 0 ? npal : 1) * sizeof(int));
+  free(b.piece_off);
+  free(b.piece);
+  free(b.pal_n);
+}
+
+void tile_map_destroy(TileMap* m) {
+  free(m->slot);
+  free(m->pal_off);
+  free(m->pal);
+  free(m->wire);
+  *m = (TileMap){0};
+}
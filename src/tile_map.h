@@ -0,0 +1,91 @@
+#ifndef CA_TILE_MAP_H
+#define CA_TILE_MAP_H
+#include "assert.h"
+#include "common.h"
+#include "workers.h"
+
+/*
+ * Sparse pixel->wire map of a layer, in square tiles.
+ *
+ * Only the tiles crossed by a wire are stored, each one in a slot; the other
+ * tiles read as background. Wire ids are relative to the tile: every slot has
+ * a palette with the wires crossing it, and its pixels hold a palette index
+ * plus one (0 is background).
+ *
+ * Other per pixel maps of the wires (like the distance map) use the same
+ * slots: TILE_MAP_PIXELS values per slot, indexed with tile_map_index.
+ */
+#define TILE_MAP_SHIFT 5
+#define TILE_MAP_SIZE (1 << TILE_MAP_SHIFT)
+#define TILE_MAP_PIXELS (TILE_MAP_SIZE * TILE_MAP_SIZE)
+
+typedef struct {
+  int w, h;     /* Size in pixels */
+  int tw, th;   /* Size in tiles */
+  int* slot;    /* Slot of each tile (-1 if empty) */
+  int nslots;
+  int* pal_off; /* Palette of slot s: pal[pal_off[s]] to pal[pal_off[s+1]] */
+  int* pal;     /* Wire ids */
+  u16* wire;    /* Palette index + 1 of each pixel of each slot */
+} TileMap;
+
+/* Horizontal or vertical run of pixels of a wire. */
+typedef struct {
+  int wire;
+  int x, y;
+  int len;
+  bool vertical;
+} TileStroke;
+
+/*
+ * Paints the runs in order (a later run wins on shared pixels). Tiles are
+ * painted in parallel by the workers (NULL: serial).
+ */
+void tile_map_build(TileMap* m, int w, int h, TileStroke* strokes, int n,
+                    WorkerPool* workers);
+void tile_map_destroy(TileMap* m);
+
+/* Index of a pixel in the slot data, -1 if its tile is empty. */
+static inline int tile_map_index(const TileMap* m, int x, int y) {
+  assert(x >= 0 && x < m->w && y >= 0 && y < m->h);
+  int s = m->slot[(y >> TILE_MAP_SHIFT) * m->tw + (x >> TILE_MAP_SHIFT)];
+  if (s < 0) return -1;
+  int ix = x & (TILE_MAP_SIZE - 1);
+  int iy = y & (TILE_MAP_SIZE - 1);
+  return s * TILE_MAP_PIXELS + (iy << TILE_MAP_SHIFT) + ix;
+}
+
+/* Wire of a pixel, -1 for background. */
+static inline int tile_map_get(const TileMap* m, int x, int y) {
+  int i = tile_map_index(m, x, y);
+  if (i < 0 || m->wire[i] == 0) return -1;
+  int s = i / TILE_MAP_PIXELS;
+  return m->pal[m->pal_off[s] + m->wire[i] - 1];
+}
+
+/*
+ * Distances are kept as 16 bit (IEEE half) floats: the sign is kept, values
+ * round to 11 significant bits, and are clamped to [2^-14, 65504] in
+ * magnitude (smaller ones become 0).
+ */
+static inline u16 tile_dist_pack(float f) {
+  u32 b;
+  memcpy(&b, &f, sizeof(b));
+  u16 sign = (b >> 16) & 0x8000;
+  b &= 0x7fffffff;
+  if (b >= 0x477ff000) return sign | 0x7bff;
+  if (b < 0x38800000) return sign;
+  /* Exponent rebiased from 127 to 15, mantissa rounded to nearest */
+  return sign | (u16)((b - 0x38000000 + 0x1000) >> 13);
+}
+
+static inline float tile_dist_unpack(u16 v) {
+  u32 b = (u32)(v & 0x8000) << 16;
+  u32 e = v & 0x7fff;
+  if (e) b |= (e << 13) + 0x38000000;
+  float f;
+  memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+#endif
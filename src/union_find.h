@@ -32,4 +32,16 @@ static inline void uf_union(int* c, int* r, int a, int b) {
   }
 }
 
+// Union-find Union keeping the smallest root, so the root of a set is its
+// first element.
+static inline void uf_union_min(int* c, int a, int b) {
+  int ca = uf_find(c, a);
+  int cb = uf_find(c, b);
+  if (ca < cb) {
+    c[cb] = ca;
+  } else if (cb < ca) {
+    c[ca] = cb;
+  }
+}
+
 #endif
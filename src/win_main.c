@@ -25,6 +25,7 @@
 #include "profiler.h"
 #include "raylib.h"
 #include "sim.h"
+#include "sim_thread.h"
 #include "sol_widget.h"
 #include "sound.h"
 #include "stb_ds.h"
@@ -107,6 +108,11 @@ static struct {
 
   Sim sim;
   HSim hsim;
+  SimThread* simt;     /* Runs sim/hsim while a simulation is on */
+  SimFrame* sim_frame; /* Frame of the simulation drawn by the UI */
+  int simu_target_seq; /* Last target change seen from the thread */
+  bool simu_paused;    /* Pause already sent to the thread */
+  DistCache dist_cache; /* Wire distances of the last parse, for the next */
   bool rewind_pressed;
   bool forward_pressed;
   bool paused;
@@ -317,7 +323,7 @@ static void on_post_image_save(bool saveas) {
     // Now does the linking.
     const char* id = C.ldef->id;
     bool solved = false;
-    if (C.mode == MODE_SIMU && C.sim.complete) {
+    if (C.mode == MODE_SIMU && C.sim_frame->snap.complete) {
       solved = true;
     }
     bool was_solved = C.bp->solved_level;
@@ -343,7 +349,8 @@ void win_main_open() {
 }
 
 static float get_speed_dt(int speed) {
-  double v1 = C.sim.base_tps;
+  /* Levels can change it while running */
+  double v1 = C.sim_frame ? C.sim_frame->snap.base_tps : C.sim.base_tps;
   switch (speed) {
     case 0:
       return v1 / 16;
@@ -378,8 +385,11 @@ static inline int get_simu_speed() {
   return (C.paused || C.time_open) ? 0 : 1;
 }
 
+/* Ticks between the drawn frame and the target, in [0, 1). */
 static float get_simu_slack_steps() {
-  return C.simu_target_steps - C.sim.state.cur_tick;
+  float slack = C.simu_target_steps - C.sim_frame->snap.tick;
+  if (slack < 0.f) return 0.f;
+  return slack < 1.f ? slack : 0.999f;
 }
 
 void load_palette_asset(const char* asset) {
@@ -400,10 +410,29 @@ static void show_kernel_error() {
   about_open("Script Error", C.kernel_error_msg, NULL);
 }
 
+static void main_start_simu_thread() {
+  C.simt = sim_thread_start(&C.sim, &C.hsim);
+  bool fresh;
+  sim_thread_lock(C.simt);
+  C.sim_frame = sim_thread_frame(C.simt, &fresh);
+  sim_thread_unlock(C.simt);
+  C.simu_target_seq = C.sim_frame->target_seq;
+  C.simu_paused = false;
+}
+
+static void main_stop_simu_thread() {
+  if (!C.simt) return;
+  sim_thread_lock(C.simt);
+  sim_thread_stop(C.simt);
+  C.simt = NULL;
+  C.sim_frame = NULL;
+}
+
 void win_main_stop_simu() {
   // assert(main_get_simu_mode() != MODE_EDIT);
   assert(main_get_simu_mode() == MODE_SIMU ||
          main_get_simu_mode() == MODE_ERROR);
+  main_stop_simu_thread();
   hsim_destroy(&C.hsim);
   sim_destroy(&C.sim);
 
@@ -573,11 +602,10 @@ void win_main_init() {
   }
 }
 
-static void simu_play_sounds() {
-  int na = arrlen(C.sim.ui_events);
-  int r = 0;
+static void simu_play_sounds(SimUiEvent* events) {
+  int na = arrlen(events);
   for (int i = 0; i < na; i++) {
-    SimUiEvent ev = C.sim.ui_events[i];
+    SimUiEvent ev = events[i];
     if (ev.sound > 0) {
       play_sound_nand();
     }
@@ -585,54 +613,60 @@ static void simu_play_sounds() {
 }
 
 /*
- * Runs simulation to ensure slack step is always 0 <= slack_step < 1
+ * Takes the last frame of the simulation thread, and sends it the new target
+ * (the ticks run on the thread, see sim_thread.h). The rest of the frame only
+ * reads the taken frame, so the lock is only held here.
  */
 static Status main_update_simu() {
-  Status status = status_ok();
   profiler_tic("Simulation");
-  Sim* pSim = &C.sim;
-  float slack_steps = get_simu_slack_steps();
-
-  /* interaction doesn't work when going backward */
-  if (C.pix_toggle > -1 && slack_steps >= 0.f) {
-    sim_toggle_pixel(pSim, C.pix_toggle);
-    hsim_clear_forward_history(&C.hsim);
-    C.pix_toggle = -1;
-    C.simu_target_steps = C.sim.state.cur_tick + 1;
-  }
-  slack_steps = get_simu_slack_steps();
-
-  while (status.ok && slack_steps < 0.f) {
-    /* Can't go backward */
-    if (!hsim_has_prv(&C.hsim)) {
-      slack_steps = 0.f;
-      C.simu_target_steps = C.sim.state.cur_tick;
-      break;
-    }
-    status = hsim_prv(&C.hsim);
-    slack_steps += 1.f;
-  }
-
-  while (status.ok && slack_steps >= 1.f) {
-    status = hsim_nxt(&C.hsim);
-    if (!status.ok) {
-      break;
-    }
-    simu_play_sounds();
+  bool fresh;
+  sim_thread_lock(C.simt);
+  SimFrame* f = sim_thread_frame(C.simt, &fresh);
+  C.sim_frame = f;
+  if (fresh) {
+    simu_play_sounds(f->snap.ui_events);
     /* Simulation has called Pause() */
-    if (C.sim.pause_requested) {
-      C.sim.pause_requested = false;
+    if (f->snap.pause_requested) {
       C.paused = true;
-      C.simu_target_steps = C.sim.state.cur_tick;
+      C.simu_paused = true;
       play_sound_click();
-      break;
     }
-    slack_steps -= 1.f;
+    /* The thread moved the target */
+    if (f->target_seq != C.simu_target_seq) {
+      C.simu_target_seq = f->target_seq;
+      C.simu_target_steps = f->target;
+    }
+  }
+  if (!f->status.ok) {
+    sim_thread_unlock(C.simt);
+    profiler_tac();
+    return f->status;
   }
 
+  if (C.pix_toggle > -1) {
+    sim_thread_push(C.simt, (SimCommand){
+                                .type = SIM_CMD_POKE,
+                                .pix = C.pix_toggle,
+                            });
+    C.pix_toggle = -1;
+  }
+  if (C.paused && !C.simu_paused) {
+    sim_thread_push(C.simt, (SimCommand){.type = SIM_CMD_PAUSE});
+  }
+  C.simu_paused = C.paused;
+
+  /* At top speed nobody watches single ticks: patches aren't recorded, going
+   * back rebuilds them from the last checkpoint. */
+  bool turbo = C.clock_speed == 5 && !C.paused && !C.time_open;
+  sim_thread_push(C.simt, (SimCommand){
+                              .type = SIM_CMD_TARGET,
+                              .target = C.simu_target_steps,
+                              .turbo = turbo,
+                              .target_seq = C.simu_target_seq,
+                          });
+  sim_thread_unlock(C.simt);
   profiler_tac();
-  // assert(get_simu_slack_steps() >= 0 && get_simu_slack_steps() < 1.f);
-  return status;
+  return status_ok();
 }
 
 float get_clock_delta(v2 c, v2 a, v2 b) {
@@ -658,11 +692,14 @@ Status main_draw_level_kernel() {
   if (!main_is_simulation_on()) return status_ok();
   LevelAPI* api = getlevel();
   if (!api->draw) return status_ok();
+  /* The level script runs on the simulation thread between draws */
+  sim_thread_lock(C.simt);
   BeginTextureMode(C.level_overlay_tex);
   rlPushMatrix();
   Status s = api->draw(api->u);
   rlPopMatrix();
   EndTextureMode();
+  sim_thread_unlock(C.simt);
   return s;
 }
 
@@ -742,8 +779,10 @@ void win_main_update() {
         hide_mask = hide_mask | (1 << i);
       }
     }
-    Tex* rendered = sim_render_v2(&C.sim, tw, th, C.ca.cam, frame_steps,
-                                  slack_steps, hide_mask, is_circuit_neon_on());
+    /* Only the frame is drawn: the simulation runs meanwhile */
+    bool neon = is_circuit_neon_on();
+    Tex* rendered = sim_render_v2(&C.sim, &C.sim_frame->snap, tw, th, C.ca.cam,
+                                  frame_steps, slack_steps, hide_mask, neon);
     profiler_tac();
     BeginTextureMode(C.img_target_tex);
     ClearBackground(PURPLE);
@@ -767,6 +806,12 @@ void win_main_update() {
 
   profiler_tac();
   texcleanup();
+  TexStats ts = texstats();
+  profiler_count("tex_count", ts.count);
+  profiler_count("tex_mb", ts.bytes >> 20);
+  profiler_count("tex_pool_mb", ts.pool_bytes >> 20);
+  profiler_count("tex_misses", ts.misses);
+  profiler_count("tex_evictions", ts.evictions);
 }
 
 static void main_update_paint_cursor_type() {
@@ -836,12 +881,28 @@ void win_main_start_simu() {
     texs[i] = C.ca.h.t_buffer[i];
   }
   LevelAPI* api = getlevel();
+  /* The NAND update result doesn't depend on the thread count. */
+  int num_threads = workers_hardware_count();
+  if (num_threads > 8) num_threads = 8;
+  /* Distances of the wires touched by the edits since the last parse are
+   * computed again, the rest of the parse is redone in full */
+  int ndirty;
+  bool all_dirty;
+  RectangleInt* dirty = hist_get_dirty_rects(&C.ca.h, &ndirty, &all_dirty);
+  dist_cache_invalidate(&C.dist_cache, all_dirty, ndirty, dirty);
+  hist_clear_dirty_rects(&C.ca.h);
+  char parse_cache_dir[512];
+  snprintf(parse_cache_dir, sizeof(parse_cache_dir), "%s",
+           get_data_path("parse_cache"));
   SimParams p = {
       .nl = nl,
       .img = &imgs[0],
       .api = api,
       .layers = &texs[0],
       .warmup_cycles = api->warmup_cycles,
+      .num_threads = num_threads,
+      .dist_cache = &C.dist_cache,
+      .parse_cache_dir = parse_cache_dir,
   };
   Status s = sim_init(&C.sim, p);
   if (!s.ok) {
@@ -854,6 +915,7 @@ void win_main_start_simu() {
   C.hsim = wrap_sim(&C.sim);
   C.simu_target_steps = 0;
   C.pix_toggle = -1;
+  main_start_simu_thread();
   if (sim_has_errors(&C.sim)) {
     play_sound_oops();
     C.mode = MODE_ERROR;
@@ -1051,7 +1113,8 @@ void main_update_controls() {
               C.paused = false;
             }
           } else {
-            int status = sim_get_pixel_error_status(&C.sim, pix_toggle);
+            int status = sim_get_pixel_error_status(
+                &C.sim, &C.sim_frame->snap, pix_toggle);
             if (status == STATUS_TOOSLOW) {
               C.mouse_msg_type = 1;
               strcpy(C.mouse_msg, T.main_wire_too_slow);
@@ -1304,7 +1367,7 @@ void win_main_draw() {
   main_draw_status_bar();
 
   if (C.mode == MODE_SIMU) {
-    bool complete = C.sim.complete;
+    bool complete = C.sim_frame->snap.complete;
     if (complete) {
       // draw_complete_badge();
     }
@@ -1517,7 +1580,7 @@ static Rectangle rgrow(int p, Rectangle r) {
 }
 
 static bool can_save_as_solution() {
-  return (C.mode == MODE_SIMU) && C.sim.complete;
+  return (C.mode == MODE_SIMU) && C.sim_frame->snap.complete;
 }
 
 void main_draw_error_message(const char* msg) {
@@ -1583,8 +1646,8 @@ void main_draw_status_bar() {
     uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
     yc += step;
 
-    bool warmup = sim_is_on_warmup(&C.sim);
-    if (warmup) {
+    SimSnapshot* snap = &C.sim_frame->snap;
+    if (snap->warmup) {
       snprintf(txt, sizeof(txt), "...");
       // E, C, T, CRIT:
       uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
@@ -1597,22 +1660,20 @@ void main_draw_status_bar() {
       yc += step;
     } else {
       snprintf(txt, sizeof(txt), T.main_bar_energy,
-               fmtnum((int)(C.sim.state.total_energy)));
+               fmtnum((int)(snap->total_energy)));
       uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
       yc += step;
-      int cycle = sim_get_effective_cycle(&C.sim);
-
-      snprintf(txt, sizeof(txt), "C: %d", cycle);
+      snprintf(txt, sizeof(txt), "C: %d", snap->cycle);
       uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
       yc += step;
 
-      int t = C.sim.state.cur_period_tick + 1;
+      int t = snap->period_tick + 1;
       snprintf(txt, sizeof(txt), "T: %d", t);
       uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
       yc += step;
 
       snprintf(txt, sizeof(txt), "CRIT: C: %d T: %d",
-               C.sim.state.max_tick_cycle, C.sim.state.max_tick);
+               snap->max_tick_cycle, snap->max_tick);
       uifont_draw_texture_outlined(txt, xc, yc, tc, bg);
       yc += step;
     }
@@ -1795,7 +1856,9 @@ void main_new_file() {
 
 void win_main_destroy() {
   discord_shutdown();
+  main_stop_simu_thread();
   paint_destroy(&C.ca);
+  dist_cache_destroy(&C.dist_cache);
   if (C.fname) {
     free(C.fname);
     C.fname = NULL;
@@ -4,6 +4,7 @@
 #include "profiler.h"
 #include "stb_ds.h"
 #include "stdlib.h"
+#include "string.h"
 
 static void draw_line(int w, int x0, int y0, int x1, int y1, Color* pix,
                       Color c) {
@@ -34,7 +35,6 @@ static void debug_edge_graph_c(int l, int w, int h, Graph* g, int* c) {
       BLUE,  SKYBLUE, MAGENTA, GREEN, GOLD, VIOLET,
   };
   int num_colors = sizeof(lut) / sizeof(Color);
-  int se = g->max_edges;
   int ds = 0;
   int ww = w;
   int hh = h;
@@ -54,7 +54,7 @@ static void debug_edge_graph_c(int l, int w, int h, Graph* g, int* c) {
     y0 = (idx0 / ww) - ds;
     x0 = idx0 % ww;
     for (int j = 0; j < g->ecount[i]; j++) {
-      int i1 = g->edges[i * se + j].e;
+      int i1 = g->edges[g->eoff[i] + j].e;
       int idx1 = g->nodes[i1];
       find_idx(s, ww, idx1, &l1, &y1, &x1);
       if (l0 == l1 && l0 == l) {
@@ -70,74 +70,70 @@ static void debug_edge_graph_c(int l, int w, int h, Graph* g, int* c) {
   printf("Saved %s.\n", fname);
 }
 
-static void draw_line_i(int w, int x0, int y0, int x1, int y1, int* pix,
-                        int c) {
-  if (x0 == x1) {
-    if (y0 > y1) {
-      int tmp = y1;
-      y1 = y0;
-      y0 = tmp;
-    }
-    for (int y = y0; y <= y1; y++) {
-      pix[y * w + x0] = c;
-    }
-  } else {
-    if (x0 > x1) {
-      int tmp = x1;
-      x1 = x0;
-      x0 = tmp;
-    }
-    for (int x = x0; x <= x1; x++) {
-      pix[y0 * w + x] = c;
-    }
-  }
-}
-
-void gen_wire_map(int l, int w, int h, Graph* g, int* comp, int* wmap) {
-  int se = g->max_edges;
-  int ds = 0;
-  int ww = w;
-  int hh = h;
+/*
+ * The wire map is painted from the graph: each node paints its pixel and
+ * each edge the pixels in between. Edges are painted once (from their first
+ * node) and without their ends. Horizontal runs go first and vertical ones
+ * after, so vertical wires own the crossings.
+ */
+static void gen_wire_map(int nl, int w, int h, Graph* g, int* comp,
+                         TileMap* wmap, WorkerPool* workers) {
   int s = w * h;
-  for (int i = 0; i < g->n; i++) {
-    int l0, x0, y0, x1, y1, l1;
-    int idx0 = g->nodes[i];
-    find_idx(s, ww, idx0, &l0, &y0, &x0);
-    int ci = comp[i];
-    if (l0 == l) wmap[y0 * ww + x0] = ci;
-    for (int j = 0; j < g->ecount[i]; j++) {
-      int i1 = g->edges[i * se + j].e;
-      int idx1 = g->nodes[i1];
-      find_idx(s, ww, idx1, &l1, &y1, &x1);
-      if (l0 == l1 && l0 == l) {
-        draw_line_i(ww, x0, y0, x1, y1, wmap, ci);
+  TileStroke* strokes[MAX_LAYERS] = {0};
+  for (int pass = 0; pass < 2; pass++) {
+    bool vertical = pass == 1;
+    for (int i = 0; i < g->n; i++) {
+      int l0, x0, y0, x1, y1, l1;
+      find_idx(s, w, g->nodes[i], &l0, &y0, &x0);
+      int ci = comp[i];
+      /* Nodes of a pixel are consecutive, the last one paints it */
+      if (!vertical && (i == g->n - 1 || graph_slot(g->nodes[i + 1]) !=
+                                             graph_slot(g->nodes[i]))) {
+        TileStroke st = {ci, x0, y0, 1, false};
+        arrput(strokes[l0], st);
+      }
+      for (int j = 0; j < g->ecount[i]; j++) {
+        int i1 = g->edges[g->eoff[i] + j].e;
+        if (i1 < i) continue;
+        find_idx(s, w, g->nodes[i1], &l1, &y1, &x1);
+        if (l0 != l1) continue;
+        if (!vertical && y0 == y1 && abs(x1 - x0) > 1) {
+          int xa = x0 < x1 ? x0 : x1;
+          TileStroke st = {ci, xa + 1, y0, abs(x1 - x0) - 1, false};
+          arrput(strokes[l0], st);
+        } else if (vertical && x0 == x1 && abs(y1 - y0) > 1) {
+          int ya = y0 < y1 ? y0 : y1;
+          TileStroke st = {ci, x0, ya + 1, abs(y1 - y0) - 1, true};
+          arrput(strokes[l0], st);
+        }
       }
     }
   }
+  for (int l = 0; l < nl; l++) {
+    tile_map_build(&wmap[l], w, h, strokes[l], arrlen(strokes[l]), workers);
+    arrfree(strokes[l]);
+  }
 }
 
 void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
-                     bool debug) {
+                     WorkerPool* workers, bool debug) {
   profiler_tic_single("wire_graph");
   /* Identify wires/components.  */
   /* Component (wire) for each graph node */
   Graph* g = &pg->g;
   wg->comp = calloc(g->n, sizeof(int));
-  wg->nwire = find_connected_components(g, wg->comp);
+  double t0 = workers_now();
+  wg->nwire = find_connected_components(g, wg->comp, workers);
+  double t1 = workers_now();
+  wg->t_comp = t1 - t0;
   if (debug) {
     for (int l = 0; l < nl; l++) {
       debug_edge_graph_c(l, w, h, g, wg->comp);
     }
   }
   /* Generate wire map */
-  for (int l = 0; l < nl; l++) {
-    int* wm = malloc(w * h * sizeof(int));
-    for (int i = 0; i < (w * h); i++) {
-      wm[i] = -1;
-    }
-    gen_wire_map(l, w, h, &pg->g, wg->comp, wm);
-    wg->wmap[l] = wm;
-  }
+  gen_wire_map(nl, w, h, &pg->g, wg->comp, wg->wmap, workers);
+  wg->t_wmap = workers_now() - t1;
   /* Assign drivers and sockets to wires. */
   wg->has_errors = false;
   int ndrv = arrlen(pg->drv);
@@ -152,7 +148,7 @@ void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
   wg->skt_status = malloc(nskt * sizeof(int));
   int num_nands = arrlen(pg->nands);
   wg->global_error_flags = 0;
-  int* wire_img = wg->wmap[0];
+  TileMap* wire_img = &wg->wmap[0];
   for (int i = 0; i < ndrv; i++) wg->drv_status[i] = 0;
   for (int i = 0; i < nskt; i++) wg->skt_status[i] = 0;
   for (int i = 0; i < nwire; i++) wg->wire_to_drv[i] = -1;
@@ -164,7 +160,7 @@ void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
       continue;
     }
     assert(idrv < w * h);
-    int c = wire_img[idrv];
+    int c = tile_map_get(wire_img, idrv % w, idrv / w);
     if (c == -1) {
       /* First error type : Disconnected nand/driver
        * This error is soft on level drivers: If a level driver is unplugged it
@@ -200,7 +196,7 @@ void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
       wg->skt_to_wire[i] = -1;
       continue;
     }
-    int s = wire_img[idx];
+    int s = tile_map_get(wire_img, idx % w, idx / w);
     /* Third kind of problem: NAND doesnt have an input. */
     if (s == -1) {
       wg->skt_status[i] |= STATUS_DISCONNECTED;
@@ -224,7 +220,7 @@ void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
     if (idx == -1) {
       continue;
     }
-    int s = wire_img[idx];
+    int s = tile_map_get(wire_img, idx % w, idx / w);
     if (s >= 0) {
       int off = wg->wire_to_skt_off[s] + cnt[s];
       cnt[s]++;
@@ -238,13 +234,54 @@ void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
   profiler_tac_single("wire_graph");
 }
 
+static int compare_socket_desc(const void* a, const void* b) {
+  const SocketDesc* sa = a;
+  const SocketDesc* sb = b;
+  if (sa->dt_ticks != sb->dt_ticks) return sa->dt_ticks - sb->dt_ticks;
+  return sa->socket - sb->socket;
+}
+
+/*
+ * Groups the sockets of each wire by delay, so a wire change is scheduled
+ * with one bulk insertion per distinct delay. Needs the socket delays (see
+ * dist_graph_init). Sockets keep their order within a group.
+ */
+void wire_graph_build_fanout(WireGraph* wg) {
+  int nwire = wg->nwire;
+  int nskt = wg->wire_to_skt_off[nwire];
+  SocketDesc* sorted = malloc(nskt * sizeof(SocketDesc));
+  memcpy(sorted, wg->wire_to_skt, nskt * sizeof(SocketDesc));
+  wg->fanout_off = malloc((nwire + 1) * sizeof(int));
+  wg->fanout_skt = malloc(nskt * sizeof(int));
+  wg->fanout = NULL;
+  for (int c = 0; c < nwire; c++) {
+    int off = wg->wire_to_skt_off[c];
+    int ns = wg->wire_to_skt_off[c + 1] - off;
+    qsort(sorted + off, ns, sizeof(SocketDesc), compare_socket_desc);
+    wg->fanout_off[c] = arrlen(wg->fanout);
+    for (int i = 0; i < ns; i++) {
+      SocketDesc sd = sorted[off + i];
+      wg->fanout_skt[off + i] = sd.socket;
+      if (i == 0 || sd.dt_ticks != sorted[off + i - 1].dt_ticks) {
+        FanoutGroup g = {.dt_ticks = sd.dt_ticks, .off = off + i, .n = 0};
+        arrput(wg->fanout, g);
+      }
+      arrlast(wg->fanout).n++;
+    }
+  }
+  wg->fanout_off[nwire] = arrlen(wg->fanout);
+  free(sorted);
+}
+
 void wire_graph_destroy(WireGraph* wg) {
   for (int i = 0; i < MAX_LAYERS; i++) {
-    free(wg->wmap[i]);
-    wg->wmap[i] = NULL;
+    tile_map_destroy(&wg->wmap[i]);
   }
   free(wg->wire_to_skt);
   free(wg->wire_to_skt_off);
+  arrfree(wg->fanout);
+  free(wg->fanout_off);
+  free(wg->fanout_skt);
   free(wg->comp);
   free(wg->wire_to_drv);
   free(wg->drv_to_wire);
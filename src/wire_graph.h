@@ -2,6 +2,7 @@
 #define CA_WIRE_GRAPH_H
 
 #include "pixel_graph.h"
+#include "tile_map.h"
 
 // Error flags for circuit parsing
 enum {
@@ -16,24 +17,39 @@ typedef struct {
   int dt_ticks; /* Socket Delay (filled in dist_graph) */
 } SocketDesc;
 
+/* Sockets of a wire that see its changes at the same tick. */
 typedef struct {
-  int nwire;               /* num of wires */
-  int* comp;               /* wire number of each graph node */
-  int* wmap[MAX_LAYERS];   /* pixel->wire map Has same size as image */
-  int* wire_to_drv;        /* wireId --> driverId correspondence */
-  int* drv_to_wire;        /* driverId --> wireId correspondence */
-  int* skt_to_wire;        /* socketId --> wireId correspondence */
-  int* drv_status;         /* error status of each driver */
-  int* skt_status;         /* error status of each socket */
-  bool has_errors;         /* errors during parsing */
-  SocketDesc* wire_to_skt; /* Sockets at each wire */
-  int* wire_to_skt_off;    /* Offset for the sockets at each wire */
-  int global_error_flags;  /* Flag with each error type (during parsing) */
+  int dt_ticks; /* Socket delay of the group */
+  int off;      /* First socket of the group in fanout_skt */
+  int n;        /* Number of sockets */
+} FanoutGroup;
+
+typedef struct {
+  int nwire;                /* num of wires */
+  int* comp;                /* wire number of each graph node */
+  TileMap wmap[MAX_LAYERS]; /* pixel->wire map (sparse) */
+  int* wire_to_drv;         /* wireId --> driverId correspondence */
+  int* drv_to_wire;         /* driverId --> wireId correspondence */
+  int* skt_to_wire;         /* socketId --> wireId correspondence */
+  int* drv_status;          /* error status of each driver */
+  int* skt_status;          /* error status of each socket */
+  bool has_errors;          /* errors during parsing */
+  SocketDesc* wire_to_skt;  /* Sockets at each wire */
+  int* wire_to_skt_off;     /* Offset for the sockets at each wire */
+  FanoutGroup* fanout;      /* Sockets of each wire grouped by delay */
+  int* fanout_off;          /* Offset for the groups at each wire */
+  int* fanout_skt;          /* Sockets of the groups */
+  int global_error_flags;   /* Flag with each error type (during parsing) */
+
+  double t_comp; /* Connected components (seconds) */
+  double t_wmap; /* Wire map tiles */
 } WireGraph;
 
+/* Wires are labeled and painted by node ranges among the workers. */
 void wire_graph_init(WireGraph* wg, int nl, int w, int h, PixelGraph* pg,
-                     bool debug);
+                     WorkerPool* workers, bool debug);
 
+void wire_graph_build_fanout(WireGraph* wg);
 void wire_graph_destroy(WireGraph* w);
 
 #endif
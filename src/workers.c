@@ -0,0 +1,257 @@
+#include "workers.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Kept apart from raylib headers: windows.h clashes with some of its names. */
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE wthread_t;
+typedef CRITICAL_SECTION wmutex_t;
+typedef CONDITION_VARIABLE wcond_t;
+#define wmutex_init(m) InitializeCriticalSection(m)
+#define wmutex_destroy(m) DeleteCriticalSection(m)
+#define wmutex_lock(m) EnterCriticalSection(m)
+#define wmutex_unlock(m) LeaveCriticalSection(m)
+#define wcond_init(c) InitializeConditionVariable(c)
+#define wcond_destroy(c)
+#define wcond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define wcond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+typedef pthread_t wthread_t;
+typedef pthread_mutex_t wmutex_t;
+typedef pthread_cond_t wcond_t;
+#define wmutex_init(m) pthread_mutex_init(m, NULL)
+#define wmutex_destroy(m) pthread_mutex_destroy(m)
+#define wmutex_lock(m) pthread_mutex_lock(m)
+#define wmutex_unlock(m) pthread_mutex_unlock(m)
+#define wcond_init(c) pthread_cond_init(c, NULL)
+#define wcond_destroy(c) pthread_cond_destroy(c)
+#define wcond_wait(c, m) pthread_cond_wait(c, m)
+#define wcond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+struct WorkerPool {
+  int nthreads;      /* Including the caller thread */
+  wthread_t* thr;    /* Spawned threads (size=nthreads-1) */
+  wmutex_t mtx;      /* Protects everything below */
+  wcond_t wake;      /* Signals a new job (or quit) */
+  wcond_t done;      /* Signals the last task of a job finished */
+  WorkerFn fn;       /* Current job */
+  void* ctx;         /* Current job context */
+  int ntasks;        /* Number of tasks in current job */
+  int next_task;     /* Next task to be picked */
+  int pending;       /* Tasks not finished yet */
+  unsigned job;      /* Job counter, so workers don't run a job twice */
+  bool quit;
+};
+
+/* Picks tasks of the current job until there's none left. */
+static void run_tasks(WorkerPool* p) {
+  while (p->next_task < p->ntasks) {
+    int itask = p->next_task++;
+    WorkerFn fn = p->fn;
+    void* ctx = p->ctx;
+    wmutex_unlock(&p->mtx);
+    fn(ctx, itask);
+    wmutex_lock(&p->mtx);
+    if (--p->pending == 0) {
+      wcond_broadcast(&p->done);
+    }
+  }
+}
+
+static void worker_loop(WorkerPool* p) {
+  unsigned seen = 0;
+  wmutex_lock(&p->mtx);
+  while (true) {
+    while (!p->quit && p->job == seen) {
+      wcond_wait(&p->wake, &p->mtx);
+    }
+    if (p->quit) break;
+    seen = p->job;
+    run_tasks(p);
+  }
+  wmutex_unlock(&p->mtx);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+  worker_loop(arg);
+  return 0;
+}
+#else
+static void* worker_main(void* arg) {
+  worker_loop(arg);
+  return NULL;
+}
+#endif
+
+WorkerPool* workers_create(int nthreads) {
+  if (nthreads < 1) nthreads = 1;
+  WorkerPool* p = calloc(1, sizeof(WorkerPool));
+  p->nthreads = nthreads;
+  wmutex_init(&p->mtx);
+  wcond_init(&p->wake);
+  wcond_init(&p->done);
+  p->thr = calloc(nthreads, sizeof(wthread_t));
+  for (int i = 0; i < nthreads - 1; i++) {
+#ifdef _WIN32
+    p->thr[i] = CreateThread(NULL, 0, worker_main, p, 0, NULL);
+    assert(p->thr[i]);
+#else
+    int r = pthread_create(&p->thr[i], NULL, worker_main, p);
+    assert(r == 0);
+    (void)r;
+#endif
+  }
+  return p;
+}
+
+void workers_destroy(WorkerPool* p) {
+  if (!p) return;
+  wmutex_lock(&p->mtx);
+  p->quit = true;
+  wcond_broadcast(&p->wake);
+  wmutex_unlock(&p->mtx);
+  for (int i = 0; i < p->nthreads - 1; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(p->thr[i], INFINITE);
+    CloseHandle(p->thr[i]);
+#else
+    pthread_join(p->thr[i], NULL);
+#endif
+  }
+  wcond_destroy(&p->wake);
+  wcond_destroy(&p->done);
+  wmutex_destroy(&p->mtx);
+  free(p->thr);
+  free(p);
+}
+
+int workers_count(WorkerPool* p) { return p ? p->nthreads : 1; }
+
+void workers_run(WorkerPool* p, int ntasks, WorkerFn fn, void* ctx) {
+  if (ntasks <= 0) return;
+  if (!p || p->nthreads == 1 || ntasks == 1) {
+    for (int i = 0; i < ntasks; i++) fn(ctx, i);
+    return;
+  }
+  wmutex_lock(&p->mtx);
+  p->fn = fn;
+  p->ctx = ctx;
+  p->ntasks = ntasks;
+  p->next_task = 0;
+  p->pending = ntasks;
+  p->job++;
+  wcond_broadcast(&p->wake);
+  run_tasks(p);
+  while (p->pending > 0) {
+    wcond_wait(&p->done, &p->mtx);
+  }
+  wmutex_unlock(&p->mtx);
+}
+
+int workers_fetch_add(int* counter, int v) {
+#ifdef _WIN32
+  return InterlockedExchangeAdd((volatile LONG*)counter, v);
+#else
+  return __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+#endif
+}
+
+int workers_hardware_count() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int n = (int)info.dwNumberOfProcessors;
+#else
+  int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return n > 0 ? n : 1;
+}
+
+double workers_now() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, t;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+struct WorkerThread {
+  wthread_t thr;
+  bool started;
+  wmutex_t mtx;
+  wcond_t cond;
+  WorkerFn fn;
+  void* ctx;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID arg) {
+  WorkerThread* t = arg;
+  t->fn(t->ctx, 0);
+  return 0;
+}
+#else
+static void* thread_main(void* arg) {
+  WorkerThread* t = arg;
+  t->fn(t->ctx, 0);
+  return NULL;
+}
+#endif
+
+WorkerThread* workers_thread_create() {
+  WorkerThread* t = calloc(1, sizeof(WorkerThread));
+  wmutex_init(&t->mtx);
+  wcond_init(&t->cond);
+  return t;
+}
+
+void workers_thread_start(WorkerThread* t, WorkerFn fn, void* ctx) {
+  assert(!t->started);
+  t->fn = fn;
+  t->ctx = ctx;
+  t->started = true;
+#ifdef _WIN32
+  t->thr = CreateThread(NULL, 0, thread_main, t, 0, NULL);
+  assert(t->thr);
+#else
+  int r = pthread_create(&t->thr, NULL, thread_main, t);
+  assert(r == 0);
+  (void)r;
+#endif
+}
+
+void workers_thread_destroy(WorkerThread* t) {
+  if (!t) return;
+  if (t->started) {
+#ifdef _WIN32
+    WaitForSingleObject(t->thr, INFINITE);
+    CloseHandle(t->thr);
+#else
+    pthread_join(t->thr, NULL);
+#endif
+  }
+  wcond_destroy(&t->cond);
+  wmutex_destroy(&t->mtx);
+  free(t);
+}
+
+void workers_thread_lock(WorkerThread* t) { wmutex_lock(&t->mtx); }
+
+void workers_thread_unlock(WorkerThread* t) { wmutex_unlock(&t->mtx); }
+
+void workers_thread_wait(WorkerThread* t) { wcond_wait(&t->cond, &t->mtx); }
+
+void workers_thread_broadcast(WorkerThread* t) { wcond_broadcast(&t->cond); }
@@ -0,0 +1,49 @@
+#ifndef CA_WORKERS_H
+#define CA_WORKERS_H
+
+/*
+ * Small persistent thread pool used to split hot loops in chunks.
+ *
+ * The calling thread also takes part in the work, so a pool created with
+ * `nthreads=1` spawns no thread at all and runs everything inline.
+ *
+ * Tasks are identified by their index only: callers are expected to split
+ * their work in fixed chunks and to merge per-task results in index order,
+ * which keeps results independent of thread scheduling.
+ */
+typedef void (*WorkerFn)(void* ctx, int itask);
+
+typedef struct WorkerPool WorkerPool;
+
+WorkerPool* workers_create(int nthreads);
+void workers_destroy(WorkerPool* pool);
+int workers_count(WorkerPool* pool);
+/* Runs fn(ctx, i) for i in [0, ntasks) and waits for all of them. */
+void workers_run(WorkerPool* pool, int ntasks, WorkerFn fn, void* ctx);
+/* Atomically adds `v` to `*counter` and returns its previous value. Lets
+ * tasks take items from a shared list. */
+int workers_fetch_add(int* counter, int v);
+/* Number of hardware threads, or 1 when it can't be known. */
+int workers_hardware_count();
+/* Monotonic time in seconds, for timings (needs no window, any thread). */
+double workers_now();
+
+/*
+ * Single long lived thread, running next to the caller instead of splitting
+ * its work, with a lock and a condition to talk to it (see sim_thread.h).
+ */
+typedef struct WorkerThread WorkerThread;
+
+/* Lock and condition only, the thread is started apart. */
+WorkerThread* workers_thread_create();
+/* Runs fn(ctx, 0) on the thread. */
+void workers_thread_start(WorkerThread* t, WorkerFn fn, void* ctx);
+/* Waits for fn to return (if started) and frees everything. */
+void workers_thread_destroy(WorkerThread* t);
+void workers_thread_lock(WorkerThread* t);
+void workers_thread_unlock(WorkerThread* t);
+/* Releases the lock until the next broadcast (lock held). */
+void workers_thread_wait(WorkerThread* t);
+void workers_thread_broadcast(WorkerThread* t);
+
+#endif